@@ -1,86 +1,136 @@
 #include "activations.h"
 #include "utils.h"
+#include "simd.h"
 
 
-double linear(const double x){
+nn_real linear(const nn_real x){
     return x;
 }
 
 
-double linear_derivative(const double x){
+nn_real linear_derivative(const nn_real y){
     return 1;
 }
 
 
-double sigmoid(const double x) {
+nn_real sigmoid(const nn_real x) {
     return 1.0 / (1.0 + exp(-x));
 }
 
 
-double sigmoid_derivative(const double x) {
-    double s = sigmoid(x);
-    return s * (1 - s);
+nn_real sigmoid_derivative(const nn_real y) {
+    return y * (1 - y);
 }
 
 
-double tanh(const double x){
-    double epx = exp(x);
-    double enx = exp(-x);
-    return (epx-enx)/(epx+enx);
+nn_real tanh_activation(const nn_real x){
+    return tanh(x);
 }
 
 
-double tanh_derivative(const double x){
-    double tanh_value = tanh(x);
-    return 1 - (tanh_value*tanh_value);
+nn_real tanh_derivative(const nn_real y){
+    return 1 - y * y;
 }
 
 
-double relu(const double x) {
+nn_real relu(const nn_real x) {
     return x > 0 ? x : 0;
 }
 
 
-double relu_derivative(const double x) {
-    return x > 0 ? 1 : 0;
+nn_real relu_derivative(const nn_real y) {
+    return y > 0 ? 1 : 0;
 }
 
 
-double *softmax(const size_t inputs_num, const double *inputs){
-    double *outputs = malloc(sizeof(double) * inputs_num);
+nn_real *softmax(const size_t inputs_num, const nn_real *inputs){
+    nn_real *outputs = malloc(sizeof(nn_real) * inputs_num);
+    if(softmax_into(inputs_num, inputs, outputs)){
+        free(outputs);
+        return NULL;
+    }
+    return outputs;
+}
+
 
-    double max_input = inputs[0];
+int softmax_into(const size_t inputs_num, const nn_real *inputs, nn_real *outputs){
+    return log_softmax_into(inputs_num, inputs, outputs, NULL);
+}
+
+
+int log_softmax_into(const size_t inputs_num, const nn_real *inputs, nn_real *outputs, nn_real *log_sum_exp){
+    nn_real max_input = inputs[0];
     for (size_t i = 1; i < inputs_num; i++) {
         if (inputs[i] > max_input) {
             max_input = inputs[i];
         }
     }
 
-    double exp_sum = 0.0;
     for(size_t i=0; i<inputs_num; ++i){
-        outputs[i] = exp(inputs[i] - max_input);
+        outputs[i] = inputs[i] - max_input;
+    }
+    simd->exp_approx(inputs_num, outputs, outputs);
+
+    nn_real exp_sum = 0.0;
+    for(size_t i=0; i<inputs_num; ++i){
         exp_sum += outputs[i];
     }
 
     if(exp_sum == 0.0){
-        free(outputs);
-        return NULL;
+        return 1;
     }
 
+    // exp_sum >= 1 since the largest input contributes exp(0), so the log never sees 0
+    if(log_sum_exp != NULL) *log_sum_exp = max_input + log(exp_sum);
+
+    nn_real inverse_sum = 1 / exp_sum;
     for(size_t i=0; i<inputs_num; ++i){
-        outputs[i] /= exp_sum;
+        outputs[i] *= inverse_sum;
     }
 
-    return outputs;
+    return 0;
 }
 
 
-double *softmax_derivative(const size_t inputs_num, const double *inputs, const double* expected_outputs){
-    double *softmax_activated_outputs = softmax(inputs_num, inputs);
-    double *softmax_derivatives = malloc(sizeof(double) * inputs_num);
-    for (size_t i = 0; i < inputs_num; i++) {
-        softmax_derivatives[i] = softmax_activated_outputs[i] * (expected_outputs[i] ? (1.0 - softmax_activated_outputs[i]) : (-softmax_activated_outputs[i]));
+void act_forward(const nn_activation type, const size_t n, const nn_real *inputs, nn_real *outputs){
+    switch(type){
+        case LINEAR_ACTIVATION:
+            if(outputs != inputs) memcpy(outputs, inputs, sizeof(nn_real) * n);
+            break;
+        case SIGMOID_ACTIVATION:
+            simd->sigmoid_approx(n, inputs, outputs);
+            break;
+        case TANH_ACTIVATION:
+            simd->tanh_approx(n, inputs, outputs);
+            break;
+        case RELU_ACTIVATION:
+            simd->relu(n, inputs, outputs);
+            break;
+        case SOFTMAX_ACTIVATION:
+            softmax_into(n, inputs, outputs);
+            break;
     }
-    free(softmax_activated_outputs);
-    return softmax_derivatives;
-}
\ No newline at end of file
+}
+
+
+void act_backward(const nn_activation type, const size_t n, const nn_real *outputs, nn_real *gradients){
+    switch(type){
+        case LINEAR_ACTIVATION:
+            break;
+        case SIGMOID_ACTIVATION:
+            for(size_t i=0; i<n; ++i) gradients[i] *= outputs[i] * (1 - outputs[i]);
+            break;
+        case TANH_ACTIVATION:
+            for(size_t i=0; i<n; ++i) gradients[i] *= 1 - outputs[i] * outputs[i];
+            break;
+        case RELU_ACTIVATION:
+            simd->relu_derivative_mul(n, outputs, gradients);
+            break;
+        case SOFTMAX_ACTIVATION: {
+            // Jacobian-vector product: g_i = y_i * (g_i - sum_j g_j * y_j)
+            nn_real weighted_sum = simd->dot(n, gradients, outputs);
+            for(size_t i=0; i<n; ++i) gradients[i] = outputs[i] * (gradients[i] - weighted_sum);
+            break;
+        }
+    }
+}
@@ -3,21 +3,36 @@
 
 #include "utils.h"
 
-#define LINEAR_ACTIVATION 0
-#define SIGMOID_ACTIVATION 1
-#define TANH_ACTIVATION 2
-#define RELU_ACTIVATION 3
-#define SOFTMAX_ACTIVATION 4
+/* Activation of a dense layer, the values are stored in checkpoints so they must not change */
+typedef enum {
+    LINEAR_ACTIVATION = 0,
+    SIGMOID_ACTIVATION = 1,
+    TANH_ACTIVATION = 2,
+    RELU_ACTIVATION = 3,
+    SOFTMAX_ACTIVATION = 4 // normalizes a whole sample, only allowed in the output layer
+} nn_activation;
 
-double linear(double x);
-double linear_derivative(double x);
-double sigmoid(double x);
-double sigmoid_derivative(double x);
-double tanh(double x);
-double tanh_derivative(double x);
-double relu(double x);
-double relu_derivative(double x);
-double *softmax(size_t inputs_num, const double *inputs);
-double *softmax_derivative(size_t inputs_num, const double *inputs, const double* expected_outputs);
+#define ACTIVATIONS_NUM 5
+
+/* Scalar activations, the derivatives take the activation output y = f(x) rather than x */
+nn_real linear(nn_real x);
+nn_real linear_derivative(nn_real y);
+nn_real sigmoid(nn_real x);
+nn_real sigmoid_derivative(nn_real y);
+nn_real tanh_activation(nn_real x); // named apart from libm tanh, which tgmath.h turns into a macro
+nn_real tanh_derivative(nn_real y);
+nn_real relu(nn_real x);
+nn_real relu_derivative(nn_real y);
+nn_real *softmax(size_t inputs_num, const nn_real *inputs);
+int softmax_into(size_t inputs_num, const nn_real *inputs, nn_real *outputs); // returns non-zero when the outputs can't be normalized, outputs may alias inputs
+int log_softmax_into(size_t inputs_num, const nn_real *inputs, nn_real *outputs, nn_real *log_sum_exp); // softmax_into that also stores log(sum(exp(inputs))) when log_sum_exp is not NULL
+
+/* Applies the activation to n contiguous values through the SIMD kernels, outputs may alias inputs
+ * Softmax treats the n values as a single sample */
+void act_forward(nn_activation type, size_t n, const nn_real *inputs, nn_real *outputs);
+
+/* Multiplies n gradients by the activation derivative, computed from the n cached activation outputs
+ * Softmax treats the n values as a single sample and applies its full Jacobian */
+void act_backward(nn_activation type, size_t n, const nn_real *outputs, nn_real *gradients);
 
 #endif //DIGITS_NN_C_ACTIVATIONS_H
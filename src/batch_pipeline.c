@@ -0,0 +1,131 @@
+#include "batch_pipeline.h"
+#include "nn_core.h"
+#include "profiler.h"
+#include "rng.h"
+#include <sched.h>
+
+
+/* Spins briefly, then yields and finally sleeps, so a side waiting on an idle ring doesn't hold a core */
+static void wait_backoff(unsigned int *attempt){
+    if(*attempt < 64){
+        ++*attempt;
+    } else if(*attempt < 128){
+        ++*attempt;
+        sched_yield();
+    } else {
+        nanosleep(&(struct timespec){0, 50000}, NULL);
+    }
+}
+
+
+static void *batch_pipeline_loader(void *argument){
+    batch_pipeline *pipeline = argument;
+
+    for(uint64_t epoch=0; ; ++epoch){
+        rng_stream rng;
+        rng_open(&rng, pipeline->seed, rng_stream_id(RNG_SHUFFLE, epoch));
+        rng_permutation(&rng, pipeline->samples_num, pipeline->samples_order);
+
+        for(size_t first=0; first<pipeline->samples_num; first+=pipeline->batch_size){
+            size_t head = atomic_load_explicit(&pipeline->head, memory_order_relaxed);
+
+            // wait for a free slot
+            unsigned int attempt = 0;
+            while(head - atomic_load_explicit(&pipeline->tail, memory_order_acquire) == pipeline->slots_num){
+                if(atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) return NULL;
+                wait_backoff(&attempt);
+            }
+
+            batch_slot *slot = &pipeline->slots[head % pipeline->slots_num];
+            slot->count = pipeline->samples_num - first < pipeline->batch_size ? pipeline->samples_num - first : pipeline->batch_size;
+            slot->last_of_epoch = first + slot->count == pipeline->samples_num;
+            gather_mnist_batch(pipeline->images, pipeline->labels, pipeline->samples_order + first, slot->count,
+                               slot->inputs, slot->expected_outputs);
+
+            // publish the slot contents before the consumer can see the new head
+            atomic_store_explicit(&pipeline->head, head + 1, memory_order_release);
+        }
+
+        if(atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) return NULL;
+    }
+}
+
+
+batch_pipeline *create_batch_pipeline(const mnist_images_set *images, const mnist_labels_set *labels, size_t batch_size, size_t slots_num){
+    if(images->number_of_images <= 0 || batch_size == 0){
+        fprintf(stderr, "Batch pipeline needs a non-empty dataset and a batch size greater than 0\n");
+        return NULL;
+    }
+    if(slots_num == 0) slots_num = 2;
+
+    size_t sample_size = (size_t)images->number_of_rows * images->number_of_columns;
+
+    batch_pipeline *pipeline = malloc(sizeof(batch_pipeline));
+    pipeline->images = images;
+    pipeline->labels = labels;
+    pipeline->batch_size = batch_size;
+    pipeline->slots_num = slots_num;
+    pipeline->samples_num = (size_t)images->number_of_images;
+    pipeline->samples_order = malloc(sizeof(size_t) * pipeline->samples_num);
+    pipeline->seed = get_random_seed();
+
+    pipeline->slots = malloc(sizeof(batch_slot) * slots_num);
+    for(size_t slot=0; slot<slots_num; ++slot){
+        pipeline->slots[slot].inputs = large_calloc(sizeof(nn_real) * batch_size * sample_size, BUFFER_SHARED);
+        pipeline->slots[slot].expected_outputs = large_calloc(sizeof(nn_real) * batch_size * MNIST_CLASSES, BUFFER_SHARED);
+    }
+
+    atomic_init(&pipeline->head, 0);
+    atomic_init(&pipeline->tail, 0);
+    atomic_init(&pipeline->stop, 0);
+
+    if(pthread_create(&pipeline->loader, NULL, batch_pipeline_loader, pipeline) != 0){
+        fprintf(stderr, "Failed to create the batch loader thread\n");
+        for(size_t slot=0; slot<slots_num; ++slot){
+            large_free(pipeline->slots[slot].inputs);
+            large_free(pipeline->slots[slot].expected_outputs);
+        }
+        free(pipeline->slots);
+        free(pipeline->samples_order);
+        free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+
+void destroy_batch_pipeline(batch_pipeline *pipeline){
+    if(pipeline == NULL) return;
+
+    atomic_store_explicit(&pipeline->stop, 1, memory_order_relaxed);
+    pthread_join(pipeline->loader, NULL);
+
+    for(size_t slot=0; slot<pipeline->slots_num; ++slot){
+        large_free(pipeline->slots[slot].inputs);
+        large_free(pipeline->slots[slot].expected_outputs);
+    }
+    free(pipeline->slots);
+    free(pipeline->samples_order);
+    free(pipeline);
+}
+
+
+const batch_slot *batch_pipeline_acquire(batch_pipeline *pipeline){
+    size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+
+    unsigned int attempt = 0;
+    NN_PROFILE_BEGIN(wait_mark);
+    while(atomic_load_explicit(&pipeline->head, memory_order_acquire) == tail)
+        wait_backoff(&attempt);
+    NN_PROFILE_END(wait_mark, PROFILE_BATCH_WAIT, 0, 0, 0);
+
+    return &pipeline->slots[tail % pipeline->slots_num];
+}
+
+
+void batch_pipeline_release(batch_pipeline *pipeline){
+    size_t tail = atomic_load_explicit(&pipeline->tail, memory_order_relaxed);
+    // the consumer is done reading the slot before the loader may overwrite it
+    atomic_store_explicit(&pipeline->tail, tail + 1, memory_order_release);
+}
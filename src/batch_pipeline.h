@@ -0,0 +1,52 @@
+#ifndef DIGITS_NN_C_BATCH_PIPELINE_H
+#define DIGITS_NN_C_BATCH_PIPELINE_H
+
+#include "utils.h"
+#include "data.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+/* Mini-batch assembled by the loader thread, contiguous and already normalized */
+typedef struct {
+    nn_real *inputs;            // batch_size x sample size, NN_WEIGHTS_ALIGNMENT aligned
+    nn_real *expected_outputs;  // batch_size x MNIST_CLASSES one-hot labels
+    size_t count;               // samples in this batch, the last batch of an epoch may be short
+    int last_of_epoch;
+} batch_slot;
+
+
+/* Prefetching pipeline: a loader thread shuffles the dataset every epoch, in an order that only depends on the seed
+ * and the epoch (see rng.h), and assembles the upcoming mini-batches into a ring of slots while the caller trains on
+ * the current one. The ring has a single producer and a single consumer, so the two sides only synchronize through the
+ * head and tail counters, without locks */
+typedef struct {
+    const mnist_images_set *images;
+    const mnist_labels_set *labels;
+    size_t batch_size;
+    size_t slots_num;
+    batch_slot *slots;
+    size_t *samples_order;
+    size_t samples_num;
+    uint64_t seed;        // random seed when the pipeline was created
+
+    _Atomic size_t head;  // batches produced so far, slot head % slots_num is filled next
+    _Atomic size_t tail;  // batches consumed so far, slot tail % slots_num is read next
+    _Atomic int stop;
+    pthread_t loader;
+} batch_pipeline;
+
+
+/* Starts a loader thread assembling batches of batch_size samples of the provided sets into slots_num slots */
+batch_pipeline *create_batch_pipeline(const mnist_images_set *images, const mnist_labels_set *labels, size_t batch_size, size_t slots_num);
+
+/* Stops the loader thread and deallocates the provided pipeline, the sets are left untouched */
+void destroy_batch_pipeline(batch_pipeline *pipeline);
+
+/* Waits for the next batch and returns it, it stays valid until batch_pipeline_release is called */
+const batch_slot *batch_pipeline_acquire(batch_pipeline *pipeline);
+
+/* Hands the batch returned by the last batch_pipeline_acquire back to the loader */
+void batch_pipeline_release(batch_pipeline *pipeline);
+
+#endif //DIGITS_NN_C_BATCH_PIPELINE_H
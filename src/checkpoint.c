@@ -0,0 +1,287 @@
+#include "checkpoint.h"
+#include "activations.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Header fields, at fixed byte offsets */
+#define HEADER_MAGIC 0             // 8 bytes, CHECKPOINT_MAGIC
+#define HEADER_VERSION 8           // uint32
+#define HEADER_REAL_SIZE 12        // uint32, sizeof(nn_real) of the parameters
+#define HEADER_LOSS_FUNCTION 16    // uint32
+#define HEADER_LAYERS_NUM 20       // uint32
+#define HEADER_INPUT_SIZE 24       // uint64
+#define HEADER_PARAMETERS_NUM 32   // uint64
+#define HEADER_PARAMETERS_OFFSET 40 // uint64
+#define HEADER_LEARNING_RATE 48    // IEEE 754 double
+#define HEADER_CHECKSUM 56         // uint64, FNV-1a of the layer table and the parameters
+
+/* Layer record fields */
+#define LAYER_SIZE 0               // uint64
+#define LAYER_PREVIOUS_SIZE 8      // uint64
+#define LAYER_WEIGHTS_STRIDE 16    // uint64
+#define LAYER_ACTIVATION_TYPE 24   // uint32, followed by 4 bytes of padding
+
+
+static int host_is_little_endian(void){
+    const uint16_t probe = 1;
+    return *(const uint8_t*)&probe == 1;
+}
+
+
+static void put_uint32(uint8_t *bytes, uint32_t value){
+    for(size_t byte=0; byte<4; ++byte) bytes[byte] = (uint8_t)(value >> (8 * byte));
+}
+
+
+static void put_uint64(uint8_t *bytes, uint64_t value){
+    for(size_t byte=0; byte<8; ++byte) bytes[byte] = (uint8_t)(value >> (8 * byte));
+}
+
+
+static uint32_t get_uint32(const uint8_t *bytes){
+    uint32_t value = 0;
+    for(size_t byte=0; byte<4; ++byte) value |= (uint32_t)bytes[byte] << (8 * byte);
+    return value;
+}
+
+
+static uint64_t get_uint64(const uint8_t *bytes){
+    uint64_t value = 0;
+    for(size_t byte=0; byte<8; ++byte) value |= (uint64_t)bytes[byte] << (8 * byte);
+    return value;
+}
+
+
+static uint64_t fnv1a_update(uint64_t hash, const void *data, size_t size){
+    const uint8_t *bytes = data;
+    for(size_t byte=0; byte<size; ++byte){
+        hash ^= bytes[byte];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+
+static size_t parameters_offset_for(size_t layers_num){
+    return align_up(CHECKPOINT_HEADER_SIZE + layers_num * CHECKPOINT_LAYER_RECORD_SIZE, NN_WEIGHTS_ALIGNMENT);
+}
+
+
+int save_neural_network(const NeuralNetwork *nn, const char *filepath){
+    if(!host_is_little_endian()){
+        fprintf(stderr, "Checkpoints store little-endian parameters, saving from a big-endian host is not supported\n");
+        return 1;
+    }
+
+    size_t parameters_offset = parameters_offset_for(nn->dense_layers_num);
+    uint8_t *preamble = calloc(1, parameters_offset); // header, layer table and padding up to the parameters
+
+    uint8_t *layer_table = preamble + CHECKPOINT_HEADER_SIZE;
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        const DenseLayer *dense_layer = &nn->dense_layers[layer];
+        uint8_t *record = layer_table + layer * CHECKPOINT_LAYER_RECORD_SIZE;
+        put_uint64(record + LAYER_SIZE, dense_layer->size);
+        put_uint64(record + LAYER_PREVIOUS_SIZE, dense_layer->previous_layer_size);
+        put_uint64(record + LAYER_WEIGHTS_STRIDE, dense_layer->weights_stride);
+        put_uint32(record + LAYER_ACTIVATION_TYPE, (uint32_t)dense_layer->activation_type);
+    }
+
+    uint64_t checksum = fnv1a_update(FNV1A_OFFSET_BASIS, layer_table, nn->dense_layers_num * CHECKPOINT_LAYER_RECORD_SIZE);
+    checksum = fnv1a_update(checksum, nn->parameters, sizeof(nn_real) * nn->parameters_num);
+
+    uint64_t learning_rate_bits;
+    memcpy(&learning_rate_bits, &nn->learning_rate, sizeof(learning_rate_bits));
+
+    memcpy(preamble + HEADER_MAGIC, CHECKPOINT_MAGIC, 8);
+    put_uint32(preamble + HEADER_VERSION, CHECKPOINT_VERSION);
+    put_uint32(preamble + HEADER_REAL_SIZE, sizeof(nn_real));
+    put_uint32(preamble + HEADER_LOSS_FUNCTION, (uint32_t)nn->loss_function);
+    put_uint32(preamble + HEADER_LAYERS_NUM, (uint32_t)nn->dense_layers_num);
+    put_uint64(preamble + HEADER_INPUT_SIZE, nn->input_layer_size);
+    put_uint64(preamble + HEADER_PARAMETERS_NUM, nn->parameters_num);
+    put_uint64(preamble + HEADER_PARAMETERS_OFFSET, parameters_offset);
+    put_uint64(preamble + HEADER_LEARNING_RATE, learning_rate_bits);
+    put_uint64(preamble + HEADER_CHECKSUM, checksum);
+
+    size_t temporary_filepath_size = strlen(filepath) + sizeof(".tmp");
+    char *temporary_filepath = malloc(temporary_filepath_size);
+    snprintf(temporary_filepath, temporary_filepath_size, "%s.tmp", filepath);
+
+    FILE *file = fopen(temporary_filepath, "wb");
+    int failed = file == NULL;
+    if(!failed){
+        failed = fwrite(preamble, parameters_offset, 1, file) != 1 ||
+                 fwrite(nn->parameters, sizeof(nn_real), nn->parameters_num, file) != nn->parameters_num;
+        failed |= fclose(file) != 0;
+    }
+    if(!failed) failed = rename(temporary_filepath, filepath) != 0;
+
+    if(failed){
+        fprintf(stderr, "Failed to write checkpoint %s\n", filepath);
+        remove(temporary_filepath);
+    }
+
+    free(temporary_filepath);
+    free(preamble);
+    return failed;
+}
+
+
+/* Validates the header and the layer table of a mapped checkpoint, returns non-zero when the network can't be built */
+static int validate_checkpoint(const uint8_t *bytes, size_t size, const char *filepath){
+    if(size < CHECKPOINT_HEADER_SIZE || memcmp(bytes + HEADER_MAGIC, CHECKPOINT_MAGIC, 8) != 0){
+        fprintf(stderr, "%s is not a checkpoint\n", filepath);
+        return 1;
+    }
+    if(get_uint32(bytes + HEADER_VERSION) != CHECKPOINT_VERSION){
+        fprintf(stderr, "Checkpoint %s has version %u, only version %d is supported\n", filepath, get_uint32(bytes + HEADER_VERSION), CHECKPOINT_VERSION);
+        return 1;
+    }
+    if(get_uint32(bytes + HEADER_REAL_SIZE) != sizeof(nn_real)){
+        fprintf(stderr, "Checkpoint %s stores %u byte parameters but this build uses %zu byte ones\n", filepath, get_uint32(bytes + HEADER_REAL_SIZE), sizeof(nn_real));
+        return 1;
+    }
+
+    size_t layers_num = get_uint32(bytes + HEADER_LAYERS_NUM);
+    size_t parameters_num = get_uint64(bytes + HEADER_PARAMETERS_NUM);
+    size_t parameters_offset = get_uint64(bytes + HEADER_PARAMETERS_OFFSET);
+    if(layers_num == 0 || parameters_offset != parameters_offset_for(layers_num) ||
+       size < parameters_offset || (size - parameters_offset) / sizeof(nn_real) < parameters_num){
+        fprintf(stderr, "Checkpoint %s is truncated or has an inconsistent header\n", filepath);
+        return 1;
+    }
+
+    // the layer table must describe exactly the parameters block the network would allocate
+    const size_t alignment_elements = NN_WEIGHTS_ALIGNMENT / sizeof(nn_real);
+    size_t previous_layer_size = get_uint64(bytes + HEADER_INPUT_SIZE);
+    size_t expected_parameters_num = 0;
+    for(size_t layer=0; layer<layers_num; ++layer){
+        const uint8_t *record = bytes + CHECKPOINT_HEADER_SIZE + layer * CHECKPOINT_LAYER_RECORD_SIZE;
+        size_t layer_size = get_uint64(record + LAYER_SIZE);
+        // sizes above parameters_num, itself bounded by the file size, can't fit, rejecting them first keeps the stride,
+        // the weights product and the running total below from wrapping
+        if(layer_size == 0 || previous_layer_size == 0 || previous_layer_size > parameters_num ||
+           get_uint64(record + LAYER_PREVIOUS_SIZE) != previous_layer_size ||
+           get_uint64(record + LAYER_WEIGHTS_STRIDE) != weights_stride_for(previous_layer_size)){
+            fprintf(stderr, "Checkpoint %s has an invalid layer %zu or was saved with a different weights layout\n", filepath, layer);
+            return 1;
+        }
+        size_t weights_stride = weights_stride_for(previous_layer_size);
+        if(layer_size > parameters_num / weights_stride ||
+           align_up(layer_size * weights_stride, alignment_elements) + align_up(layer_size, alignment_elements) >
+           parameters_num - expected_parameters_num){
+            fprintf(stderr, "Checkpoint %s has a layer %zu needing more than the %zu parameters it declares\n", filepath, layer, parameters_num);
+            return 1;
+        }
+        expected_parameters_num += align_up(layer_size * weights_stride, alignment_elements);
+        expected_parameters_num += align_up(layer_size, alignment_elements);
+        previous_layer_size = layer_size;
+    }
+    if(expected_parameters_num != parameters_num){
+        fprintf(stderr, "Checkpoint %s declares %zu parameters but its layers need %zu\n", filepath, parameters_num, expected_parameters_num);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+NeuralNetwork *load_neural_network(const char *filepath, size_t max_batch_size, int verify_checksum){
+    if(!host_is_little_endian()){
+        fprintf(stderr, "Checkpoints store little-endian parameters, loading on a big-endian host is not supported\n");
+        return NULL;
+    }
+
+    int file = open(filepath, O_RDONLY);
+    if(file == -1){
+        fprintf(stderr, "Failed to open checkpoint %s\n", filepath);
+        return NULL;
+    }
+    struct stat file_stats;
+    if(fstat(file, &file_stats) != 0 || file_stats.st_size == 0){
+        fprintf(stderr, "Failed to read checkpoint %s\n", filepath);
+        close(file);
+        return NULL;
+    }
+
+    // private writable mapping: pages are shared with the page cache until training writes to them
+    size_t size = (size_t)file_stats.st_size;
+    uint8_t *bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    close(file);
+    if(bytes == MAP_FAILED){
+        fprintf(stderr, "Failed to map checkpoint %s\n", filepath);
+        return NULL;
+    }
+
+    if(validate_checkpoint(bytes, size, filepath)){
+        munmap(bytes, size);
+        return NULL;
+    }
+
+    size_t layers_num = get_uint32(bytes + HEADER_LAYERS_NUM);
+    size_t parameters_num = get_uint64(bytes + HEADER_PARAMETERS_NUM);
+    nn_real *parameters = (nn_real*)(bytes + get_uint64(bytes + HEADER_PARAMETERS_OFFSET));
+
+    if(verify_checksum){
+        uint64_t checksum = fnv1a_update(FNV1A_OFFSET_BASIS, bytes + CHECKPOINT_HEADER_SIZE, layers_num * CHECKPOINT_LAYER_RECORD_SIZE);
+        checksum = fnv1a_update(checksum, parameters, sizeof(nn_real) * parameters_num);
+        if(checksum != get_uint64(bytes + HEADER_CHECKSUM)){
+            fprintf(stderr, "Checkpoint %s is corrupted, its checksum does not match\n", filepath);
+            munmap(bytes, size);
+            return NULL;
+        }
+    }
+
+    NeuralNetwork *nn = malloc(sizeof(NeuralNetwork));
+    nn->input_layer_size = get_uint64(bytes + HEADER_INPUT_SIZE);
+    uint64_t learning_rate_bits = get_uint64(bytes + HEADER_LEARNING_RATE);
+    memcpy(&nn->learning_rate, &learning_rate_bits, sizeof(nn->learning_rate));
+    nn->parameters = parameters;
+    nn->parameters_num = parameters_num;
+    nn->parameters_mapping = bytes;
+    nn->parameters_mapping_size = size;
+    nn->parameters_version = 0;
+    nn->dense_layers_num = layers_num;
+    nn->dense_layers = malloc(sizeof(DenseLayer) * layers_num);
+
+    int invalid = set_network_loss(nn, (int)get_uint32(bytes + HEADER_LOSS_FUNCTION));
+
+    const size_t alignment_elements = NN_WEIGHTS_ALIGNMENT / sizeof(nn_real);
+    nn_real *parameters_cursor = parameters;
+    for(size_t layer=0; layer<layers_num && !invalid; ++layer){
+        const uint8_t *record = bytes + CHECKPOINT_HEADER_SIZE + layer * CHECKPOINT_LAYER_RECORD_SIZE;
+        DenseLayer *dense_layer = &nn->dense_layers[layer];
+        dense_layer->size = get_uint64(record + LAYER_SIZE);
+        dense_layer->previous_layer_size = get_uint64(record + LAYER_PREVIOUS_SIZE);
+        dense_layer->weights_stride = get_uint64(record + LAYER_WEIGHTS_STRIDE);
+        dense_layer->weights = parameters_cursor;
+        parameters_cursor += align_up(dense_layer->size * dense_layer->weights_stride, alignment_elements);
+        dense_layer->biases = parameters_cursor;
+        parameters_cursor += align_up(dense_layer->size, alignment_elements);
+        invalid = set_dense_layer_activation(dense_layer, (int)get_uint32(record + LAYER_ACTIVATION_TYPE)) ||
+                  (dense_layer->activation_type == SOFTMAX_ACTIVATION && layer != layers_num-1);
+    }
+
+    if(invalid){
+        fprintf(stderr, "Checkpoint %s uses an unknown loss function or activation type, or softmax outside the output layer\n", filepath);
+        free(nn->dense_layers);
+        free(nn);
+        munmap(bytes, size);
+        return NULL;
+    }
+
+    nn->workspace = create_workspace(nn, max_batch_size);
+    if(nn->workspace == NULL){
+        free(nn->dense_layers);
+        free(nn);
+        munmap(bytes, size);
+        return NULL;
+    }
+    nn->optimizer = NULL; // optimizer state is not checkpointed, training resumes with fresh sgd
+    set_network_optimizer(nn, default_optimizer_config(SGD_OPTIMIZER, nn->learning_rate));
+    return nn;
+}
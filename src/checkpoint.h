@@ -0,0 +1,28 @@
+#ifndef DIGITS_NN_C_CHECKPOINT_H
+#define DIGITS_NN_C_CHECKPOINT_H
+
+#include "nn_core.h"
+
+
+/* Checkpoint layout, every integer little-endian:
+ *   header       CHECKPOINT_HEADER_SIZE bytes, see checkpoint.c
+ *   layer table  dense_layers_num records of CHECKPOINT_LAYER_RECORD_SIZE bytes
+ *   parameters   starting on a NN_WEIGHTS_ALIGNMENT boundary, the parameters block of the network byte for byte
+ * The checksum covers the layer table and the parameters */
+#define CHECKPOINT_MAGIC "CEURALNN"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_HEADER_SIZE 64
+#define CHECKPOINT_LAYER_RECORD_SIZE 32
+
+
+/* Writes the topology, activations, loss and parameters of the provided network to filepath
+ * The file is written next to its destination and renamed over it, so mapped readers of an older checkpoint are
+ * never affected. Returns non-zero on failure */
+int save_neural_network(const NeuralNetwork *nn, const char *filepath);
+
+/* Maps the provided checkpoint and returns a network whose weights and biases point straight into the mapping,
+ * copy-on-write, so nothing is read or copied up front. The workspace is sized for max_batch_size samples and when
+ * verify_checksum is non-zero the parameters are checked in one sequential pass. Returns NULL on failure */
+NeuralNetwork *load_neural_network(const char *filepath, size_t max_batch_size, int verify_checksum);
+
+#endif //DIGITS_NN_C_CHECKPOINT_H
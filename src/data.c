@@ -1,137 +1,159 @@
 #include "data.h"
+#include "profiler.h"
+#include "placement.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+/* Reads the big-endian 32 bit integer at the provided position */
+static int32_t read_big_endian_int32(const uint8_t *bytes){
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return (int32_t)ntohl(value);
+}
 
 
-int read_from_file(void *var_pointer, size_t bytes_to_read, FILE* file){
-    size_t result = fread(var_pointer, bytes_to_read, 1, file);
-    if (result == 0) {
-        if (feof(file)) {
-            fprintf(stderr, "End of file reached or no data to read\n");
-        } else if (ferror(file)) {
-            fprintf(stderr, "Error reading from file");
-        }
-        fclose(file);
+int idx_open(const char *filepath, idx_tensor *tensor){
+    memset(tensor, 0, sizeof(idx_tensor));
+
+    int file = open(filepath, O_RDONLY);
+    if(file == -1){
+        fprintf(stderr, "Failed to open IDX file %s!\n", filepath);
         return 1;
     }
-    return 0;
-}
 
+    struct stat file_stats;
+    if(fstat(file, &file_stats) != 0 || file_stats.st_size < 4){
+        fprintf(stderr, "IDX file %s is too small to hold a header\n", filepath);
+        close(file);
+        return 1;
+    }
 
-mnist_images_set load_mnist_handwritten_images(const char* images_filepath){
-    FILE *images_set_file = fopen(images_filepath, "rb");
-    if (images_set_file == NULL) {
-        fprintf(stderr, "Failed to open training images file!\n");
-        return (mnist_images_set){-1};
+    size_t mapping_size = (size_t)file_stats.st_size;
+    void *mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file); // the mapping keeps its own reference to the file
+    if(mapping == MAP_FAILED){
+        fprintf(stderr, "Failed to map IDX file %s\n", filepath);
+        return 1;
     }
+    const uint8_t *bytes = mapping;
 
-    mnist_images_set images_set;
+    // magic number: two zero bytes, the element type and the number of dimensions
+    if(bytes[0] != 0 || bytes[1] != 0 || bytes[2] != IDX_UNSIGNED_BYTE || bytes[3] == 0 || bytes[3] > IDX_MAX_DIMENSIONS){
+        fprintf(stderr, "IDX file %s has an invalid or unsupported magic number\n", filepath);
+        munmap(mapping, mapping_size);
+        return 1;
+    }
 
-    int32_t magic_number;
-    if(read_from_file(&magic_number, sizeof(int32_t), images_set_file)) return (mnist_images_set){-1};
-    magic_number = ntohl(magic_number);
-    images_set.magic_number = magic_number;
+    uint8_t dimensions_num = bytes[3];
+    size_t header_size = 4 + 4 * (size_t)dimensions_num;
+    if(mapping_size < header_size){
+        fprintf(stderr, "IDX file %s is truncated inside its header\n", filepath);
+        munmap(mapping, mapping_size);
+        return 1;
+    }
 
-    int32_t number_of_images;
-    if(read_from_file(&number_of_images, sizeof(int32_t), images_set_file)) return (mnist_images_set){-1};
-    number_of_images = ntohl(number_of_images);
-    images_set.number_of_images = number_of_images;
+    size_t elements_num = 1;
+    for(uint8_t dimension=0; dimension<dimensions_num; ++dimension){
+        tensor->dimensions[dimension] = read_big_endian_int32(bytes + 4 + 4 * dimension);
+        if(tensor->dimensions[dimension] < 0){
+            fprintf(stderr, "IDX file %s declares a negative dimension\n", filepath);
+            munmap(mapping, mapping_size);
+            return 1;
+        }
+        // a product wrapping around size_t would pass the size check below and index past the mapping
+        size_t dimension_size = (size_t)tensor->dimensions[dimension];
+        if(dimension_size != 0 && elements_num > SIZE_MAX / dimension_size){
+            fprintf(stderr, "IDX file %s declares more elements than can be addressed\n", filepath);
+            munmap(mapping, mapping_size);
+            return 1;
+        }
+        elements_num *= dimension_size;
+    }
 
+    if(mapping_size - header_size < elements_num){
+        fprintf(stderr, "IDX file %s holds %zu elements but its header declares %zu\n", filepath, mapping_size - header_size, elements_num);
+        munmap(mapping, mapping_size);
+        return 1;
+    }
 
-    int32_t number_of_rows;
-    if(read_from_file(&number_of_rows, sizeof(int32_t), images_set_file)) return (mnist_images_set){-1};
-    number_of_rows = ntohl(number_of_rows);
-    images_set.number_of_rows = number_of_rows;
+    tensor->mapping = mapping;
+    tensor->mapping_size = mapping_size;
+    tensor->magic_number = read_big_endian_int32(bytes);
+    tensor->dimensions_num = dimensions_num;
+    tensor->items_num = (size_t)tensor->dimensions[0];
+    tensor->item_size = tensor->items_num ? elements_num / tensor->items_num : 0;
+    tensor->data = bytes + header_size;
+
+    placement_config placement = get_placement_config();
+    if(placement.numa != NUMA_FIRST_TOUCH || placement.huge_pages == HUGE_PAGES_RESERVED){
+        void *copy = large_calloc(mapping_size, BUFFER_SHARED);
+        if(copy != NULL){
+            memcpy(copy, mapping, mapping_size);
+            munmap(mapping, mapping_size);
+            tensor->mapping = copy;
+            tensor->copied = 1;
+            tensor->data = (const uint8_t*)copy + header_size;
+            return 0;
+        }
+    }
 
-    int32_t number_of_columns;
-    if(read_from_file(&number_of_columns, sizeof(int32_t), images_set_file)) return (mnist_images_set){-1};
-    number_of_columns = ntohl(number_of_columns);
-    images_set.number_of_columns = number_of_columns;
+    // the whole file is read front to back at least once per epoch, in huge pages where the filesystem allows
+    madvise(mapping, mapping_size, MADV_WILLNEED);
+    if(placement.huge_pages != HUGE_PAGES_OFF) madvise(mapping, mapping_size, MADV_HUGEPAGE);
+    return 0;
+}
 
 
-    uint8_t **images_data = malloc(number_of_images * sizeof(uint8_t*));
-    for (int i = 0; i < number_of_images; ++i) {
-        images_data[i] = malloc(number_of_rows * number_of_columns * sizeof(uint8_t));
-    }
-    for(int32_t image=0; image<number_of_images; ++image){
-        for(int32_t pixel=0; pixel<number_of_rows*number_of_columns; ++pixel){
-            if(read_from_file(&images_data[image][pixel], sizeof(uint8_t), images_set_file)){
-                free_uint8_array(images_data, number_of_images);
-                return (mnist_images_set){-1};
-            }
-            //fprintf(stdout, "%d, ", images_data[image][pixel]);
-        }
-    }
+void idx_close(idx_tensor *tensor){
+    if(tensor->copied) large_free(tensor->mapping);
+    else if(tensor->mapping != NULL) munmap(tensor->mapping, tensor->mapping_size);
+    tensor->mapping = NULL;
+    tensor->data = NULL;
+}
 
-    /*
-    for(int32_t image=0; image<number_of_images; ++image){
-        for(int32_t pixel=0; pixel<number_of_rows*number_of_columns; ++pixel){
-            fprintf(stdout, "%hhu, ", images_data[image][pixel]);
-        }
-        fprintf(stdout, "\n\n");
-    }*/
 
+mnist_images_set load_mnist_handwritten_images(const char* images_filepath){
+    mnist_images_set images_set;
+    if(idx_open(images_filepath, &images_set.tensor)) return (mnist_images_set){-1};
 
-    fclose(images_set_file);
-    double **double_images_data = convert_uint8_to_double(images_data, number_of_images, number_of_rows*number_of_columns);
-    normalize_double_data(double_images_data, number_of_images, number_of_rows*number_of_columns);
-    images_set.images = double_images_data;
-    free_uint8_array(images_data, number_of_images);
+    if(images_set.tensor.dimensions_num != 3){
+        fprintf(stderr, "Images file %s should have 3 dimensions but has %d\n", images_filepath, images_set.tensor.dimensions_num);
+        idx_close(&images_set.tensor);
+        return (mnist_images_set){-1};
+    }
 
-    /*for(int32_t image=0; image<number_of_images; ++image){
-        for(int32_t pixel=0; pixel<number_of_rows*number_of_columns; ++pixel){
-            fprintf(stdout, "%f, ", images_set.images[image][pixel]);
-        }
-        fprintf(stdout, "\n\n");
-    }*/
+    images_set.magic_number = images_set.tensor.magic_number;
+    images_set.number_of_images = images_set.tensor.dimensions[0];
+    images_set.number_of_rows = images_set.tensor.dimensions[1];
+    images_set.number_of_columns = images_set.tensor.dimensions[2];
+    images_set.pixels = images_set.tensor.data;
     return images_set;
 }
 
 
 mnist_labels_set load_mnist_handwritten_labels(const char* labels_filepath){
-    FILE *labels_set_file = fopen(labels_filepath, "rb");
-    if (labels_set_file == NULL) {
-        fprintf(stderr, "Failed to open training images file!\n");
-        return (mnist_labels_set){-1};
-    }
-
     mnist_labels_set labels_set;
+    if(idx_open(labels_filepath, &labels_set.tensor)) return (mnist_labels_set){-1};
 
-    int32_t magic_number;
-    if(read_from_file(&magic_number, sizeof(int32_t), labels_set_file)) return (mnist_labels_set){-1};
-    magic_number = ntohl(magic_number);
-    labels_set.magic_number = magic_number;
-
-    int32_t number_of_items;
-    if(read_from_file(&number_of_items, sizeof(int32_t), labels_set_file)) return (mnist_labels_set){-1};
-    number_of_items = ntohl(number_of_items);
-    labels_set.number_of_items = number_of_items;
-
-
-    uint8_t **labels_data = malloc(number_of_items * sizeof(uint8_t*));
-    for (int i = 0; i < number_of_items; ++i) {
-        labels_data[i] = malloc(10 * sizeof(uint8_t));
+    if(labels_set.tensor.dimensions_num != 1){
+        fprintf(stderr, "Labels file %s should have 1 dimension but has %d\n", labels_filepath, labels_set.tensor.dimensions_num);
+        idx_close(&labels_set.tensor);
+        return (mnist_labels_set){-1};
     }
 
-    for(int32_t label=0; label<number_of_items; ++label){
-        uint8_t label_value;
-        if(read_from_file(&label_value, sizeof(uint8_t), labels_set_file)){
-            free_uint8_array(labels_data, number_of_items);
+    for(size_t item=0; item<labels_set.tensor.items_num; ++item){
+        if(labels_set.tensor.data[item] >= MNIST_CLASSES){
+            fprintf(stderr, "Labels file %s has label %d at item %zu, expected 0 to %d\n", labels_filepath, labels_set.tensor.data[item], item, MNIST_CLASSES-1);
+            idx_close(&labels_set.tensor);
             return (mnist_labels_set){-1};
         }
-
-        for(int i = 0; i < 10; ++i){
-            if (i == label_value) {
-                labels_data[label][i] = 1;
-            } else {
-                labels_data[label][i] = 0;
-            }
-        }
     }
 
-    fclose(labels_set_file);
-    double **double_labels_data = convert_uint8_to_double(labels_data, number_of_items, 10);
-    normalize_double_data(double_labels_data, number_of_items, 10);
-    labels_set.labels = double_labels_data;
-    free_uint8_array(labels_data, number_of_items);
+    labels_set.magic_number = labels_set.tensor.magic_number;
+    labels_set.number_of_items = labels_set.tensor.dimensions[0];
+    labels_set.labels = labels_set.tensor.data;
     return labels_set;
 }
 
@@ -141,7 +163,8 @@ mnist_handwritten_digits_data load_mnist_data(const char* training_images_filepa
                                               const char* test_images_filepath,
                                               const char* test_labels_filepath
                                              ){
-    mnist_handwritten_digits_data mnist_data;
+    NN_PROFILE_BEGIN(loading_mark);
+    mnist_handwritten_digits_data mnist_data = {0};
     mnist_data.training_images = load_mnist_handwritten_images(training_images_filepath);
     if(mnist_data.training_images.magic_number == -1){
         fprintf(stderr, "Error loading mnist training images!\n");
@@ -150,26 +173,62 @@ mnist_handwritten_digits_data load_mnist_data(const char* training_images_filepa
     mnist_data.training_labels = load_mnist_handwritten_labels(training_labels_filepath);
     if(mnist_data.training_labels.magic_number == -1){
         fprintf(stderr, "Error loading mnist training labels!\n");
+        destroy_mnist_data(mnist_data);
         return (mnist_handwritten_digits_data){-1};
     }
     mnist_data.test_images = load_mnist_handwritten_images(test_images_filepath);
     if(mnist_data.test_images.magic_number == -1){
         fprintf(stderr, "Error loading mnist test images!\n");
+        destroy_mnist_data(mnist_data);
         return (mnist_handwritten_digits_data){-1};
     }
     mnist_data.test_labels = load_mnist_handwritten_labels(test_labels_filepath);
     if(mnist_data.test_labels.magic_number == -1){
         fprintf(stderr, "Error loading mnist test labels!\n");
+        destroy_mnist_data(mnist_data);
+        return (mnist_handwritten_digits_data){-1};
+    }
+
+    if(mnist_data.training_images.number_of_images != mnist_data.training_labels.number_of_items ||
+       mnist_data.test_images.number_of_images != mnist_data.test_labels.number_of_items){
+        fprintf(stderr, "Mnist images and labels sets have different sizes!\n");
+        destroy_mnist_data(mnist_data);
         return (mnist_handwritten_digits_data){-1};
     }
 
+    NN_PROFILE_END(loading_mark, PROFILE_DATA_LOADING, 0, 0,
+                   mnist_data.training_images.tensor.mapping_size + mnist_data.training_labels.tensor.mapping_size +
+                   mnist_data.test_images.tensor.mapping_size + mnist_data.test_labels.tensor.mapping_size);
     return mnist_data;
 }
 
 
 void destroy_mnist_data(mnist_handwritten_digits_data mnist_data){
-    free_double_array(mnist_data.training_images.images, mnist_data.training_images.number_of_images);
-    free_double_array(mnist_data.training_labels.labels, mnist_data.training_labels.number_of_items);
-    free_double_array(mnist_data.test_images.images, mnist_data.test_images.number_of_images);
-    free_double_array(mnist_data.test_labels.labels, mnist_data.test_labels.number_of_items);
+    idx_close(&mnist_data.training_images.tensor);
+    idx_close(&mnist_data.training_labels.tensor);
+    idx_close(&mnist_data.test_images.tensor);
+    idx_close(&mnist_data.test_labels.tensor);
+}
+
+
+void gather_mnist_batch(const mnist_images_set *images, const mnist_labels_set *labels,
+                        const size_t *indices, size_t count,
+                        nn_real *inputs, nn_real *expected_outputs
+                        ){
+    const size_t image_size = (size_t)images->number_of_rows * images->number_of_columns;
+    const nn_real pixel_scale = (nn_real)1 / 255; // IDX unsigned bytes span 0 to 255
+    NN_PROFILE_BEGIN(assembly_mark);
+
+    for(size_t sample=0; sample<count; ++sample){
+        const uint8_t *pixels = images->pixels + indices[sample] * image_size;
+        nn_real *sample_inputs = inputs + sample * image_size;
+        for(size_t pixel=0; pixel<image_size; ++pixel)
+            sample_inputs[pixel] = (nn_real)pixels[pixel] * pixel_scale;
+
+        nn_real *sample_outputs = expected_outputs + sample * MNIST_CLASSES;
+        memset(sample_outputs, 0, sizeof(nn_real) * MNIST_CLASSES);
+        sample_outputs[labels->labels[indices[sample]]] = 1;
+    }
+    NN_PROFILE_END(assembly_mark, PROFILE_BATCH_ASSEMBLY, 0, count * image_size,
+                   count * (image_size + 1 + sizeof(nn_real) * (image_size + MNIST_CLASSES)));
 }
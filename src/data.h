@@ -4,10 +4,37 @@
 #include "utils.h"
 
 
+/* Highest number of dimensions an IDX file may declare */
+#define IDX_MAX_DIMENSIONS 8
+
+/* IDX element type code of unsigned bytes, the only one the loaders accept */
+#define IDX_UNSIGNED_BYTE 0x08
+
+/* Number of classes of the handwritten digits labels */
+#define MNIST_CLASSES 10
+
+
+/* Memory mapped IDX file, data points straight into the mapping so nothing is copied or decoded up front. When the
+ * placement configuration interleaves buffers over NUMA nodes or backs them with reserved huge pages, which page cache
+ * pages can't be, the file is copied into a large_calloc buffer instead */
+typedef struct{
+    void *mapping;          // file mapping or its copy
+    size_t mapping_size;
+    int copied;
+    int32_t magic_number;
+    uint8_t dimensions_num;
+    int32_t dimensions[IDX_MAX_DIMENSIONS];
+    size_t items_num;   // first dimension
+    size_t item_size;   // product of the remaining dimensions, in elements
+    const uint8_t *data; // items_num x item_size contiguous elements
+} idx_tensor;
+
+
 typedef struct{
     int32_t magic_number;
     int32_t number_of_items;
-    double **labels;
+    const uint8_t *labels; // class index of every item
+    idx_tensor tensor;
 } mnist_labels_set;
 
 
@@ -16,7 +43,8 @@ typedef struct{
     int32_t number_of_images;
     int32_t number_of_rows;
     int32_t number_of_columns;
-    double **images;
+    const uint8_t *pixels; // number_of_images x rows x columns raw pixels
+    idx_tensor tensor;
 } mnist_images_set;
 
 
@@ -28,6 +56,14 @@ typedef struct{
 } mnist_handwritten_digits_data;
 
 
+/* Maps the provided IDX file and validates its header and size against the declared dimensions
+ * Returns non-zero and leaves tensor unmapped on failure */
+int idx_open(const char *filepath, idx_tensor *tensor);
+
+/* Unmaps or deallocates the provided IDX file */
+void idx_close(idx_tensor *tensor);
+
+
 mnist_handwritten_digits_data load_mnist_data(const char* training_images_filepath,
                                               const char* training_labels_filepath,
                                               const char* test_images_filepath,
@@ -38,4 +74,12 @@ mnist_handwritten_digits_data load_mnist_data(const char* training_images_filepa
 void destroy_mnist_data(mnist_handwritten_digits_data mnist_data);
 
 
+/* Assembles count samples, picked by indices, into contiguous network inputs normalized to [0, 1] and one-hot expected
+ * outputs. This is the only place pixels are converted, so the dataset itself stays in its raw uint8 form */
+void gather_mnist_batch(const mnist_images_set *images, const mnist_labels_set *labels,
+                        const size_t *indices, size_t count,
+                        nn_real *inputs, nn_real *expected_outputs
+                        );
+
+
 #endif //DIGITS_NN_C_DATA_H
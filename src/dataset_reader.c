@@ -0,0 +1,289 @@
+#include "dataset_reader.h"
+#include "data.h"
+#include "profiler.h"
+#include "placement.h"
+
+
+typedef struct {
+    FILE *images_file;
+    FILE *labels_file;
+    long images_offset; // first sample byte, right after the header
+    long labels_offset;
+    size_t samples_num;
+    size_t sample_size;
+    size_t classes;
+    size_t read_samples;
+} idx_source_context;
+
+
+/* Reads and validates the header of an unsigned byte IDX file with the expected number of dimensions */
+static int read_idx_header(FILE *file, const char *filepath, uint8_t expected_dimensions, int32_t *dimensions){
+    uint8_t magic[4];
+    if(fread(magic, sizeof(magic), 1, file) != 1 || magic[0] != 0 || magic[1] != 0 ||
+       magic[2] != IDX_UNSIGNED_BYTE || magic[3] != expected_dimensions){
+        fprintf(stderr, "IDX file %s has an invalid magic number, expected %d unsigned byte dimensions\n", filepath, expected_dimensions);
+        return 1;
+    }
+
+    for(uint8_t dimension=0; dimension<expected_dimensions; ++dimension){
+        uint32_t value;
+        if(fread(&value, sizeof(value), 1, file) != 1){
+            fprintf(stderr, "IDX file %s is truncated inside its header\n", filepath);
+            return 1;
+        }
+        dimensions[dimension] = (int32_t)ntohl(value);
+        if(dimensions[dimension] < 0){
+            fprintf(stderr, "IDX file %s declares a negative dimension\n", filepath);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static size_t idx_source_read(void *context, size_t max_samples, uint8_t *samples, uint8_t *labels){
+    idx_source_context *idx = context;
+    size_t remaining = idx->samples_num - idx->read_samples;
+    size_t count = max_samples < remaining ? max_samples : remaining;
+    if(count == 0) return 0;
+
+    NN_PROFILE_BEGIN(loading_mark);
+    if(fread(samples, idx->sample_size, count, idx->images_file) != count ||
+       fread(labels, 1, count, idx->labels_file) != count){
+        fprintf(stderr, "IDX files ended before the %zu samples their headers declare\n", idx->samples_num);
+        idx->read_samples = idx->samples_num;
+        return 0;
+    }
+
+    for(size_t sample=0; sample<count; ++sample){
+        if(labels[sample] >= idx->classes){
+            fprintf(stderr, "IDX label %d at sample %zu is out of range, expected 0 to %zu\n", labels[sample], idx->read_samples + sample, idx->classes-1);
+            idx->read_samples = idx->samples_num;
+            return 0;
+        }
+    }
+
+    idx->read_samples += count;
+    NN_PROFILE_END(loading_mark, PROFILE_DATA_LOADING, 0, 0, count * (idx->sample_size + 1));
+    return count;
+}
+
+
+static int idx_source_rewind(void *context){
+    idx_source_context *idx = context;
+    idx->read_samples = 0;
+    return fseek(idx->images_file, idx->images_offset, SEEK_SET) != 0 || fseek(idx->labels_file, idx->labels_offset, SEEK_SET) != 0;
+}
+
+
+static void idx_source_close(void *context){
+    idx_source_context *idx = context;
+    if(idx->images_file) fclose(idx->images_file);
+    if(idx->labels_file) fclose(idx->labels_file);
+    free(idx);
+}
+
+
+int open_idx_source(const char *images_filepath, const char *labels_filepath, size_t classes, dataset_source *source){
+    idx_source_context *idx = calloc(1, sizeof(idx_source_context));
+    idx->images_file = fopen(images_filepath, "rb");
+    idx->labels_file = fopen(labels_filepath, "rb");
+    if(idx->images_file == NULL || idx->labels_file == NULL){
+        fprintf(stderr, "Failed to open IDX files %s and %s!\n", images_filepath, labels_filepath);
+        idx_source_close(idx);
+        return 1;
+    }
+
+    int32_t images_dimensions[3], labels_dimensions[1];
+    if(read_idx_header(idx->images_file, images_filepath, 3, images_dimensions) ||
+       read_idx_header(idx->labels_file, labels_filepath, 1, labels_dimensions)){
+        idx_source_close(idx);
+        return 1;
+    }
+    if(images_dimensions[0] != labels_dimensions[0]){
+        fprintf(stderr, "IDX files %s and %s hold different numbers of samples\n", images_filepath, labels_filepath);
+        idx_source_close(idx);
+        return 1;
+    }
+
+    idx->images_offset = ftell(idx->images_file);
+    idx->labels_offset = ftell(idx->labels_file);
+    idx->samples_num = (size_t)images_dimensions[0];
+    idx->sample_size = (size_t)images_dimensions[1] * (size_t)images_dimensions[2];
+    idx->classes = classes;
+
+    source->sample_size = idx->sample_size;
+    source->classes = classes;
+    source->samples_num = idx->samples_num;
+    source->context = idx;
+    source->read = idx_source_read;
+    source->rewind = idx_source_rewind;
+    source->close = idx_source_close;
+    return 0;
+}
+
+
+/* Background thread: keeps filling whichever staging buffer the consumer has released, rewinding the source at the
+ * end of every epoch so the next epoch is already being read while the current one finishes */
+static void *dataset_reader_producer(void *argument){
+    dataset_reader *reader = argument;
+
+    while(1){
+        staging_buffer *buffer = &reader->staging[reader->producer_index];
+
+        pthread_mutex_lock(&reader->lock);
+        while(buffer->full && !reader->stop) pthread_cond_wait(&reader->changed, &reader->lock);
+        int stop = reader->stop;
+        pthread_mutex_unlock(&reader->lock);
+        if(stop) break;
+
+        size_t count = reader->source.read(reader->source.context, reader->chunk_samples, buffer->samples, buffer->labels);
+        int last_of_epoch = count < reader->chunk_samples;
+        if(last_of_epoch && reader->source.rewind(reader->source.context))
+            fprintf(stderr, "Failed to rewind the dataset source, the next epoch will be empty\n");
+
+        pthread_mutex_lock(&reader->lock);
+        buffer->count = count;
+        buffer->last_of_epoch = last_of_epoch;
+        buffer->full = 1;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+
+        reader->producer_index ^= 1;
+    }
+
+    return NULL;
+}
+
+
+dataset_reader *create_dataset_reader(dataset_source source, size_t chunk_samples, size_t shuffle_samples){
+    if(chunk_samples == 0) chunk_samples = 1;
+    if(shuffle_samples == 0) shuffle_samples = 1;
+
+    dataset_reader *reader = calloc(1, sizeof(dataset_reader));
+    reader->source = source;
+    reader->chunk_samples = chunk_samples;
+    for(size_t buffer=0; buffer<2; ++buffer){
+        reader->staging[buffer].samples = large_calloc(chunk_samples * source.sample_size, BUFFER_SHARED);
+        reader->staging[buffer].labels = large_calloc(chunk_samples, BUFFER_SHARED);
+    }
+    reader->shuffle_capacity = shuffle_samples;
+    reader->shuffle_samples = large_calloc(shuffle_samples * source.sample_size, BUFFER_SHARED);
+    reader->shuffle_labels = large_calloc(shuffle_samples, BUFFER_SHARED);
+    rng_open(&reader->rng, get_random_seed(), rng_stream_id(RNG_READER, 0));
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->changed, NULL);
+    if(pthread_create(&reader->producer, NULL, dataset_reader_producer, reader) != 0){
+        fprintf(stderr, "Failed to create the dataset reader thread\n");
+        reader->source.close(reader->source.context);
+        pthread_mutex_destroy(&reader->lock);
+        pthread_cond_destroy(&reader->changed);
+        for(size_t buffer=0; buffer<2; ++buffer){
+            large_free(reader->staging[buffer].samples);
+            large_free(reader->staging[buffer].labels);
+        }
+        large_free(reader->shuffle_samples);
+        large_free(reader->shuffle_labels);
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+
+void destroy_dataset_reader(dataset_reader *reader){
+    if(reader == NULL) return;
+
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->changed);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_join(reader->producer, NULL);
+
+    reader->source.close(reader->source.context);
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+    for(size_t buffer=0; buffer<2; ++buffer){
+        large_free(reader->staging[buffer].samples);
+        large_free(reader->staging[buffer].labels);
+    }
+    large_free(reader->shuffle_samples);
+    large_free(reader->shuffle_labels);
+    free(reader);
+}
+
+
+/* Moves the next staged sample into slot of the shuffle buffer, returns 0 once the epoch has no samples left */
+static int pull_staged_sample(dataset_reader *reader, size_t slot){
+    while(1){
+        staging_buffer *buffer = &reader->staging[reader->consumer_index];
+
+        pthread_mutex_lock(&reader->lock);
+        while(!buffer->full) pthread_cond_wait(&reader->changed, &reader->lock);
+        pthread_mutex_unlock(&reader->lock);
+
+        if(reader->consumer_position < buffer->count){
+            size_t sample_size = reader->source.sample_size;
+            memcpy(reader->shuffle_samples + slot * sample_size, buffer->samples + reader->consumer_position * sample_size, sample_size);
+            reader->shuffle_labels[slot] = buffer->labels[reader->consumer_position];
+            ++reader->consumer_position;
+            return 1;
+        }
+
+        // buffer drained, hand it back to the producer
+        int last_of_epoch = buffer->last_of_epoch;
+        pthread_mutex_lock(&reader->lock);
+        buffer->full = 0;
+        pthread_cond_broadcast(&reader->changed);
+        pthread_mutex_unlock(&reader->lock);
+        reader->consumer_index ^= 1;
+        reader->consumer_position = 0;
+
+        if(last_of_epoch) return 0;
+    }
+}
+
+
+size_t dataset_reader_next_batch(dataset_reader *reader, size_t batch_size, nn_real *inputs, nn_real *expected_outputs){
+    const size_t sample_size = reader->source.sample_size;
+    const size_t classes = reader->source.classes;
+    const nn_real pixel_scale = (nn_real)1 / 255;
+    NN_PROFILE_BEGIN(assembly_mark);
+
+    size_t produced = 0;
+    while(produced < batch_size){
+        while(!reader->epoch_input_done && reader->shuffle_count < reader->shuffle_capacity){
+            if(!pull_staged_sample(reader, reader->shuffle_count)){
+                reader->epoch_input_done = 1;
+                break;
+            }
+            ++reader->shuffle_count;
+        }
+        if(reader->shuffle_count == 0) break;
+
+        // emit a random sample of the shuffle buffer and fill its slot with the last one
+        size_t slot = rng_below(&reader->rng, reader->shuffle_count);
+        const uint8_t *sample = reader->shuffle_samples + slot * sample_size;
+        nn_real *sample_inputs = inputs + produced * sample_size;
+        for(size_t element=0; element<sample_size; ++element)
+            sample_inputs[element] = (nn_real)sample[element] * pixel_scale;
+        nn_real *sample_outputs = expected_outputs + produced * classes;
+        memset(sample_outputs, 0, sizeof(nn_real) * classes);
+        sample_outputs[reader->shuffle_labels[slot]] = 1;
+        ++produced;
+
+        --reader->shuffle_count;
+        if(slot != reader->shuffle_count){
+            memcpy(reader->shuffle_samples + slot * sample_size, reader->shuffle_samples + reader->shuffle_count * sample_size, sample_size);
+            reader->shuffle_labels[slot] = reader->shuffle_labels[reader->shuffle_count];
+        }
+    }
+
+    if(produced == 0 && reader->epoch_input_done) reader->epoch_input_done = 0; // the next call starts a new epoch
+    // includes waiting on the producer whenever the staging buffers run dry
+    NN_PROFILE_END(assembly_mark, PROFILE_BATCH_ASSEMBLY, 0, produced * sample_size,
+                   produced * (sample_size + 1 + sizeof(nn_real) * (sample_size + classes)));
+    return produced;
+}
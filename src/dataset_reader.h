@@ -0,0 +1,71 @@
+#ifndef DIGITS_NN_C_DATASET_READER_H
+#define DIGITS_NN_C_DATASET_READER_H
+
+#include "utils.h"
+#include "rng.h"
+#include <pthread.h>
+
+
+/* Sequential source of labelled uint8 samples, implemented once per file format */
+typedef struct {
+    size_t sample_size;  // elements per sample
+    size_t classes;      // labels range from 0 to classes-1
+    size_t samples_num;  // samples per epoch
+    void *context;
+    /* Reads up to max_samples samples and their labels, returns how many were read, 0 at the end of the data */
+    size_t (*read)(void *context, size_t max_samples, uint8_t *samples, uint8_t *labels);
+    /* Moves back to the first sample, returns non-zero on failure */
+    int (*rewind)(void *context);
+    void (*close)(void *context);
+} dataset_source;
+
+
+/* One of the two staging buffers the background thread fills while the other one is being consumed */
+typedef struct {
+    uint8_t *samples;
+    uint8_t *labels;
+    size_t count;
+    int last_of_epoch; // the source was exhausted and rewound after this buffer
+    int full;
+} staging_buffer;
+
+
+/* Streaming reader with bounded memory: a background thread reads the source in chunks into two staging buffers,
+ * samples then go through a shuffle buffer before being normalized into contiguous mini-batches */
+typedef struct {
+    dataset_source source;
+    size_t chunk_samples;
+    staging_buffer staging[2];
+    size_t producer_index;
+    size_t consumer_index;
+    size_t consumer_position;  // next sample of staging[consumer_index] to take
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t producer;
+    int stop;
+
+    size_t shuffle_capacity;   // samples held by the shuffle buffer, 1 keeps the source order
+    size_t shuffle_count;
+    uint8_t *shuffle_samples;
+    uint8_t *shuffle_labels;
+    int epoch_input_done;      // every sample of the current epoch has entered the shuffle buffer
+    rng_stream rng;            // picks the evicted shuffle buffer sample
+} dataset_reader;
+
+
+/* Opens an IDX images file and its IDX labels file as a source, returns non-zero on failure */
+int open_idx_source(const char *images_filepath, const char *labels_filepath, size_t classes, dataset_source *source);
+
+/* Creates a reader over the provided source, which it takes ownership of. The staging buffers hold chunk_samples
+ * samples each and the shuffle buffer shuffle_samples, so memory use is independent of the dataset size */
+dataset_reader *create_dataset_reader(dataset_source source, size_t chunk_samples, size_t shuffle_samples);
+
+/* Stops the background thread, closes the source and deallocates the provided reader */
+void destroy_dataset_reader(dataset_reader *reader);
+
+/* Writes up to batch_size shuffled samples into inputs, scaled to [0, 1], and their one-hot labels into
+ * expected_outputs. Returns the number of samples written, fewer than batch_size only at the end of an epoch and 0 once
+ * the epoch is exhausted, the call after that starts the next epoch */
+size_t dataset_reader_next_batch(dataset_reader *reader, size_t batch_size, nn_real *inputs, nn_real *expected_outputs);
+
+#endif //DIGITS_NN_C_DATASET_READER_H
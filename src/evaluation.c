@@ -0,0 +1,153 @@
+#include "evaluation.h"
+#include <pthread.h>
+
+
+typedef struct {
+    const NeuralNetwork *nn;
+    const mnist_images_set *images;
+    const mnist_labels_set *labels;
+    size_t index;
+    size_t first;               // contiguous shard of the sets evaluated by this worker
+    size_t count;
+    size_t correct;
+    double loss;
+    size_t confusion[MNIST_CLASSES][MNIST_CLASSES];
+} evaluation_worker;
+
+
+static void *evaluation_worker_loop(void *argument){
+    evaluation_worker *worker = argument;
+    const NeuralNetwork *nn = worker->nn;
+    const size_t input_size = nn->input_layer_size;
+
+    NeuralNetwork *replica = NULL;
+    if(get_placement_config().numa == NUMA_REPLICATE && numa_nodes_num() > 1){
+        replica = replicate_neural_network(nn, current_numa_node());
+        if(replica != NULL) nn = replica;
+    }
+
+    nn_workspace *workspace = create_workspace(nn, EVALUATION_BATCH_SIZE);
+    size_t *indices = malloc(sizeof(size_t) * EVALUATION_BATCH_SIZE);
+    nn_real *inputs = large_calloc(sizeof(nn_real) * input_size * EVALUATION_BATCH_SIZE, BUFFER_LOCAL);
+    nn_real *expected_outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * EVALUATION_BATCH_SIZE);
+    nn_real *outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * EVALUATION_BATCH_SIZE);
+
+    for(size_t done=0; done<worker->count; done+=EVALUATION_BATCH_SIZE){
+        size_t count = worker->count - done < EVALUATION_BATCH_SIZE ? worker->count - done : EVALUATION_BATCH_SIZE;
+        for(size_t sample=0; sample<count; ++sample) indices[sample] = worker->first + done + sample;
+        gather_mnist_batch(worker->images, worker->labels, indices, count, inputs, expected_outputs);
+        nn_predict_batch(nn, inputs, count, outputs, workspace);
+
+        for(size_t sample=0; sample<count; ++sample){
+            const nn_real *sample_outputs = outputs + sample * MNIST_CLASSES;
+            size_t label = worker->labels->labels[indices[sample]];
+            size_t predicted = argmax(MNIST_CLASSES, sample_outputs);
+            worker->loss += calculate_loss(nn, sample_outputs, expected_outputs + sample * MNIST_CLASSES);
+            worker->correct += predicted == label;
+            ++worker->confusion[label][predicted];
+        }
+    }
+
+    free(outputs);
+    free(expected_outputs);
+    large_free(inputs);
+    free(indices);
+    destroy_workspace(workspace);
+    if(replica != NULL) destroy_neural_network(replica);
+    return NULL;
+}
+
+
+/* Entry of the workers running on their own thread, which unlike the calling one can be pinned */
+static void *evaluation_thread(void *argument){
+    evaluation_worker *worker = argument;
+    pin_thread(worker->index);
+    return evaluation_worker_loop(worker);
+}
+
+
+int evaluate(const NeuralNetwork *nn, const mnist_images_set *images, const mnist_labels_set *labels, size_t threads_num,
+             evaluation_result *result){
+    size_t image_size = (size_t)images->number_of_rows * (size_t)images->number_of_columns;
+    if(nn->input_layer_size != image_size || nn->dense_layers[nn->dense_layers_num-1].size != MNIST_CLASSES){
+        fprintf(stderr, "Network with %zu inputs and %zu outputs can't evaluate %d x %d images of %d classes\n",
+                nn->input_layer_size, nn->dense_layers[nn->dense_layers_num-1].size,
+                images->number_of_rows, images->number_of_columns, MNIST_CLASSES);
+        return 1;
+    }
+    if(images->number_of_images != labels->number_of_items){
+        fprintf(stderr, "Evaluation sets hold %d images but %d labels\n", images->number_of_images, labels->number_of_items);
+        return 1;
+    }
+
+    size_t samples_num = (size_t)images->number_of_images;
+    if(threads_num == 0){
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_num = online_cpus > 0 ? (size_t)online_cpus : 1;
+    }
+    // no worker gets less than a full batch, except when the whole set is smaller than one
+    size_t max_threads = (samples_num + EVALUATION_BATCH_SIZE - 1) / EVALUATION_BATCH_SIZE;
+    if(threads_num > max_threads) threads_num = max_threads > 0 ? max_threads : 1;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    evaluation_worker *workers = calloc(threads_num, sizeof(evaluation_worker));
+    pthread_t *threads = malloc(sizeof(pthread_t) * threads_num);
+    for(size_t thread=0; thread<threads_num; ++thread){
+        evaluation_worker *worker = &workers[thread];
+        worker->nn = nn;
+        worker->images = images;
+        worker->labels = labels;
+        worker->index = thread;
+        worker->first = samples_num * thread / threads_num;
+        worker->count = samples_num * (thread + 1) / threads_num - worker->first;
+    }
+    // worker 0 runs on the calling thread
+    size_t started = 1;
+    for(; started<threads_num; ++started){
+        if(pthread_create(&threads[started], NULL, evaluation_thread, &workers[started]) != 0){
+            fprintf(stderr, "Failed to create evaluation thread %zu, evaluating its shard on the calling thread\n", started);
+            break;
+        }
+    }
+    evaluation_worker_loop(&workers[0]);
+    for(size_t thread=started; thread<threads_num; ++thread) evaluation_worker_loop(&workers[thread]);
+    for(size_t thread=1; thread<started; ++thread) pthread_join(threads[thread], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    memset(result, 0, sizeof(evaluation_result));
+    result->samples_num = samples_num;
+    for(size_t thread=0; thread<threads_num; ++thread){
+        result->correct += workers[thread].correct;
+        result->loss += workers[thread].loss;
+        for(size_t expected=0; expected<MNIST_CLASSES; ++expected)
+            for(size_t predicted=0; predicted<MNIST_CLASSES; ++predicted)
+                result->confusion[expected][predicted] += workers[thread].confusion[expected][predicted];
+    }
+    result->accuracy = samples_num ? (double)result->correct / (double)samples_num : 0;
+    result->loss = samples_num ? result->loss / (double)samples_num : 0;
+    result->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+    result->samples_per_second = result->seconds > 0 ? (double)samples_num / result->seconds : 0;
+
+    free(threads);
+    free(workers);
+    return 0;
+}
+
+
+void print_evaluation(FILE *file, const evaluation_result *result, int confusion){
+    fprintf(file, "Evaluation: accuracy %.2f%% (%zu/%zu), loss %f, %.0f samples/s\n", 100.0 * result->accuracy,
+            result->correct, result->samples_num, result->loss, result->samples_per_second);
+    if(!confusion) return;
+
+    fprintf(file, "Confusion matrix (rows expected, columns predicted):\n     ");
+    for(size_t predicted=0; predicted<MNIST_CLASSES; ++predicted) fprintf(file, "%7zu", predicted);
+    fprintf(file, "\n");
+    for(size_t expected=0; expected<MNIST_CLASSES; ++expected){
+        fprintf(file, "%5zu", expected);
+        for(size_t predicted=0; predicted<MNIST_CLASSES; ++predicted) fprintf(file, "%7zu", result->confusion[expected][predicted]);
+        fprintf(file, "\n");
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef DIGITS_NN_C_EVALUATION_H
+#define DIGITS_NN_C_EVALUATION_H
+
+#include "nn_core.h"
+#include "data.h"
+
+
+/* Samples each evaluation worker runs through the network at once */
+#define EVALUATION_BATCH_SIZE 256
+
+
+typedef struct {
+    size_t samples_num;
+    size_t correct;
+    double accuracy;            // correct / samples_num
+    double loss;                // mean loss of the network's loss function
+    double seconds;
+    double samples_per_second;
+    size_t confusion[MNIST_CLASSES][MNIST_CLASSES]; // [expected class][predicted class] sample counts
+} evaluation_result;
+
+
+/* Runs batched inference over every sample of the provided sets on threads_num threads (0 uses one per online CPU),
+ * each with its own workspace and, under NUMA_REPLICATE, its own copy of the parameters on its node. The network is
+ * only read, so it can be evaluated while other threads use it for anything that does not update its parameters, such
+ * as assembling the next batches.
+ * Returns non-zero and leaves result untouched when the network does not match the sets */
+int evaluate(const NeuralNetwork *nn, const mnist_images_set *images, const mnist_labels_set *labels, size_t threads_num,
+             evaluation_result *result);
+
+/* Prints the accuracy, loss and throughput of an evaluation, followed by its confusion matrix when confusion is non-zero */
+void print_evaluation(FILE *file, const evaluation_result *result, int confusion);
+
+#endif //DIGITS_NN_C_EVALUATION_H
@@ -0,0 +1,179 @@
+#include "gemm.h"
+#include "simd.h"
+#include <pthread.h>
+
+
+/* Packing buffers are per thread so concurrent callers never share them, they are allocated on first use */
+static pthread_key_t packing_buffers_key;
+static pthread_once_t packing_buffers_once = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    nn_real *packed_a; // GEMM_MC x GEMM_KC, stored as GEMM_MR-row panels
+    nn_real *packed_b; // GEMM_KC x GEMM_NC, stored as GEMM_NR-column panels
+} packing_buffers;
+
+
+static void destroy_packing_buffers(void *buffers){
+    free(((packing_buffers*)buffers)->packed_a);
+    free(((packing_buffers*)buffers)->packed_b);
+    free(buffers);
+}
+
+
+static void create_packing_buffers_key(void){
+    pthread_key_create(&packing_buffers_key, destroy_packing_buffers);
+}
+
+
+static packing_buffers *get_packing_buffers(void){
+    pthread_once(&packing_buffers_once, create_packing_buffers_key);
+    packing_buffers *buffers = pthread_getspecific(packing_buffers_key);
+    if(buffers == NULL){
+        buffers = malloc(sizeof(packing_buffers));
+        buffers->packed_a = aligned_calloc(64, sizeof(nn_real) * GEMM_MC * GEMM_KC);
+        buffers->packed_b = aligned_calloc(64, sizeof(nn_real) * GEMM_KC * GEMM_NC);
+        pthread_setspecific(packing_buffers_key, buffers);
+    }
+    return buffers;
+}
+
+
+/* Packs the mc x kc block of op(A) starting at (row, depth) into GEMM_MR-row panels, zero padding the last panel */
+static void pack_a(int transpose_a, const nn_real *a, size_t lda, size_t row, size_t depth, size_t mc, size_t kc, nn_real *packed){
+    for(size_t panel=0; panel<mc; panel+=GEMM_MR){
+        size_t rows = mc - panel < GEMM_MR ? mc - panel : GEMM_MR;
+        for(size_t p=0; p<kc; ++p){
+            for(size_t i=0; i<GEMM_MR; ++i){
+                nn_real value = 0;
+                if(i < rows){
+                    size_t r = row + panel + i, d = depth + p;
+                    value = transpose_a ? a[d * lda + r] : a[r * lda + d];
+                }
+                *packed++ = value;
+            }
+        }
+    }
+}
+
+
+/* Packs the kc x nc block of op(B) starting at (depth, column) into GEMM_NR-column panels, zero padding the last panel */
+static void pack_b(int transpose_b, const nn_real *b, size_t ldb, size_t depth, size_t column, size_t kc, size_t nc, nn_real *packed){
+    for(size_t panel=0; panel<nc; panel+=GEMM_NR){
+        size_t columns = nc - panel < GEMM_NR ? nc - panel : GEMM_NR;
+        for(size_t p=0; p<kc; ++p){
+            size_t d = depth + p;
+            for(size_t j=0; j<GEMM_NR; ++j){
+                nn_real value = 0;
+                if(j < columns){
+                    size_t c = column + panel + j;
+                    value = transpose_b ? b[c * ldb + d] : b[d * ldb + c];
+                }
+                *packed++ = value;
+            }
+        }
+    }
+}
+
+
+/* Multiplies a GEMM_MR-row panel by a GEMM_NR-column panel, keeping the whole C tile in registers
+ * and writing back only the rows x columns part that lies inside C
+ * With an epilogue, bias (the tile's columns of it) is added and the activation applied to the tile before the write */
+static void gemm_micro_kernel(size_t kc, const nn_real *restrict packed_a, const nn_real *restrict packed_b,
+                              nn_real beta, nn_real *restrict c, size_t ldc, size_t rows, size_t columns,
+                              const gemm_epilogue *epilogue, const nn_real *bias){
+    nn_real tile[GEMM_MR][GEMM_NR];
+    simd->gemm_tile(kc, packed_a, packed_b, tile);
+
+    if(epilogue == NULL){
+        for(size_t i=0; i<rows; ++i){
+            nn_real *c_row = c + i * ldc;
+            if(beta == 0){
+                for(size_t j=0; j<columns; ++j) c_row[j] = tile[i][j];
+            } else {
+                for(size_t j=0; j<columns; ++j) c_row[j] = beta * c_row[j] + tile[i][j];
+            }
+        }
+        return;
+    }
+
+    for(size_t i=0; i<rows; ++i){
+        if(beta != 0)
+            for(size_t j=0; j<columns; ++j) tile[i][j] += beta * c[i * ldc + j];
+        if(bias != NULL)
+            for(size_t j=0; j<columns; ++j) tile[i][j] += bias[j];
+    }
+    // the tile is contiguous, lanes outside C hold finite values of the zero padded panels and are never written
+    act_forward(epilogue->activation, GEMM_MR * GEMM_NR, &tile[0][0], &tile[0][0]);
+
+    for(size_t i=0; i<rows; ++i)
+        memcpy(c + i * ldc, tile[i], sizeof(nn_real) * columns);
+}
+
+
+void gemm(int transpose_a, int transpose_b,
+          size_t m, size_t n, size_t k,
+          const nn_real *a, size_t lda,
+          const nn_real *b, size_t ldb,
+          nn_real beta,
+          nn_real *c, size_t ldc
+          ){
+    gemm_fused(transpose_a, transpose_b, m, n, k, a, lda, b, ldb, beta, c, ldc, NULL);
+}
+
+
+void gemm_fused(int transpose_a, int transpose_b,
+                size_t m, size_t n, size_t k,
+                const nn_real *a, size_t lda,
+                const nn_real *b, size_t ldb,
+                nn_real beta,
+                nn_real *c, size_t ldc,
+                const gemm_epilogue *epilogue
+                ){
+    if(m == 0 || n == 0) return;
+
+    if(k == 0){ // op(A) * op(B) is empty, only the beta scaling and the epilogue remain
+        for(size_t i=0; i<m; ++i){
+            nn_real *c_row = c + i * ldc;
+            for(size_t j=0; j<n; ++j){
+                c_row[j] = beta == 0 ? 0 : beta * c_row[j];
+                if(epilogue != NULL && epilogue->bias != NULL) c_row[j] += epilogue->bias[j];
+            }
+            if(epilogue != NULL) act_forward(epilogue->activation, n, c_row, c_row);
+        }
+        return;
+    }
+
+    packing_buffers *buffers = get_packing_buffers();
+
+    for(size_t jc=0; jc<n; jc+=GEMM_NC){
+        size_t nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+
+        for(size_t pc=0; pc<k; pc+=GEMM_KC){
+            size_t kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            nn_real block_beta = pc == 0 ? beta : 1; // later depth blocks accumulate onto the first one
+            const gemm_epilogue *block_epilogue = pc + kc == k ? epilogue : NULL; // C is final only after the last one
+            pack_b(transpose_b, b, ldb, pc, jc, kc, nc, buffers->packed_b);
+
+            for(size_t ic=0; ic<m; ic+=GEMM_MC){
+                size_t mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                pack_a(transpose_a, a, lda, ic, pc, mc, kc, buffers->packed_a);
+
+                for(size_t jr=0; jr<nc; jr+=GEMM_NR){
+                    size_t columns = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    for(size_t ir=0; ir<mc; ir+=GEMM_MR){
+                        size_t rows = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        gemm_micro_kernel(kc,
+                                          buffers->packed_a + ir * kc,
+                                          buffers->packed_b + jr * kc,
+                                          block_beta,
+                                          c + (ic + ir) * ldc + jc + jr, ldc,
+                                          rows, columns,
+                                          block_epilogue,
+                                          block_epilogue && block_epilogue->bias ? block_epilogue->bias + jc + jr : NULL
+                                          );
+                    }
+                }
+            }
+        }
+    }
+}
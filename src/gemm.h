@@ -0,0 +1,50 @@
+#ifndef DIGITS_NN_C_GEMM_H
+#define DIGITS_NN_C_GEMM_H
+
+#include "utils.h"
+#include "activations.h"
+
+/* Register tile computed by the micro-kernel (rows of C x columns of C), a tile row is one AVX-512 register wide */
+#define GEMM_MR 4
+#if NN_SINGLE_PRECISION
+#define GEMM_NR 16
+#else
+#define GEMM_NR 8
+#endif
+
+/* Cache blocking: MC x KC panels of A stay in L2, KC x NC panels of B stay in L3 */
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 512
+
+
+/* Work applied to each register tile of C before its only write back, once the full depth has been accumulated */
+typedef struct {
+    const nn_real *bias;       // n elements added to every row of C, NULL for none
+    nn_activation activation;  // must be element-wise, softmax is left to the caller
+} gemm_epilogue;
+
+
+/* Computes C = op(A) * op(B) + beta * C, where op(X) is X or its transpose
+ * op(A) is m x k, op(B) is k x n and C is m x n, all row-major with leading dimensions lda, ldb and ldc
+ * When beta is 0 C does not need to be initialized */
+void gemm(int transpose_a, int transpose_b,
+          size_t m, size_t n, size_t k,
+          const nn_real *a, size_t lda,
+          const nn_real *b, size_t ldb,
+          nn_real beta,
+          nn_real *c, size_t ldc
+          );
+
+/* gemm that also adds the bias and applies the activation of epilogue to C while each tile is still hot, so a dense
+ * layer forward pass writes its outputs exactly once. A NULL epilogue behaves like gemm */
+void gemm_fused(int transpose_a, int transpose_b,
+                size_t m, size_t n, size_t k,
+                const nn_real *a, size_t lda,
+                const nn_real *b, size_t ldb,
+                nn_real beta,
+                nn_real *c, size_t ldc,
+                const gemm_epilogue *epilogue
+                );
+
+#endif //DIGITS_NN_C_GEMM_H
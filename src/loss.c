@@ -1,29 +1,30 @@
 #include "loss.h"
+#include "simd.h"
 
 
 #define EPSILON 1e-10
 
-double safe_log(double x) {
+nn_real safe_log(nn_real x) {
     return log(x < EPSILON ? EPSILON : x);
 }
 
 
-double mean_squared_error_loss(const size_t output_size, const double *network_output, const double *expected_output){
-    double sum = 0;
+nn_real mean_squared_error_loss(const size_t output_size, const nn_real *network_output, const nn_real *expected_output){
+    nn_real sum = 0;
     for(size_t output_neuron=0; output_neuron<output_size; ++output_neuron){
         sum += pow((network_output[output_neuron] - expected_output[output_neuron]), 2);
     }
-    return (1/(double)output_size)*sum;
+    return (1/(nn_real)output_size)*sum;
 }
 
 
-double mean_squared_error_loss_derivative(const double predicted, const double actual, const size_t output_size) {
-    return (2.0 / (double)output_size) * (predicted - actual);
+nn_real mean_squared_error_loss_derivative(const nn_real predicted, const nn_real actual, const size_t output_size) {
+    return (2.0 / (nn_real)output_size) * (predicted - actual);
 }
 
 
-double multi_class_cross_entropy_loss(const size_t output_size, const double *network_output, const double *expected_output){
-    double sum = 0;
+nn_real multi_class_cross_entropy_loss(const size_t output_size, const nn_real *network_output, const nn_real *expected_output){
+    nn_real sum = 0;
     for(size_t output_neuron=0; output_neuron<output_size; ++output_neuron){
         sum += expected_output[output_neuron] * safe_log(network_output[output_neuron]);
     }
@@ -31,14 +32,30 @@ double multi_class_cross_entropy_loss(const size_t output_size, const double *ne
 }
 
 
-double multi_class_cross_entropy_loss_derivative(const double predicted, const double actual) {
+nn_real multi_class_cross_entropy_loss_derivative(const nn_real predicted, const nn_real actual) {
     if (predicted == 0) return 0; // handle log(0)
     return -actual / predicted;
 }
 
 
-double binary_cross_entropy_loss(const size_t output_size, const double *network_output, const double *expected_output){
-    double correct_class = -1;
+nn_real softmax_cross_entropy_loss(const size_t output_size, const nn_real *logits, const nn_real log_sum_exp, const nn_real *expected_output){
+    // -log(softmax(z)_i) = log_sum_exp - z_i, exact even where the probability underflows
+    nn_real sum = 0;
+    for(size_t output_neuron=0; output_neuron<output_size; ++output_neuron){
+        sum += expected_output[output_neuron] * (log_sum_exp - logits[output_neuron]);
+    }
+    return sum;
+}
+
+
+void softmax_cross_entropy_deltas(const size_t count, const nn_real *probabilities, const nn_real *expected_outputs, nn_real *deltas){
+    if(deltas != probabilities) memcpy(deltas, probabilities, sizeof(nn_real) * count);
+    simd->axpy(count, -1, expected_outputs, deltas);
+}
+
+
+nn_real binary_cross_entropy_loss(const size_t output_size, const nn_real *network_output, const nn_real *expected_output){
+    nn_real correct_class = -1;
     if(output_size > 2)
         fprintf(stderr, "Using binary cross entropy on outputs with more than one class, this will not work as supposed! Consider changing to another loss function that supports multiple classes\n");
     if(expected_output[0] == 1 && expected_output[1] == 1)
@@ -49,7 +66,7 @@ double binary_cross_entropy_loss(const size_t output_size, const double *network
 }
 
 
-double binary_cross_entropy_loss_derivative(double predicted, double actual) {
+nn_real binary_cross_entropy_loss_derivative(nn_real predicted, nn_real actual) {
     if (predicted == 0 || predicted == 1) return 0; // handle log(0)
     return (predicted - actual) / (predicted * (1 - predicted));
 }
\ No newline at end of file
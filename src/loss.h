@@ -7,11 +7,13 @@
 #define MULTI_CROSS_ENTROPY_LOSS 1
 #define BINARY_CROSS_ENTROPY_LOSS 2
 
-double mean_squared_error_loss(size_t output_size, const double *network_output, const double *expected_output);
-double mean_squared_error_loss_derivative(double predicted, double actual, size_t output_size);
-double multi_class_cross_entropy_loss(size_t output_size, const double *network_output, const double *expected_output);
-double multi_class_cross_entropy_loss_derivative(double predicted, double actual);
-double binary_cross_entropy_loss(size_t output_size, const double *network_output, const double *expected_output);
-double binary_cross_entropy_loss_derivative(double predicted, double actual);
+nn_real mean_squared_error_loss(size_t output_size, const nn_real *network_output, const nn_real *expected_output);
+nn_real mean_squared_error_loss_derivative(nn_real predicted, nn_real actual, size_t output_size);
+nn_real multi_class_cross_entropy_loss(size_t output_size, const nn_real *network_output, const nn_real *expected_output);
+nn_real multi_class_cross_entropy_loss_derivative(nn_real predicted, nn_real actual);
+nn_real softmax_cross_entropy_loss(size_t output_size, const nn_real *logits, nn_real log_sum_exp, const nn_real *expected_output); // cross entropy of softmax(logits) straight from the logits
+void softmax_cross_entropy_deltas(size_t count, const nn_real *probabilities, const nn_real *expected_outputs, nn_real *deltas); // p - y, the fused softmax and cross entropy gradient
+nn_real binary_cross_entropy_loss(size_t output_size, const nn_real *network_output, const nn_real *expected_output);
+nn_real binary_cross_entropy_loss_derivative(nn_real predicted, nn_real actual);
 
 #endif //DIGITS_NN_C_LOSS_H
@@ -3,12 +3,53 @@
 #include "loss.h"
 #include "utils.h"
 #include "data.h"
+#include "trainer.h"
+#include "batch_pipeline.h"
+#include "checkpoint.h"
+#include "profiler.h"
+#include "evaluation.h"
+#include "rng.h"
+#include "dataset_reader.h"
+
+/* Staging chunk and shuffle buffer of the NN_STREAM_DATA reader, in samples */
+#define STREAM_CHUNK_SAMPLES 4096
+#define STREAM_SHUFFLE_SAMPLES 16384
+
+/* Returns non-zero when a resumed network has the dataset's input size, MNIST_CLASSES outputs and exactly the layers
+ * and activations main would create, printing the first mismatch otherwise */
+static int checkpoint_matches(const NeuralNetwork *nn, size_t input_size, const size_t *layers, const int *activations,
+                              size_t layers_num){
+    if(nn->input_layer_size != input_size){
+        fprintf(stderr, "Checkpoint takes %zu inputs, the images have %zu pixels\n", nn->input_layer_size, input_size);
+        return 0;
+    }
+    if(nn->dense_layers[nn->dense_layers_num-1].size != MNIST_CLASSES){
+        fprintf(stderr, "Checkpoint has %zu outputs instead of %d\n", nn->dense_layers[nn->dense_layers_num-1].size, MNIST_CLASSES);
+        return 0;
+    }
+    if(nn->dense_layers_num != layers_num){
+        fprintf(stderr, "Checkpoint has %zu dense layers instead of %zu\n", nn->dense_layers_num, layers_num);
+        return 0;
+    }
+    for(size_t layer=0; layer<layers_num; ++layer){
+        if(nn->dense_layers[layer].size != layers[layer] || (int)nn->dense_layers[layer].activation_type != activations[layer]){
+            fprintf(stderr, "Checkpoint layer %zu has %zu neurons and activation %d instead of %zu and %d\n", layer,
+                    nn->dense_layers[layer].size, (int)nn->dense_layers[layer].activation_type, layers[layer], activations[layer]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
 
 int main(){
-    srand48(time(NULL));
+    // initialization, shuffling and sampling all derive from this seed, NN_SEED=<seed> reproduces the run
+    fprintf(stdout, "Random seed %llu\n", (unsigned long long)get_random_seed());
 
-    mnist_handwritten_digits_data mnist_data = load_mnist_data("../data/mnist/handwritten-digits/train/train-images.idx3-ubyte",
-                                                               "../data/mnist/handwritten-digits/train/train-labels.idx1-ubyte",
+    const char *training_images_filepath = "../data/mnist/handwritten-digits/train/train-images.idx3-ubyte";
+    const char *training_labels_filepath = "../data/mnist/handwritten-digits/train/train-labels.idx1-ubyte";
+    mnist_handwritten_digits_data mnist_data = load_mnist_data(training_images_filepath,
+                                                               training_labels_filepath,
                                                                "../data/mnist/handwritten-digits/test/t10k-images.idx3-ubyte",
                                                                "../data/mnist/handwritten-digits/test/t10k-labels.idx1-ubyte"
                                                                );
@@ -21,13 +62,13 @@ int main(){
     for(int photo=0; photo<1; ++photo){
         for(int i=0; i<mnist_data.training_images.number_of_rows; ++i){
             for(int j=0; j<mnist_data.training_images.number_of_columns; ++j){
-                fprintf(stdout, "%.0f\t", mnist_data.training_images.images[photo][i*mnist_data.training_images.number_of_rows+j]*255);
+                fprintf(stdout, "%d\t", mnist_data.training_images.pixels[(photo*mnist_data.training_images.number_of_rows+i)*mnist_data.training_images.number_of_columns+j]);
             }
             fprintf(stdout, "\n");
         }
         fprintf(stdout, "\n");
         for(int i=0; i<10; ++i){
-            fprintf(stdout, "%.0f ", mnist_data.training_labels.labels[photo][i]);
+            fprintf(stdout, "%d ", mnist_data.training_labels.labels[photo] == i);
         }
         fprintf(stdout, "\n\n\n");
     }
@@ -37,64 +78,132 @@ int main(){
     int layers_activations[] = {RELU_ACTIVATION, RELU_ACTIVATION, SOFTMAX_ACTIVATION};
     int loss_function = MULTI_CROSS_ENTROPY_LOSS;
     size_t layers_num = sizeof(layers)/sizeof(layers[0]);
-    double learning_rate = 0.000000001;
-
-    NeuralNetwork* nn = create_neural_network(mnist_data.training_images.number_of_rows * mnist_data.training_images.number_of_columns,
+    int optimizer_type = ADAM_OPTIMIZER;
+    double learning_rate = 0.001;
+    size_t batch_size = 256;
+    size_t training_threads = 0; // one worker per online CPU
+    const char *checkpoint_filepath = "digits-recognizer.ckpt"; // rewritten every epoch, resumed from with NN_RESUME=1
+    size_t input_size = (size_t)mnist_data.training_images.number_of_rows * (size_t)mnist_data.training_images.number_of_columns;
+
+    NeuralNetwork* nn = NULL;
+    const char *resume = getenv("NN_RESUME");
+    if(resume != NULL && strcmp(resume, "0") != 0 && access(checkpoint_filepath, F_OK) == 0){
+        nn = load_neural_network(checkpoint_filepath, batch_size, 1);
+        if(nn != NULL && !checkpoint_matches(nn, input_size, layers, layers_activations, layers_num)){
+            fprintf(stderr, "Not resuming from %s, it doesn't match the configured network\n", checkpoint_filepath);
+            destroy_neural_network(nn);
+            nn = NULL;
+        }
+        if(nn != NULL) fprintf(stdout, "Resumed neural network from %s\n", checkpoint_filepath);
+    }
+    if(nn == NULL) nn = create_neural_network(input_size,
                                               layers_num,
                                               layers,
                                               layers_activations,
                                               loss_function,
-                                              learning_rate);
+                                              learning_rate,
+                                              batch_size);
 
     if(nn == NULL){
         fprintf(stderr, "Error creating neural network\n");
         exit(1);
     }
+    set_network_optimizer(nn, default_optimizer_config(optimizer_type, learning_rate));
 
 
-    size_t batch_size = 256;
-    int epochs = 10000;
+    nn_trainer *trainer = create_trainer(nn, training_threads);
+    if(trainer == NULL){
+        fprintf(stderr, "Error creating trainer\n");
+        exit(1);
+    }
+    fprintf(stdout, "Training with %zu worker threads\n", trainer->threads_num);
+    print_placement_config(stdout);
+
+    int epochs = 50;
+    nn_real *sample_inputs = malloc(sizeof(nn_real) * input_size);
+    nn_real *sample_labels = malloc(sizeof(nn_real) * MNIST_CLASSES);
+    rng_stream sampling;
+    rng_open(&sampling, get_random_seed(), rng_stream_id(RNG_SAMPLING, 0));
+
+    // the loader thread shuffles every epoch and assembles the next batches while the current one trains,
+    // NN_STREAM_DATA=1 streams the training set from disk through a dataset_reader with bounded memory instead
+    batch_pipeline *pipeline = NULL;
+    dataset_reader *reader = NULL;
+    nn_real *stream_inputs = NULL;
+    nn_real *stream_outputs = NULL;
+    const char *stream_data = getenv("NN_STREAM_DATA");
+    if(stream_data != NULL && strcmp(stream_data, "0") != 0){
+        dataset_source source;
+        if(open_idx_source(training_images_filepath, training_labels_filepath, MNIST_CLASSES, &source) == 0)
+            reader = create_dataset_reader(source, STREAM_CHUNK_SAMPLES, STREAM_SHUFFLE_SAMPLES);
+        if(reader == NULL){
+            fprintf(stderr, "Error creating dataset reader\n");
+            exit(1);
+        }
+        stream_inputs = large_calloc(sizeof(nn_real) * batch_size * input_size, BUFFER_SHARED);
+        stream_outputs = large_calloc(sizeof(nn_real) * batch_size * MNIST_CLASSES, BUFFER_SHARED);
+        if(stream_inputs == NULL || stream_outputs == NULL){
+            fprintf(stderr, "Error allocating stream batches\n");
+            exit(1);
+        }
+        fprintf(stdout, "Streaming the training set in chunks of %d samples through a shuffle buffer of %d\n",
+                STREAM_CHUNK_SAMPLES, STREAM_SHUFFLE_SAMPLES);
+    } else{
+        pipeline = create_batch_pipeline(&mnist_data.training_images, &mnist_data.training_labels, batch_size, 4);
+        if(pipeline == NULL){
+            fprintf(stderr, "Error creating batch pipeline\n");
+            exit(1);
+        }
+    }
 
     for(int epoch = 0; epoch < epochs; epoch++) {
-        // Shuffle the training data at the beginning of each epoch
-        shuffle_training_data(mnist_data.training_images.images, mnist_data.training_labels.labels, mnist_data.training_images.number_of_images);
-
-        double batch_loss;
-        for(size_t i = 0; i < mnist_data.training_images.number_of_images; i += batch_size) {
-            batch_loss = 0.0;
-            for(size_t j = i; j < i + batch_size && j < mnist_data.training_images.number_of_images; j++) {
-                double *network_output = feedforward(nn, mnist_data.training_images.images[j]);
-                /*fprintf(stdout, "[");
-                for(size_t x=0; x<10; ++x){
-                    fprintf(stdout, "%f, ", network_output[x]);
-                }
-                fprintf(stdout, "]\n");*/
-
-                batch_loss += calculate_loss(nn, network_output, mnist_data.training_labels.labels[j]);
-                backpropagation(nn, mnist_data.training_images.images[j], mnist_data.training_labels.labels[j]);
-                free(network_output);
-            }
-            batch_loss /= (double)batch_size;
+        double batch_loss = 0;
+        if(reader != NULL){
+            size_t count;
+            while((count = dataset_reader_next_batch(reader, batch_size, stream_inputs, stream_outputs)) > 0)
+                batch_loss = trainer_backprop_batch(trainer, stream_inputs, stream_outputs, count);
+        } else{
+            int last_of_epoch;
+            do {
+                const batch_slot *batch = batch_pipeline_acquire(pipeline);
+                batch_loss = trainer_backprop_batch(trainer, batch->inputs, batch->expected_outputs, batch->count);
+                last_of_epoch = batch->last_of_epoch;
+                batch_pipeline_release(pipeline);
+            } while(!last_of_epoch);
         }
         fprintf(stdout, "Epoch %d, Batch Loss: %f\n", epoch + 1, batch_loss);
-        int random = (int)drand48()/mnist_data.training_images.number_of_images;
-        double *network_output = feedforward(nn, mnist_data.training_images.images[random]);
+        save_neural_network(nn, checkpoint_filepath);
+        evaluation_result evaluation;
+        if(evaluate(nn, &mnist_data.test_images, &mnist_data.test_labels, training_threads, &evaluation) == 0)
+            print_evaluation(stdout, &evaluation, epoch == epochs - 1);
+        size_t random = rng_below(&sampling, (size_t)mnist_data.training_images.number_of_images);
+        gather_mnist_batch(&mnist_data.training_images, &mnist_data.training_labels, &random, 1, sample_inputs, sample_labels);
+        nn_real *network_output = feedforward(nn, sample_inputs);
 
         fprintf(stdout, "Net Output: ");
         fprintf(stdout, "[");
-        for(size_t x=0; x<10; ++x){
+        for(size_t x=0; x<MNIST_CLASSES; ++x){
             fprintf(stdout, "%f, ", network_output[x]);
         }
         fprintf(stdout, "]\n");
         fprintf(stdout, "Expected Output: ");
         fprintf(stdout, "[");
-        for(size_t x=0; x<10; ++x){
-            fprintf(stdout, "%f, ", mnist_data.training_labels.labels[random][x]);
+        for(size_t x=0; x<MNIST_CLASSES; ++x){
+            fprintf(stdout, "%f, ", sample_labels[x]);
         }
         fprintf(stdout, "]\n");
+        // after the evaluation and the sample, so their forward passes are charged to this epoch
+        NN_PROFILE_REPORT(stdout, "epoch");
         fprintf(stdout, "\n");
     }
 
+    destroy_batch_pipeline(pipeline);
+    destroy_dataset_reader(reader);
+    large_free(stream_inputs);
+    large_free(stream_outputs);
+    destroy_trainer(trainer);
+    free(sample_inputs);
+    free(sample_labels);
     destroy_neural_network(nn);
     destroy_mnist_data(mnist_data);
 
@@ -1,68 +1,62 @@
 #include "nn_core.h"
 #include "activations.h"
 #include "loss.h"
+#include "gemm.h"
+#include "simd.h"
+#include "profiler.h"
+#include "rng.h"
+#include <sys/mman.h>
 
 
-double random_normal(double mean, double stddev) {
-    double u1, u2, z0;
-    u1 = drand48() / (RAND_MAX + 1.0);
-    u2 = drand48() / (RAND_MAX + 1.0);
-    z0 = sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
-    return z0 * stddev + mean;
-}
-
-
-double random_uniform(double min, double max) {
-    return min + (double)drand48() / ((double)RAND_MAX / (max - min));
-}
-
-
-void he_init_weights(size_t current_layer_size, size_t previous_layer_size, double** weights){
-    double standard_deviation = sqrt(2. / (double)previous_layer_size);
+/* Every neuron's weights are the consecutive elements neuron * previous_layer_size onwards of the layer's stream,
+ * whatever the row padding, so the initialization only depends on the seed and the layer sizes */
+void he_init_weights(size_t current_layer_size, size_t previous_layer_size, size_t weights_stride, nn_real *weights,
+                     uint64_t seed, uint64_t stream){
+    nn_real standard_deviation = sqrt(2. / (double)previous_layer_size);
 
     for(size_t current_layer_neuron=0; current_layer_neuron<current_layer_size; ++current_layer_neuron){
-        for(size_t previous_layer_neuron=0; previous_layer_neuron<previous_layer_size; ++previous_layer_neuron){
-            weights[current_layer_neuron][previous_layer_neuron] = random_normal(0, standard_deviation);
-        }
+        rng_fill_normal(seed, stream, current_layer_neuron * previous_layer_size, previous_layer_size, 0,
+                        standard_deviation, weights + current_layer_neuron * weights_stride);
     }
 }
 
 
-void gorlot_init_weights(size_t current_layer_size, size_t previous_layer_size, double** weights){
-    double standard_deviation = sqrt(6. / (previous_layer_size + current_layer_size));
+void gorlot_init_weights(size_t current_layer_size, size_t previous_layer_size, size_t weights_stride, nn_real *weights,
+                         uint64_t seed, uint64_t stream){
+    nn_real standard_deviation = sqrt(6. / (previous_layer_size + current_layer_size));
 
     for(size_t current_layer_neuron=0; current_layer_neuron<current_layer_size; ++current_layer_neuron){
-        for(size_t previous_layer_neuron=0; previous_layer_neuron<previous_layer_size; ++previous_layer_neuron){
-            weights[current_layer_neuron][previous_layer_neuron] = random_uniform(-standard_deviation, standard_deviation);
-        }
+        rng_fill_uniform(seed, stream, current_layer_neuron * previous_layer_size, previous_layer_size,
+                         -standard_deviation, standard_deviation, weights + current_layer_neuron * weights_stride);
     }
 }
 
 
-void init_biases(size_t current_layer_size, double *biases, const double bias_value){
+void init_biases(size_t current_layer_size, nn_real *biases, const nn_real bias_value){
     for(size_t current_layer_neuron=0; current_layer_neuron<current_layer_size; ++current_layer_neuron){
         biases[current_layer_neuron] = bias_value;
     }
 }
 
 
+size_t weights_stride_for(size_t previous_layer_size){
+#if NN_PAD_WEIGHT_ROWS
+    return align_up(previous_layer_size, NN_WEIGHTS_ALIGNMENT / sizeof(nn_real));
+#else
+    return previous_layer_size;
+#endif
+}
 
-NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense_layers_num, const size_t *dense_layers_size, const int *dense_layers_activation_types, const int loss_function, const double learning_rate){
-    if(input_layer_size <= 0){
-        fprintf(stderr, "Invalid number of neurons for input layer\n");
-        return NULL;
-    }
 
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+int set_dense_layer_activation(DenseLayer *layer, int activation_type){
+    if(activation_type < 0 || activation_type >= ACTIVATIONS_NUM) return 1;
+    layer->activation_type = (nn_activation)activation_type;
+    return 0;
+}
 
-    NeuralNetwork *nn = malloc(sizeof(NeuralNetwork));
-    nn->input_layer_size = input_layer_size;
-    nn->learning_rate = learning_rate;
 
+int set_network_loss(NeuralNetwork *nn, int loss_function){
     switch(loss_function){
-        default:
-            fprintf(stderr, "Unrecognized loss function! Defaulting to Mean Squared Error\n");
         case MEAN_SQUARED_ERROR_LOSS:
             nn->loss = NULL;
             nn->loss_derivative = NULL;
@@ -75,6 +69,49 @@ NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense
             nn->loss = binary_cross_entropy_loss;
             nn->loss_derivative = binary_cross_entropy_loss_derivative;
             break;
+        default:
+            return 1;
+    }
+    nn->loss_function = loss_function;
+    return 0;
+}
+
+
+int fused_softmax_cross_entropy(const NeuralNetwork *nn){
+    return nn->dense_layers[nn->dense_layers_num-1].activation_type == SOFTMAX_ACTIVATION &&
+           nn->loss_function == MULTI_CROSS_ENTROPY_LOSS;
+}
+
+
+int set_network_optimizer(NeuralNetwork *nn, optimizer_config config){
+    nn_optimizer *optimizer = create_optimizer(config, nn->parameters_num);
+    if(optimizer == NULL) return 1;
+    destroy_optimizer(nn->optimizer);
+    nn->optimizer = optimizer;
+    nn->learning_rate = config.learning_rate;
+    return 0;
+}
+
+
+NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense_layers_num, const size_t *dense_layers_size, const int *dense_layers_activation_types, const int loss_function, const double learning_rate, const size_t max_batch_size){
+    if(input_layer_size <= 0){
+        fprintf(stderr, "Invalid number of neurons for input layer\n");
+        return NULL;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    NeuralNetwork *nn = malloc(sizeof(NeuralNetwork));
+    nn->input_layer_size = input_layer_size;
+    nn->learning_rate = learning_rate;
+
+    nn->parameters_mapping = NULL;
+    nn->parameters_mapping_size = 0;
+    nn->parameters_version = 0;
+    if(set_network_loss(nn, loss_function)){
+        fprintf(stderr, "Unrecognized loss function! Defaulting to Mean Squared Error\n");
+        set_network_loss(nn, MEAN_SQUARED_ERROR_LOSS);
     }
 
     /* Dense Layers Initialization */
@@ -89,7 +126,26 @@ NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense
         nn->dense_layers_num = dense_layers_num;
         nn->dense_layers = malloc(sizeof(DenseLayer) * dense_layers_num);
 
+        // every layer's weights and biases live in one block, each sub-block starting on its own cache line
+        const size_t alignment_elements = NN_WEIGHTS_ALIGNMENT / sizeof(nn_real);
         size_t previous_layer_size = input_layer_size;
+        size_t parameters_num = 0;
+        for(size_t layer=0; layer<dense_layers_num; ++layer){
+            parameters_num += align_up(dense_layers_size[layer] * weights_stride_for(previous_layer_size), alignment_elements);
+            parameters_num += align_up(dense_layers_size[layer], alignment_elements);
+            previous_layer_size = dense_layers_size[layer];
+        }
+        nn->parameters_num = parameters_num;
+        nn->parameters = large_calloc(sizeof(nn_real) * parameters_num, BUFFER_SHARED);
+        if(nn->parameters == NULL){
+            fprintf(stderr, "Failed to allocate %zu parameters for the neural network\n", parameters_num);
+            free(nn->dense_layers);
+            free(nn);
+            return NULL;
+        }
+
+        nn_real *parameters_cursor = nn->parameters;
+        previous_layer_size = input_layer_size;
 
         // init each dense layer with provided sizes
         for(size_t layer=0; layer<dense_layers_num; ++layer){
@@ -97,56 +153,32 @@ NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense
 
             DenseLayer dense_layer;
             dense_layer.size = dense_layer_size;
-            dense_layer.outputs = malloc(1);
-            // malloc weights
-            dense_layer.weights = malloc(sizeof(double*) * dense_layer_size);
-            for(size_t current_layer_neuron=0; current_layer_neuron<dense_layer_size; ++current_layer_neuron){
-                dense_layer.weights[current_layer_neuron] = malloc(sizeof(double) * previous_layer_size);
+            // carve weights and biases out of the parameters block
+            dense_layer.weights_stride = weights_stride_for(previous_layer_size);
+            dense_layer.weights = parameters_cursor;
+            parameters_cursor += align_up(dense_layer_size * dense_layer.weights_stride, alignment_elements);
+            dense_layer.biases = parameters_cursor;
+            parameters_cursor += align_up(dense_layer_size, alignment_elements);
+
+            int activation_type = dense_layers_activation_types[layer];
+            if(activation_type == SOFTMAX_ACTIVATION && layer != dense_layers_num-1){
+                fprintf(stderr, "Softmax activation is not allowed in intermediate layers. It should only be used in the output layer. Defaulting to ReLU on layer %lu!\n", layer);
+                activation_type = RELU_ACTIVATION;
             }
-            // malloc bias
-            dense_layer.biases = malloc(sizeof(double) * dense_layer_size);
-
-            switch(dense_layers_activation_types[layer]){
-                default:
-                    fprintf(stderr, "Activation type not recognized for layer %zu! Defaulting to ReLU\n", layer);
-                case RELU_ACTIVATION:
-                    dense_layer.activation = relu;
-                    dense_layer.activation_derivative = relu_derivative;
-                    he_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                    init_biases(dense_layer_size, dense_layer.biases, 0.01);
-                    break;
-                case LINEAR_ACTIVATION:
-                    dense_layer.activation = linear;
-                    dense_layer.activation_derivative = linear_derivative;
-                    gorlot_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                    init_biases(dense_layer_size, dense_layer.biases, 0);
-                    break;
-                case SOFTMAX_ACTIVATION:
-                    if(layer != dense_layers_num-1){
-                        fprintf(stderr, "Softmax activation is not allowed in intermediate layers. It should only be used in the output layer. Defaulting to ReLU on layer %lu!\n", layer);
-                        dense_layer.activation = relu;
-                        dense_layer.activation_derivative = relu_derivative;
-                        he_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                        init_biases(dense_layer_size, dense_layer.biases, 0.01);
-                        break;
-                    }
-                    dense_layer.activation = NULL;
-                    dense_layer.activation_derivative = NULL;
-                    gorlot_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                    init_biases(dense_layer_size, dense_layer.biases, 0);
-                    break;
-                case SIGMOID_ACTIVATION:
-                    dense_layer.activation = sigmoid;
-                    dense_layer.activation_derivative = sigmoid_derivative;
-                    gorlot_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                    init_biases(dense_layer_size, dense_layer.biases, 0);
-                    break;
-                case TANH_ACTIVATION:
-                    nn->dense_layers[layer].activation = tanh;
-                    nn->dense_layers[layer].activation_derivative = tanh_derivative;
-                    gorlot_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights);
-                    init_biases(dense_layer_size, dense_layer.biases, 0);
-                    break;
+            if(set_dense_layer_activation(&dense_layer, activation_type)){
+                fprintf(stderr, "Activation type not recognized for layer %zu! Defaulting to ReLU\n", layer);
+                activation_type = RELU_ACTIVATION;
+                set_dense_layer_activation(&dense_layer, activation_type);
+            }
+
+            if(activation_type == RELU_ACTIVATION){
+                he_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights_stride, dense_layer.weights,
+                                get_random_seed(), rng_stream_id(RNG_INIT, layer));
+                init_biases(dense_layer_size, dense_layer.biases, 0.01);
+            } else {
+                gorlot_init_weights(dense_layer_size, previous_layer_size, dense_layer.weights_stride, dense_layer.weights,
+                                    get_random_seed(), rng_stream_id(RNG_INIT, layer));
+                init_biases(dense_layer_size, dense_layer.biases, 0);
             }
             dense_layer.previous_layer_size = previous_layer_size;
 
@@ -163,6 +195,17 @@ NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense
     }
 
 
+    nn->workspace = create_workspace(nn, max_batch_size);
+    if(nn->workspace == NULL){
+        large_free(nn->parameters);
+        free(nn->dense_layers);
+        free(nn);
+        return NULL;
+    }
+    nn->optimizer = NULL;
+    set_network_optimizer(nn, default_optimizer_config(SGD_OPTIMIZER, learning_rate));
+
+
     gettimeofday(&end, NULL);
     long seconds = end.tv_sec - start.tv_sec;
     long useconds = end.tv_usec - start.tv_usec;
@@ -175,150 +218,354 @@ NeuralNetwork *create_neural_network(const size_t input_layer_size, size_t dense
 }
 
 
+nn_workspace *create_workspace(const NeuralNetwork *nn, size_t max_batch_size){
+    if(max_batch_size == 0) max_batch_size = 1;
+
+    // zeroed, so destroy_workspace can release a partially allocated one
+    nn_workspace *workspace = calloc(1, sizeof(nn_workspace));
+    if(workspace == NULL) return NULL;
+    workspace->max_batch_size = max_batch_size;
+    workspace->layers_outputs = calloc(nn->dense_layers_num, sizeof(nn_real*));
+    if(workspace->layers_outputs == NULL){
+        free(workspace);
+        return NULL;
+    }
+    workspace->layers_num = nn->dense_layers_num;
+
+    int failed = 0;
+    size_t widest_layer_size = 0;
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        workspace->layers_outputs[layer] = large_calloc(sizeof(nn_real) * max_batch_size * nn->dense_layers[layer].size, BUFFER_LOCAL);
+        failed |= workspace->layers_outputs[layer] == NULL;
+        if(nn->dense_layers[layer].size > widest_layer_size) widest_layer_size = nn->dense_layers[layer].size;
+    }
+    workspace->deltas = large_calloc(sizeof(nn_real) * max_batch_size * widest_layer_size, BUFFER_LOCAL);
+    workspace->new_deltas = large_calloc(sizeof(nn_real) * max_batch_size * widest_layer_size, BUFFER_LOCAL);
+    workspace->gradients = large_calloc(sizeof(nn_real) * nn->parameters_num, BUFFER_LOCAL);
+    workspace->logits = large_calloc(sizeof(nn_real) * max_batch_size * nn->dense_layers[nn->dense_layers_num-1].size, BUFFER_LOCAL);
+    workspace->log_sum_exps = large_calloc(sizeof(nn_real) * max_batch_size, BUFFER_LOCAL);
+    failed |= workspace->deltas == NULL || workspace->new_deltas == NULL || workspace->gradients == NULL ||
+              workspace->logits == NULL || workspace->log_sum_exps == NULL;
+    if(nn->dense_layers[0].size <= SPARSE_INPUTS_MAX_LAYER_SIZE){
+        workspace->sparse_inputs = create_sparse_rows(max_batch_size, nn->input_layer_size, SPARSE_INPUTS_MAX_DENSITY);
+        workspace->sparse_scratch = large_calloc(sizeof(nn_real) * nn->input_layer_size * nn->dense_layers[0].size, BUFFER_LOCAL);
+        workspace->sparse_weights = large_calloc(sizeof(nn_real) * nn->input_layer_size * nn->dense_layers[0].size, BUFFER_LOCAL);
+        failed |= workspace->sparse_inputs == NULL || workspace->sparse_scratch == NULL || workspace->sparse_weights == NULL;
+    }
+
+    if(failed){
+        fprintf(stderr, "Failed to allocate a workspace for batches of %zu samples\n", max_batch_size);
+        destroy_workspace(workspace);
+        return NULL;
+    }
+    return workspace;
+}
+
+
+void destroy_workspace(nn_workspace *workspace){
+    if(workspace == NULL) return;
+    for(size_t layer=0; layer<workspace->layers_num; ++layer)
+        large_free(workspace->layers_outputs[layer]);
+    free(workspace->layers_outputs);
+    large_free(workspace->deltas);
+    large_free(workspace->new_deltas);
+    large_free(workspace->gradients);
+    large_free(workspace->logits);
+    large_free(workspace->log_sum_exps);
+    destroy_sparse_rows(workspace->sparse_inputs);
+    large_free(workspace->sparse_scratch);
+    large_free(workspace->sparse_weights);
+    free(workspace);
+}
+
+
 void destroy_neural_network(NeuralNetwork *nn){
-    for(size_t dense_layer=0; dense_layer<nn->dense_layers_num; ++dense_layer){
-        for(size_t dense_layer_neuron=0; dense_layer_neuron<nn->dense_layers[dense_layer].size; ++dense_layer_neuron)
-            free(nn->dense_layers[dense_layer].weights[dense_layer_neuron]);
+    destroy_workspace(nn->workspace);
+    destroy_optimizer(nn->optimizer);
+    if(nn->parameters_mapping != NULL)
+        munmap(nn->parameters_mapping, nn->parameters_mapping_size);
+    else
+        large_free(nn->parameters);
+    free(nn->dense_layers);
+    free(nn);
+}
+
 
-        free(nn->dense_layers[dense_layer].weights);
-        free(nn->dense_layers[dense_layer].biases);
+NeuralNetwork *replicate_neural_network(const NeuralNetwork *nn, int node){
+    nn_real *parameters = large_calloc_on_node(sizeof(nn_real) * nn->parameters_num, node);
+    if(parameters == NULL){
+        fprintf(stderr, "Failed to allocate a replica of %zu parameters on NUMA node %d\n", nn->parameters_num, node);
+        return NULL;
+    }
+    memcpy(parameters, nn->parameters, sizeof(nn_real) * nn->parameters_num);
+
+    NeuralNetwork *replica = malloc(sizeof(NeuralNetwork));
+    *replica = *nn;
+    replica->parameters = parameters;
+    replica->parameters_mapping = NULL;
+    replica->parameters_mapping_size = 0;
+    replica->workspace = NULL;
+    replica->optimizer = NULL;
+    replica->dense_layers = malloc(sizeof(DenseLayer) * nn->dense_layers_num);
+    // same layout, every layer points at the same offsets of the copy
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        replica->dense_layers[layer] = nn->dense_layers[layer];
+        replica->dense_layers[layer].weights = parameters + (nn->dense_layers[layer].weights - nn->parameters);
+        replica->dense_layers[layer].biases = parameters + (nn->dense_layers[layer].biases - nn->parameters);
     }
-    nn = NULL;
+    return replica;
 }
 
 
-double weighted_sum(size_t previous_layer_size, size_t current_layer_size, double *input, double *weights, double bias){
-    double weighted_sum = 0;
-    for(size_t input_neuron=0; input_neuron<previous_layer_size; ++input_neuron){
-        weighted_sum += input[input_neuron] * weights[input_neuron];
+/* Writes the error of every output neuron of one sample with respect to its pre-activation value */
+void output_layer_deltas(const NeuralNetwork *nn, const nn_real *outputs, const nn_real *expected_output, nn_real *deltas){
+    const DenseLayer *output_layer = &nn->dense_layers[nn->dense_layers_num-1];
+
+    for(size_t neuron=0; neuron<output_layer->size; ++neuron){
+        deltas[neuron] = nn->loss_derivative ? nn->loss_derivative(outputs[neuron], expected_output[neuron]) :
+                         mean_squared_error_loss_derivative(outputs[neuron], expected_output[neuron], output_layer->size);
     }
-    return weighted_sum;
+    act_backward(output_layer->activation_type, output_layer->size, outputs, deltas);
 }
 
 
-double *feedforward(NeuralNetwork *nn, const double *input){
+void backpropagation(NeuralNetwork *nn, const nn_real *network_input, const nn_real *expected_output){
+    // gradients are complete before any weight moves, so every layer propagates through the weights it was run with
+    memset(nn->workspace->gradients, 0, sizeof(nn_real) * nn->parameters_num);
+    backpropagate_gradients(nn, network_input, expected_output, 1, nn->workspace);
+    apply_gradients(nn, nn->workspace->gradients, 1);
+}
 
-    size_t previous_layer_size = nn->input_layer_size;
-    double *inputs = malloc(sizeof(double) * nn->input_layer_size);
-    for(size_t i=0; i<nn->input_layer_size; ++i)
-        inputs[i] = input[i];
 
-    double *outputs = NULL;
-    for(size_t current_layer=0; current_layer<nn->dense_layers_num; ++current_layer){
+nn_real calculate_loss(const NeuralNetwork *nn, const nn_real *network_output, const nn_real *expected_output){
+    if(nn->loss == NULL)
+        return mean_squared_error_loss(nn->dense_layers[nn->dense_layers_num-1].size, network_output, expected_output);
+    return nn->loss(nn->dense_layers[nn->dense_layers_num-1].size, network_output, expected_output);
+}
 
-        if(nn->dense_layers[current_layer].activation == NULL){ // activation function is softmax
-            double *biased_inputs = malloc(sizeof(double) * nn->dense_layers[current_layer].size);
-            for(size_t current_layer_neuron=0; current_layer_neuron<nn->dense_layers[current_layer].size; ++current_layer_neuron){
-                double weighted_sum_value = weighted_sum(previous_layer_size,
-                                                         nn->dense_layers[current_layer].size,
-                                                         inputs, nn->dense_layers[current_layer].weights[current_layer_neuron],
-                                                         nn->dense_layers[current_layer].biases[current_layer_neuron]
-                );
-                double biased_value = weighted_sum_value + nn->dense_layers[current_layer].biases[current_layer_neuron];
 
-                biased_inputs[current_layer_neuron] = biased_value;
-            }
-            outputs = softmax(nn->dense_layers[current_layer].size, biased_inputs);
-            free(biased_inputs);
-        } else {
-            outputs = malloc(sizeof(double) * nn->dense_layers[current_layer].size);
-            for(size_t current_layer_neuron=0; current_layer_neuron<nn->dense_layers[current_layer].size; ++current_layer_neuron){
-                double weighted_sum_value = weighted_sum(previous_layer_size,
-                                                         nn->dense_layers[current_layer].size,
-                                                         inputs, nn->dense_layers[current_layer].weights[current_layer_neuron],
-                                                         nn->dense_layers[current_layer].biases[current_layer_neuron]
-                );
-                double biased_value = weighted_sum_value + nn->dense_layers[current_layer].biases[current_layer_neuron];
-                outputs[current_layer_neuron] = nn->dense_layers[current_layer].activation(biased_value);
-            }
-        }
+/* Computes the batch_size x layer->size outputs of a dense layer for a batch of inputs with
+ * layer->previous_layer_size contiguous elements per sample. Bias and element-wise activations are applied in the gemm
+ * epilogue, so the outputs are written once. When sparse_inputs is not NULL it holds the same inputs compacted, and
+ * only their non-zero elements are multiplied, by transposed_weights, the transpose_rows of the layer's weights. When logits is not NULL a softmax layer keeps its pre-activation values
+ * there and the log of every sample's normalizer in log_sum_exps, as the training loss needs them */
+void dense_layer_forward_batch(const DenseLayer *layer, const nn_real *inputs, const sparse_rows *sparse_inputs, const nn_real *transposed_weights,
+                               size_t batch_size, nn_real *outputs, nn_real *logits, nn_real *log_sum_exps){
+    int softmax = layer->activation_type == SOFTMAX_ACTIVATION;
+    gemm_epilogue epilogue = {layer->biases, softmax ? LINEAR_ACTIVATION : layer->activation_type};
+    nn_real *pre_activations = softmax && logits ? logits : outputs;
+
+    if(sparse_inputs){
+        // Z = X * W^T over the non-zero inputs, then the same epilogue the gemm would apply
+        sparse_dense_gemm(sparse_inputs, layer->size, transposed_weights, pre_activations, layer->size);
+        for(size_t sample=0; sample<batch_size; ++sample)
+            simd->axpy(layer->size, 1, layer->biases, pre_activations + sample * layer->size);
+        act_forward(epilogue.activation, batch_size * layer->size, pre_activations, pre_activations);
+    } else {
+        // Z = X * W^T + b, the weight rows are contiguous along the input dimension
+        gemm_fused(0, 1, batch_size, layer->size, layer->previous_layer_size,
+                   inputs, layer->previous_layer_size,
+                   layer->weights, layer->weights_stride,
+                   0, pre_activations, layer->size,
+                   &epilogue);
+    }
 
-        free(inputs);
-        inputs = malloc(sizeof(double) * nn->dense_layers[current_layer].size);
-        nn->dense_layers[current_layer].outputs = malloc(sizeof(double) * nn->dense_layers[current_layer].size);
-        memcpy(inputs, outputs, sizeof(double) * nn->dense_layers[current_layer].size);
-        memcpy(nn->dense_layers[current_layer].outputs, outputs, sizeof(double) * nn->dense_layers[current_layer].size);
-        free(outputs);
-        outputs = NULL;
-        previous_layer_size = nn->dense_layers[current_layer].size;
+    if(softmax){
+        for(size_t sample=0; sample<batch_size; ++sample)
+            log_softmax_into(layer->size, pre_activations + sample * layer->size, outputs + sample * layer->size,
+                             logits ? &log_sum_exps[sample] : NULL);
     }
+}
+
 
-    return inputs;
+/* Input elements the first layer multiplies for the compacted chunk, all of them when it runs dense */
+static inline size_t first_layer_inputs_num(const NeuralNetwork *nn, const nn_workspace *workspace, size_t batch_size){
+    return workspace->sparse_inputs && workspace->sparse_inputs->rows ? workspace->sparse_inputs->nonzeros : nn->input_layer_size * batch_size;
 }
 
 
-void backpropagation(NeuralNetwork *nn, const double *network_input, const double *expected_output){
-    size_t last_layer_index = nn->dense_layers_num-1;
+/* Transposed first layer weights of the sparse path, transposed again only when the parameters changed since */
+static const nn_real *sparse_first_layer_weights(const NeuralNetwork *nn, nn_workspace *workspace){
+    const DenseLayer *layer = &nn->dense_layers[0];
+    if(workspace->sparse_weights_of != layer->weights || workspace->sparse_weights_version != nn->parameters_version){
+        transpose_rows(layer->size, layer->previous_layer_size, layer->weights, layer->weights_stride, workspace->sparse_weights);
+        workspace->sparse_weights_of = layer->weights;
+        workspace->sparse_weights_version = nn->parameters_version;
+    }
+    return workspace->sparse_weights;
+}
+
+
+/* Runs at most workspace->max_batch_size samples through every dense layer, storing the outputs of each layer in the
+ * workspace. The inputs are compacted first, so the first layer and its gradients only touch the non-zero ones while
+ * there are few enough of them. When outputs is not NULL the output layer writes there instead and, since only
+ * training reads them, softmax logits are not kept */
+void feedforward_batch_into(const NeuralNetwork *nn, const nn_real *inputs, size_t batch_size, nn_workspace *workspace, nn_real *outputs){
+    const sparse_rows *sparse_inputs = NULL;
+    const nn_real *sparse_weights = NULL;
+    if(workspace->sparse_inputs && compact_rows(batch_size, inputs, workspace->sparse_inputs) == 0){
+        sparse_inputs = workspace->sparse_inputs;
+        sparse_weights = sparse_first_layer_weights(nn, workspace);
+    }
+    const nn_real *layer_inputs = inputs;
+    nn_real *logits = outputs ? NULL : workspace->logits;
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        nn_real *layer_outputs = outputs && layer == nn->dense_layers_num-1 ? outputs : workspace->layers_outputs[layer];
+        NN_PROFILE_BEGIN(forward_mark);
+        dense_layer_forward_batch(&nn->dense_layers[layer], layer_inputs, layer == 0 ? sparse_inputs : NULL, sparse_weights, batch_size,
+                                  layer_outputs, logits, workspace->log_sum_exps);
+        // X * W^T plus the bias, reading the weights, biases and inputs and writing the outputs once
+        NN_PROFILE_END(forward_mark, PROFILE_FORWARD, layer,
+                       (2 * (layer == 0 ? first_layer_inputs_num(nn, workspace, batch_size) :
+                                          nn->dense_layers[layer].previous_layer_size * batch_size) + batch_size) * nn->dense_layers[layer].size,
+                       sizeof(nn_real) * ((nn->dense_layers[layer].previous_layer_size + 1) * (nn->dense_layers[layer].size + batch_size) - 1));
+        layer_inputs = layer_outputs;
+    }
+}
+
+
+nn_real *feedforward(NeuralNetwork *nn, const nn_real *input){
+    feedforward_batch_into(nn, input, 1, nn->workspace, NULL);
+    return nn->workspace->layers_outputs[nn->dense_layers_num-1];
+}
+
+
+void feedforward_batch(NeuralNetwork *nn, const nn_real *inputs, size_t batch_size, nn_real *outputs){
+    nn_predict_batch(nn, inputs, batch_size, outputs, nn->workspace);
+}
+
+
+void nn_predict(const NeuralNetwork *nn, const nn_real *input, nn_real *output, nn_workspace *workspace){
+    feedforward_batch_into(nn, input, 1, workspace, output);
+}
 
 
+void nn_predict_batch(const NeuralNetwork *nn, const nn_real *inputs, size_t batch_size, nn_real *outputs, nn_workspace *workspace){
+    size_t output_size = nn->dense_layers[nn->dense_layers_num-1].size;
+    size_t chunk_size = workspace->max_batch_size;
 
-    double *deltas = malloc(sizeof(double) * nn->dense_layers[last_layer_index].size);
-    double *softmax_derivatives = NULL;
-    if(nn->dense_layers[last_layer_index].activation == NULL){
-        softmax_derivatives = softmax_derivative(nn->dense_layers[last_layer_index].size, nn->dense_layers[last_layer_index].outputs, expected_output);
+    for(size_t first=0; first<batch_size; first+=chunk_size){
+        size_t samples = batch_size - first < chunk_size ? batch_size - first : chunk_size;
+        feedforward_batch_into(nn, inputs + first * nn->input_layer_size, samples, workspace, outputs + first * output_size);
     }
+}
+
 
-    for(size_t neuron=0; neuron<nn->dense_layers[last_layer_index].size; ++neuron){
-        double network_value = nn->dense_layers[last_layer_index].outputs[neuron];
-        double expected_value = expected_output[neuron];
-        double loss_derivative = nn->loss_derivative ? nn->loss_derivative(network_value, expected_value) :
-                                 mean_squared_error_loss_derivative(network_value, expected_value, nn->dense_layers[last_layer_index].size);
-
-        if(nn->dense_layers[last_layer_index].activation == NULL){
-            deltas[neuron] = loss_derivative *
-                             softmax_derivatives[neuron];
-        } else {
-            deltas[neuron] = loss_derivative *
-                             nn->dense_layers[last_layer_index].activation_derivative(network_value);
+double backpropagate_gradients(const NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size, nn_workspace *workspace){
+    size_t last_layer_index = nn->dense_layers_num-1;
+    size_t output_size = nn->dense_layers[last_layer_index].size;
+    nn_real **layers_outputs = workspace->layers_outputs;
+    nn_real *deltas = workspace->deltas;
+    nn_real *new_deltas = workspace->new_deltas;
+
+    double loss = 0;
+    NN_PROFILE_BEGIN(loss_mark);
+    if(fused_softmax_cross_entropy(nn)){
+        // softmax and cross entropy cancel into p - y, one pass over the whole batch
+        for(size_t sample=0; sample<batch_size; ++sample)
+            loss += softmax_cross_entropy_loss(output_size, workspace->logits + sample * output_size, workspace->log_sum_exps[sample],
+                                               expected_outputs + sample * output_size);
+        softmax_cross_entropy_deltas(batch_size * output_size, layers_outputs[last_layer_index], expected_outputs, deltas);
+    } else {
+        for(size_t sample=0; sample<batch_size; ++sample){
+            const nn_real *sample_outputs = layers_outputs[last_layer_index] + sample * output_size;
+            const nn_real *sample_expected = expected_outputs + sample * output_size;
+            loss += calculate_loss(nn, sample_outputs, sample_expected);
+            output_layer_deltas(nn, sample_outputs, sample_expected, deltas + sample * output_size);
         }
     }
+    NN_PROFILE_END(loss_mark, PROFILE_LOSS, 0, 4 * batch_size * output_size, sizeof(nn_real) * 3 * batch_size * output_size);
+
+    for(size_t layer=last_layer_index; ; --layer){
+        NN_PROFILE_BEGIN(backward_mark);
+        const DenseLayer *current_layer = &nn->dense_layers[layer];
+        const nn_real *layer_inputs = layer == 0 ? inputs : layers_outputs[layer-1];
+        nn_real *weight_gradients = workspace->gradients + (current_layer->weights - nn->parameters);
+        nn_real *bias_gradients = workspace->gradients + (current_layer->biases - nn->parameters);
+
+        // dW += deltas^T * X summed over the batch, only over the non-zero inputs when the forward pass compacted them
+        if(layer == 0 && workspace->sparse_inputs && workspace->sparse_inputs->rows == batch_size)
+            sparse_outer_product(deltas, current_layer->size, current_layer->size, workspace->sparse_inputs,
+                                 weight_gradients, current_layer->weights_stride, workspace->sparse_scratch);
+        else
+            gemm(1, 0, current_layer->size, current_layer->previous_layer_size, batch_size,
+                 deltas, current_layer->size,
+                 layer_inputs, current_layer->previous_layer_size,
+                 1, weight_gradients, current_layer->weights_stride);
+        for(size_t sample=0; sample<batch_size; ++sample)
+            simd->axpy(current_layer->size, 1, deltas + sample * current_layer->size, bias_gradients);
+
+        if(layer > 0){
+            // propagate the deltas through this layer's weights: dX = deltas * W
+            const DenseLayer *previous_layer = &nn->dense_layers[layer-1];
+            gemm(0, 0, batch_size, current_layer->previous_layer_size, current_layer->size,
+                 deltas, current_layer->size,
+                 current_layer->weights, current_layer->weights_stride,
+                 0, new_deltas, current_layer->previous_layer_size);
+            act_backward(previous_layer->activation_type, batch_size * previous_layer->size, layers_outputs[layer-1], new_deltas);
+
+            nn_real *swap = deltas;
+            deltas = new_deltas;
+            new_deltas = swap;
+        }
 
-    if(softmax_derivatives) free(softmax_derivatives);
+        // dW and the bias gradients read and write the gradients once, dX reads the weights and writes the new deltas
+        NN_PROFILE_END(backward_mark, PROFILE_BACKWARD, layer,
+                       (2 * (layer == 0 ? first_layer_inputs_num(nn, workspace, batch_size) :
+                                          2 * current_layer->previous_layer_size * batch_size) + batch_size) * current_layer->size,
+                       sizeof(nn_real) * (2 * (current_layer->previous_layer_size + 1) * current_layer->size +
+                                          (current_layer->size + current_layer->previous_layer_size) * batch_size +
+                                          (layer > 0) * current_layer->previous_layer_size * (current_layer->size + batch_size)));
+        if(layer == 0) break;
+    }
 
+    return loss;
+}
 
-    for(size_t layer=nn->dense_layers_num-2; ; --layer){
-        if(layer == 0) break;
 
-        DenseLayer *current_layer = &nn->dense_layers[layer];
-        DenseLayer *next_layer = &nn->dense_layers[layer + 1];
+/* Runs the forward and backward passes of at most workspace->max_batch_size samples, adding their gradients into
+ * workspace->gradients. Returns the summed loss of the samples */
+double accumulate_batch_gradients(const NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size, nn_workspace *workspace){
+    feedforward_batch_into(nn, inputs, batch_size, workspace, NULL);
+    return backpropagate_gradients(nn, inputs, expected_outputs, batch_size, workspace);
+}
 
-        double *new_deltas = malloc(sizeof(double) * current_layer->size);
-        for(size_t current_layer_neuron=0; current_layer_neuron<current_layer->size; ++current_layer_neuron){
-            double sum = 0;
-            for(size_t next_layer_neuron=0; next_layer_neuron<next_layer->size; ++next_layer_neuron){
-                sum += deltas[next_layer_neuron] * next_layer->weights[next_layer_neuron][current_layer_neuron];
-            }
-            //if(current_layer->activation == NULL){}
-                //new_deltas[current_layer_neuron] = sum * new_deltas[current_layer_neuron];
-            //else
-                new_deltas[current_layer_neuron] = sum * current_layer->activation_derivative(current_layer->outputs[current_layer_neuron]);
-        }
 
-        for(size_t next_layer_neuron=0; next_layer_neuron<next_layer->size; ++next_layer_neuron){
-            for(size_t current_layer_neuron=0; current_layer_neuron<current_layer->size; ++current_layer_neuron){
-                next_layer->weights[next_layer_neuron][current_layer_neuron] -= nn->learning_rate * deltas[next_layer_neuron] * current_layer->outputs[current_layer_neuron];
-            }
-            next_layer->biases[next_layer_neuron] -= nn->learning_rate * deltas[next_layer_neuron];
-        }
+double compute_gradients(const NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size, nn_workspace *workspace){
+    size_t output_size = nn->dense_layers[nn->dense_layers_num-1].size;
+    size_t chunk_size = workspace->max_batch_size;
 
-        free(deltas);
-        deltas = new_deltas;
-    }
+    // gradients share the layout of nn->parameters so they can be applied in a single pass
+    memset(workspace->gradients, 0, sizeof(nn_real) * nn->parameters_num);
 
-    DenseLayer *first_layer = &nn->dense_layers[0];
-    for(size_t current_neuron=0; current_neuron<first_layer->size; ++current_neuron){
-        for(size_t input_neuron=0; input_neuron<nn->input_layer_size; ++input_neuron){
-            first_layer->weights[current_neuron][input_neuron] -= nn->learning_rate * deltas[current_neuron] * network_input[input_neuron];
-        }
-        first_layer->biases[current_neuron] -= nn->learning_rate * deltas[current_neuron];
+    double loss = 0;
+    for(size_t first=0; first<batch_size; first+=chunk_size){
+        size_t samples = batch_size - first < chunk_size ? batch_size - first : chunk_size;
+        loss += accumulate_batch_gradients(nn,
+                                           inputs + first * nn->input_layer_size,
+                                           expected_outputs + first * output_size,
+                                           samples, workspace);
     }
+    return loss;
+}
 
-    free(deltas);
+
+void apply_gradients(NeuralNetwork *nn, const nn_real *gradients, size_t batch_size){
+    NN_PROFILE_BEGIN(optimizer_mark);
+    optimizer_step(nn->optimizer, nn->parameters, gradients, (nn_real)(1.0 / (double)batch_size));
+    parameters_changed(nn);
+    // parameters read and written, gradients read, every moment read and written
+    NN_PROFILE_END(optimizer_mark, PROFILE_OPTIMIZER, 0, 0,
+                   sizeof(nn_real) * nn->parameters_num * (3 + 2 * (size_t)(nn->optimizer->first_moment != NULL) +
+                                                           2 * (size_t)(nn->optimizer->second_moment != NULL)));
 }
 
 
-double calculate_loss(NeuralNetwork *nn, const double *network_output, const double *expected_output){
-    if(nn->loss == NULL)
-        return mean_squared_error_loss(nn->dense_layers[nn->dense_layers_num-1].size, network_output, expected_output);
-    return nn->loss(nn->dense_layers[nn->dense_layers_num-1].size, network_output, expected_output);
-}
\ No newline at end of file
+double backprop_batch(NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size){
+    double loss = compute_gradients(nn, inputs, expected_outputs, batch_size, nn->workspace);
+
+    // apply the batch averaged gradients once
+    apply_gradients(nn, nn->workspace->gradients, batch_size);
+
+    return loss / (double)batch_size;
+}
@@ -2,51 +2,163 @@
 #define DIGITS_NN_C_NN_CORE_H
 
 #include "utils.h"
+#include "optimizer.h"
+#include "activations.h"
+#include "sparse.h"
+#include "placement.h"
+
+
+/* Alignment in bytes of every weight/bias block (one cache line) */
+#define NN_WEIGHTS_ALIGNMENT 64
+
+/* When non-zero the leading dimension of each weight block is padded so every row starts on a
+ * NN_WEIGHTS_ALIGNMENT boundary, otherwise rows are packed back to back */
+#ifndef NN_PAD_WEIGHT_ROWS
+#define NN_PAD_WEIGHT_ROWS 1
+#endif
 
 
 typedef struct {
     size_t size;
     size_t previous_layer_size;
-    double **weights;
-    double *biases;
-    double *outputs;
-    double (*activation)(double);
-    double (*activation_derivative)(double);
+    size_t weights_stride;  // leading dimension of the weights block, in elements (>= previous_layer_size)
+    nn_real *weights;        // size x weights_stride row-major block, row n holds the weights of neuron n
+    nn_real *biases;
+    nn_activation activation_type; // switched on once per layer, the activation runs over the whole batch
 } DenseLayer;
 
 
+/* Scratch memory of the forward and backward passes, sized once for up to max_batch_size samples so that
+ * training and inference never allocate on the hot path */
+typedef struct {
+    size_t max_batch_size;
+    size_t layers_num;
+    nn_real **layers_outputs;  // per dense layer, max_batch_size x layer size activations
+    nn_real *deltas;           // max_batch_size x widest dense layer errors being propagated
+    nn_real *new_deltas;
+    nn_real *gradients;        // same layout and size as the parameters block of the network
+    nn_real *logits;           // max_batch_size x output size pre-softmax values, kept when the output layer is softmax
+    nn_real *log_sum_exps;     // per sample log of the softmax normalizer, so the loss never takes the log of a probability
+    sparse_rows *sparse_inputs; // non-zero inputs of the current chunk, the first layer runs on them while sparse enough,
+                               // NULL when it is wider than SPARSE_INPUTS_MAX_LAYER_SIZE
+    nn_real *sparse_scratch;   // input size x first layer size transposed weight gradients of the sparse path
+    nn_real *sparse_weights;   // input size x first layer size transposed weights the sparse path multiplies by, kept
+                               // across chunks and rebuilt once the weights below or their parameters_version change
+    const nn_real *sparse_weights_of;
+    uint64_t sparse_weights_version;
+} nn_workspace;
+
+
 typedef struct{
     size_t input_layer_size;
     size_t dense_layers_num;
     DenseLayer *dense_layers;
-    double (*loss)(size_t, const double*, const double*);
-    double (*loss_derivative)(const double, const double);
-    double learning_rate;
+    int loss_function;      // one of the *_LOSS ids of loss.h
+    nn_real (*loss)(size_t, const nn_real*, const nn_real*);
+    nn_real (*loss_derivative)(const nn_real, const nn_real);
+    double learning_rate;   // learning rate of the optimizer, kept in checkpoints
+    nn_optimizer *optimizer; // update rule applied by apply_gradients, plain sgd unless set_network_optimizer says otherwise
+    nn_real *parameters;     // single aligned block holding the weights and biases of every dense layer
+    size_t parameters_num;  // number of elements in parameters, padding included
+    uint64_t parameters_version; // bumped by parameters_changed, workspaces rebuild what they derive from the parameters
+    nn_workspace *workspace; // scratch memory used by feedforward and backpropagation
+    void *parameters_mapping;      // checkpoint mapping parameters points into, NULL when parameters is a large_calloc buffer
+    size_t parameters_mapping_size;
 } NeuralNetwork;
 
 
-/* Creates and returns a neural network with the provided layer sizes and activation type */
+/* Returns the weights of the provided neuron of a dense layer, previous_layer_size contiguous elements */
+static inline nn_real *dense_layer_neuron_weights(const DenseLayer *layer, size_t neuron){
+    return layer->weights + neuron * layer->weights_stride;
+}
+
+
+/* Creates and returns a neural network with the provided layer sizes and activation type
+ * Its workspace is sized for batches of up to max_batch_size samples, larger batches are processed in chunks */
 NeuralNetwork *create_neural_network(size_t input_layer_size,
                                      size_t dense_layers_num,
                                      const size_t *dense_layers_size,
                                      const int *dense_layers_activation_types,
                                      int loss_function,
-                                     double learning_rate
+                                     double learning_rate,
+                                     size_t max_batch_size
                                      );
 
+/* Sets the activation of the provided layer to activation_type, returns non-zero when unknown */
+int set_dense_layer_activation(DenseLayer *layer, int activation_type);
+
+/* Points the loss functions of the provided network at the ones of loss_function, returns non-zero when unknown */
+int set_network_loss(NeuralNetwork *nn, int loss_function);
+
+/* Whether the network ends in softmax trained with multi class cross entropy, whose backward pass fuses into p - y */
+int fused_softmax_cross_entropy(const NeuralNetwork *nn);
+
+/* Replaces the optimizer of the provided network, discarding the state of the previous one
+ * Returns non-zero and keeps the current optimizer when the optimizer type is unknown */
+int set_network_optimizer(NeuralNetwork *nn, optimizer_config config);
+
+/* Leading dimension used for the weights block of a layer fed by previous_layer_size neurons */
+size_t weights_stride_for(size_t previous_layer_size);
+
+/* Copies the parameters of the provided network onto a NUMA node for a worker running there that only reads them.
+ * The copy has no workspace nor optimizer and is released with destroy_neural_network. Returns NULL on failure */
+NeuralNetwork *replicate_neural_network(const NeuralNetwork *nn, int node);
+
 /* Deallocates the provided neural network */
 void destroy_neural_network(NeuralNetwork *nn);
 
+/* Allocates a workspace able to hold the activations, errors and gradients of the provided network for
+ * batches of up to max_batch_size samples. Returns NULL, after printing why, when an allocation fails */
+nn_workspace *create_workspace(const NeuralNetwork *nn, size_t max_batch_size);
+
+/* Deallocates the provided workspace */
+void destroy_workspace(nn_workspace *workspace);
+
 /* Feeds the provided input into the provided neural network and returns the output
- * If the neural network has X neurons, then the first X elements of the provided input will be fed to the network */
-double *feedforward(NeuralNetwork *nn, const double *input);
+ * If the neural network has X neurons, then the first X elements of the provided input will be fed to the network
+ * The returned output lives in the network workspace: it must not be freed and is overwritten by the next pass
+ * Not thread safe since the network workspace is shared, concurrent callers should use nn_predict */
+nn_real *feedforward(NeuralNetwork *nn, const nn_real *input);
+
+/* Feeds batch_size inputs, stored contiguously with input_layer_size elements each, through the network and
+ * writes the batch_size x output layer size outputs into outputs */
+void feedforward_batch(NeuralNetwork *nn, const nn_real *inputs, size_t batch_size, nn_real *outputs);
+
+/* Writes the output of a single input into output, keeping every intermediate activation in the caller-owned workspace
+ * The network is only read, so any number of threads can predict against one model without locks as long as each
+ * thread passes its own workspace (see create_workspace) */
+void nn_predict(const NeuralNetwork *nn, const nn_real *input, nn_real *output, nn_workspace *workspace);
+
+/* Batch counterpart of nn_predict, batches larger than the workspace are processed in chunks */
+void nn_predict_batch(const NeuralNetwork *nn, const nn_real *inputs, size_t batch_size, nn_real *outputs, nn_workspace *workspace);
 
 /* Calculates the loss of the network, comparing the network output and the expected output using
  * the loss function of the network */
-double calculate_loss(NeuralNetwork *nn, const double *network_output, const double *expected_output);
+nn_real calculate_loss(const NeuralNetwork *nn, const nn_real *network_output, const nn_real *expected_output);
+
+/* Propagates backwards through the network from the outputs cached by the last feedforward call, computing the gradients
+ * of every layer into the network workspace and only then applying them as one optimizer step */
+void backpropagation(NeuralNetwork *nn, const nn_real *network_input, const nn_real *expected_output);
+
+/* Backward pass only: adds the gradients of batch_size samples, whose forward pass is already stored in the workspace
+ * outputs, into workspace->gradients without touching the network. Returns the summed loss of the samples */
+double backpropagate_gradients(const NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size, nn_workspace *workspace);
+
+/* Runs a forward and backward pass over a batch of batch_size contiguous inputs and expected outputs, accumulating the
+ * gradients of every sample and applying their average to the weights and biases once. Returns the mean loss of the batch */
+double backprop_batch(NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size);
+
+/* Runs the forward and backward passes of batch_size samples using the provided workspace, overwriting
+ * workspace->gradients with their summed gradients. The network is only read, so several threads may compute
+ * gradients concurrently, each with its own workspace. Returns the summed loss of the samples */
+double compute_gradients(const NeuralNetwork *nn, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size, nn_workspace *workspace);
+
+/* Applies gradients summed over batch_size samples, laid out like nn->parameters, as one averaged optimizer step */
+void apply_gradients(NeuralNetwork *nn, const nn_real *gradients, size_t batch_size);
 
-/* Propagates backwards through the network, calculating gradients and updating weights and biases
- * based on the network output and the expected output, using the activation functions attributed to the layers of the network*/
-void backpropagation(NeuralNetwork *nn, const double *network_input, const double *expected_output);
+/* Must follow any write to the parameters other than apply_gradients, so workspaces drop what they derived from them */
+static inline void parameters_changed(NeuralNetwork *nn){
+    ++nn->parameters_version;
+}
 
 #endif //DIGITS_NN_C_NN_CORE_H
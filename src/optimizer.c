@@ -0,0 +1,93 @@
+#include "optimizer.h"
+#include "nn_core.h"
+#include "simd.h"
+
+
+optimizer_config default_optimizer_config(int type, double learning_rate){
+    optimizer_config config;
+    config.type = type;
+    config.learning_rate = learning_rate;
+    config.momentum = 0.9;
+    config.beta2 = 0.999;
+    config.epsilon = 1e-8;
+    config.weight_decay = type == ADAMW_OPTIMIZER ? 0.01 : 0;
+    return config;
+}
+
+
+nn_optimizer *create_optimizer(optimizer_config config, size_t parameters_num){
+    int moments;
+    switch(config.type){
+        case SGD_OPTIMIZER: moments = 0; break;
+        case MOMENTUM_OPTIMIZER:
+        case NESTEROV_OPTIMIZER: moments = 1; break;
+        case ADAM_OPTIMIZER:
+        case ADAMW_OPTIMIZER: moments = 2; break;
+        default: return NULL;
+    }
+
+    nn_optimizer *optimizer = malloc(sizeof(nn_optimizer));
+    optimizer->config = config;
+    optimizer->parameters_num = parameters_num;
+    optimizer->first_moment = moments >= 1 ? large_calloc(sizeof(nn_real) * parameters_num, BUFFER_SHARED) : NULL;
+    optimizer->second_moment = moments >= 2 ? large_calloc(sizeof(nn_real) * parameters_num, BUFFER_SHARED) : NULL;
+    optimizer->steps = 0;
+    return optimizer;
+}
+
+
+void destroy_optimizer(nn_optimizer *optimizer){
+    if(optimizer == NULL) return;
+    large_free(optimizer->first_moment);
+    large_free(optimizer->second_moment);
+    free(optimizer);
+}
+
+
+void optimizer_step(nn_optimizer *optimizer, nn_real *parameters, const nn_real *gradients, nn_real gradient_scale){
+    const optimizer_config *config = &optimizer->config;
+    ++optimizer->steps;
+
+    optimizer_coefficients coefficients;
+    coefficients.gradient_scale = gradient_scale;
+    coefficients.l2 = (nn_real)config->weight_decay;
+    coefficients.decay = 1;
+    coefficients.learning_rate = (nn_real)config->learning_rate;
+    coefficients.beta1 = (nn_real)config->momentum;
+    coefficients.beta2 = (nn_real)config->beta2;
+    coefficients.epsilon = (nn_real)config->epsilon;
+    coefficients.gradient_weight = 0;
+    coefficients.moment_weight = 1;
+
+    switch(config->type){
+        case SGD_OPTIMIZER:
+            // the L2 gradient of plain sgd is a shrink of the parameters, folded into the decay
+            coefficients.decay = (nn_real)(1 - config->learning_rate * config->weight_decay);
+            coefficients.l2 = 0;
+            simd->sgd_update(optimizer->parameters_num, &coefficients, gradients, parameters);
+            break;
+        case NESTEROV_OPTIMIZER:
+            // look ahead: step along g + momentum * v instead of v
+            coefficients.gradient_weight = 1;
+            coefficients.moment_weight = (nn_real)config->momentum;
+            // fall through
+        case MOMENTUM_OPTIMIZER:
+            simd->momentum_update(optimizer->parameters_num, &coefficients, gradients, optimizer->first_moment, parameters);
+            break;
+        case ADAMW_OPTIMIZER:
+            coefficients.decay = (nn_real)(1 - config->learning_rate * config->weight_decay);
+            coefficients.l2 = 0;
+            // fall through
+        case ADAM_OPTIMIZER: {
+            // bias corrections folded into the step size and epsilon so the kernel needs no per step state
+            double first_correction = 1 - pow(config->momentum, (double)optimizer->steps);
+            double second_correction = sqrt(1 - pow(config->beta2, (double)optimizer->steps));
+            coefficients.learning_rate = (nn_real)(config->learning_rate * second_correction / first_correction);
+            coefficients.epsilon = (nn_real)(config->epsilon * second_correction);
+            simd->adam_update(optimizer->parameters_num, &coefficients, gradients, optimizer->first_moment, optimizer->second_moment, parameters);
+            break;
+        }
+        default:
+            break;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef DIGITS_NN_C_OPTIMIZER_H
+#define DIGITS_NN_C_OPTIMIZER_H
+
+#include "utils.h"
+
+
+#define SGD_OPTIMIZER 0
+#define MOMENTUM_OPTIMIZER 1
+#define NESTEROV_OPTIMIZER 2
+#define ADAM_OPTIMIZER 3
+#define ADAMW_OPTIMIZER 4
+
+
+typedef struct {
+    int type;               // one of the *_OPTIMIZER ids
+    double learning_rate;
+    double momentum;        // velocity decay of momentum and nesterov, first moment decay (beta1) of adam and adamw
+    double beta2;           // second moment decay of adam and adamw
+    double epsilon;         // adam and adamw denominator guard
+    double weight_decay;    // L2 penalty added to the gradients, decoupled from them by adamw
+} optimizer_config;
+
+
+/* Update rule and its state, the moment buffers share the layout of the parameters block they update so a step is a
+ * single pass over contiguous memory */
+typedef struct {
+    optimizer_config config;
+    size_t parameters_num;
+    nn_real *first_moment;  // velocity of momentum and nesterov, NULL for sgd
+    nn_real *second_moment; // adam and adamw only, NULL otherwise
+    uint64_t steps;
+} nn_optimizer;
+
+
+/* Returns the usual hyperparameters of the provided optimizer: momentum 0.9, beta2 0.999, epsilon 1e-8, weight decay
+ * 0.01 for adamw and 0 otherwise */
+optimizer_config default_optimizer_config(int type, double learning_rate);
+
+/* Creates an optimizer with zeroed state for a parameters block of parameters_num elements
+ * Returns NULL when the optimizer type is unknown */
+nn_optimizer *create_optimizer(optimizer_config config, size_t parameters_num);
+
+/* Deallocates the provided optimizer */
+void destroy_optimizer(nn_optimizer *optimizer);
+
+/* Updates parameters in place from gradients, both laid out like the parameters block, in one fused pass
+ * gradient_scale multiplies every gradient first, 1 / batch size turns summed gradients into their average */
+void optimizer_step(nn_optimizer *optimizer, nn_real *parameters, const nn_real *gradients, nn_real gradient_scale);
+
+#endif //DIGITS_NN_C_OPTIMIZER_H
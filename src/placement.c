@@ -0,0 +1,261 @@
+// CPU affinity masks and pthread_setaffinity_np are GNU extensions
+#define _GNU_SOURCE
+#include "placement.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// memory policies of mbind(2), without depending on libnuma for its numaif.h
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+
+/* Nodes a placement mask can name, one bit each */
+#define MAX_NUMA_NODES 64
+
+/* Bytes in front of every buffer remembering how to release it, keeps the buffer 64 byte aligned */
+#define BUFFER_HEADER_SIZE 64
+
+
+typedef struct {
+    void *mapping;          // NULL when the buffer comes from the heap
+    size_t mapping_size;
+} buffer_header;
+
+
+static placement_config config = {HUGE_PAGES_TRANSPARENT, NUMA_FIRST_TOUCH, 0};
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static size_t nodes_num;
+static int node_ids[MAX_NUMA_NODES];
+static size_t cpus_num;
+static int cpus[CPU_SETSIZE];       // usable CPUs, node by node
+static int cpu_nodes[CPU_SETSIZE];  // node of every entry of cpus
+
+static _Atomic size_t reserved_fallbacks;   // MAP_HUGETLB allocations the reserved pool could not back
+static _Atomic int placement_failed;
+
+
+static const char *const huge_pages_names[] = {"off", "transparent", "reserved"};
+static const char *const numa_names[] = {"first-touch", "interleave", "replicate"};
+
+
+static int parse_option(const char *variable, const char *const *names, int names_num, int fallback){
+    const char *value = getenv(variable);
+    if(value == NULL) return fallback;
+    for(int name=0; name<names_num; ++name)
+        if(strcmp(value, names[name]) == 0) return name;
+    fprintf(stderr, "Unknown %s value %s, keeping %s\n", variable, value, names[fallback]);
+    return fallback;
+}
+
+
+/* Reads the configuration before main runs, like the SIMD level, so every allocation sees the same one */
+__attribute__((constructor))
+static void read_placement_config(void){
+    config.huge_pages = parse_option("NN_HUGE_PAGES", huge_pages_names, 3, config.huge_pages);
+    config.numa = parse_option("NN_NUMA", numa_names, 3, config.numa);
+    const char *pin = getenv("NN_PIN_THREADS");
+    config.pin_threads = pin != NULL && strcmp(pin, "0") != 0;
+}
+
+
+placement_config get_placement_config(void){
+    return config;
+}
+
+
+void set_placement_config(placement_config new_config){
+    config = new_config;
+}
+
+
+/* Expands a sysfs list such as "0-3,8-11" read from path into values, returns how many it holds */
+static size_t read_sysfs_list(const char *path, int *values, size_t capacity){
+    FILE *file = fopen(path, "r");
+    if(file == NULL) return 0;
+    char text[4096];
+    size_t count = 0;
+    if(fgets(text, sizeof(text), file) != NULL){
+        char *cursor = text;
+        while(*cursor != '\0' && *cursor != '\n'){
+            char *end;
+            long first = strtol(cursor, &end, 10);
+            if(end == cursor) break;
+            long last = first;
+            if(*end == '-') last = strtol(end + 1, &end, 10);
+            for(long value=first; value<=last && count<capacity; ++value) values[count++] = (int)value;
+            cursor = *end == ',' ? end + 1 : end;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+
+static void detect_topology(void){
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu) CPU_SET(cpu, &allowed);
+
+    nodes_num = read_sysfs_list("/sys/devices/system/node/online", node_ids, MAX_NUMA_NODES);
+    int node_cpus[CPU_SETSIZE];
+    for(size_t node=0; node<nodes_num; ++node){
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node_ids[node]);
+        size_t node_cpus_num = read_sysfs_list(path, node_cpus, CPU_SETSIZE);
+        for(size_t cpu=0; cpu<node_cpus_num && cpus_num<CPU_SETSIZE; ++cpu){
+            if(!CPU_ISSET(node_cpus[cpu], &allowed)) continue;
+            cpus[cpus_num] = node_cpus[cpu];
+            cpu_nodes[cpus_num++] = node_ids[node];
+        }
+    }
+
+    // no sysfs NUMA information: a single node holding every allowed CPU
+    if(nodes_num == 0 || cpus_num == 0){
+        nodes_num = 1;
+        node_ids[0] = 0;
+        cpus_num = 0;
+        for(int cpu=0; cpu<CPU_SETSIZE; ++cpu){
+            if(!CPU_ISSET(cpu, &allowed)) continue;
+            cpus[cpus_num] = cpu;
+            cpu_nodes[cpus_num++] = 0;
+        }
+    }
+}
+
+
+size_t numa_nodes_num(void){
+    pthread_once(&topology_once, detect_topology);
+    return nodes_num;
+}
+
+
+int current_numa_node(void){
+    unsigned int cpu, node;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+    return (int)node;
+}
+
+
+int pin_thread(size_t index){
+    pthread_once(&topology_once, detect_topology);
+    if(!config.pin_threads || cpus_num == 0) return current_numa_node();
+
+    size_t slot = index % cpus_num;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[slot], &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+        fprintf(stderr, "Failed to pin a thread to CPU %d\n", cpus[slot]);
+        return current_numa_node();
+    }
+    return cpu_nodes[slot];
+}
+
+
+/* Applies a memory policy to a mapping nothing has touched yet, so every page is allocated accordingly */
+static void place_mapping(void *mapping, size_t size, int policy, unsigned long nodes){
+    if(syscall(SYS_mbind, mapping, size, policy, &nodes, sizeof(nodes) * 8, 0) != 0 && !atomic_exchange(&placement_failed, 1))
+        fprintf(stderr, "mbind failed, large buffers fall back to first-touch placement\n");
+}
+
+
+/* Maps size zeroed bytes, 2 MB aligned when they get huge pages so every one of them can be backed by one */
+static void *map_buffer(size_t size, size_t *mapping_size){
+    int huge = config.huge_pages != HUGE_PAGES_OFF && size >= HUGE_PAGE_SIZE;
+    if(huge && config.huge_pages == HUGE_PAGES_RESERVED){
+        *mapping_size = align_up(size, HUGE_PAGE_SIZE);
+        void *mapping = mmap(NULL, *mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(mapping != MAP_FAILED) return mapping;
+        atomic_fetch_add(&reserved_fallbacks, 1);
+    }
+
+    *mapping_size = align_up(size, huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE));
+    // over-reserve by one huge page and trim both ends to get an aligned mapping
+    size_t reserved_size = *mapping_size + (huge ? HUGE_PAGE_SIZE : 0);
+    char *reserved = mmap(NULL, reserved_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(reserved == MAP_FAILED) return NULL;
+    char *mapping = huge ? (char*)align_up((size_t)reserved, HUGE_PAGE_SIZE) : reserved;
+    if(mapping > reserved) munmap(reserved, (size_t)(mapping - reserved));
+    size_t tail = (size_t)(reserved + reserved_size - (mapping + *mapping_size));
+    if(tail > 0) munmap(mapping + *mapping_size, tail);
+    if(huge) madvise(mapping, *mapping_size, MADV_HUGEPAGE);
+    return mapping;
+}
+
+
+static void *allocate_buffer(size_t size, int policy, unsigned long nodes){
+    size_t total_size = size + BUFFER_HEADER_SIZE;
+    buffer_header header = {NULL, 0};
+    char *block;
+
+    if(total_size < LARGE_BUFFER_MIN_SIZE){
+        block = aligned_calloc(BUFFER_HEADER_SIZE, total_size);
+        if(block == NULL) return NULL;
+    } else {
+        block = map_buffer(total_size, &header.mapping_size);
+        if(block == NULL) return NULL;
+        if(policy != MPOL_DEFAULT) place_mapping(block, header.mapping_size, policy, nodes);
+        header.mapping = block;
+    }
+    memcpy(block, &header, sizeof(header));
+    return block + BUFFER_HEADER_SIZE;
+}
+
+
+void *large_calloc(size_t size, int sharing){
+    if(config.numa == NUMA_FIRST_TOUCH || numa_nodes_num() < 2) return allocate_buffer(size, MPOL_DEFAULT, 0);
+    if(sharing == BUFFER_LOCAL) return large_calloc_on_node(size, current_numa_node());
+
+    unsigned long nodes = 0;
+    for(size_t node=0; node<nodes_num; ++node)
+        if(node_ids[node] < MAX_NUMA_NODES) nodes |= 1ul << node_ids[node];
+    return allocate_buffer(size, MPOL_INTERLEAVE, nodes);
+}
+
+
+void *large_calloc_on_node(size_t size, int node){
+    if(numa_nodes_num() < 2 || node < 0 || node >= MAX_NUMA_NODES) return allocate_buffer(size, MPOL_DEFAULT, 0);
+    return allocate_buffer(size, MPOL_PREFERRED, 1ul << node);
+}
+
+
+void large_free(void *buffer){
+    if(buffer == NULL) return;
+    char *block = (char*)buffer - BUFFER_HEADER_SIZE;
+    buffer_header header;
+    memcpy(&header, block, sizeof(header));
+    if(header.mapping != NULL) munmap(header.mapping, header.mapping_size);
+    else free(block);
+}
+
+
+/* Reads the first line of a sysfs or procfs file into text, empty when it can't be read */
+static void read_first_line(const char *path, char *text, size_t size){
+    text[0] = '\0';
+    FILE *file = fopen(path, "r");
+    if(file == NULL) return;
+    if(fgets(text, (int)size, file) == NULL) text[0] = '\0';
+    text[strcspn(text, "\n")] = '\0';
+    fclose(file);
+}
+
+
+void print_placement_config(FILE *file){
+    pthread_once(&topology_once, detect_topology);
+
+    char transparent_mode[128], free_huge_pages[32];
+    read_first_line("/sys/kernel/mm/transparent_hugepage/enabled", transparent_mode, sizeof(transparent_mode));
+    read_first_line("/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages", free_huge_pages, sizeof(free_huge_pages));
+
+    fprintf(file, "Placement: huge pages %s (transparent: %s, reserved free: %s), numa %s over %zu node%s and %zu CPUs, "
+                  "threads %s\n", huge_pages_names[config.huge_pages], transparent_mode[0] ? transparent_mode : "unavailable",
+            free_huge_pages[0] ? free_huge_pages : "0", numa_names[config.numa], nodes_num, nodes_num == 1 ? "" : "s",
+            cpus_num, config.pin_threads ? "pinned" : "unpinned");
+    size_t fallbacks = atomic_load(&reserved_fallbacks);
+    if(fallbacks > 0) fprintf(file, "Placement: %zu buffers fell back to transparent huge pages, the reserved pool ran dry\n", fallbacks);
+}
@@ -0,0 +1,66 @@
+#ifndef DIGITS_NN_C_PLACEMENT_H
+#define DIGITS_NN_C_PLACEMENT_H
+
+#include "utils.h"
+
+
+/* Huge page backing of large buffers, NN_HUGE_PAGES=off|transparent|reserved */
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_TRANSPARENT 1    // 2 MB aligned mappings advised with MADV_HUGEPAGE
+#define HUGE_PAGES_RESERVED 2       // MAP_HUGETLB from the reserved pool, transparent ones once it runs dry
+
+/* NUMA placement of large buffers, NN_NUMA=first-touch|interleave|replicate */
+#define NUMA_FIRST_TOUCH 0          // wherever the first thread writing a page runs, the kernel default
+#define NUMA_INTERLEAVE 1           // shared buffers spread page by page over every node, per thread ones on its node
+#define NUMA_REPLICATE 2            // as interleave, and read-only workers get a copy of the parameters on their node
+
+/* Sharing of a large buffer, decides where NUMA_INTERLEAVE and NUMA_REPLICATE place it */
+#define BUFFER_SHARED 0             // read or written by threads on any node: parameters, datasets, batches
+#define BUFFER_LOCAL 1              // used by the allocating thread only: workspaces
+
+/* Size of the huge pages buffers are aligned to and backed with */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+/* Buffers smaller than this come from the heap, neither huge pages nor placement pay off for them. Huge pages only
+ * back buffers of at least HUGE_PAGE_SIZE, so rounding up never more than doubles their footprint */
+#define LARGE_BUFFER_MIN_SIZE ((size_t)256 << 10)
+
+
+typedef struct {
+    int huge_pages;     // one of the HUGE_PAGES_* modes
+    int numa;           // one of the NUMA_* placements
+    int pin_threads;    // non-zero pins every worker thread to its own CPU, filling one node after the other
+} placement_config;
+
+
+/* Configuration in effect, read from NN_HUGE_PAGES, NN_NUMA and NN_PIN_THREADS before main runs and defaulting to
+ * transparent huge pages, first-touch placement and unpinned threads */
+placement_config get_placement_config(void);
+
+/* Replaces the configuration, buffers allocated so far keep their placement */
+void set_placement_config(placement_config config);
+
+/* Prints the configuration along with the NUMA nodes, CPUs and reserved huge pages of the machine */
+void print_placement_config(FILE *file);
+
+/* Allocates a zeroed buffer aligned to at least 64 bytes, backed and placed according to the configuration and the
+ * provided BUFFER_* sharing. Release it with large_free. Returns NULL on failure */
+void *large_calloc(size_t size, int sharing);
+
+/* large_calloc placing the buffer on the provided NUMA node whatever the configuration */
+void *large_calloc_on_node(size_t size, int node);
+
+/* Deallocates a buffer of large_calloc or large_calloc_on_node, NULL is ignored */
+void large_free(void *buffer);
+
+/* Number of NUMA nodes of the machine, 1 when it exposes none */
+size_t numa_nodes_num(void);
+
+/* NUMA node the calling thread runs on, 0 when unknown */
+int current_numa_node(void);
+
+/* Pins the calling thread to the index-th CPU, wrapping around, when the configuration asks for pinned threads and
+ * returns the NUMA node it runs on from then on. CPUs are ordered node by node, so consecutive workers share a node */
+int pin_thread(size_t index);
+
+#endif //DIGITS_NN_C_PLACEMENT_H
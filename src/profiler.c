@@ -0,0 +1,146 @@
+#include "profiler.h"
+
+#if NN_PROFILING
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+typedef struct {
+    _Atomic uint64_t calls;
+    _Atomic uint64_t nanoseconds;
+    _Atomic uint64_t cycles;
+    _Atomic uint64_t cache_misses;
+    _Atomic uint64_t flops;
+    _Atomic uint64_t bytes;
+} profile_counters;
+
+
+static const char *const section_names[PROFILE_SECTIONS_NUM] = {
+    "forward", "backward", "loss", "optimizer", "data loading", "batch assembly", "batch wait"
+};
+
+static profile_counters counters[PROFILE_SECTIONS_NUM][PROFILE_MAX_LAYERS];
+static pthread_once_t profiler_once = PTHREAD_ONCE_INIT;
+static int perf_requested;
+static _Atomic int perf_failed;
+static _Atomic uint64_t interval_start; // wall clock of the previous report
+static _Atomic size_t reports_num;
+
+// per thread hardware counters, opened on the first mark of every thread
+static _Thread_local int perf_opened;
+static _Thread_local int cycles_fd = -1;
+static _Thread_local int cache_misses_fd = -1;
+
+
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static void profiler_init(void){
+    perf_requested = getenv("NN_PROFILE_PERF") != NULL;
+    atomic_store(&interval_start, now_ns());
+}
+
+
+/* Counts a hardware event of the calling thread in user space, -1 when perf events are unavailable */
+static int open_perf_counter(uint64_t config){
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = config;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+}
+
+
+static uint64_t read_perf_counter(int fd){
+    uint64_t value = 0;
+    if(fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+    return value;
+}
+
+
+profile_mark profile_begin(void){
+    pthread_once(&profiler_once, profiler_init);
+
+    if(perf_requested && !perf_opened){
+        perf_opened = 1;
+        cycles_fd = open_perf_counter(PERF_COUNT_HW_CPU_CYCLES);
+        cache_misses_fd = open_perf_counter(PERF_COUNT_HW_CACHE_MISSES);
+        if((cycles_fd < 0 || cache_misses_fd < 0) && !atomic_exchange(&perf_failed, 1))
+            fprintf(stderr, "perf_event_open failed, cycles and cache misses will not be reported (check perf_event_paranoid)\n");
+    }
+
+    profile_mark mark = {0, read_perf_counter(cycles_fd), read_perf_counter(cache_misses_fd)};
+    mark.nanoseconds = now_ns();
+    return mark;
+}
+
+
+void profile_end(const profile_mark *mark, profile_section section, size_t layer, double flops, double bytes){
+    uint64_t nanoseconds = now_ns() - mark->nanoseconds;
+    profile_counters *section_counters = &counters[section][layer < PROFILE_MAX_LAYERS ? layer : PROFILE_MAX_LAYERS-1];
+
+    atomic_fetch_add_explicit(&section_counters->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&section_counters->nanoseconds, nanoseconds, memory_order_relaxed);
+    atomic_fetch_add_explicit(&section_counters->flops, (uint64_t)flops, memory_order_relaxed);
+    atomic_fetch_add_explicit(&section_counters->bytes, (uint64_t)bytes, memory_order_relaxed);
+    if(cycles_fd >= 0)
+        atomic_fetch_add_explicit(&section_counters->cycles, read_perf_counter(cycles_fd) - mark->cycles, memory_order_relaxed);
+    if(cache_misses_fd >= 0)
+        atomic_fetch_add_explicit(&section_counters->cache_misses, read_perf_counter(cache_misses_fd) - mark->cache_misses, memory_order_relaxed);
+}
+
+
+void profile_report(FILE *file, const char *label){
+    pthread_once(&profiler_once, profiler_init);
+
+    uint64_t now = now_ns();
+    double wall_seconds = (double)(now - atomic_exchange(&interval_start, now)) * 1e-9;
+    int perf = perf_requested && !atomic_load(&perf_failed);
+
+    uint64_t total_nanoseconds = 0;
+    for(size_t section=0; section<PROFILE_SECTIONS_NUM; ++section)
+        for(size_t layer=0; layer<PROFILE_MAX_LAYERS; ++layer)
+            total_nanoseconds += atomic_load(&counters[section][layer].nanoseconds);
+
+    fprintf(file, "Profile of %s %zu, %.3fs wall clock, %.3fs instrumented across threads\n",
+            label, atomic_fetch_add(&reports_num, 1) + 1, wall_seconds, (double)total_nanoseconds * 1e-9);
+    fprintf(file, "%-15s %5s %10s %12s %7s %9s %9s", "section", "layer", "calls", "time ms", "share", "GFLOP/s", "GB/s");
+    if(perf) fprintf(file, " %14s %14s", "cycles", "cache misses");
+    fprintf(file, "\n");
+
+    for(size_t section=0; section<PROFILE_SECTIONS_NUM; ++section){
+        for(size_t layer=0; layer<PROFILE_MAX_LAYERS; ++layer){
+            profile_counters *section_counters = &counters[section][layer];
+            uint64_t calls = atomic_exchange(&section_counters->calls, 0);
+            uint64_t nanoseconds = atomic_exchange(&section_counters->nanoseconds, 0);
+            uint64_t flops = atomic_exchange(&section_counters->flops, 0);
+            uint64_t bytes = atomic_exchange(&section_counters->bytes, 0);
+            uint64_t cycles = atomic_exchange(&section_counters->cycles, 0);
+            uint64_t cache_misses = atomic_exchange(&section_counters->cache_misses, 0);
+            if(calls == 0) continue;
+
+            double elapsed = nanoseconds > 0 ? (double)nanoseconds : 1;
+            char layer_name[8] = "-";
+            if(section == PROFILE_FORWARD || section == PROFILE_BACKWARD) snprintf(layer_name, sizeof(layer_name), "%zu", layer);
+            fprintf(file, "%-15s %5s %10llu %12.3f %6.1f%% %9.3f %9.3f", section_names[section], layer_name,
+                    (unsigned long long)calls, (double)nanoseconds * 1e-6,
+                    total_nanoseconds > 0 ? 100.0 * (double)nanoseconds / (double)total_nanoseconds : 0.0,
+                    (double)flops / elapsed, (double)bytes / elapsed);
+            if(perf) fprintf(file, " %14llu %14llu", (unsigned long long)cycles, (unsigned long long)cache_misses);
+            fprintf(file, "\n");
+        }
+    }
+    fflush(file);
+}
+
+#endif
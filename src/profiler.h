@@ -0,0 +1,57 @@
+#ifndef DIGITS_NN_C_PROFILER_H
+#define DIGITS_NN_C_PROFILER_H
+
+#include "utils.h"
+
+
+/* Instrumented parts of training, forward and backward are further split per dense layer */
+typedef enum {
+    PROFILE_FORWARD = 0,
+    PROFILE_BACKWARD,
+    PROFILE_LOSS,           // loss and output layer deltas
+    PROFILE_OPTIMIZER,
+    PROFILE_DATA_LOADING,   // IDX files mapped or read
+    PROFILE_BATCH_ASSEMBLY, // raw samples converted into network inputs and one-hot outputs
+    PROFILE_BATCH_WAIT,     // time the consumer of the batch pipeline spent waiting for the loader
+    PROFILE_SECTIONS_NUM
+} profile_section;
+
+/* Layers tracked separately, deeper ones are accounted to the last */
+#define PROFILE_MAX_LAYERS 16
+
+
+/* Instrumentation is compiled in only when built with NN_PROFILING (cmake -DPROFILING=ON), otherwise every NN_PROFILE_*
+ * macro expands to nothing and its arguments are never evaluated. Counters are shared by every thread, so the times of
+ * concurrent workers add up. Setting the NN_PROFILE_PERF environment variable also reads the cycles and cache misses of
+ * the calling thread through perf_event_open */
+#if NN_PROFILING
+
+typedef struct {
+    uint64_t nanoseconds;
+    uint64_t cycles;
+    uint64_t cache_misses;
+} profile_mark;
+
+/* Starts timing a section on the calling thread */
+profile_mark profile_begin(void);
+
+/* Accounts the time since mark, along with the floating point operations and bytes moved, to a section and layer */
+void profile_end(const profile_mark *mark, profile_section section, size_t layer, double flops, double bytes);
+
+/* Prints the breakdown of everything recorded since the previous report, labelled with label and the report
+ * number, and resets the counters */
+void profile_report(FILE *file, const char *label);
+
+#define NN_PROFILE_BEGIN(mark) profile_mark mark = profile_begin()
+#define NN_PROFILE_END(mark, section, layer, flops, bytes) profile_end(&(mark), section, layer, (double)(flops), (double)(bytes))
+#define NN_PROFILE_REPORT(file, label) profile_report(file, label)
+
+#else
+
+#define NN_PROFILE_BEGIN(mark) ((void)0)
+#define NN_PROFILE_END(mark, section, layer, flops, bytes) ((void)0)
+#define NN_PROFILE_REPORT(file, label) ((void)0)
+
+#endif
+
+#endif //DIGITS_NN_C_PROFILER_H
@@ -0,0 +1,166 @@
+#include "quantization.h"
+#include "activations.h"
+#include "simd.h"
+
+
+/* Scale and zero point mapping [min_value, max_value], widened to include 0, onto 0..QUANTIZED_ACTIVATION_MAX */
+static void activation_quantization_parameters(nn_real min_value, nn_real max_value, float *scale, int32_t *zero_point){
+    if(min_value > 0) min_value = 0;
+    if(max_value < 0) max_value = 0;
+    float range = (float)(max_value - min_value);
+    *scale = range > 0 ? range / QUANTIZED_ACTIVATION_MAX : 1;
+    *zero_point = (int32_t)lrintf((float)-min_value / *scale);
+}
+
+
+static void quantize_activations(size_t n, const nn_real *values, float scale, int32_t zero_point, uint8_t *quantized){
+    float inverse_scale = 1 / scale;
+    for(size_t i=0; i<n; ++i){
+        int32_t value = (int32_t)lrintf((float)values[i] * inverse_scale) + zero_point;
+        quantized[i] = (uint8_t)(value < 0 ? 0 : value > QUANTIZED_ACTIVATION_MAX ? QUANTIZED_ACTIVATION_MAX : value);
+    }
+}
+
+
+static void float_range(size_t n, const nn_real *values, nn_real *min_value, nn_real *max_value){
+    for(size_t i=0; i<n; ++i){
+        if(values[i] < *min_value) *min_value = values[i];
+        if(values[i] > *max_value) *max_value = values[i];
+    }
+}
+
+
+quantized_network *quantize_neural_network(const NeuralNetwork *nn, const nn_real *calibration_inputs, size_t calibration_samples){
+    if(calibration_samples == 0){
+        fprintf(stderr, "Quantization needs at least one calibration sample\n");
+        return NULL;
+    }
+
+    quantized_network *qnn = malloc(sizeof(quantized_network));
+    qnn->input_layer_size = nn->input_layer_size;
+    qnn->layers_num = nn->dense_layers_num;
+    qnn->layers = malloc(sizeof(quantized_layer) * nn->dense_layers_num);
+    qnn->widest_layer_size = nn->input_layer_size;
+
+    // observe the range of every layer input by running the float network over the calibration set in chunks
+    nn_real *min_inputs = calloc(nn->dense_layers_num, sizeof(nn_real));
+    nn_real *max_inputs = calloc(nn->dense_layers_num, sizeof(nn_real));
+    nn_workspace *workspace = create_workspace(nn, nn->workspace->max_batch_size);
+    nn_real *outputs = malloc(sizeof(nn_real) * workspace->max_batch_size * nn->dense_layers[nn->dense_layers_num-1].size);
+    for(size_t first=0; first<calibration_samples; first+=workspace->max_batch_size){
+        size_t samples = calibration_samples - first < workspace->max_batch_size ? calibration_samples - first : workspace->max_batch_size;
+        const nn_real *inputs = calibration_inputs + first * nn->input_layer_size;
+        nn_predict_batch(nn, inputs, samples, outputs, workspace); // hidden layer outputs stay in the workspace
+
+        float_range(samples * nn->input_layer_size, inputs, &min_inputs[0], &max_inputs[0]);
+        for(size_t layer=1; layer<nn->dense_layers_num; ++layer)
+            float_range(samples * nn->dense_layers[layer-1].size, workspace->layers_outputs[layer-1], &min_inputs[layer], &max_inputs[layer]);
+    }
+    free(outputs);
+    destroy_workspace(workspace);
+
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        const DenseLayer *dense_layer = &nn->dense_layers[layer];
+        quantized_layer *quantized = &qnn->layers[layer];
+        quantized->size = dense_layer->size;
+        quantized->previous_layer_size = dense_layer->previous_layer_size;
+        quantized->weights_stride = align_up(dense_layer->previous_layer_size, NN_WEIGHTS_ALIGNMENT);
+        quantized->weights = aligned_calloc(NN_WEIGHTS_ALIGNMENT, quantized->size * quantized->weights_stride);
+        quantized->weight_scales = malloc(sizeof(float) * quantized->size);
+        quantized->weight_sums = malloc(sizeof(int32_t) * quantized->size);
+        quantized->biases = malloc(sizeof(float) * quantized->size);
+        quantized->activation_type = dense_layer->activation_type;
+        activation_quantization_parameters(min_inputs[layer], max_inputs[layer], &quantized->input_scale, &quantized->input_zero_point);
+        if(quantized->size > qnn->widest_layer_size) qnn->widest_layer_size = quantized->size;
+
+        for(size_t neuron=0; neuron<dense_layer->size; ++neuron){
+            const nn_real *neuron_weights = dense_layer_neuron_weights(dense_layer, neuron);
+            int8_t *quantized_weights = quantized->weights + neuron * quantized->weights_stride;
+
+            nn_real max_magnitude = 0;
+            for(size_t input=0; input<dense_layer->previous_layer_size; ++input)
+                if(fabs(neuron_weights[input]) > max_magnitude) max_magnitude = fabs(neuron_weights[input]);
+            float scale = max_magnitude > 0 ? (float)max_magnitude / 127 : 1;
+
+            int32_t weights_sum = 0;
+            for(size_t input=0; input<dense_layer->previous_layer_size; ++input){
+                quantized_weights[input] = (int8_t)lrintf((float)neuron_weights[input] / scale);
+                weights_sum += quantized_weights[input];
+            }
+            quantized->weight_scales[neuron] = scale;
+            quantized->weight_sums[neuron] = weights_sum;
+            quantized->biases[neuron] = (float)dense_layer->biases[neuron];
+        }
+    }
+
+    free(min_inputs);
+    free(max_inputs);
+    return qnn;
+}
+
+
+void destroy_quantized_network(quantized_network *qnn){
+    if(qnn == NULL) return;
+    for(size_t layer=0; layer<qnn->layers_num; ++layer){
+        free(qnn->layers[layer].weights);
+        free(qnn->layers[layer].weight_scales);
+        free(qnn->layers[layer].weight_sums);
+        free(qnn->layers[layer].biases);
+    }
+    free(qnn->layers);
+    free(qnn);
+}
+
+
+quantized_workspace *create_quantized_workspace(const quantized_network *qnn){
+    quantized_workspace *workspace = malloc(sizeof(quantized_workspace));
+    // the padding past a narrower layer keeps stale bytes of the wider rows quantized before it, they are harmless
+    // only because the padding of every weight row is zero
+    workspace->quantized_inputs = aligned_calloc(NN_WEIGHTS_ALIGNMENT, align_up(qnn->widest_layer_size, NN_WEIGHTS_ALIGNMENT));
+    workspace->outputs = aligned_calloc(NN_WEIGHTS_ALIGNMENT, sizeof(nn_real) * qnn->widest_layer_size);
+    return workspace;
+}
+
+
+void destroy_quantized_workspace(quantized_workspace *workspace){
+    if(workspace == NULL) return;
+    free(workspace->quantized_inputs);
+    free(workspace->outputs);
+    free(workspace);
+}
+
+
+void quantized_predict(const quantized_network *qnn, const nn_real *input, nn_real *output, quantized_workspace *workspace){
+    const quantized_layer *first_layer = &qnn->layers[0];
+    quantize_activations(qnn->input_layer_size, input, first_layer->input_scale, first_layer->input_zero_point, workspace->quantized_inputs);
+
+    for(size_t layer=0; layer<qnn->layers_num; ++layer){
+        const quantized_layer *current = &qnn->layers[layer];
+        const quantized_layer *next = layer + 1 < qnn->layers_num ? &qnn->layers[layer + 1] : NULL;
+        nn_real *outputs = next ? workspace->outputs : output;
+
+        for(size_t neuron=0; neuron<current->size; ++neuron){
+            // padded length so the kernels run without tails, the zeroed weight padding cancels whatever the input
+            // padding holds
+            int32_t accumulator = simd->dot_u8s8(current->weights_stride, workspace->quantized_inputs, current->weights + neuron * current->weights_stride);
+            accumulator -= current->input_zero_point * current->weight_sums[neuron];
+            outputs[neuron] = (nn_real)(current->input_scale * current->weight_scales[neuron] * (float)accumulator + current->biases[neuron]);
+        }
+        act_forward(current->activation_type, current->size, outputs, outputs);
+
+        if(next != NULL){
+            quantize_activations(current->size, outputs, next->input_scale, next->input_zero_point, workspace->quantized_inputs);
+        }
+    }
+}
+
+
+size_t quantized_network_size(const quantized_network *qnn){
+    size_t size = 0;
+    for(size_t layer=0; layer<qnn->layers_num; ++layer){
+        const quantized_layer *quantized = &qnn->layers[layer];
+        size += quantized->size * quantized->previous_layer_size;                       // int8 weights
+        size += quantized->size * (sizeof(float) * 2 + sizeof(int32_t));               // scales, biases and sums
+    }
+    return size;
+}
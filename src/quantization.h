@@ -0,0 +1,58 @@
+#ifndef DIGITS_NN_C_QUANTIZATION_H
+#define DIGITS_NN_C_QUANTIZATION_H
+
+#include "nn_core.h"
+
+
+/* Dense layer with int8 weights quantized symmetrically per output neuron, fed with 7 bit unsigned activations
+ * quantized per layer with a zero point: input = input_scale * (quantized input - input_zero_point) */
+typedef struct {
+    size_t size;
+    size_t previous_layer_size;
+    size_t weights_stride;     // leading dimension of weights, previous_layer_size padded to NN_WEIGHTS_ALIGNMENT bytes
+    int8_t *weights;           // size x weights_stride, padding zeroed
+    float *weight_scales;      // per neuron, weight = scale * quantized weight
+    int32_t *weight_sums;      // per neuron sum of the quantized weights, removes the zero point in one multiply
+    float *biases;
+    float input_scale;
+    int32_t input_zero_point;
+    nn_activation activation_type;
+} quantized_layer;
+
+
+typedef struct {
+    size_t input_layer_size;
+    size_t layers_num;
+    quantized_layer *layers;
+    size_t widest_layer_size; // widest input or output of any layer, sizes the workspaces
+} quantized_network;
+
+
+/* Per thread scratch memory of quantized inference */
+typedef struct {
+    uint8_t *quantized_inputs; // input of the current layer, widest_layer_size padded
+    nn_real *outputs;          // dequantized output of the current layer
+} quantized_workspace;
+
+
+/* Quantizes the provided network post training: weights get per neuron scales and every layer input gets a scale and
+ * zero point calibrated on the min and max activations the float network produces for calibration_samples inputs */
+quantized_network *quantize_neural_network(const NeuralNetwork *nn, const nn_real *calibration_inputs, size_t calibration_samples);
+
+/* Deallocates the provided quantized network */
+void destroy_quantized_network(quantized_network *qnn);
+
+/* Allocates scratch memory for running the provided quantized network, release it with destroy_quantized_workspace */
+quantized_workspace *create_quantized_workspace(const quantized_network *qnn);
+
+/* Deallocates the provided quantized workspace */
+void destroy_quantized_workspace(quantized_workspace *workspace);
+
+/* Writes the output of a single input into output running int8 x uint8 -> int32 dot products, requantizing between
+ * layers with the bias and activation applied on the way. Like nn_predict it only reads the network */
+void quantized_predict(const quantized_network *qnn, const nn_real *input, nn_real *output, quantized_workspace *workspace);
+
+/* Size in bytes of the weights and biases of the provided quantized network */
+size_t quantized_network_size(const quantized_network *qnn);
+
+#endif //DIGITS_NN_C_QUANTIZATION_H
@@ -0,0 +1,173 @@
+#include "rng.h"
+#include "simd.h"
+
+/* Uniform values made out of every four word Philox block, one 24 bit float per word or one 53 bit double per two */
+#if NN_SINGLE_PRECISION
+#define VALUES_PER_BLOCK 4
+#else
+#define VALUES_PER_BLOCK 2
+#endif
+
+/* Blocks the fill functions generate per kernel call, and normals per Box-Muller batch */
+#define FILL_CHUNK_BLOCKS 64
+#define NORMAL_CHUNK 256
+
+#define TWO_PI 6.283185307179586476925286766559
+
+
+static uint64_t random_seed;
+
+
+/* SplitMix64 finalizer, spreads the clock and pid bits over the whole default seed */
+static uint64_t mix_bits(uint64_t x){
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+
+/* Reads the seed before main runs, like the SIMD level, so every stream sees the same one */
+__attribute__((constructor))
+static void read_random_seed(void){
+    const char *value = getenv("NN_SEED");
+    if(value != NULL){
+        char *end;
+        random_seed = strtoull(value, &end, 0);
+        if(end != value && *end == '\0') return;
+        fprintf(stderr, "Invalid NN_SEED value %s, seeding from the clock\n", value);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    random_seed = mix_bits(((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec) ^ ((uint64_t)getpid() << 32));
+}
+
+
+uint64_t get_random_seed(void){
+    return random_seed;
+}
+
+
+void set_random_seed(uint64_t seed){
+    random_seed = seed;
+}
+
+
+void rng_open(rng_stream *rng, uint64_t seed, uint64_t stream){
+    rng->key = seed;
+    rng->stream = stream;
+    rng->next_block = 0;
+    rng->used = 4 * RNG_BUFFER_BLOCKS;
+}
+
+
+uint32_t rng_next_u32(rng_stream *rng){
+    if(rng->used == 4 * RNG_BUFFER_BLOCKS){
+        simd->philox_blocks(RNG_BUFFER_BLOCKS, rng->key, rng->stream, rng->next_block, rng->buffer);
+        rng->next_block += RNG_BUFFER_BLOCKS;
+        rng->used = 0;
+    }
+    return rng->buffer[rng->used++];
+}
+
+
+uint64_t rng_next_u64(rng_stream *rng){
+    uint64_t high = rng_next_u32(rng);
+    return high << 32 | rng_next_u32(rng);
+}
+
+
+/* Uniform [0, 1) value number index of the provided words, out of the top bits of one (float) or two (double) words */
+static inline nn_real unit_uniform(const uint32_t *words, size_t index){
+#if NN_SINGLE_PRECISION
+    return (nn_real)(words[index] >> 8) * 0x1p-24f;
+#else
+    return (nn_real)((((uint64_t)words[2*index] << 32) | words[2*index + 1]) >> 11) * 0x1p-53;
+#endif
+}
+
+
+nn_real rng_next_uniform(rng_stream *rng){
+#if NN_SINGLE_PRECISION
+    uint32_t words[1] = {rng_next_u32(rng)};
+#else
+    uint32_t words[2] = {rng_next_u32(rng), rng_next_u32(rng)};
+#endif
+    return unit_uniform(words, 0);
+}
+
+
+size_t rng_below(rng_stream *rng, size_t bound){
+    if(bound == 0) return 0;
+    unsigned __int128 product = (unsigned __int128)rng_next_u64(rng) * bound;
+    if((uint64_t)product < bound){
+        // the low half falls below 2^64 mod bound for the values that would bias the result, draw again
+        uint64_t threshold = -(uint64_t)bound % bound;
+        while((uint64_t)product < threshold) product = (unsigned __int128)rng_next_u64(rng) * bound;
+    }
+    return (size_t)(product >> 64);
+}
+
+
+void rng_shuffle(rng_stream *rng, size_t count, size_t *indices){
+    for(size_t i=count; i>1; --i){
+        size_t j = rng_below(rng, i);
+        size_t temp = indices[i-1];
+        indices[i-1] = indices[j];
+        indices[j] = temp;
+    }
+}
+
+
+void rng_permutation(rng_stream *rng, size_t count, size_t *indices){
+    for(size_t i=0; i<count; ++i) indices[i] = i;
+    rng_shuffle(rng, count, indices);
+}
+
+
+/* values[i] = uniform [0, 1) element first + i of the stream, whole blocks are generated by the SIMD kernel and the
+ * values of the partial ones at both ends dropped */
+static void fill_unit_uniform(uint64_t seed, uint64_t stream, size_t first, size_t n, nn_real *values){
+    uint32_t words[4 * FILL_CHUNK_BLOCKS];
+    size_t done = 0;
+    while(done < n){
+        size_t index = first + done, skipped = index % VALUES_PER_BLOCK;
+        size_t count = FILL_CHUNK_BLOCKS * VALUES_PER_BLOCK - skipped;
+        if(count > n - done) count = n - done;
+        size_t blocks = (skipped + count + VALUES_PER_BLOCK - 1) / VALUES_PER_BLOCK;
+        simd->philox_blocks(blocks, seed, stream, index / VALUES_PER_BLOCK, words);
+        for(size_t i=0; i<count; ++i) values[done + i] = unit_uniform(words, skipped + i);
+        done += count;
+    }
+}
+
+
+void rng_fill_uniform(uint64_t seed, uint64_t stream, size_t first, size_t n, nn_real min, nn_real max, nn_real *values){
+    fill_unit_uniform(seed, stream, first, n, values);
+    nn_real range = max - min;
+    for(size_t i=0; i<n; ++i) values[i] = min + range * values[i];
+}
+
+
+void rng_fill_normal(uint64_t seed, uint64_t stream, size_t first, size_t n, nn_real mean, nn_real stddev, nn_real *values){
+    // normal element e comes out of the pair of uniforms 2 * (e / 2) and 2 * (e / 2) + 1, the cosine for even e
+    nn_real uniforms[NORMAL_CHUNK];
+    size_t done = 0;
+    while(done < n){
+        size_t index = first + done, skipped = index % 2;
+        size_t count = NORMAL_CHUNK - skipped;
+        if(count > n - done) count = n - done;
+        size_t pairs = (skipped + count + 1) / 2;
+        fill_unit_uniform(seed, stream, index - skipped, 2 * pairs, uniforms);
+
+        for(size_t pair=0; pair<pairs; ++pair){
+            nn_real radius = stddev * sqrt(-2 * log(1 - uniforms[2*pair]));  // 1 - u is in (0, 1]
+            nn_real angle = (nn_real)TWO_PI * uniforms[2*pair + 1];
+            nn_real normals[2] = {mean + radius * cos(angle), mean + radius * sin(angle)};
+            for(size_t k=0; k<2; ++k){
+                size_t element = 2*pair + k;
+                if(element >= skipped && element < skipped + count) values[done + element - skipped] = normals[k];
+            }
+        }
+        done += count;
+    }
+}
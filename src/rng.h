@@ -0,0 +1,72 @@
+#ifndef DIGITS_NN_C_RNG_H
+#define DIGITS_NN_C_RNG_H
+
+#include "utils.h"
+
+
+/* Every random number is Philox4x32-10 (see simd.h) keyed by the seed, of a counter made of a 64 bit stream id and the
+ * position within that stream. Nothing is shared between streams, so threads draw from their own without locking and
+ * the numbers only depend on the seed, the stream and the position, never on the thread count or the SIMD level */
+
+/* Purposes streams are drawn for, the id of a stream is rng_stream_id(purpose, index) */
+#define RNG_INIT 1          // index: dense layer whose weights are initialized
+#define RNG_SHUFFLE 2       // index: epoch whose training order is shuffled
+#define RNG_READER 3        // index: dataset_reader, shuffle buffer evictions
+#define RNG_SAMPLING 4      // index: free, samples picked by the entry points
+#define RNG_DROPOUT 5       // index: thread or sample drawing dropout masks
+#define RNG_SWEEP 6         // index: 0, configurations drawn by random search
+
+/* Blocks of four words a sequential stream generates at once */
+#define RNG_BUFFER_BLOCKS 16
+
+
+static inline uint64_t rng_stream_id(uint64_t purpose, uint64_t index){
+    return purpose << 48 | index;
+}
+
+
+/* Sequential view of one stream, for draws whose number isn't known in advance (shuffles, sampling) */
+typedef struct {
+    uint64_t key;
+    uint64_t stream;
+    uint64_t next_block;                    // first block the next refill generates
+    uint32_t buffer[4 * RNG_BUFFER_BLOCKS];
+    size_t used;                            // words of buffer already drawn
+} rng_stream;
+
+
+/* Seed in effect, read from NN_SEED before main runs and taken from the clock when unset, so a run is reproduced by
+ * setting NN_SEED to the seed it printed */
+uint64_t get_random_seed(void);
+
+/* Replaces the seed, streams opened before keep theirs */
+void set_random_seed(uint64_t seed);
+
+/* Positions rng at the start of the provided stream of the provided seed */
+void rng_open(rng_stream *rng, uint64_t seed, uint64_t stream);
+
+/* Next 32 or 64 uniformly distributed bits of the stream */
+uint32_t rng_next_u32(rng_stream *rng);
+uint64_t rng_next_u64(rng_stream *rng);
+
+/* Next uniformly distributed value in [0, 1) */
+nn_real rng_next_uniform(rng_stream *rng);
+
+/* Next uniformly distributed integer in [0, bound), without modulo bias (Lemire's multiply and reject), 0 when bound is 0 */
+size_t rng_below(rng_stream *rng, size_t bound);
+
+/* Fisher-Yates shuffle of the provided indices */
+void rng_shuffle(rng_stream *rng, size_t count, size_t *indices);
+
+/* indices = a uniformly random permutation of 0 to count - 1 */
+void rng_permutation(rng_stream *rng, size_t count, size_t *indices);
+
+/* values[i] = element first + i of the uniform [min, max) sequence of the provided stream. Elements are addressed
+ * rather than drawn, so a range split into calls, across threads or not, gets the same values as a single call */
+void rng_fill_uniform(uint64_t seed, uint64_t stream, size_t first, size_t n, nn_real min, nn_real max, nn_real *values);
+
+/* values[i] = element first + i of the normal sequence of the provided stream, addressed like rng_fill_uniform.
+ * Box-Muller turns every two uniforms into two normals, one logarithm and square root and a sine and cosine */
+void rng_fill_normal(uint64_t seed, uint64_t stream, size_t first, size_t n, nn_real mean, nn_real stddev, nn_real *values);
+
+#endif //DIGITS_NN_C_RNG_H
@@ -0,0 +1,516 @@
+#include "serving.h"
+#include <errno.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+/* Request of one connection thread, on its stack until a worker posts done */
+struct serve_request {
+    const float *inputs;
+    float *outputs;
+    uint64_t queued_ns;
+    sem_t done;
+    serve_request *next;
+};
+
+
+typedef struct {
+    inference_server *server;
+    int fd;
+    size_t slot;
+} serve_connection;
+
+
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+static size_t latency_bucket(uint64_t nanoseconds){
+    if(nanoseconds < LATENCY_SUB_BUCKETS) return (size_t)nanoseconds;
+    unsigned int exponent = 63 - (unsigned int)__builtin_clzll(nanoseconds); // at least LATENCY_SUB_BUCKET_BITS
+    return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+           ((nanoseconds >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+
+/* Largest latency falling into the provided bucket */
+static uint64_t latency_bucket_limit(size_t bucket){
+    if(bucket < LATENCY_SUB_BUCKETS) return bucket;
+    unsigned int shift = (unsigned int)(bucket / LATENCY_SUB_BUCKETS) - 1;
+    uint64_t lowest = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+
+void latency_histogram_record(latency_histogram *histogram, uint64_t nanoseconds){
+    atomic_fetch_add_explicit(&histogram->counts[latency_bucket(nanoseconds)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while(nanoseconds > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, nanoseconds,
+                                                                      memory_order_relaxed, memory_order_relaxed));
+}
+
+
+uint64_t latency_histogram_percentile(latency_histogram *histogram, double fraction){
+    uint64_t total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+    if(total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(fraction * (double)total);
+    if(rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    for(size_t bucket=0; bucket<LATENCY_BUCKETS; ++bucket){
+        seen += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+        if(seen >= rank){
+            uint64_t limit = latency_bucket_limit(bucket);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+
+static int write_all(int fd, const void *buffer, size_t size){
+    const char *bytes = buffer;
+    while(size > 0){
+        ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL); // a closed peer is an error, not a SIGPIPE
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return 1;
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+
+static int read_all(int fd, void *buffer, size_t size){
+    char *bytes = buffer;
+    while(size > 0){
+        ssize_t got = read(fd, bytes, size);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return 1;
+        bytes += got;
+        size -= (size_t)got;
+    }
+    return 0;
+}
+
+
+int serve_write_frame(int fd, uint32_t type, const void *payload, uint32_t length){
+    serve_frame_header header = {length, type};
+    if(write_all(fd, &header, sizeof(header))) return 1;
+    return length > 0 && write_all(fd, payload, length);
+}
+
+
+int serve_read_frame(int fd, serve_frame_header *header, void *payload, size_t capacity){
+    if(read_all(fd, header, sizeof(serve_frame_header))) return 1;
+    if(header->length > SERVE_MAX_PAYLOAD) return 1;
+    if(header->length <= capacity) return header->length > 0 && read_all(fd, payload, header->length);
+
+    char discarded[4096];
+    for(size_t left=header->length; left>0;){
+        size_t size = left < sizeof(discarded) ? left : sizeof(discarded);
+        if(read_all(fd, discarded, size)) return 1;
+        left -= size;
+    }
+    return SERVE_FRAME_DISCARDED;
+}
+
+
+static int socket_address(const char *socket_path, struct sockaddr_un *address){
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    if(strlen(socket_path) >= sizeof(address->sun_path)){
+        fprintf(stderr, "Socket path %s is longer than %zu characters\n", socket_path, sizeof(address->sun_path) - 1);
+        return 1;
+    }
+    strcpy(address->sun_path, socket_path);
+    return 0;
+}
+
+
+int serve_connect(const char *socket_path){
+    struct sockaddr_un address;
+    if(socket_address(socket_path, &address)) return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+        perror("socket");
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0){
+        fprintf(stderr, "Failed to connect to %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Queues the provided request and waits for a worker to run it, returns non-zero when the server is stopping */
+static int submit_request(inference_server *server, serve_request *request){
+    sem_init(&request->done, 0, 0);
+    request->next = NULL;
+    request->queued_ns = now_ns();
+
+    pthread_mutex_lock(&server->lock);
+    if(server->stopping){
+        pthread_mutex_unlock(&server->lock);
+        sem_destroy(&request->done);
+        return 1;
+    }
+    if(server->queue_tail) server->queue_tail->next = request;
+    else server->queue_head = request;
+    server->queue_tail = request;
+    ++server->queued;
+    pthread_cond_signal(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+
+    while(sem_wait(&request->done) != 0 && errno == EINTR);
+    sem_destroy(&request->done);
+    return 0;
+}
+
+
+/* Waits for the next batch and moves up to max_batch_size requests into batch, returns 0 once the server stopped and
+ * the queue is drained */
+static size_t take_batch(inference_server *server, serve_request **batch){
+    const size_t max_batch_size = server->config.max_batch_size;
+    size_t count = 0;
+
+    pthread_mutex_lock(&server->lock);
+    for(;;){
+        if(server->queued == 0){
+            if(server->stopping) break;
+            pthread_cond_wait(&server->queue_cond, &server->lock);
+            continue;
+        }
+        if(server->queued >= max_batch_size || server->stopping) break;
+
+        // the batch is dispatched partially filled once its oldest request has waited long enough
+        uint64_t deadline_ns = server->queue_head->queued_ns + server->config.max_delay_ns;
+        if(now_ns() >= deadline_ns) break;
+        struct timespec deadline = {(time_t)(deadline_ns / 1000000000u), (long)(deadline_ns % 1000000000u)};
+        pthread_cond_timedwait(&server->queue_cond, &server->lock, &deadline);
+    }
+
+    while(count < max_batch_size && server->queue_head){
+        batch[count++] = server->queue_head;
+        server->queue_head = server->queue_head->next;
+    }
+    if(server->queue_head == NULL) server->queue_tail = NULL;
+    server->queued -= count;
+    // requests past a full batch are left to the next free worker
+    if(server->queued > 0) pthread_cond_signal(&server->queue_cond);
+    pthread_mutex_unlock(&server->lock);
+    return count;
+}
+
+
+static void *serve_worker_loop(void *argument){
+    inference_server *server = argument;
+    const NeuralNetwork *nn = server->nn;
+    const size_t max_batch_size = server->config.max_batch_size;
+    const size_t input_size = nn->input_layer_size;
+    const size_t output_size = nn->dense_layers[nn->dense_layers_num-1].size;
+
+    int node = pin_thread(atomic_fetch_add(&server->workers_pinned, 1));
+    NeuralNetwork *replica = NULL;
+    if(get_placement_config().numa == NUMA_REPLICATE && numa_nodes_num() > 1){
+        replica = replicate_neural_network(nn, node);
+        if(replica != NULL) nn = replica;
+    }
+
+    nn_workspace *workspace = create_workspace(nn, max_batch_size);
+    serve_request **batch = malloc(sizeof(serve_request*) * max_batch_size);
+    nn_real *inputs = large_calloc(sizeof(nn_real) * input_size * max_batch_size, BUFFER_LOCAL);
+    nn_real *outputs = large_calloc(sizeof(nn_real) * output_size * max_batch_size, BUFFER_LOCAL);
+
+    size_t count;
+    while((count = take_batch(server, batch)) > 0){
+        for(size_t sample=0; sample<count; ++sample)
+            for(size_t i=0; i<input_size; ++i) inputs[sample * input_size + i] = batch[sample]->inputs[i];
+
+        nn_predict_batch(nn, inputs, count, outputs, workspace);
+
+        uint64_t done_ns = now_ns();
+        for(size_t sample=0; sample<count; ++sample){
+            serve_request *request = batch[sample];
+            for(size_t i=0; i<output_size; ++i) request->outputs[i] = (float)outputs[sample * output_size + i];
+            latency_histogram_record(&server->latency, done_ns - request->queued_ns);
+        }
+        // counted before any answer goes out, so a SERVE_STATS sent after an answer always includes it
+        atomic_fetch_add_explicit(&server->requests, count, memory_order_relaxed);
+        atomic_fetch_add_explicit(&server->batches, 1, memory_order_relaxed);
+        for(size_t sample=0; sample<count; ++sample)
+            sem_post(&batch[sample]->done); // the request belongs to its connection again from here on
+    }
+
+    large_free(outputs);
+    large_free(inputs);
+    free(batch);
+    destroy_workspace(workspace);
+    if(replica != NULL) destroy_neural_network(replica);
+    return NULL;
+}
+
+
+static int send_error(inference_server *server, int fd, const char *message){
+    atomic_fetch_add_explicit(&server->errors, 1, memory_order_relaxed);
+    return serve_write_frame(fd, SERVE_ERROR, message, (uint32_t)strlen(message));
+}
+
+
+static void *serve_connection_loop(void *argument){
+    serve_connection *connection = argument;
+    inference_server *server = connection->server;
+    const int fd = connection->fd;
+    const size_t input_size = server->nn->input_layer_size;
+    const size_t output_size = server->nn->dense_layers[server->nn->dense_layers_num-1].size;
+
+    size_t capacity = sizeof(float) * input_size;
+    float *payload = malloc(capacity);
+    float *outputs = malloc(sizeof(float) * output_size);
+    char text[1024];
+
+    serve_frame_header header;
+    int failed = 0;
+    int status;
+    while(!failed && ((status = serve_read_frame(fd, &header, payload, capacity)) == 0 || status == SERVE_FRAME_DISCARDED)){
+        if(header.type != SERVE_INFO && header.type != SERVE_PREDICT && header.type != SERVE_STATS){
+            snprintf(text, sizeof(text), "unknown request type %u", header.type);
+            failed = send_error(server, fd, text);
+            continue;
+        }
+        // oversized payloads were read past by serve_read_frame, so the next frame is read from the right place
+        size_t expected_length = header.type == SERVE_PREDICT ? capacity : 0;
+        if(header.length != expected_length){
+            if(header.type == SERVE_PREDICT)
+                snprintf(text, sizeof(text), "expected %zu float32 inputs (%zu bytes), got %u bytes", input_size, capacity, header.length);
+            else
+                snprintf(text, sizeof(text), "request type %u takes no payload, got %u bytes", header.type, header.length);
+            failed = send_error(server, fd, text);
+            continue;
+        }
+
+        switch(header.type){
+            case SERVE_INFO: {
+                uint32_t info[3] = {(uint32_t)input_size, (uint32_t)output_size, (uint32_t)server->config.max_batch_size};
+                failed = serve_write_frame(fd, SERVE_INFO, info, sizeof(info));
+                break;
+            }
+            case SERVE_PREDICT: {
+                serve_request request;
+                request.inputs = payload;
+                request.outputs = outputs;
+                if(submit_request(server, &request)){
+                    failed = send_error(server, fd, "server is stopping");
+                    break;
+                }
+                failed = serve_write_frame(fd, SERVE_PREDICT, outputs, (uint32_t)(sizeof(float) * output_size));
+                break;
+            }
+            case SERVE_STATS:
+                serve_report(server, text, sizeof(text));
+                failed = serve_write_frame(fd, SERVE_STATS, text, (uint32_t)strlen(text));
+                break;
+        }
+    }
+
+    free(outputs);
+    free(payload);
+
+    // closed under the lock, so stop_inference_server never shuts down a descriptor that was reused meanwhile
+    pthread_mutex_lock(&server->lock);
+    close(fd);
+    server->connection_fds[connection->slot] = -1;
+    --server->connections_num;
+    pthread_cond_signal(&server->connections_cond);
+    pthread_mutex_unlock(&server->lock);
+    free(connection);
+    return NULL;
+}
+
+
+inference_server *create_inference_server(const NeuralNetwork *nn, const char *socket_path, serve_config config){
+    struct sockaddr_un address;
+    if(socket_address(socket_path, &address)) return NULL;
+    if(config.max_batch_size == 0) config.max_batch_size = 1;
+    if(config.max_connections == 0) config.max_connections = 1;
+    if(config.workers_num == 0){
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.workers_num = online_cpus > 0 ? (size_t)online_cpus : 1;
+    }
+
+    // a socket left behind by a server that did not shut down cleanly would make bind fail
+    struct stat status;
+    if(stat(socket_path, &status) == 0 && S_ISSOCK(status.st_mode)) unlink(socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        perror("socket");
+        return NULL;
+    }
+    if(bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listen_fd, SOMAXCONN) != 0){
+        fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        close(listen_fd);
+        return NULL;
+    }
+
+    inference_server *server = calloc(1, sizeof(inference_server));
+    server->nn = nn;
+    server->config = config;
+    server->listen_fd = listen_fd;
+    strcpy(server->socket_path, socket_path);
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_condattr_t condition_attributes;
+    pthread_condattr_init(&condition_attributes);
+    pthread_condattr_setclock(&condition_attributes, CLOCK_MONOTONIC); // batch deadlines are monotonic
+    pthread_cond_init(&server->queue_cond, &condition_attributes);
+    pthread_condattr_destroy(&condition_attributes);
+    pthread_cond_init(&server->connections_cond, NULL);
+    server->connection_fds = malloc(sizeof(int) * config.max_connections);
+    for(size_t slot=0; slot<config.max_connections; ++slot) server->connection_fds[slot] = -1;
+    server->start_ns = now_ns();
+
+    server->workers = malloc(sizeof(pthread_t) * config.workers_num);
+    for(; server->workers_started<config.workers_num; ++server->workers_started){
+        if(pthread_create(&server->workers[server->workers_started], NULL, serve_worker_loop, server) != 0){
+            fprintf(stderr, "Failed to create serving worker %zu\n", server->workers_started);
+            break;
+        }
+    }
+    if(server->workers_started == 0){
+        destroy_inference_server(server);
+        return NULL;
+    }
+    return server;
+}
+
+
+static void accept_connection(inference_server *server){
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if(fd < 0) return;
+
+    pthread_mutex_lock(&server->lock);
+    size_t slot = 0;
+    while(slot < server->config.max_connections && server->connection_fds[slot] != -1) ++slot;
+    if(slot == server->config.max_connections){
+        pthread_mutex_unlock(&server->lock);
+        send_error(server, fd, "too many connections");
+        close(fd);
+        return;
+    }
+    server->connection_fds[slot] = fd;
+    ++server->connections_num;
+    pthread_mutex_unlock(&server->lock);
+
+    serve_connection *connection = malloc(sizeof(serve_connection));
+    connection->server = server;
+    connection->fd = fd;
+    connection->slot = slot;
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if(pthread_create(&thread, &attributes, serve_connection_loop, connection) != 0){
+        fprintf(stderr, "Failed to create a connection thread, closing the connection\n");
+        close(fd);
+        free(connection);
+        pthread_mutex_lock(&server->lock);
+        server->connection_fds[slot] = -1;
+        --server->connections_num;
+        pthread_mutex_unlock(&server->lock);
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+
+/* Stops queueing requests, waits for every connection to close and for the workers to drain the queue */
+static void stop_inference_server(inference_server *server){
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    pthread_cond_broadcast(&server->queue_cond);
+    // connections blocked reading their next request see it closed, the ones waiting for a batch still get it
+    for(size_t slot=0; slot<server->config.max_connections; ++slot)
+        if(server->connection_fds[slot] != -1) shutdown(server->connection_fds[slot], SHUT_RDWR);
+    while(server->connections_num > 0) pthread_cond_wait(&server->connections_cond, &server->lock);
+    pthread_mutex_unlock(&server->lock);
+
+    for(size_t worker=0; worker<server->workers_started; ++worker) pthread_join(server->workers[worker], NULL);
+    server->workers_started = 0;
+}
+
+
+int run_inference_server(inference_server *server, volatile sig_atomic_t *stop, FILE *report, double report_seconds){
+    struct pollfd listener = {server->listen_fd, POLLIN, 0};
+    uint64_t report_interval_ns = (uint64_t)(report_seconds * 1e9);
+    uint64_t next_report_ns = now_ns() + report_interval_ns;
+    char text[1024];
+    int failed = 0;
+
+    while(!*stop){
+        int ready = poll(&listener, 1, 100); // wakes up regularly to notice *stop and report
+        if(report != NULL && report_interval_ns > 0 && now_ns() >= next_report_ns){
+            serve_report(server, text, sizeof(text));
+            fputs(text, report);
+            fflush(report);
+            next_report_ns += report_interval_ns;
+        }
+        if(ready < 0 && errno != EINTR){
+            perror("poll");
+            failed = 1;
+            break;
+        }
+        if(ready > 0) accept_connection(server);
+    }
+
+    stop_inference_server(server);
+    return failed;
+}
+
+
+void destroy_inference_server(inference_server *server){
+    if(server == NULL) return;
+    if(server->workers_started > 0) stop_inference_server(server);
+
+    close(server->listen_fd);
+    unlink(server->socket_path);
+    pthread_cond_destroy(&server->connections_cond);
+    pthread_cond_destroy(&server->queue_cond);
+    pthread_mutex_destroy(&server->lock);
+    free(server->workers);
+    free(server->connection_fds);
+    free(server);
+}
+
+
+void serve_report(inference_server *server, char *buffer, size_t size){
+    double seconds = (double)(now_ns() - server->start_ns) * 1e-9;
+    uint64_t requests = atomic_load_explicit(&server->requests, memory_order_relaxed);
+    uint64_t batches = atomic_load_explicit(&server->batches, memory_order_relaxed);
+    uint64_t errors = atomic_load_explicit(&server->errors, memory_order_relaxed);
+
+    pthread_mutex_lock(&server->lock);
+    size_t connections_num = server->connections_num;
+    size_t queued = server->queued;
+    pthread_mutex_unlock(&server->lock);
+
+    snprintf(buffer, size,
+             "Served %llu requests in %llu batches (%.2f samples per batch), %llu errors, %.1f requests/s over %.1fs, "
+             "%zu connections, %zu queued, latency p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+             (unsigned long long)requests, (unsigned long long)batches, batches ? (double)requests / (double)batches : 0.0,
+             (unsigned long long)errors, seconds > 0 ? (double)requests / seconds : 0.0, seconds, connections_num, queued,
+             (double)latency_histogram_percentile(&server->latency, 0.5) * 1e-3,
+             (double)latency_histogram_percentile(&server->latency, 0.99) * 1e-3,
+             (double)latency_histogram_percentile(&server->latency, 0.999) * 1e-3,
+             (double)atomic_load_explicit(&server->latency.max, memory_order_relaxed) * 1e-3);
+}
@@ -0,0 +1,119 @@
+#ifndef DIGITS_NN_C_SERVING_H
+#define DIGITS_NN_C_SERVING_H
+
+#include "nn_core.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+
+/* Wire protocol over a Unix stream socket. Every frame is a serve_frame_header followed by length payload bytes, all
+ * in the host's byte order since both ends run on the same machine:
+ *   SERVE_INFO     no payload, answered with three uint32: inputs and outputs per sample and the server's max batch size
+ *   SERVE_PREDICT  the float32 inputs of one sample, answered with its float32 outputs
+ *   SERVE_STATS    no payload, answered with the text of serve_report
+ * A request that can't be served is answered with a SERVE_ERROR frame holding a message, the connection stays usable */
+#define SERVE_INFO 1
+#define SERVE_PREDICT 2
+#define SERVE_STATS 3
+#define SERVE_ERROR 255
+
+/* Largest payload either end reads, frames announcing more close the connection */
+#define SERVE_MAX_PAYLOAD (1u << 24)
+
+/* serve_read_frame status of a frame whose payload didn't fit and was read past */
+#define SERVE_FRAME_DISCARDED 2
+
+typedef struct {
+    uint32_t length;    // payload bytes following the header
+    uint32_t type;
+} serve_frame_header;
+
+
+/* Log-linear histogram of nanosecond latencies: every power of two is split into LATENCY_SUB_BUCKETS buckets, so
+ * percentiles are exact below LATENCY_SUB_BUCKETS ns and within 1/LATENCY_SUB_BUCKETS above. Recording is lock free */
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    _Atomic uint64_t counts[LATENCY_BUCKETS];
+    _Atomic uint64_t total;
+    _Atomic uint64_t max;
+} latency_histogram;
+
+
+typedef struct {
+    size_t max_batch_size;      // samples coalesced into one forward pass at most
+    uint64_t max_delay_ns;      // longest the oldest queued request waits for its batch to fill
+    size_t workers_num;         // threads running forward passes, 0 uses one per online CPU
+    size_t max_connections;     // connections served at once, further ones are answered with an error and closed
+} serve_config;
+
+
+typedef struct serve_request serve_request;
+
+/* Dynamic batching server: one thread per connection reads requests and queues them, the workers take up to
+ * max_batch_size queued requests at once, as soon as that many are waiting or the oldest one has waited max_delay_ns,
+ * and run them through nn_predict_batch with their own workspace, pinned and reading their own copy of the parameters
+ * when the placement configuration asks for it */
+typedef struct {
+    const NeuralNetwork *nn;
+    serve_config config;
+    int listen_fd;
+    char socket_path[108];
+
+    pthread_mutex_t lock;                   // guards everything down to stopping
+    pthread_cond_t queue_cond;              // signaled on every queued request and on stop
+    pthread_cond_t connections_cond;        // signaled on every closed connection
+    serve_request *queue_head;
+    serve_request *queue_tail;
+    size_t queued;
+    int *connection_fds;                    // max_connections slots, -1 when free
+    size_t connections_num;
+    int stopping;                           // no request is queued anymore once set
+    pthread_t *workers;
+    size_t workers_started;
+    _Atomic size_t workers_pinned;          // hands every worker the index it is pinned by
+
+    uint64_t start_ns;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t batches;
+    _Atomic uint64_t errors;
+    latency_histogram latency;              // from queueing a request to its outputs being ready
+} inference_server;
+
+
+/* Records a latency of the provided nanoseconds */
+void latency_histogram_record(latency_histogram *histogram, uint64_t nanoseconds);
+
+/* Returns the latency below which the provided fraction (0 to 1) of the recorded ones fall, in nanoseconds */
+uint64_t latency_histogram_percentile(latency_histogram *histogram, double fraction);
+
+/* Writes a whole frame, returns non-zero on failure */
+int serve_write_frame(int fd, uint32_t type, const void *payload, uint32_t length);
+
+/* Reads the next frame, its payload into payload, which holds capacity bytes. A payload larger than capacity but
+ * within SERVE_MAX_PAYLOAD is read and dropped, keeping the connection in sync, and SERVE_FRAME_DISCARDED returned.
+ * Returns any other non-zero value when the connection was closed, failed or announced more than SERVE_MAX_PAYLOAD */
+int serve_read_frame(int fd, serve_frame_header *header, void *payload, size_t capacity);
+
+/* Connects to a server listening on socket_path, returns the connected socket or -1 */
+int serve_connect(const char *socket_path);
+
+/* Listens on socket_path, replacing a stale socket left there, and starts the workers. The network is only read, it
+ * must outlive the server. Returns NULL on failure */
+inference_server *create_inference_server(const NeuralNetwork *nn, const char *socket_path, serve_config config);
+
+/* Accepts connections until *stop is set, printing serve_report to report every report_seconds when report is not
+ * NULL. Then stops queueing requests, closes every connection once its pending request is answered and stops the
+ * workers. Returns non-zero when accepting failed */
+int run_inference_server(inference_server *server, volatile sig_atomic_t *stop, FILE *report, double report_seconds);
+
+/* Stops the provided server if it still runs, removes its socket and deallocates it */
+void destroy_inference_server(inference_server *server);
+
+/* Writes the request, batch and error counters, throughput and latency percentiles of the provided server to buffer */
+void serve_report(inference_server *server, char *buffer, size_t size);
+
+#endif //DIGITS_NN_C_SERVING_H
@@ -0,0 +1,1277 @@
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+/* Scalar reference kernels, also used on non x86 targets */
+
+static nn_real dot_scalar(size_t n, const nn_real *x, const nn_real *y){
+    nn_real sum = 0;
+    for(size_t i=0; i<n; ++i) sum += x[i] * y[i];
+    return sum;
+}
+
+
+static void axpy_scalar(size_t n, nn_real alpha, const nn_real *x, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] += alpha * x[i];
+}
+
+
+static void relu_scalar(size_t n, const nn_real *x, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] = x[i] > 0 ? x[i] : 0;
+}
+
+
+static void relu_derivative_mul_scalar(size_t n, const nn_real *outputs, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] = outputs[i] > 0 ? y[i] : 0;
+}
+
+
+static void gemm_tile_scalar(size_t kc, const nn_real *packed_a, const nn_real *packed_b, nn_real tile[GEMM_MR][GEMM_NR]){
+    memset(tile, 0, sizeof(nn_real) * GEMM_MR * GEMM_NR);
+    for(size_t p=0; p<kc; ++p){
+        for(size_t i=0; i<GEMM_MR; ++i){
+            nn_real a_value = packed_a[p * GEMM_MR + i];
+            for(size_t j=0; j<GEMM_NR; ++j){
+                tile[i][j] += a_value * packed_b[p * GEMM_NR + j];
+            }
+        }
+    }
+}
+
+
+static int32_t dot_u8s8_scalar(size_t n, const uint8_t *a, const int8_t *w){
+    int32_t sum = 0;
+    for(size_t i=0; i<n; ++i) sum += (int32_t)a[i] * w[i];
+    return sum;
+}
+
+
+/* Branchless, every element is stored in the next slot, which only advances past the non-zero ones */
+static size_t compact_nonzeros_scalar(size_t n, const nn_real *x, nn_real *values, uint32_t *indices){
+    size_t count = 0;
+    for(size_t i=0; i<n; ++i){
+        values[count] = x[i];
+        indices[count] = (uint32_t)i;
+        count += x[i] != 0;
+    }
+    return count;
+}
+
+
+/* Columns [first, n) of sparse_rows_sum and sparse_rows_axpy, finishes the columns the vector kernels leave over */
+static void sparse_rows_sum_columns(size_t first, size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y){
+    for(size_t j=first; j<n; ++j){
+        nn_real sum = 0;
+        for(size_t k=0; k<nonzeros; ++k) sum += values[k] * rows[indices[k] * n + j];
+        y[j] = sum;
+    }
+}
+
+
+static void sparse_rows_axpy_columns(size_t first, size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows){
+    for(size_t k=0; k<nonzeros; ++k){
+        nn_real *row = rows + indices[k] * n;
+        for(size_t j=first; j<n; ++j) row[j] += values[k] * x[j];
+    }
+}
+
+
+static void sparse_rows_sum_scalar(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y){
+    memset(y, 0, sizeof(nn_real) * n);
+    for(size_t k=0; k<nonzeros; ++k){
+        const nn_real *row = rows + indices[k] * n;
+        for(size_t j=0; j<n; ++j) y[j] += values[k] * row[j];
+    }
+}
+
+
+static void sparse_rows_axpy_scalar(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows){
+    sparse_rows_axpy_columns(0, nonzeros, values, indices, x, n, rows);
+}
+
+
+/* Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"), multipliers and key increments */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+static void philox_blocks_scalar(size_t blocks, uint64_t key, uint64_t stream, uint64_t first_block, uint32_t *out){
+    for(size_t b=0; b<blocks; ++b){
+        uint64_t block = first_block + b;
+        uint32_t c0 = (uint32_t)block, c1 = (uint32_t)(block >> 32), c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+        uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+        for(int round=0; round<PHILOX_ROUNDS; ++round){
+            uint64_t p0 = (uint64_t)PHILOX_M0 * c0, p1 = (uint64_t)PHILOX_M1 * c2;
+            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            c1 = (uint32_t)p1;
+            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c3 = (uint32_t)p0;
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        out[4*b] = c0;
+        out[4*b + 1] = c1;
+        out[4*b + 2] = c2;
+        out[4*b + 3] = c3;
+    }
+}
+
+
+/* Splits the block counters first_block to first_block + width - 1 into their low and high words, for vector loads */
+static inline void philox_counters(uint64_t first_block, size_t width, uint32_t *low, uint32_t *high){
+    for(size_t lane=0; lane<width; ++lane){
+        low[lane] = (uint32_t)(first_block + lane);
+        high[lane] = (uint32_t)((first_block + lane) >> 32);
+    }
+}
+
+
+static void exp_scalar(size_t n, const nn_real *x, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] = exp(x[i]);
+}
+
+
+static void sigmoid_scalar(size_t n, const nn_real *x, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] = 1 / (1 + exp(-x[i]));
+}
+
+
+static void tanh_scalar(size_t n, const nn_real *x, nn_real *y){
+    for(size_t i=0; i<n; ++i) y[i] = tanh(x[i]);
+}
+
+
+static void sgd_update_scalar(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *parameters){
+    for(size_t i=0; i<n; ++i){
+        nn_real g = c->gradient_scale * gradients[i] + c->l2 * parameters[i];
+        parameters[i] = c->decay * parameters[i] - c->learning_rate * g;
+    }
+}
+
+
+static void momentum_update_scalar(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *velocity, nn_real *parameters){
+    for(size_t i=0; i<n; ++i){
+        nn_real g = c->gradient_scale * gradients[i] + c->l2 * parameters[i];
+        velocity[i] = c->beta1 * velocity[i] + g;
+        nn_real direction = c->gradient_weight * g + c->moment_weight * velocity[i];
+        parameters[i] = c->decay * parameters[i] - c->learning_rate * direction;
+    }
+}
+
+
+static void adam_update_scalar(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *m, nn_real *v, nn_real *parameters){
+    for(size_t i=0; i<n; ++i){
+        nn_real g = c->gradient_scale * gradients[i] + c->l2 * parameters[i];
+        m[i] = c->beta1 * m[i] + (1 - c->beta1) * g;
+        v[i] = c->beta2 * v[i] + (1 - c->beta2) * g * g;
+        parameters[i] = c->decay * parameters[i] - c->learning_rate * m[i] / (sqrt(v[i]) + c->epsilon);
+    }
+}
+
+
+static const simd_kernels scalar_kernels = {
+    "scalar", dot_scalar, axpy_scalar, relu_scalar, relu_derivative_mul_scalar, gemm_tile_scalar, dot_u8s8_scalar,
+    sgd_update_scalar, momentum_update_scalar, adam_update_scalar, exp_scalar, sigmoid_scalar, tanh_scalar,
+    compact_nonzeros_scalar, sparse_rows_sum_scalar, sparse_rows_axpy_scalar, philox_blocks_scalar
+};
+
+
+#ifdef SIMD_X86
+
+/* Every kernel below is written once against these names, which resolve to the _ps or _pd intrinsics of nn_real */
+#if NN_SINGLE_PRECISION
+typedef __m128 sse_real;
+typedef __m256 avx_real;
+typedef __m512 avx512_real;
+typedef __mmask16 avx512_mask;
+#define SSE(op) _mm_##op##_ps
+#define AVX(op) _mm256_##op##_ps
+#define AVX512(op) _mm512_##op##_ps
+#define AVX512_CMP_MASK _mm512_mask_cmp_ps_mask
+#define SSE_BITS(op) _mm_##op##_epi32
+#define AVX_BITS(op) _mm256_##op##_epi32
+#define AVX512_BITS(op) _mm512_##op##_epi32
+#define SSE_BITS_SET1 _mm_set1_epi32
+#define AVX_BITS_SET1 _mm256_set1_epi32
+#define AVX512_BITS_SET1 _mm512_set1_epi32
+#define SSE_AS_BITS _mm_castps_si128
+#define SSE_FROM_BITS _mm_castsi128_ps
+#define AVX_AS_BITS _mm256_castps_si256
+#define AVX_FROM_BITS _mm256_castsi256_ps
+#define AVX512_AS_BITS _mm512_castps_si512
+#define AVX512_FROM_BITS _mm512_castsi512_ps
+#define AVX512_INDICES_STORE(p, v) _mm512_storeu_si512(p, v) // AVX512_WIDTH int32 lanes
+#else
+typedef __m128d sse_real;
+typedef __m256d avx_real;
+typedef __m512d avx512_real;
+typedef __mmask8 avx512_mask;
+#define SSE(op) _mm_##op##_pd
+#define AVX(op) _mm256_##op##_pd
+#define AVX512(op) _mm512_##op##_pd
+#define AVX512_CMP_MASK _mm512_mask_cmp_pd_mask
+#define SSE_BITS(op) _mm_##op##_epi64
+#define AVX_BITS(op) _mm256_##op##_epi64
+#define AVX512_BITS(op) _mm512_##op##_epi64
+#define SSE_BITS_SET1 _mm_set1_epi64x
+#define AVX_BITS_SET1 _mm256_set1_epi64x
+#define AVX512_BITS_SET1 _mm512_set1_epi64
+#define SSE_AS_BITS _mm_castpd_si128
+#define SSE_FROM_BITS _mm_castsi128_pd
+#define AVX_AS_BITS _mm256_castpd_si256
+#define AVX_FROM_BITS _mm256_castsi256_pd
+#define AVX512_AS_BITS _mm512_castpd_si512
+#define AVX512_FROM_BITS _mm512_castsi512_pd
+#define AVX512_INDICES_STORE(p, v) _mm256_storeu_si256((__m256i*)(p), _mm512_castsi512_si256(v))
+#endif
+
+#define SSE_WIDTH (sizeof(sse_real) / sizeof(nn_real))
+#define AVX_WIDTH (sizeof(avx_real) / sizeof(nn_real))
+#define AVX512_WIDTH (sizeof(avx512_real) / sizeof(nn_real))
+
+
+/* Vector exp: x = k * ln2 + r with |r| <= ln2 / 2, exp(r) - 1 from its Taylor series and 2^k built in the exponent
+ * bits. The series stops where its truncation error drops below half an ulp: measured against libm over the clamped
+ * range exp stays within 2 ulp, sigmoid within 3 ulp and tanh within 4 ulp in both precisions. Inputs are clamped to
+ * +-EXP_INPUT_MAX, so exp never returns 0 or infinity but saturates at about 2^+-1021 (2^+-125 in float) */
+#if NN_SINGLE_PRECISION
+#define EXP_TAYLOR_TERMS 7
+#define EXP_INPUT_MAX 87.0f
+#define TANH_INPUT_MAX 9.1f          // tanh rounds to 1 beyond it
+#define EXP_MANTISSA_BITS 23
+#define EXP_BIAS 127
+#define EXP_ROUNDING_SHIFT 0x1.8p23f // adding it rounds to an integer held in the low mantissa bits
+#define LN2_HIGH 0.693359375f        // few significant bits, so k * LN2_HIGH is exact
+#define LN2_LOW -2.12194440e-4f
+#else
+#define EXP_TAYLOR_TERMS 13
+#define EXP_INPUT_MAX 708.0
+#define TANH_INPUT_MAX 19.1
+#define EXP_MANTISSA_BITS 52
+#define EXP_BIAS 1023
+#define EXP_ROUNDING_SHIFT 0x1.8p52
+#define LN2_HIGH 6.93147180369123816490e-01
+#define LN2_LOW 1.90821492927058770002e-10
+#endif
+#define LOG2E 1.44269504088896340736
+
+/* 1/(i+1)!, exp(r) - 1 = r * (1 + r/2! + r^2/3! + ...) */
+static const nn_real exp_taylor[] = {
+    1.0, 1.0/2, 1.0/6, 1.0/24, 1.0/120, 1.0/720, 1.0/5040, 1.0/40320, 1.0/362880, 1.0/3628800, 1.0/39916800,
+    1.0/479001600, 1.0/6227020800
+};
+
+
+/* Runs a vector kernel of the form kernel(vector) over an array, finishing the tail through a zero padded vector so
+ * every element goes through the same approximation */
+#define ELEMENTWISE_LOOP(width, load, store, kernel) do { \
+    size_t i = 0; \
+    for(; i+(width)<=n; i+=(width)) store(y + i, kernel(load(x + i))); \
+    if(i < n){ \
+        nn_real lanes[width] = {0}; \
+        memcpy(lanes, x + i, sizeof(nn_real) * (n - i)); \
+        store(lanes, kernel(load(lanes))); \
+        memcpy(y + i, lanes, sizeof(nn_real) * (n - i)); \
+    } \
+} while(0)
+
+
+/* Mask selecting the first remaining lanes of an AVX-512 register */
+static inline avx512_mask avx512_tail_mask(size_t remaining){
+    return remaining >= AVX512_WIDTH ? (avx512_mask)~0u : (avx512_mask)((1u << remaining) - 1);
+}
+
+
+/* SSE2, baseline of every x86-64 CPU */
+
+__attribute__((target("sse2")))
+static nn_real dot_sse2(size_t n, const nn_real *x, const nn_real *y){
+    sse_real sum0 = SSE(setzero)(), sum1 = SSE(setzero)();
+    size_t i = 0;
+    for(; i+2*SSE_WIDTH<=n; i+=2*SSE_WIDTH){
+        sum0 = SSE(add)(sum0, SSE(mul)(SSE(loadu)(x + i), SSE(loadu)(y + i)));
+        sum1 = SSE(add)(sum1, SSE(mul)(SSE(loadu)(x + i + SSE_WIDTH), SSE(loadu)(y + i + SSE_WIDTH)));
+    }
+    nn_real lanes[SSE_WIDTH];
+    SSE(storeu)(lanes, SSE(add)(sum0, sum1));
+    nn_real sum = 0;
+    for(size_t lane=0; lane<SSE_WIDTH; ++lane) sum += lanes[lane];
+    for(; i<n; ++i) sum += x[i] * y[i];
+    return sum;
+}
+
+
+__attribute__((target("sse2")))
+static void axpy_sse2(size_t n, nn_real alpha, const nn_real *x, nn_real *y){
+    sse_real alpha_vector = SSE(set1)(alpha);
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH)
+        SSE(storeu)(y + i, SSE(add)(SSE(loadu)(y + i), SSE(mul)(alpha_vector, SSE(loadu)(x + i))));
+    for(; i<n; ++i) y[i] += alpha * x[i];
+}
+
+
+__attribute__((target("sse2")))
+static void relu_sse2(size_t n, const nn_real *x, nn_real *y){
+    sse_real zero = SSE(setzero)();
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH)
+        SSE(storeu)(y + i, SSE(max)(SSE(loadu)(x + i), zero));
+    for(; i<n; ++i) y[i] = x[i] > 0 ? x[i] : 0;
+}
+
+
+__attribute__((target("sse2")))
+static void relu_derivative_mul_sse2(size_t n, const nn_real *outputs, nn_real *y){
+    sse_real zero = SSE(setzero)();
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH){
+        sse_real mask = SSE(cmpgt)(SSE(loadu)(outputs + i), zero);
+        SSE(storeu)(y + i, SSE(and)(mask, SSE(loadu)(y + i)));
+    }
+    for(; i<n; ++i) y[i] = outputs[i] > 0 ? y[i] : 0;
+}
+
+
+__attribute__((target("sse2")))
+static void gemm_tile_sse2(size_t kc, const nn_real *packed_a, const nn_real *packed_b, nn_real tile[GEMM_MR][GEMM_NR]){
+    sse_real c[GEMM_MR][GEMM_NR / SSE_WIDTH];
+    for(size_t i=0; i<GEMM_MR; ++i)
+        for(size_t j=0; j<GEMM_NR/SSE_WIDTH; ++j)
+            c[i][j] = SSE(setzero)();
+
+    for(size_t p=0; p<kc; ++p){
+        sse_real b[GEMM_NR / SSE_WIDTH];
+        for(size_t j=0; j<GEMM_NR/SSE_WIDTH; ++j) b[j] = SSE(load)(packed_b + p * GEMM_NR + SSE_WIDTH * j);
+        for(size_t i=0; i<GEMM_MR; ++i){
+            sse_real a = SSE(set1)(packed_a[p * GEMM_MR + i]);
+            for(size_t j=0; j<GEMM_NR/SSE_WIDTH; ++j) c[i][j] = SSE(add)(c[i][j], SSE(mul)(a, b[j]));
+        }
+    }
+
+    for(size_t i=0; i<GEMM_MR; ++i)
+        for(size_t j=0; j<GEMM_NR/SSE_WIDTH; ++j)
+            SSE(storeu)(&tile[i][SSE_WIDTH * j], c[i][j]);
+}
+
+
+__attribute__((target("sse2")))
+static int32_t dot_u8s8_sse2(size_t n, const uint8_t *a, const int8_t *w){
+    __m128i zero = _mm_setzero_si128(), sum = _mm_setzero_si128();
+    size_t i = 0;
+    for(; i+16<=n; i+=16){
+        // widen both operands to int16, the weights keeping their sign, and multiply-add pairs into int32
+        __m128i a_vector = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i w_vector = _mm_loadu_si128((const __m128i*)(w + i));
+        __m128i w_sign = _mm_cmpgt_epi8(zero, w_vector);
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(a_vector, zero), _mm_unpacklo_epi8(w_vector, w_sign)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpackhi_epi8(a_vector, zero), _mm_unpackhi_epi8(w_vector, w_sign)));
+    }
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    int32_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for(; i<n; ++i) total += (int32_t)a[i] * w[i];
+    return total;
+}
+
+
+/* Returns exp(x) - 1 of the reduced argument and writes 2^k into scale, exp(x) = scale * (1 + result) */
+__attribute__((target("sse2")))
+static inline sse_real exp_parts_sse2(sse_real x, sse_real *scale){
+    x = SSE(min)(SSE(max)(x, SSE(set1)(-EXP_INPUT_MAX)), SSE(set1)(EXP_INPUT_MAX));
+    sse_real shifted = SSE(add)(SSE(mul)(x, SSE(set1)(LOG2E)), SSE(set1)(EXP_ROUNDING_SHIFT));
+    sse_real k = SSE(sub)(shifted, SSE(set1)(EXP_ROUNDING_SHIFT));
+    sse_real r = SSE(sub)(SSE(sub)(x, SSE(mul)(k, SSE(set1)(LN2_HIGH))), SSE(mul)(k, SSE(set1)(LN2_LOW)));
+
+    sse_real q = SSE(set1)(exp_taylor[EXP_TAYLOR_TERMS-1]);
+    for(int term=EXP_TAYLOR_TERMS-2; term>=0; --term) q = SSE(add)(SSE(mul)(q, r), SSE(set1)(exp_taylor[term]));
+
+    __m128i exponent = SSE_BITS(add)(SSE_AS_BITS(shifted), SSE_BITS_SET1(EXP_BIAS));
+    *scale = SSE_FROM_BITS(SSE_BITS(slli)(exponent, EXP_MANTISSA_BITS));
+    return SSE(mul)(r, q);
+}
+
+
+__attribute__((target("sse2")))
+static inline sse_real exp_vector_sse2(sse_real x){
+    sse_real scale, m = exp_parts_sse2(x, &scale);
+    return SSE(add)(scale, SSE(mul)(scale, m));
+}
+
+
+__attribute__((target("sse2")))
+static inline sse_real sigmoid_vector_sse2(sse_real x){
+    sse_real one = SSE(set1)(1);
+    return SSE(div)(one, SSE(add)(one, exp_vector_sse2(SSE(sub)(SSE(setzero)(), x))));
+}
+
+
+/* tanh(|x|) = expm1(2|x|) / (expm1(2|x|) + 2), expm1 = scale * m + (scale - 1) keeps its relative accuracy near 0 */
+__attribute__((target("sse2")))
+static inline sse_real tanh_vector_sse2(sse_real x){
+    sse_real sign = SSE(and)(x, SSE(set1)(-0.0));
+    sse_real magnitude = SSE(min)(SSE(andnot)(SSE(set1)(-0.0), x), SSE(set1)(TANH_INPUT_MAX));
+    sse_real scale, m = exp_parts_sse2(SSE(add)(magnitude, magnitude), &scale);
+    sse_real expm1 = SSE(add)(SSE(mul)(scale, m), SSE(sub)(scale, SSE(set1)(1)));
+    return SSE(or)(SSE(div)(expm1, SSE(add)(expm1, SSE(set1)(2))), sign);
+}
+
+
+__attribute__((target("sse2")))
+static void exp_sse2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(SSE_WIDTH, SSE(loadu), SSE(storeu), exp_vector_sse2);
+}
+
+
+__attribute__((target("sse2")))
+static void sigmoid_sse2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(SSE_WIDTH, SSE(loadu), SSE(storeu), sigmoid_vector_sse2);
+}
+
+
+__attribute__((target("sse2")))
+static void tanh_sse2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(SSE_WIDTH, SSE(loadu), SSE(storeu), tanh_vector_sse2);
+}
+
+
+/* The optimizer updates of SSE2 and AVX2 finish their tails with the scalar kernels */
+
+__attribute__((target("sse2")))
+static void sgd_update_sse2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *parameters){
+    sse_real scale = SSE(set1)(c->gradient_scale), l2 = SSE(set1)(c->l2), decay = SSE(set1)(c->decay), rate = SSE(set1)(c->learning_rate);
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH){
+        sse_real p = SSE(loadu)(parameters + i);
+        sse_real g = SSE(add)(SSE(mul)(scale, SSE(loadu)(gradients + i)), SSE(mul)(l2, p));
+        SSE(storeu)(parameters + i, SSE(sub)(SSE(mul)(decay, p), SSE(mul)(rate, g)));
+    }
+    sgd_update_scalar(n - i, c, gradients + i, parameters + i);
+}
+
+
+__attribute__((target("sse2")))
+static void momentum_update_sse2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *velocity, nn_real *parameters){
+    sse_real scale = SSE(set1)(c->gradient_scale), l2 = SSE(set1)(c->l2), decay = SSE(set1)(c->decay), rate = SSE(set1)(c->learning_rate);
+    sse_real beta1 = SSE(set1)(c->beta1), gradient_weight = SSE(set1)(c->gradient_weight), moment_weight = SSE(set1)(c->moment_weight);
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH){
+        sse_real p = SSE(loadu)(parameters + i);
+        sse_real g = SSE(add)(SSE(mul)(scale, SSE(loadu)(gradients + i)), SSE(mul)(l2, p));
+        sse_real velocity_vector = SSE(add)(SSE(mul)(beta1, SSE(loadu)(velocity + i)), g);
+        sse_real direction = SSE(add)(SSE(mul)(gradient_weight, g), SSE(mul)(moment_weight, velocity_vector));
+        SSE(storeu)(velocity + i, velocity_vector);
+        SSE(storeu)(parameters + i, SSE(sub)(SSE(mul)(decay, p), SSE(mul)(rate, direction)));
+    }
+    momentum_update_scalar(n - i, c, gradients + i, velocity + i, parameters + i);
+}
+
+
+__attribute__((target("sse2")))
+static void adam_update_sse2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *m, nn_real *v, nn_real *parameters){
+    sse_real scale = SSE(set1)(c->gradient_scale), l2 = SSE(set1)(c->l2), decay = SSE(set1)(c->decay), rate = SSE(set1)(c->learning_rate);
+    sse_real beta1 = SSE(set1)(c->beta1), beta1_complement = SSE(set1)(1 - c->beta1);
+    sse_real beta2 = SSE(set1)(c->beta2), beta2_complement = SSE(set1)(1 - c->beta2), epsilon = SSE(set1)(c->epsilon);
+    size_t i = 0;
+    for(; i+SSE_WIDTH<=n; i+=SSE_WIDTH){
+        sse_real p = SSE(loadu)(parameters + i);
+        sse_real g = SSE(add)(SSE(mul)(scale, SSE(loadu)(gradients + i)), SSE(mul)(l2, p));
+        sse_real m_vector = SSE(add)(SSE(mul)(beta1, SSE(loadu)(m + i)), SSE(mul)(beta1_complement, g));
+        sse_real v_vector = SSE(add)(SSE(mul)(beta2, SSE(loadu)(v + i)), SSE(mul)(beta2_complement, SSE(mul)(g, g)));
+        sse_real direction = SSE(div)(m_vector, SSE(add)(SSE(sqrt)(v_vector), epsilon));
+        SSE(storeu)(m + i, m_vector);
+        SSE(storeu)(v + i, v_vector);
+        SSE(storeu)(parameters + i, SSE(sub)(SSE(mul)(decay, p), SSE(mul)(rate, direction)));
+    }
+    adam_update_scalar(n - i, c, gradients + i, m + i, v + i, parameters + i);
+}
+
+
+__attribute__((target("sse2")))
+static void sparse_rows_sum_sse2(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y){
+    size_t j = 0;
+    for(; j+4*SSE_WIDTH<=n; j+=4*SSE_WIDTH){ // four vectors of y stay in registers across every non-zero
+        sse_real sum0 = SSE(setzero)(), sum1 = SSE(setzero)(), sum2 = SSE(setzero)(), sum3 = SSE(setzero)();
+        for(size_t k=0; k<nonzeros; ++k){
+            sse_real value = SSE(set1)(values[k]);
+            const nn_real *row = rows + indices[k] * n + j;
+            sum0 = SSE(add)(sum0, SSE(mul)(value, SSE(loadu)(row)));
+            sum1 = SSE(add)(sum1, SSE(mul)(value, SSE(loadu)(row + SSE_WIDTH)));
+            sum2 = SSE(add)(sum2, SSE(mul)(value, SSE(loadu)(row + 2*SSE_WIDTH)));
+            sum3 = SSE(add)(sum3, SSE(mul)(value, SSE(loadu)(row + 3*SSE_WIDTH)));
+        }
+        SSE(storeu)(y + j, sum0);
+        SSE(storeu)(y + j + SSE_WIDTH, sum1);
+        SSE(storeu)(y + j + 2*SSE_WIDTH, sum2);
+        SSE(storeu)(y + j + 3*SSE_WIDTH, sum3);
+    }
+    for(; j+SSE_WIDTH<=n; j+=SSE_WIDTH){
+        sse_real sum = SSE(setzero)();
+        for(size_t k=0; k<nonzeros; ++k)
+            sum = SSE(add)(sum, SSE(mul)(SSE(set1)(values[k]), SSE(loadu)(rows + indices[k] * n + j)));
+        SSE(storeu)(y + j, sum);
+    }
+    sparse_rows_sum_columns(j, nonzeros, values, indices, rows, n, y);
+}
+
+
+__attribute__((target("sse2")))
+static void sparse_rows_axpy_sse2(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows){
+    size_t j = 0;
+    for(; j+4*SSE_WIDTH<=n; j+=4*SSE_WIDTH){ // four vectors of x stay in registers across every non-zero
+        sse_real x0 = SSE(loadu)(x + j), x1 = SSE(loadu)(x + j + SSE_WIDTH);
+        sse_real x2 = SSE(loadu)(x + j + 2*SSE_WIDTH), x3 = SSE(loadu)(x + j + 3*SSE_WIDTH);
+        for(size_t k=0; k<nonzeros; ++k){
+            sse_real value = SSE(set1)(values[k]);
+            nn_real *row = rows + indices[k] * n + j;
+            SSE(storeu)(row, SSE(add)(SSE(loadu)(row), SSE(mul)(value, x0)));
+            SSE(storeu)(row + SSE_WIDTH, SSE(add)(SSE(loadu)(row + SSE_WIDTH), SSE(mul)(value, x1)));
+            SSE(storeu)(row + 2*SSE_WIDTH, SSE(add)(SSE(loadu)(row + 2*SSE_WIDTH), SSE(mul)(value, x2)));
+            SSE(storeu)(row + 3*SSE_WIDTH, SSE(add)(SSE(loadu)(row + 3*SSE_WIDTH), SSE(mul)(value, x3)));
+        }
+    }
+    for(; j+SSE_WIDTH<=n; j+=SSE_WIDTH){
+        sse_real x0 = SSE(loadu)(x + j);
+        for(size_t k=0; k<nonzeros; ++k){
+            nn_real *row = rows + indices[k] * n + j;
+            SSE(storeu)(row, SSE(add)(SSE(loadu)(row), SSE(mul)(SSE(set1)(values[k]), x0)));
+        }
+    }
+    sparse_rows_axpy_columns(j, nonzeros, values, indices, x, n, rows);
+}
+
+
+/* Philox on four blocks at once, one lane each. Only the even lanes have a 32 x 32 -> 64 bit multiply before AVX-512,
+ * so the odd lanes are shifted down into them and both halves of the products are put back together */
+static inline void philox_mulhilo_sse2(__m128i c, __m128i m, __m128i *hi, __m128i *lo){
+    const __m128i low_words = _mm_set1_epi64x(0xFFFFFFFF);
+    __m128i even = _mm_mul_epu32(c, m), odd = _mm_mul_epu32(_mm_srli_epi64(c, 32), m);
+    *lo = _mm_or_si128(_mm_and_si128(even, low_words), _mm_slli_epi64(odd, 32));
+    *hi = _mm_or_si128(_mm_srli_epi64(even, 32), _mm_andnot_si128(low_words, odd));
+}
+
+
+static void philox_blocks_sse2(size_t blocks, uint64_t key, uint64_t stream, uint64_t first_block, uint32_t *out){
+    const __m128i m0 = _mm_set1_epi32((int)PHILOX_M0), m1 = _mm_set1_epi32((int)PHILOX_M1);
+    const __m128i w0 = _mm_set1_epi32((int)PHILOX_W0), w1 = _mm_set1_epi32((int)PHILOX_W1);
+    size_t b = 0;
+    for(; b+4<=blocks; b+=4){
+        uint32_t low[4], high[4];
+        philox_counters(first_block + b, 4, low, high);
+        __m128i c0 = _mm_loadu_si128((const __m128i*)low), c1 = _mm_loadu_si128((const __m128i*)high);
+        __m128i c2 = _mm_set1_epi32((int)(uint32_t)stream), c3 = _mm_set1_epi32((int)(uint32_t)(stream >> 32));
+        __m128i k0 = _mm_set1_epi32((int)(uint32_t)key), k1 = _mm_set1_epi32((int)(uint32_t)(key >> 32));
+        for(int round=0; round<PHILOX_ROUNDS; ++round){
+            __m128i hi0, lo0, hi1, lo1;
+            philox_mulhilo_sse2(c0, m0, &hi0, &lo0);
+            philox_mulhilo_sse2(c2, m1, &hi1, &lo1);
+            c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), k0);
+            c1 = lo1;
+            c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), k1);
+            c3 = lo0;
+            k0 = _mm_add_epi32(k0, w0);
+            k1 = _mm_add_epi32(k1, w1);
+        }
+        // lanes hold one word of every block, transpose them back into consecutive blocks
+        __m128i t0 = _mm_unpacklo_epi32(c0, c1), t1 = _mm_unpackhi_epi32(c0, c1);
+        __m128i t2 = _mm_unpacklo_epi32(c2, c3), t3 = _mm_unpackhi_epi32(c2, c3);
+        __m128i *destination = (__m128i*)(out + 4*b);
+        _mm_storeu_si128(destination, _mm_unpacklo_epi64(t0, t2));
+        _mm_storeu_si128(destination + 1, _mm_unpackhi_epi64(t0, t2));
+        _mm_storeu_si128(destination + 2, _mm_unpacklo_epi64(t1, t3));
+        _mm_storeu_si128(destination + 3, _mm_unpackhi_epi64(t1, t3));
+    }
+    philox_blocks_scalar(blocks - b, key, stream, first_block + b, out + 4*b);
+}
+
+
+static const simd_kernels sse2_kernels = {
+    "sse2", dot_sse2, axpy_sse2, relu_sse2, relu_derivative_mul_sse2, gemm_tile_sse2, dot_u8s8_sse2,
+    sgd_update_sse2, momentum_update_sse2, adam_update_sse2, exp_sse2, sigmoid_sse2, tanh_sse2,
+    compact_nonzeros_scalar, sparse_rows_sum_sse2, sparse_rows_axpy_sse2, philox_blocks_sse2
+};
+
+
+/* AVX2 with FMA */
+
+__attribute__((target("avx2,fma")))
+static nn_real dot_avx2(size_t n, const nn_real *x, const nn_real *y){
+    avx_real sum0 = AVX(setzero)(), sum1 = AVX(setzero)();
+    size_t i = 0;
+    for(; i+2*AVX_WIDTH<=n; i+=2*AVX_WIDTH){
+        sum0 = AVX(fmadd)(AVX(loadu)(x + i), AVX(loadu)(y + i), sum0);
+        sum1 = AVX(fmadd)(AVX(loadu)(x + i + AVX_WIDTH), AVX(loadu)(y + i + AVX_WIDTH), sum1);
+    }
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH)
+        sum0 = AVX(fmadd)(AVX(loadu)(x + i), AVX(loadu)(y + i), sum0);
+    nn_real lanes[AVX_WIDTH];
+    AVX(storeu)(lanes, AVX(add)(sum0, sum1));
+    nn_real sum = 0;
+    for(size_t lane=0; lane<AVX_WIDTH; ++lane) sum += lanes[lane];
+    for(; i<n; ++i) sum += x[i] * y[i];
+    return sum;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(size_t n, nn_real alpha, const nn_real *x, nn_real *y){
+    avx_real alpha_vector = AVX(set1)(alpha);
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH)
+        AVX(storeu)(y + i, AVX(fmadd)(alpha_vector, AVX(loadu)(x + i), AVX(loadu)(y + i)));
+    for(; i<n; ++i) y[i] += alpha * x[i];
+}
+
+
+__attribute__((target("avx2,fma")))
+static void relu_avx2(size_t n, const nn_real *x, nn_real *y){
+    avx_real zero = AVX(setzero)();
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH)
+        AVX(storeu)(y + i, AVX(max)(AVX(loadu)(x + i), zero));
+    for(; i<n; ++i) y[i] = x[i] > 0 ? x[i] : 0;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void relu_derivative_mul_avx2(size_t n, const nn_real *outputs, nn_real *y){
+    avx_real zero = AVX(setzero)();
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH){
+        avx_real mask = AVX(cmp)(AVX(loadu)(outputs + i), zero, _CMP_GT_OQ);
+        AVX(storeu)(y + i, AVX(and)(mask, AVX(loadu)(y + i)));
+    }
+    for(; i<n; ++i) y[i] = outputs[i] > 0 ? y[i] : 0;
+}
+
+
+__attribute__((target("avx2,fma")))
+static void gemm_tile_avx2(size_t kc, const nn_real *packed_a, const nn_real *packed_b, nn_real tile[GEMM_MR][GEMM_NR]){
+    avx_real c[GEMM_MR][GEMM_NR / AVX_WIDTH];
+    for(size_t i=0; i<GEMM_MR; ++i)
+        for(size_t j=0; j<GEMM_NR/AVX_WIDTH; ++j)
+            c[i][j] = AVX(setzero)();
+
+    for(size_t p=0; p<kc; ++p){
+        avx_real b[GEMM_NR / AVX_WIDTH];
+        for(size_t j=0; j<GEMM_NR/AVX_WIDTH; ++j) b[j] = AVX(load)(packed_b + p * GEMM_NR + AVX_WIDTH * j);
+        for(size_t i=0; i<GEMM_MR; ++i){
+            avx_real a = AVX(set1)(packed_a[p * GEMM_MR + i]);
+            for(size_t j=0; j<GEMM_NR/AVX_WIDTH; ++j) c[i][j] = AVX(fmadd)(a, b[j], c[i][j]);
+        }
+    }
+
+    for(size_t i=0; i<GEMM_MR; ++i)
+        for(size_t j=0; j<GEMM_NR/AVX_WIDTH; ++j)
+            AVX(storeu)(&tile[i][AVX_WIDTH * j], c[i][j]);
+}
+
+
+__attribute__((target("avx2,fma")))
+static int32_t dot_u8s8_avx2(size_t n, const uint8_t *a, const int8_t *w){
+    __m256i ones = _mm256_set1_epi16(1), sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i+32<=n; i+=32){
+        __m256i pairs = _mm256_maddubs_epi16(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(w + i)));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(pairs, ones));
+    }
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    int32_t total = 0;
+    for(size_t lane=0; lane<8; ++lane) total += lanes[lane];
+    for(; i<n; ++i) total += (int32_t)a[i] * w[i];
+    return total;
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline avx_real exp_parts_avx2(avx_real x, avx_real *scale){
+    x = AVX(min)(AVX(max)(x, AVX(set1)(-EXP_INPUT_MAX)), AVX(set1)(EXP_INPUT_MAX));
+    avx_real shifted = AVX(fmadd)(x, AVX(set1)(LOG2E), AVX(set1)(EXP_ROUNDING_SHIFT));
+    avx_real k = AVX(sub)(shifted, AVX(set1)(EXP_ROUNDING_SHIFT));
+    avx_real r = AVX(fnmadd)(k, AVX(set1)(LN2_LOW), AVX(fnmadd)(k, AVX(set1)(LN2_HIGH), x));
+
+    avx_real q = AVX(set1)(exp_taylor[EXP_TAYLOR_TERMS-1]);
+    for(int term=EXP_TAYLOR_TERMS-2; term>=0; --term) q = AVX(fmadd)(q, r, AVX(set1)(exp_taylor[term]));
+
+    __m256i exponent = AVX_BITS(add)(AVX_AS_BITS(shifted), AVX_BITS_SET1(EXP_BIAS));
+    *scale = AVX_FROM_BITS(AVX_BITS(slli)(exponent, EXP_MANTISSA_BITS));
+    return AVX(mul)(r, q);
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline avx_real exp_vector_avx2(avx_real x){
+    avx_real scale, m = exp_parts_avx2(x, &scale);
+    return AVX(fmadd)(scale, m, scale);
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline avx_real sigmoid_vector_avx2(avx_real x){
+    avx_real one = AVX(set1)(1);
+    return AVX(div)(one, AVX(add)(one, exp_vector_avx2(AVX(sub)(AVX(setzero)(), x))));
+}
+
+
+__attribute__((target("avx2,fma")))
+static inline avx_real tanh_vector_avx2(avx_real x){
+    avx_real sign = AVX(and)(x, AVX(set1)(-0.0));
+    avx_real magnitude = AVX(min)(AVX(andnot)(AVX(set1)(-0.0), x), AVX(set1)(TANH_INPUT_MAX));
+    avx_real scale, m = exp_parts_avx2(AVX(add)(magnitude, magnitude), &scale);
+    avx_real expm1 = AVX(fmadd)(scale, m, AVX(sub)(scale, AVX(set1)(1)));
+    return AVX(or)(AVX(div)(expm1, AVX(add)(expm1, AVX(set1)(2))), sign);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void exp_avx2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(AVX_WIDTH, AVX(loadu), AVX(storeu), exp_vector_avx2);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void sigmoid_avx2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(AVX_WIDTH, AVX(loadu), AVX(storeu), sigmoid_vector_avx2);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void tanh_avx2(size_t n, const nn_real *x, nn_real *y){
+    ELEMENTWISE_LOOP(AVX_WIDTH, AVX(loadu), AVX(storeu), tanh_vector_avx2);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void sgd_update_avx2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *parameters){
+    avx_real scale = AVX(set1)(c->gradient_scale), l2 = AVX(set1)(c->l2), decay = AVX(set1)(c->decay), rate = AVX(set1)(c->learning_rate);
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH){
+        avx_real p = AVX(loadu)(parameters + i);
+        avx_real g = AVX(fmadd)(scale, AVX(loadu)(gradients + i), AVX(mul)(l2, p));
+        AVX(storeu)(parameters + i, AVX(fmsub)(decay, p, AVX(mul)(rate, g)));
+    }
+    sgd_update_scalar(n - i, c, gradients + i, parameters + i);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void momentum_update_avx2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *velocity, nn_real *parameters){
+    avx_real scale = AVX(set1)(c->gradient_scale), l2 = AVX(set1)(c->l2), decay = AVX(set1)(c->decay), rate = AVX(set1)(c->learning_rate);
+    avx_real beta1 = AVX(set1)(c->beta1), gradient_weight = AVX(set1)(c->gradient_weight), moment_weight = AVX(set1)(c->moment_weight);
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH){
+        avx_real p = AVX(loadu)(parameters + i);
+        avx_real g = AVX(fmadd)(scale, AVX(loadu)(gradients + i), AVX(mul)(l2, p));
+        avx_real velocity_vector = AVX(fmadd)(beta1, AVX(loadu)(velocity + i), g);
+        avx_real direction = AVX(fmadd)(gradient_weight, g, AVX(mul)(moment_weight, velocity_vector));
+        AVX(storeu)(velocity + i, velocity_vector);
+        AVX(storeu)(parameters + i, AVX(fmsub)(decay, p, AVX(mul)(rate, direction)));
+    }
+    momentum_update_scalar(n - i, c, gradients + i, velocity + i, parameters + i);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void adam_update_avx2(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *m, nn_real *v, nn_real *parameters){
+    avx_real scale = AVX(set1)(c->gradient_scale), l2 = AVX(set1)(c->l2), decay = AVX(set1)(c->decay), rate = AVX(set1)(c->learning_rate);
+    avx_real beta1 = AVX(set1)(c->beta1), beta1_complement = AVX(set1)(1 - c->beta1);
+    avx_real beta2 = AVX(set1)(c->beta2), beta2_complement = AVX(set1)(1 - c->beta2), epsilon = AVX(set1)(c->epsilon);
+    size_t i = 0;
+    for(; i+AVX_WIDTH<=n; i+=AVX_WIDTH){
+        avx_real p = AVX(loadu)(parameters + i);
+        avx_real g = AVX(fmadd)(scale, AVX(loadu)(gradients + i), AVX(mul)(l2, p));
+        avx_real m_vector = AVX(fmadd)(beta1, AVX(loadu)(m + i), AVX(mul)(beta1_complement, g));
+        avx_real v_vector = AVX(fmadd)(beta2, AVX(loadu)(v + i), AVX(mul)(beta2_complement, AVX(mul)(g, g)));
+        avx_real direction = AVX(div)(m_vector, AVX(add)(AVX(sqrt)(v_vector), epsilon));
+        AVX(storeu)(m + i, m_vector);
+        AVX(storeu)(v + i, v_vector);
+        AVX(storeu)(parameters + i, AVX(fmsub)(decay, p, AVX(mul)(rate, direction)));
+    }
+    adam_update_scalar(n - i, c, gradients + i, m + i, v + i, parameters + i);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void sparse_rows_sum_avx2(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y){
+    size_t j = 0;
+    for(; j+4*AVX_WIDTH<=n; j+=4*AVX_WIDTH){ // four vectors of y stay in registers across every non-zero
+        avx_real sum0 = AVX(setzero)(), sum1 = AVX(setzero)(), sum2 = AVX(setzero)(), sum3 = AVX(setzero)();
+        for(size_t k=0; k<nonzeros; ++k){
+            avx_real value = AVX(set1)(values[k]);
+            const nn_real *row = rows + indices[k] * n + j;
+            sum0 = AVX(fmadd)(value, AVX(loadu)(row), sum0);
+            sum1 = AVX(fmadd)(value, AVX(loadu)(row + AVX_WIDTH), sum1);
+            sum2 = AVX(fmadd)(value, AVX(loadu)(row + 2*AVX_WIDTH), sum2);
+            sum3 = AVX(fmadd)(value, AVX(loadu)(row + 3*AVX_WIDTH), sum3);
+        }
+        AVX(storeu)(y + j, sum0);
+        AVX(storeu)(y + j + AVX_WIDTH, sum1);
+        AVX(storeu)(y + j + 2*AVX_WIDTH, sum2);
+        AVX(storeu)(y + j + 3*AVX_WIDTH, sum3);
+    }
+    for(; j+AVX_WIDTH<=n; j+=AVX_WIDTH){
+        avx_real sum = AVX(setzero)();
+        for(size_t k=0; k<nonzeros; ++k)
+            sum = AVX(fmadd)(AVX(set1)(values[k]), AVX(loadu)(rows + indices[k] * n + j), sum);
+        AVX(storeu)(y + j, sum);
+    }
+    sparse_rows_sum_columns(j, nonzeros, values, indices, rows, n, y);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void sparse_rows_axpy_avx2(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows){
+    size_t j = 0;
+    for(; j+4*AVX_WIDTH<=n; j+=4*AVX_WIDTH){ // four vectors of x stay in registers across every non-zero
+        avx_real x0 = AVX(loadu)(x + j), x1 = AVX(loadu)(x + j + AVX_WIDTH);
+        avx_real x2 = AVX(loadu)(x + j + 2*AVX_WIDTH), x3 = AVX(loadu)(x + j + 3*AVX_WIDTH);
+        for(size_t k=0; k<nonzeros; ++k){
+            avx_real value = AVX(set1)(values[k]);
+            nn_real *row = rows + indices[k] * n + j;
+            AVX(storeu)(row, AVX(fmadd)(value, x0, AVX(loadu)(row)));
+            AVX(storeu)(row + AVX_WIDTH, AVX(fmadd)(value, x1, AVX(loadu)(row + AVX_WIDTH)));
+            AVX(storeu)(row + 2*AVX_WIDTH, AVX(fmadd)(value, x2, AVX(loadu)(row + 2*AVX_WIDTH)));
+            AVX(storeu)(row + 3*AVX_WIDTH, AVX(fmadd)(value, x3, AVX(loadu)(row + 3*AVX_WIDTH)));
+        }
+    }
+    for(; j+AVX_WIDTH<=n; j+=AVX_WIDTH){
+        avx_real x0 = AVX(loadu)(x + j);
+        for(size_t k=0; k<nonzeros; ++k){
+            nn_real *row = rows + indices[k] * n + j;
+            AVX(storeu)(row, AVX(fmadd)(AVX(set1)(values[k]), x0, AVX(loadu)(row)));
+        }
+    }
+    sparse_rows_axpy_columns(j, nonzeros, values, indices, x, n, rows);
+}
+
+
+__attribute__((target("avx2")))
+static inline void philox_mulhilo_avx2(__m256i c, __m256i m, __m256i *hi, __m256i *lo){
+    __m256i even = _mm256_mul_epu32(c, m), odd = _mm256_mul_epu32(_mm256_srli_epi64(c, 32), m);
+    *lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xAA);
+    *hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+
+__attribute__((target("avx2")))
+static void philox_blocks_avx2(size_t blocks, uint64_t key, uint64_t stream, uint64_t first_block, uint32_t *out){
+    const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0), m1 = _mm256_set1_epi32((int)PHILOX_M1);
+    const __m256i w0 = _mm256_set1_epi32((int)PHILOX_W0), w1 = _mm256_set1_epi32((int)PHILOX_W1);
+    size_t b = 0;
+    for(; b+8<=blocks; b+=8){
+        uint32_t low[8], high[8];
+        philox_counters(first_block + b, 8, low, high);
+        __m256i c0 = _mm256_loadu_si256((const __m256i*)low), c1 = _mm256_loadu_si256((const __m256i*)high);
+        __m256i c2 = _mm256_set1_epi32((int)(uint32_t)stream), c3 = _mm256_set1_epi32((int)(uint32_t)(stream >> 32));
+        __m256i k0 = _mm256_set1_epi32((int)(uint32_t)key), k1 = _mm256_set1_epi32((int)(uint32_t)(key >> 32));
+        for(int round=0; round<PHILOX_ROUNDS; ++round){
+            __m256i hi0, lo0, hi1, lo1;
+            philox_mulhilo_avx2(c0, m0, &hi0, &lo0);
+            philox_mulhilo_avx2(c2, m1, &hi1, &lo1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), k0);
+            c1 = lo1;
+            c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), k1);
+            c3 = lo0;
+            k0 = _mm256_add_epi32(k0, w0);
+            k1 = _mm256_add_epi32(k1, w1);
+        }
+        // transposed within 128 bit halves, which then hold blocks b..b+3 and b+4..b+7
+        __m256i t0 = _mm256_unpacklo_epi32(c0, c1), t1 = _mm256_unpackhi_epi32(c0, c1);
+        __m256i t2 = _mm256_unpacklo_epi32(c2, c3), t3 = _mm256_unpackhi_epi32(c2, c3);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i *destination = (__m256i*)(out + 4*b);
+        _mm256_storeu_si256(destination, _mm256_permute2x128_si256(u0, u1, 0x20));
+        _mm256_storeu_si256(destination + 1, _mm256_permute2x128_si256(u2, u3, 0x20));
+        _mm256_storeu_si256(destination + 2, _mm256_permute2x128_si256(u0, u1, 0x31));
+        _mm256_storeu_si256(destination + 3, _mm256_permute2x128_si256(u2, u3, 0x31));
+    }
+    philox_blocks_sse2(blocks - b, key, stream, first_block + b, out + 4*b);
+}
+
+
+static const simd_kernels avx2_kernels = {
+    "avx2", dot_avx2, axpy_avx2, relu_avx2, relu_derivative_mul_avx2, gemm_tile_avx2, dot_u8s8_avx2,
+    sgd_update_avx2, momentum_update_avx2, adam_update_avx2, exp_avx2, sigmoid_avx2, tanh_avx2,
+    compact_nonzeros_scalar, sparse_rows_sum_avx2, sparse_rows_axpy_avx2, // compress stores start at AVX-512
+    philox_blocks_avx2
+};
+
+
+/* AVX-512 foundation, tails are handled with masked loads and stores */
+
+__attribute__((target("avx512f")))
+static nn_real dot_avx512(size_t n, const nn_real *x, const nn_real *y){
+    avx512_real sum0 = AVX512(setzero)(), sum1 = AVX512(setzero)();
+    size_t i = 0;
+    for(; i+2*AVX512_WIDTH<=n; i+=2*AVX512_WIDTH){
+        sum0 = AVX512(fmadd)(AVX512(loadu)(x + i), AVX512(loadu)(y + i), sum0);
+        sum1 = AVX512(fmadd)(AVX512(loadu)(x + i + AVX512_WIDTH), AVX512(loadu)(y + i + AVX512_WIDTH), sum1);
+    }
+    for(; i<n; i+=AVX512_WIDTH){ // at most two more, possibly partial, vectors
+        avx512_mask mask = avx512_tail_mask(n - i);
+        sum0 = AVX512(fmadd)(AVX512(maskz_loadu)(mask, x + i), AVX512(maskz_loadu)(mask, y + i), sum0);
+    }
+    return AVX512(reduce_add)(AVX512(add)(sum0, sum1));
+}
+
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(size_t n, nn_real alpha, const nn_real *x, nn_real *y){
+    avx512_real alpha_vector = AVX512(set1)(alpha);
+    size_t i = 0;
+    for(; i+AVX512_WIDTH<=n; i+=AVX512_WIDTH)
+        AVX512(storeu)(y + i, AVX512(fmadd)(alpha_vector, AVX512(loadu)(x + i), AVX512(loadu)(y + i)));
+    if(i < n){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        avx512_real result = AVX512(fmadd)(alpha_vector, AVX512(maskz_loadu)(mask, x + i), AVX512(maskz_loadu)(mask, y + i));
+        AVX512(mask_storeu)(y + i, mask, result);
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void relu_avx512(size_t n, const nn_real *x, nn_real *y){
+    avx512_real zero = AVX512(setzero)();
+    size_t i = 0;
+    for(; i+AVX512_WIDTH<=n; i+=AVX512_WIDTH)
+        AVX512(storeu)(y + i, AVX512(max)(AVX512(loadu)(x + i), zero));
+    if(i < n){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        AVX512(mask_storeu)(y + i, mask, AVX512(max)(AVX512(maskz_loadu)(mask, x + i), zero));
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void relu_derivative_mul_avx512(size_t n, const nn_real *outputs, nn_real *y){
+    avx512_real zero = AVX512(setzero)();
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        avx512_mask positive = AVX512_CMP_MASK(mask, AVX512(maskz_loadu)(mask, outputs + i), zero, _CMP_GT_OQ);
+        AVX512(mask_storeu)(y + i, mask, AVX512(maskz_loadu)(positive, y + i));
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void gemm_tile_avx512(size_t kc, const nn_real *packed_a, const nn_real *packed_b, nn_real tile[GEMM_MR][GEMM_NR]){
+    // GEMM_NR is chosen so one register holds a whole row of the tile
+    avx512_real c[GEMM_MR];
+    for(size_t i=0; i<GEMM_MR; ++i) c[i] = AVX512(setzero)();
+
+    for(size_t p=0; p<kc; ++p){
+        avx512_real b = AVX512(load)(packed_b + p * GEMM_NR);
+        for(size_t i=0; i<GEMM_MR; ++i)
+            c[i] = AVX512(fmadd)(AVX512(set1)(packed_a[p * GEMM_MR + i]), b, c[i]);
+    }
+
+    for(size_t i=0; i<GEMM_MR; ++i) AVX512(storeu)(tile[i], c[i]);
+}
+
+
+__attribute__((target("avx512f")))
+static inline avx512_real exp_parts_avx512(avx512_real x, avx512_real *scale){
+    x = AVX512(min)(AVX512(max)(x, AVX512(set1)(-EXP_INPUT_MAX)), AVX512(set1)(EXP_INPUT_MAX));
+    avx512_real shifted = AVX512(fmadd)(x, AVX512(set1)(LOG2E), AVX512(set1)(EXP_ROUNDING_SHIFT));
+    avx512_real k = AVX512(sub)(shifted, AVX512(set1)(EXP_ROUNDING_SHIFT));
+    avx512_real r = AVX512(fnmadd)(k, AVX512(set1)(LN2_LOW), AVX512(fnmadd)(k, AVX512(set1)(LN2_HIGH), x));
+
+    avx512_real q = AVX512(set1)(exp_taylor[EXP_TAYLOR_TERMS-1]);
+    for(int term=EXP_TAYLOR_TERMS-2; term>=0; --term) q = AVX512(fmadd)(q, r, AVX512(set1)(exp_taylor[term]));
+
+    __m512i exponent = AVX512_BITS(add)(AVX512_AS_BITS(shifted), AVX512_BITS_SET1(EXP_BIAS));
+    *scale = AVX512_FROM_BITS(AVX512_BITS(slli)(exponent, EXP_MANTISSA_BITS));
+    return AVX512(mul)(r, q);
+}
+
+
+__attribute__((target("avx512f")))
+static inline avx512_real exp_vector_avx512(avx512_real x){
+    avx512_real scale, m = exp_parts_avx512(x, &scale);
+    return AVX512(fmadd)(scale, m, scale);
+}
+
+
+__attribute__((target("avx512f")))
+static inline avx512_real sigmoid_vector_avx512(avx512_real x){
+    avx512_real one = AVX512(set1)(1);
+    return AVX512(div)(one, AVX512(add)(one, exp_vector_avx512(AVX512(sub)(AVX512(setzero)(), x))));
+}
+
+
+__attribute__((target("avx512f")))
+static inline avx512_real tanh_vector_avx512(avx512_real x){
+    // sign and magnitude through integer ops, AVX-512F lacks the floating point and/or of AVX512DQ
+    __m512i sign_bit = AVX512_AS_BITS(AVX512(set1)(-0.0));
+    __m512i sign = _mm512_and_si512(AVX512_AS_BITS(x), sign_bit);
+    avx512_real magnitude = AVX512(min)(AVX512_FROM_BITS(_mm512_andnot_si512(sign_bit, AVX512_AS_BITS(x))), AVX512(set1)(TANH_INPUT_MAX));
+    avx512_real scale, m = exp_parts_avx512(AVX512(add)(magnitude, magnitude), &scale);
+    avx512_real expm1 = AVX512(fmadd)(scale, m, AVX512(sub)(scale, AVX512(set1)(1)));
+    avx512_real result = AVX512(div)(expm1, AVX512(add)(expm1, AVX512(set1)(2)));
+    return AVX512_FROM_BITS(_mm512_or_si512(AVX512_AS_BITS(result), sign));
+}
+
+
+#define AVX512_ELEMENTWISE_LOOP(kernel) do { \
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){ \
+        avx512_mask mask = avx512_tail_mask(n - i); \
+        AVX512(mask_storeu)(y + i, mask, kernel(AVX512(maskz_loadu)(mask, x + i))); \
+    } \
+} while(0)
+
+
+__attribute__((target("avx512f")))
+static void exp_avx512(size_t n, const nn_real *x, nn_real *y){
+    AVX512_ELEMENTWISE_LOOP(exp_vector_avx512);
+}
+
+
+__attribute__((target("avx512f")))
+static void sigmoid_avx512(size_t n, const nn_real *x, nn_real *y){
+    AVX512_ELEMENTWISE_LOOP(sigmoid_vector_avx512);
+}
+
+
+__attribute__((target("avx512f")))
+static void tanh_avx512(size_t n, const nn_real *x, nn_real *y){
+    AVX512_ELEMENTWISE_LOOP(tanh_vector_avx512);
+}
+
+
+__attribute__((target("avx512f")))
+static void sgd_update_avx512(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *parameters){
+    avx512_real scale = AVX512(set1)(c->gradient_scale), l2 = AVX512(set1)(c->l2), decay = AVX512(set1)(c->decay), rate = AVX512(set1)(c->learning_rate);
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        avx512_real p = AVX512(maskz_loadu)(mask, parameters + i);
+        avx512_real g = AVX512(fmadd)(scale, AVX512(maskz_loadu)(mask, gradients + i), AVX512(mul)(l2, p));
+        AVX512(mask_storeu)(parameters + i, mask, AVX512(fmsub)(decay, p, AVX512(mul)(rate, g)));
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void momentum_update_avx512(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *velocity, nn_real *parameters){
+    avx512_real scale = AVX512(set1)(c->gradient_scale), l2 = AVX512(set1)(c->l2), decay = AVX512(set1)(c->decay), rate = AVX512(set1)(c->learning_rate);
+    avx512_real beta1 = AVX512(set1)(c->beta1), gradient_weight = AVX512(set1)(c->gradient_weight), moment_weight = AVX512(set1)(c->moment_weight);
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        avx512_real p = AVX512(maskz_loadu)(mask, parameters + i);
+        avx512_real g = AVX512(fmadd)(scale, AVX512(maskz_loadu)(mask, gradients + i), AVX512(mul)(l2, p));
+        avx512_real velocity_vector = AVX512(fmadd)(beta1, AVX512(maskz_loadu)(mask, velocity + i), g);
+        avx512_real direction = AVX512(fmadd)(gradient_weight, g, AVX512(mul)(moment_weight, velocity_vector));
+        AVX512(mask_storeu)(velocity + i, mask, velocity_vector);
+        AVX512(mask_storeu)(parameters + i, mask, AVX512(fmsub)(decay, p, AVX512(mul)(rate, direction)));
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void adam_update_avx512(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *m, nn_real *v, nn_real *parameters){
+    avx512_real scale = AVX512(set1)(c->gradient_scale), l2 = AVX512(set1)(c->l2), decay = AVX512(set1)(c->decay), rate = AVX512(set1)(c->learning_rate);
+    avx512_real beta1 = AVX512(set1)(c->beta1), beta1_complement = AVX512(set1)(1 - c->beta1);
+    avx512_real beta2 = AVX512(set1)(c->beta2), beta2_complement = AVX512(set1)(1 - c->beta2), epsilon = AVX512(set1)(c->epsilon);
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - i);
+        avx512_real p = AVX512(maskz_loadu)(mask, parameters + i);
+        avx512_real g = AVX512(fmadd)(scale, AVX512(maskz_loadu)(mask, gradients + i), AVX512(mul)(l2, p));
+        avx512_real m_vector = AVX512(fmadd)(beta1, AVX512(maskz_loadu)(mask, m + i), AVX512(mul)(beta1_complement, g));
+        avx512_real v_vector = AVX512(fmadd)(beta2, AVX512(maskz_loadu)(mask, v + i), AVX512(mul)(beta2_complement, AVX512(mul)(g, g)));
+        avx512_real direction = AVX512(div)(m_vector, AVX512(add)(AVX512(sqrt)(v_vector), epsilon));
+        AVX512(mask_storeu)(m + i, mask, m_vector);
+        AVX512(mask_storeu)(v + i, mask, v_vector);
+        AVX512(mask_storeu)(parameters + i, mask, AVX512(fmsub)(decay, p, AVX512(mul)(rate, direction)));
+    }
+}
+
+
+/* Compresses the non-zero lanes of every vector to the front and stores the whole vector, so the slots past the kept
+ * ones are overwritten (see SPARSE_COMPACTION_SLACK) */
+__attribute__((target("avx512f")))
+static size_t compact_nonzeros_avx512(size_t n, const nn_real *x, nn_real *values, uint32_t *indices){
+    const avx512_real zero = AVX512(setzero)();
+    const __m512i step = _mm512_set1_epi32((int)AVX512_WIDTH);
+    __m512i lane_indices = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); // the first AVX512_WIDTH are used
+    size_t count = 0;
+    for(size_t i=0; i<n; i+=AVX512_WIDTH){
+        avx512_mask lanes = avx512_tail_mask(n - i);
+        avx512_real elements = AVX512(maskz_loadu)(lanes, x + i);
+        avx512_mask nonzero = AVX512_CMP_MASK(lanes, elements, zero, _CMP_NEQ_UQ);
+        AVX512(storeu)(values + count, AVX512(maskz_compress)(nonzero, elements));
+        AVX512_INDICES_STORE(indices + count, _mm512_maskz_compress_epi32(nonzero, lane_indices));
+        count += (size_t)__builtin_popcount((unsigned int)nonzero);
+        lane_indices = _mm512_add_epi32(lane_indices, step);
+    }
+    return count;
+}
+
+
+__attribute__((target("avx512f")))
+static void sparse_rows_sum_avx512(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y){
+    size_t j = 0;
+    for(; j+4*AVX512_WIDTH<=n; j+=4*AVX512_WIDTH){ // four vectors of y stay in registers across every non-zero
+        avx512_real sum0 = AVX512(setzero)(), sum1 = AVX512(setzero)(), sum2 = AVX512(setzero)(), sum3 = AVX512(setzero)();
+        for(size_t k=0; k<nonzeros; ++k){
+            avx512_real value = AVX512(set1)(values[k]);
+            const nn_real *row = rows + indices[k] * n + j;
+            sum0 = AVX512(fmadd)(value, AVX512(loadu)(row), sum0);
+            sum1 = AVX512(fmadd)(value, AVX512(loadu)(row + AVX512_WIDTH), sum1);
+            sum2 = AVX512(fmadd)(value, AVX512(loadu)(row + 2*AVX512_WIDTH), sum2);
+            sum3 = AVX512(fmadd)(value, AVX512(loadu)(row + 3*AVX512_WIDTH), sum3);
+        }
+        AVX512(storeu)(y + j, sum0);
+        AVX512(storeu)(y + j + AVX512_WIDTH, sum1);
+        AVX512(storeu)(y + j + 2*AVX512_WIDTH, sum2);
+        AVX512(storeu)(y + j + 3*AVX512_WIDTH, sum3);
+    }
+    for(; j<n; j+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - j);
+        avx512_real sum = AVX512(setzero)();
+        for(size_t k=0; k<nonzeros; ++k)
+            sum = AVX512(fmadd)(AVX512(set1)(values[k]), AVX512(maskz_loadu)(mask, rows + indices[k] * n + j), sum);
+        AVX512(mask_storeu)(y + j, mask, sum);
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static void sparse_rows_axpy_avx512(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows){
+    size_t j = 0;
+    for(; j+4*AVX512_WIDTH<=n; j+=4*AVX512_WIDTH){ // four vectors of x stay in registers across every non-zero
+        avx512_real x0 = AVX512(loadu)(x + j), x1 = AVX512(loadu)(x + j + AVX512_WIDTH);
+        avx512_real x2 = AVX512(loadu)(x + j + 2*AVX512_WIDTH), x3 = AVX512(loadu)(x + j + 3*AVX512_WIDTH);
+        for(size_t k=0; k<nonzeros; ++k){
+            avx512_real value = AVX512(set1)(values[k]);
+            nn_real *row = rows + indices[k] * n + j;
+            AVX512(storeu)(row, AVX512(fmadd)(value, x0, AVX512(loadu)(row)));
+            AVX512(storeu)(row + AVX512_WIDTH, AVX512(fmadd)(value, x1, AVX512(loadu)(row + AVX512_WIDTH)));
+            AVX512(storeu)(row + 2*AVX512_WIDTH, AVX512(fmadd)(value, x2, AVX512(loadu)(row + 2*AVX512_WIDTH)));
+            AVX512(storeu)(row + 3*AVX512_WIDTH, AVX512(fmadd)(value, x3, AVX512(loadu)(row + 3*AVX512_WIDTH)));
+        }
+    }
+    for(; j<n; j+=AVX512_WIDTH){
+        avx512_mask mask = avx512_tail_mask(n - j);
+        avx512_real x0 = AVX512(maskz_loadu)(mask, x + j);
+        for(size_t k=0; k<nonzeros; ++k){
+            nn_real *row = rows + indices[k] * n + j;
+            AVX512(mask_storeu)(row, mask, AVX512(fmadd)(AVX512(set1)(values[k]), x0, AVX512(maskz_loadu)(mask, row)));
+        }
+    }
+}
+
+
+__attribute__((target("avx512f")))
+static inline void philox_mulhilo_avx512(__m512i c, __m512i m, __m512i *hi, __m512i *lo){
+    __m512i even = _mm512_mul_epu32(c, m), odd = _mm512_mul_epu32(_mm512_srli_epi64(c, 32), m);
+    *lo = _mm512_mask_blend_epi32(0xAAAA, even, _mm512_slli_epi64(odd, 32));
+    *hi = _mm512_mask_blend_epi32(0xAAAA, _mm512_srli_epi64(even, 32), odd);
+}
+
+
+__attribute__((target("avx512f,avx2")))
+static void philox_blocks_avx512(size_t blocks, uint64_t key, uint64_t stream, uint64_t first_block, uint32_t *out){
+    const __m512i m0 = _mm512_set1_epi32((int)PHILOX_M0), m1 = _mm512_set1_epi32((int)PHILOX_M1);
+    const __m512i w0 = _mm512_set1_epi32((int)PHILOX_W0), w1 = _mm512_set1_epi32((int)PHILOX_W1);
+    size_t b = 0;
+    for(; b+16<=blocks; b+=16){
+        uint32_t low[16], high[16];
+        philox_counters(first_block + b, 16, low, high);
+        __m512i c0 = _mm512_loadu_si512(low), c1 = _mm512_loadu_si512(high);
+        __m512i c2 = _mm512_set1_epi32((int)(uint32_t)stream), c3 = _mm512_set1_epi32((int)(uint32_t)(stream >> 32));
+        __m512i k0 = _mm512_set1_epi32((int)(uint32_t)key), k1 = _mm512_set1_epi32((int)(uint32_t)(key >> 32));
+        for(int round=0; round<PHILOX_ROUNDS; ++round){
+            __m512i hi0, lo0, hi1, lo1;
+            philox_mulhilo_avx512(c0, m0, &hi0, &lo0);
+            philox_mulhilo_avx512(c2, m1, &hi1, &lo1);
+            c0 = _mm512_xor_si512(_mm512_xor_si512(hi1, c1), k0);
+            c1 = lo1;
+            c2 = _mm512_xor_si512(_mm512_xor_si512(hi0, c3), k1);
+            c3 = lo0;
+            k0 = _mm512_add_epi32(k0, w0);
+            k1 = _mm512_add_epi32(k1, w1);
+        }
+        // transposed within 128 bit lanes, u0 then holds blocks b, b+4, b+8 and b+12, the lanes are put in order after
+        __m512i t0 = _mm512_unpacklo_epi32(c0, c1), t1 = _mm512_unpackhi_epi32(c0, c1);
+        __m512i t2 = _mm512_unpacklo_epi32(c2, c3), t3 = _mm512_unpackhi_epi32(c2, c3);
+        __m512i u0 = _mm512_unpacklo_epi64(t0, t2), u1 = _mm512_unpackhi_epi64(t0, t2);
+        __m512i u2 = _mm512_unpacklo_epi64(t1, t3), u3 = _mm512_unpackhi_epi64(t1, t3);
+        __m512i v0 = _mm512_shuffle_i32x4(u0, u1, _MM_SHUFFLE(1, 0, 1, 0)), v1 = _mm512_shuffle_i32x4(u2, u3, _MM_SHUFFLE(1, 0, 1, 0));
+        __m512i v2 = _mm512_shuffle_i32x4(u0, u1, _MM_SHUFFLE(3, 2, 3, 2)), v3 = _mm512_shuffle_i32x4(u2, u3, _MM_SHUFFLE(3, 2, 3, 2));
+        uint32_t *destination = out + 4*b;
+        _mm512_storeu_si512(destination, _mm512_shuffle_i32x4(v0, v1, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm512_storeu_si512(destination + 16, _mm512_shuffle_i32x4(v0, v1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm512_storeu_si512(destination + 32, _mm512_shuffle_i32x4(v2, v3, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm512_storeu_si512(destination + 48, _mm512_shuffle_i32x4(v2, v3, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    philox_blocks_avx2(blocks - b, key, stream, first_block + b, out + 4*b);
+}
+
+
+static const simd_kernels avx512_kernels = {
+    "avx512", dot_avx512, axpy_avx512, relu_avx512, relu_derivative_mul_avx512, gemm_tile_avx512, dot_u8s8_avx2,
+    sgd_update_avx512, momentum_update_avx512, adam_update_avx512, exp_avx512, sigmoid_avx512, tanh_avx512,
+    compact_nonzeros_avx512, sparse_rows_sum_avx512, sparse_rows_axpy_avx512, philox_blocks_avx512
+};
+
+
+/* AVX-512 VNNI, vpdpbusd multiplies and accumulates unsigned by signed bytes straight into int32 */
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t dot_u8s8_avx512vnni(size_t n, const uint8_t *a, const int8_t *w){
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    for(; i+64<=n; i+=64)
+        sum = _mm512_dpbusd_epi32(sum, _mm512_loadu_si512(a + i), _mm512_loadu_si512(w + i));
+    int32_t total = _mm512_reduce_add_epi32(sum);
+    for(; i<n; ++i) total += (int32_t)a[i] * w[i];
+    return total;
+}
+
+
+static const simd_kernels avx512vnni_kernels = {
+    "avx512vnni", dot_avx512, axpy_avx512, relu_avx512, relu_derivative_mul_avx512, gemm_tile_avx512, dot_u8s8_avx512vnni,
+    sgd_update_avx512, momentum_update_avx512, adam_update_avx512, exp_avx512, sigmoid_avx512, tanh_avx512,
+    compact_nonzeros_avx512, sparse_rows_sum_avx512, sparse_rows_axpy_avx512, philox_blocks_avx512
+};
+
+#endif
+
+
+const simd_kernels *simd = &scalar_kernels;
+
+
+const simd_kernels *simd_kernels_for(const char *name){
+    if(strcmp(name, "scalar") == 0) return &scalar_kernels;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if(strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) return &sse2_kernels;
+    if(strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &avx2_kernels;
+    int avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if(strcmp(name, "avx512") == 0 && avx512) return &avx512_kernels;
+    if(strcmp(name, "avx512vnni") == 0 && avx512 && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni"))
+        return &avx512vnni_kernels;
+#endif
+    return NULL;
+}
+
+
+/* Picks the widest kernels the CPU supports before main runs, so the hot path only pays an indirect call */
+__attribute__((constructor))
+static void select_simd_kernels(void){
+    static const char *levels[] = {"scalar", "sse2", "avx2", "avx512", "avx512vnni"};
+    const char *cap = getenv("NN_SIMD");
+
+    for(size_t level=0; level<sizeof(levels)/sizeof(levels[0]); ++level){
+        const simd_kernels *kernels = simd_kernels_for(levels[level]);
+        if(kernels != NULL) simd = kernels;
+        if(cap != NULL && strcmp(cap, levels[level]) == 0) break;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef DIGITS_NN_C_SIMD_H
+#define DIGITS_NN_C_SIMD_H
+
+#include "utils.h"
+#include "gemm.h"
+
+
+/* Coefficients of one fused optimizer step, every update first forms g = gradient_scale * gradient + l2 * parameter
+ * and finishes with parameter = decay * parameter - learning_rate * direction (see optimizer.c) */
+typedef struct {
+    nn_real gradient_scale;
+    nn_real l2;              // coupled weight decay
+    nn_real decay;           // decoupled weight decay, 1 - learning_rate * weight_decay
+    nn_real learning_rate;
+    nn_real beta1;           // velocity or first moment decay
+    nn_real beta2;           // second moment decay
+    nn_real epsilon;
+    nn_real gradient_weight; // momentum direction = gradient_weight * g + moment_weight * velocity
+    nn_real moment_weight;
+} optimizer_coefficients;
+
+
+/* Dense kernels implemented once per instruction set, the widest one supported by the running CPU is picked at startup */
+typedef struct {
+    const char *name;
+    nn_real (*dot)(size_t n, const nn_real *x, const nn_real *y);                // returns sum of x[i] * y[i]
+    void (*axpy)(size_t n, nn_real alpha, const nn_real *x, nn_real *y);          // y[i] += alpha * x[i]
+    void (*relu)(size_t n, const nn_real *x, nn_real *y);                        // y[i] = max(x[i], 0), y may alias x
+    void (*relu_derivative_mul)(size_t n, const nn_real *outputs, nn_real *y);   // y[i] *= outputs[i] > 0
+    /* tile[i][j] = sum over p of packed_a[p * GEMM_MR + i] * packed_b[p * GEMM_NR + j] */
+    void (*gemm_tile)(size_t kc, const nn_real *packed_a, const nn_real *packed_b, nn_real tile[GEMM_MR][GEMM_NR]);
+    /* returns sum of a[i] * w[i] in int32, a must not exceed QUANTIZED_ACTIVATION_MAX so no kernel saturates */
+    int32_t (*dot_u8s8)(size_t n, const uint8_t *a, const int8_t *w);
+    /* direction = g */
+    void (*sgd_update)(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *parameters);
+    /* velocity = beta1 * velocity + g, direction as described by gradient_weight and moment_weight */
+    void (*momentum_update)(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *velocity, nn_real *parameters);
+    /* m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2, direction = m / (sqrt(v) + epsilon) */
+    void (*adam_update)(size_t n, const optimizer_coefficients *c, const nn_real *gradients, nn_real *m, nn_real *v, nn_real *parameters);
+    /* y[i] = exp(x[i]), 1 / (1 + exp(-x[i])) and tanh(x[i]), polynomial approximations past the scalar level (see
+     * simd.c for their error bounds), y may alias x */
+    void (*exp_approx)(size_t n, const nn_real *x, nn_real *y);
+    void (*sigmoid_approx)(size_t n, const nn_real *x, nn_real *y);
+    void (*tanh_approx)(size_t n, const nn_real *x, nn_real *y);
+    /* stores the non-zero x[i] and their i in values and indices, returns how many there are. Both need room for
+     * n + SPARSE_COMPACTION_SLACK elements, as the slots past the last kept one may be overwritten */
+    size_t (*compact_nonzeros)(size_t n, const nn_real *x, nn_real *values, uint32_t *indices);
+    /* y[j] = sum over k of values[k] * rows[indices[k] * n + j], for j < n */
+    void (*sparse_rows_sum)(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *rows, size_t n, nn_real *y);
+    /* rows[indices[k] * n + j] += values[k] * x[j], for j < n, the indices must be distinct */
+    void (*sparse_rows_axpy)(size_t nonzeros, const nn_real *values, const uint32_t *indices, const nn_real *x, size_t n, nn_real *rows);
+    /* out[4 * b] to out[4 * b + 3] = Philox4x32-10 of the counter (first_block + b, stream) under key, for b < blocks.
+     * Bit-identical at every level, so the random streams of rng.h don't depend on the CPU */
+    void (*philox_blocks)(size_t blocks, uint64_t key, uint64_t stream, uint64_t first_block, uint32_t *out);
+} simd_kernels;
+
+
+/* Elements compact_nonzeros may write past the ones it keeps, one AVX-512 vector of float */
+#define SPARSE_COMPACTION_SLACK 16
+
+
+/* Largest quantized activation, 7 bits keep the pairwise int16 sums of AVX2 maddubs from saturating */
+#define QUANTIZED_ACTIVATION_MAX 127
+
+
+/* Kernels selected for this CPU, setting the NN_SIMD environment variable to scalar, sse2, avx2, avx512 or avx512vnni
+ * caps the selection at that level */
+extern const simd_kernels *simd;
+
+/* Kernels of the provided level (scalar, sse2, avx2, avx512 or avx512vnni), NULL when unknown or not supported by this CPU */
+const simd_kernels *simd_kernels_for(const char *name);
+
+#endif //DIGITS_NN_C_SIMD_H
@@ -0,0 +1,87 @@
+#include "sparse.h"
+#include "simd.h"
+#include "placement.h"
+
+
+sparse_rows *create_sparse_rows(size_t max_rows, size_t columns, double max_density){
+    if(max_rows == 0) max_rows = 1;
+
+    sparse_rows *sparse = malloc(sizeof(sparse_rows));
+    if(sparse == NULL) return NULL;
+    sparse->rows = 0;
+    sparse->columns = columns;
+    sparse->max_rows = max_rows;
+    sparse->max_density = max_density;
+    sparse->capacity = (size_t)(max_density * (double)(max_rows * columns));
+    sparse->nonzeros = 0;
+    sparse->row_offsets = malloc(sizeof(size_t) * (max_rows + 1));
+    // compaction stores every element before knowing whether it is kept, so a whole row of slack follows the capacity
+    sparse->indices = large_calloc(sizeof(uint32_t) * (sparse->capacity + columns + SPARSE_COMPACTION_SLACK), BUFFER_LOCAL);
+    sparse->values = large_calloc(sizeof(nn_real) * (sparse->capacity + columns + SPARSE_COMPACTION_SLACK), BUFFER_LOCAL);
+    if(sparse->row_offsets == NULL || sparse->indices == NULL || sparse->values == NULL){
+        destroy_sparse_rows(sparse);
+        return NULL;
+    }
+    sparse->row_offsets[0] = 0;
+    return sparse;
+}
+
+
+void destroy_sparse_rows(sparse_rows *sparse){
+    if(sparse == NULL) return;
+    free(sparse->row_offsets);
+    large_free(sparse->indices);
+    large_free(sparse->values);
+    free(sparse);
+}
+
+
+int compact_rows(size_t rows, const nn_real *dense, sparse_rows *sparse){
+    sparse->rows = 0;
+    if(rows > sparse->max_rows) return 1;
+
+    // judged by the rows of this chunk, the capacity only bounds a full chunk, so limit <= capacity
+    size_t limit = (size_t)(sparse->max_density * (double)(rows * sparse->columns));
+    size_t nonzeros = 0;
+    for(size_t row=0; row<rows; ++row){
+        if(nonzeros > limit) return 1;
+        nonzeros += simd->compact_nonzeros(sparse->columns, dense + row * sparse->columns,
+                                           sparse->values + nonzeros, sparse->indices + nonzeros);
+        sparse->row_offsets[row+1] = nonzeros;
+    }
+    if(nonzeros > limit) return 1;
+
+    sparse->rows = rows;
+    sparse->nonzeros = nonzeros;
+    return 0;
+}
+
+
+void transpose_rows(size_t rows, size_t columns, const nn_real *b, size_t ldb, nn_real *t){
+    for(size_t row=0; row<rows; ++row)
+        for(size_t column=0; column<columns; ++column)
+            t[column * rows + row] = b[row * ldb + column];
+}
+
+
+void sparse_dense_gemm(const sparse_rows *a, size_t columns_num, const nn_real *bt, nn_real *c, size_t ldc){
+    for(size_t row=0; row<a->rows; ++row){
+        size_t first = a->row_offsets[row];
+        simd->sparse_rows_sum(a->row_offsets[row+1] - first, a->values + first, a->indices + first, bt, columns_num, c + row * ldc);
+    }
+}
+
+
+void sparse_outer_product(const nn_real *a, size_t lda, size_t columns_num, const sparse_rows *sparse, nn_real *c, size_t ldc, nn_real *scratch){
+    // accumulated transposed, one contiguous row per input column, and added into c once
+    memset(scratch, 0, sizeof(nn_real) * sparse->columns * columns_num);
+    for(size_t row=0; row<sparse->rows; ++row){
+        size_t first = sparse->row_offsets[row];
+        simd->sparse_rows_axpy(sparse->row_offsets[row+1] - first, sparse->values + first, sparse->indices + first,
+                               a + row * lda, columns_num, scratch);
+    }
+
+    for(size_t n=0; n<columns_num; ++n)
+        for(size_t column=0; column<sparse->columns; ++column)
+            c[n * ldc + column] += scratch[column * columns_num + n];
+}
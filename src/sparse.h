@@ -0,0 +1,53 @@
+#ifndef DIGITS_NN_C_SPARSE_H
+#define DIGITS_NN_C_SPARSE_H
+
+#include "utils.h"
+
+
+/* Highest fraction of non-zero inputs the first layer still runs sparse at, above it the packed gemm is faster */
+#define SPARSE_INPUTS_MAX_DENSITY 0.25
+
+/* Widest first layer that runs sparse, past it the transposed weights outgrow the cache the gemm blocks for */
+#define SPARSE_INPUTS_MAX_LAYER_SIZE 256
+
+
+/* Compressed sparse rows of a batch of inputs: only the non-zero elements of each row, with their column */
+typedef struct {
+    size_t rows;            // rows compacted by the last compact_rows, 0 when it gave up
+    size_t columns;
+    size_t max_rows;
+    double max_density;     // fraction of the compacted elements that may be non-zero
+    size_t capacity;        // non-zero elements the buffers hold, max_density of max_rows rows
+    size_t nonzeros;
+    size_t *row_offsets;    // rows + 1 entries, row r spans [row_offsets[r], row_offsets[r+1]) of indices and values
+    uint32_t *indices;
+    nn_real *values;
+} sparse_rows;
+
+
+/* Allocates sparse rows for up to max_rows rows of columns elements, holding up to max_density of them non-zero.
+ * Returns NULL when an allocation fails */
+sparse_rows *create_sparse_rows(size_t max_rows, size_t columns, double max_density);
+
+/* Deallocates the provided sparse rows */
+void destroy_sparse_rows(sparse_rows *sparse);
+
+/* Compacts rows x sparse->columns contiguous dense elements into sparse. Gives up, setting sparse->rows to 0 and
+ * returning non-zero, when rows exceeds max_rows or as soon as more than max_density of the elements of
+ * these rows are non-zero, so dense data costs a partial scan whatever the number of rows */
+int compact_rows(size_t rows, const nn_real *dense, sparse_rows *sparse);
+
+/* t[column][n] = b[n][column] for the rows x columns row-major b of leading dimension ldb, so that every non-zero
+ * input selects one contiguous row of t */
+void transpose_rows(size_t rows, size_t columns, const nn_real *b, size_t ldb, nn_real *t);
+
+/* c[r][n] = sum over the non-zeros of row r of value * bt[column][n], for n < columns_num and every compacted row.
+ * bt is the a->columns x columns_num transpose_rows of the dense operand, c is row-major with leading dimension ldc */
+void sparse_dense_gemm(const sparse_rows *a, size_t columns_num, const nn_real *bt, nn_real *c, size_t ldc);
+
+/* c[n][column] += sum over the rows r of a[r][n] * value, for every non-zero (column, value) of row r of sparse, that
+ * is the gradient of dense weights fed by sparse inputs. a is rows x columns_num with leading dimension lda, scratch
+ * holds sparse->columns x columns_num elements */
+void sparse_outer_product(const nn_real *a, size_t lda, size_t columns_num, const sparse_rows *sparse, nn_real *c, size_t ldc, nn_real *scratch);
+
+#endif //DIGITS_NN_C_SPARSE_H
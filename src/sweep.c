@@ -0,0 +1,500 @@
+#include "sweep.h"
+#include "loss.h"
+#include "rng.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+
+/* Names the spec and the summary use, indexed by the *_ACTIVATION and *_OPTIMIZER ids */
+static const char *const activation_names[] = {"linear", "sigmoid", "tanh", "relu"};
+static const char *const optimizer_names[] = {"sgd", "momentum", "nesterov", "adam", "adamw"};
+static const char *const metric_names[] = {"accuracy", "loss"};
+
+
+typedef struct {
+    const sweep_spec *spec;
+    const sweep_params *params;
+    size_t runs_num;
+    sweep_result *results;
+    FILE *progress;
+
+    // read-only views of the one copy of the dataset every run shares
+    mnist_images_set training_images;
+    mnist_labels_set training_labels;
+    mnist_images_set validation_images;
+    mnist_labels_set validation_labels;
+    const mnist_images_set *test_images;
+    const mnist_labels_set *test_labels;
+    uint64_t seed;
+
+    _Atomic size_t next_run;
+    _Atomic size_t runs_done;
+    _Atomic size_t workers_pinned;
+    pthread_mutex_t progress_lock;
+} sweep_pool;
+
+
+sweep_spec default_sweep_spec(void){
+    sweep_spec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.search = SWEEP_GRID;
+    spec.architectures_num = 1;
+    spec.hidden_layers_num[0] = 2;
+    spec.hidden_layers[0][0] = 16;
+    spec.hidden_layers[0][1] = 16;
+    spec.activations_num = 1;
+    spec.activations[0] = RELU_ACTIVATION;
+    spec.optimizers_num = 1;
+    spec.optimizers[0] = ADAM_OPTIMIZER;
+    spec.learning_rates_num = 1;
+    spec.learning_rates[0] = 0.001;
+    spec.batch_sizes_num = 1;
+    spec.batch_sizes[0] = 256;
+    spec.epochs = 10;
+    spec.patience = 3;
+    spec.min_delta = 0;
+    spec.metric = SWEEP_METRIC_ACCURACY;
+    spec.validation_samples = 10000;
+    spec.workers = 0;
+    return spec;
+}
+
+
+static int find_name(const char *value, const char *const *names, int names_num){
+    for(int name=0; name<names_num; ++name)
+        if(strcmp(value, names[name]) == 0) return name;
+    return -1;
+}
+
+
+/* Parses a positive integer into value, returns non-zero when the text isn't one */
+static int parse_size(const char *text, size_t *value){
+    char *end;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if(end == text || *end != '\0' || parsed == 0 || text[0] == '-') return 1;
+    *value = (size_t)parsed;
+    return 0;
+}
+
+
+int parse_sweep_count(const char *text, size_t *value){
+    if(strcmp(text, "0") == 0){
+        *value = 0;
+        return 0;
+    }
+    return parse_size(text, value);
+}
+
+
+static int parse_positive_double(const char *text, double *value){
+    char *end;
+    *value = strtod(text, &end);
+    return end == text || *end != '\0' || !(*value > 0);
+}
+
+
+/* Parses the comma separated hidden layer sizes of one architecture */
+static int parse_architecture(char *text, size_t *sizes, size_t *sizes_num){
+    *sizes_num = 0;
+    for(char *save, *size=strtok_r(text, ",", &save); size!=NULL; size=strtok_r(NULL, ",", &save)){
+        if(*sizes_num == SWEEP_MAX_HIDDEN_LAYERS || parse_size(size, &sizes[*sizes_num])) return 1;
+        ++*sizes_num;
+    }
+    return *sizes_num == 0;
+}
+
+
+/* Parses the values of one setting, already split into values_num words */
+static int parse_setting(const char *key, char **values, size_t values_num, sweep_spec *spec){
+    if(values_num == 0) return 1;
+
+    if(strcmp(key, "search") == 0){
+        if(strcmp(values[0], "grid") == 0 && values_num == 1){
+            spec->search = SWEEP_GRID;
+            return 0;
+        }
+        spec->search = SWEEP_RANDOM;
+        return strcmp(values[0], "random") != 0 || values_num != 2 || parse_size(values[1], &spec->random_runs);
+    }
+    if(values_num > SWEEP_MAX_VALUES){
+        fprintf(stderr, "At most %d values per setting\n", SWEEP_MAX_VALUES);
+        return 1;
+    }
+    if(strcmp(key, "hidden_layers") == 0){
+        spec->architectures_num = values_num;
+        for(size_t value=0; value<values_num; ++value)
+            if(parse_architecture(values[value], spec->hidden_layers[value], &spec->hidden_layers_num[value])) return 1;
+        return 0;
+    }
+    if(strcmp(key, "activation") == 0){
+        spec->activations_num = values_num;
+        for(size_t value=0; value<values_num; ++value)
+            if((spec->activations[value] = find_name(values[value], activation_names, 4)) < 0) return 1;
+        return 0;
+    }
+    if(strcmp(key, "optimizer") == 0){
+        spec->optimizers_num = values_num;
+        for(size_t value=0; value<values_num; ++value)
+            if((spec->optimizers[value] = find_name(values[value], optimizer_names, 5)) < 0) return 1;
+        return 0;
+    }
+    if(strcmp(key, "learning_rate") == 0){
+        char *separator = strchr(values[0], ':');
+        if(separator != NULL){
+            *separator = '\0';
+            spec->learning_rates_num = 0;
+            return values_num != 1 || parse_positive_double(values[0], &spec->learning_rate_min) ||
+                   parse_positive_double(separator + 1, &spec->learning_rate_max) ||
+                   spec->learning_rate_min > spec->learning_rate_max;
+        }
+        spec->learning_rates_num = values_num;
+        for(size_t value=0; value<values_num; ++value)
+            if(parse_positive_double(values[value], &spec->learning_rates[value])) return 1;
+        return 0;
+    }
+    if(strcmp(key, "batch_size") == 0){
+        spec->batch_sizes_num = values_num;
+        for(size_t value=0; value<values_num; ++value)
+            if(parse_size(values[value], &spec->batch_sizes[value])) return 1;
+        return 0;
+    }
+    if(values_num != 1) return 1;
+    if(strcmp(key, "metric") == 0) return (spec->metric = find_name(values[0], metric_names, 2)) < 0;
+    if(strcmp(key, "epochs") == 0) return parse_size(values[0], &spec->epochs);
+    if(strcmp(key, "min_delta") == 0){
+        char *end;
+        spec->min_delta = strtod(values[0], &end);
+        return end == values[0] || *end != '\0' || spec->min_delta < 0;
+    }
+
+    // settings that may be 0
+    size_t *target = strcmp(key, "patience") == 0 ? &spec->patience :
+                     strcmp(key, "validation") == 0 ? &spec->validation_samples :
+                     strcmp(key, "workers") == 0 ? &spec->workers : NULL;
+    if(target == NULL) return 1;
+    return parse_sweep_count(values[0], target);
+}
+
+
+int parse_sweep_spec(const char *filepath, sweep_spec *spec){
+    FILE *file = fopen(filepath, "r");
+    if(file == NULL){
+        fprintf(stderr, "Failed to open sweep spec %s\n", filepath);
+        return 1;
+    }
+    *spec = default_sweep_spec();
+
+    char line[4096];
+    int failed = 0;
+    for(size_t line_number=1; !failed && fgets(line, sizeof(line), file) != NULL; ++line_number){
+        line[strcspn(line, "#\n")] = '\0';
+        char original[sizeof(line)];
+        memcpy(original, line, sizeof(line));
+
+        char *words[SWEEP_MAX_VALUES + 2];
+        size_t words_num = 0;
+        for(char *save, *word=strtok_r(line, " \t\r", &save); word!=NULL; word=strtok_r(NULL, " \t\r", &save)){
+            if(words_num == SWEEP_MAX_VALUES + 2){
+                fprintf(stderr, "At most %d values per setting\n", SWEEP_MAX_VALUES);
+                failed = 1;
+                break;
+            }
+            words[words_num++] = word;
+        }
+        if(!failed && words_num > 0) failed = parse_setting(words[0], words + 1, words_num - 1, spec);
+        if(failed) fprintf(stderr, "Invalid setting on line %zu of %s: %s\n", line_number, filepath, original);
+    }
+    fclose(file);
+    if(failed) return 1;
+
+    if(spec->search == SWEEP_GRID && spec->learning_rates_num == 0){
+        fprintf(stderr, "Learning rate ranges need random search, list the grid's learning rates instead\n");
+        return 1;
+    }
+    return 0;
+}
+
+
+size_t sweep_runs_num(const sweep_spec *spec){
+    if(spec->search == SWEEP_RANDOM) return spec->random_runs;
+    return spec->architectures_num * spec->activations_num * spec->optimizers_num * spec->learning_rates_num *
+           spec->batch_sizes_num;
+}
+
+
+void expand_sweep_spec(const sweep_spec *spec, sweep_params *params){
+    size_t runs_num = sweep_runs_num(spec);
+    rng_stream rng;
+    rng_open(&rng, get_random_seed(), rng_stream_id(RNG_SWEEP, 0));
+
+    for(size_t run=0; run<runs_num; ++run){
+        // mixed radix digits of the run index for grid search, uniform draws for random search
+        size_t digits = run;
+        size_t choices[5], counts[5] = {spec->architectures_num, spec->activations_num, spec->optimizers_num,
+                                        spec->learning_rates_num, spec->batch_sizes_num};
+        for(size_t parameter=5; parameter-->0;){
+            if(spec->search == SWEEP_RANDOM){
+                choices[parameter] = rng_below(&rng, counts[parameter]);
+            } else {
+                choices[parameter] = digits % counts[parameter];
+                digits /= counts[parameter];
+            }
+        }
+
+        sweep_params *run_params = &params[run];
+        run_params->hidden_layers_num = spec->hidden_layers_num[choices[0]];
+        memcpy(run_params->hidden_layers, spec->hidden_layers[choices[0]], sizeof(run_params->hidden_layers));
+        run_params->activation = spec->activations[choices[1]];
+        run_params->optimizer = spec->optimizers[choices[2]];
+        if(spec->learning_rates_num > 0){
+            run_params->learning_rate = spec->learning_rates[choices[3]];
+        } else {
+            double log_min = log(spec->learning_rate_min), log_max = log(spec->learning_rate_max);
+            run_params->learning_rate = exp(log_min + (log_max - log_min) * (double)rng_next_uniform(&rng));
+        }
+        run_params->batch_size = spec->batch_sizes[choices[4]];
+    }
+}
+
+
+/* Returns non-zero when the candidate validation result beats the best one by more than min_delta */
+static int improves(const sweep_spec *spec, const evaluation_result *candidate, const evaluation_result *best){
+    if(spec->metric == SWEEP_METRIC_LOSS) return candidate->loss < best->loss - spec->min_delta;
+    return candidate->accuracy > best->accuracy + spec->min_delta;
+}
+
+
+static void train_run(sweep_pool *pool, size_t run){
+    const sweep_spec *spec = pool->spec;
+    const sweep_params *params = &pool->params[run];
+    sweep_result *result = &pool->results[run];
+    memset(result, 0, sizeof(sweep_result));
+    result->params = *params;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t layers[SWEEP_MAX_HIDDEN_LAYERS + 1];
+    int activations[SWEEP_MAX_HIDDEN_LAYERS + 1];
+    for(size_t layer=0; layer<params->hidden_layers_num; ++layer){
+        layers[layer] = params->hidden_layers[layer];
+        activations[layer] = params->activation;
+    }
+    layers[params->hidden_layers_num] = MNIST_CLASSES;
+    activations[params->hidden_layers_num] = SOFTMAX_ACTIVATION;
+
+    size_t input_size = (size_t)pool->training_images.number_of_rows * (size_t)pool->training_images.number_of_columns;
+    NeuralNetwork *nn = create_neural_network(input_size, params->hidden_layers_num + 1, layers, activations,
+                                              MULTI_CROSS_ENTROPY_LOSS, params->learning_rate, params->batch_size);
+    if(nn == NULL || set_network_optimizer(nn, default_optimizer_config(params->optimizer, params->learning_rate))){
+        if(nn != NULL) destroy_neural_network(nn);
+        result->failed = 1;
+        return;
+    }
+
+    size_t samples_num = (size_t)pool->training_images.number_of_images;
+    size_t *samples_order = malloc(sizeof(size_t) * samples_num);
+    nn_real *inputs = large_calloc(sizeof(nn_real) * params->batch_size * input_size, BUFFER_LOCAL);
+    nn_real *expected_outputs = malloc(sizeof(nn_real) * params->batch_size * MNIST_CLASSES);
+    nn_real *best_parameters = large_calloc(sizeof(nn_real) * nn->parameters_num, BUFFER_LOCAL);
+    size_t epochs_since_best = 0;
+
+    for(size_t epoch=0; epoch<spec->epochs; ++epoch){
+        rng_stream rng;
+        rng_open(&rng, pool->seed, rng_stream_id(RNG_SHUFFLE, epoch));
+        rng_permutation(&rng, samples_num, samples_order);
+        for(size_t first=0; first<samples_num; first+=params->batch_size){
+            size_t count = samples_num - first < params->batch_size ? samples_num - first : params->batch_size;
+            gather_mnist_batch(&pool->training_images, &pool->training_labels, samples_order + first, count, inputs,
+                               expected_outputs);
+            backprop_batch(nn, inputs, expected_outputs, count);
+        }
+        ++result->epochs_run;
+
+        evaluation_result validation;
+        evaluate(nn, &pool->validation_images, &pool->validation_labels, 1, &validation);
+        if(result->best_epoch == 0 || improves(spec, &validation, &result->validation)){
+            result->validation = validation;
+            result->best_epoch = epoch + 1;
+            memcpy(best_parameters, nn->parameters, sizeof(nn_real) * nn->parameters_num);
+            epochs_since_best = 0;
+        } else {
+            ++epochs_since_best;
+        }
+
+        // a diverged run never recovers, stop it along with the ones out of patience
+        if(!isfinite(validation.loss) || (spec->patience > 0 && epochs_since_best >= spec->patience)){
+            result->stopped_early = epoch + 1 < spec->epochs;
+            break;
+        }
+    }
+
+    memcpy(nn->parameters, best_parameters, sizeof(nn_real) * nn->parameters_num);
+    parameters_changed(nn);
+    evaluate(nn, pool->test_images, pool->test_labels, 1, &result->test);
+
+    large_free(best_parameters);
+    free(expected_outputs);
+    large_free(inputs);
+    free(samples_order);
+    destroy_neural_network(nn);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+
+/* Writes the hidden layer sizes of a run as a comma separated list */
+static void format_architecture(const sweep_params *params, char *buffer, size_t size){
+    size_t length = 0;
+    buffer[0] = '\0';
+    for(size_t layer=0; layer<params->hidden_layers_num && length<size; ++layer)
+        length += (size_t)snprintf(buffer + length, size - length, layer ? ",%zu" : "%zu", params->hidden_layers[layer]);
+}
+
+
+static void *sweep_worker(void *argument){
+    sweep_pool *pool = argument;
+    pin_thread(atomic_fetch_add(&pool->workers_pinned, 1));
+
+    for(size_t run=atomic_fetch_add(&pool->next_run, 1); run<pool->runs_num; run=atomic_fetch_add(&pool->next_run, 1)){
+        train_run(pool, run);
+        size_t done = atomic_fetch_add(&pool->runs_done, 1) + 1;
+        if(pool->progress == NULL) continue;
+
+        const sweep_result *result = &pool->results[run];
+        char architecture[128];
+        format_architecture(&result->params, architecture, sizeof(architecture));
+        pthread_mutex_lock(&pool->progress_lock);
+        if(result->failed){
+            fprintf(pool->progress, "[%zu/%zu] run %zu failed to create its network\n", done, pool->runs_num, run);
+        } else {
+            fprintf(pool->progress, "[%zu/%zu] run %zu (%s %s %s lr %g batch %zu): validation accuracy %.2f%% at epoch "
+                                    "%zu of %zu%s, %.1fs\n", done, pool->runs_num, run, architecture,
+                    activation_names[result->params.activation], optimizer_names[result->params.optimizer],
+                    result->params.learning_rate, result->params.batch_size, 100.0 * result->validation.accuracy,
+                    result->best_epoch, result->epochs_run, result->stopped_early ? ", stopped early" : "",
+                    result->seconds);
+        }
+        fflush(pool->progress);
+        pthread_mutex_unlock(&pool->progress_lock);
+    }
+    return NULL;
+}
+
+
+int run_sweep(const sweep_spec *spec, const mnist_handwritten_digits_data *data, const sweep_params *params,
+              size_t runs_num, sweep_result *results, FILE *progress){
+    size_t training_num = (size_t)data->training_images.number_of_images;
+    if(training_num != (size_t)data->training_labels.number_of_items ||
+       data->test_images.number_of_images != data->test_labels.number_of_items){
+        fprintf(stderr, "Sweep sets hold different numbers of images and labels\n");
+        return 1;
+    }
+    if(spec->validation_samples >= training_num){
+        fprintf(stderr, "Can't hold %zu validation samples out of %zu training samples\n", spec->validation_samples, training_num);
+        return 1;
+    }
+
+    sweep_pool *pool = calloc(1, sizeof(sweep_pool));
+    pool->spec = spec;
+    pool->params = params;
+    pool->runs_num = runs_num;
+    pool->results = results;
+    pool->progress = progress;
+    pool->seed = get_random_seed();
+    pool->test_images = &data->test_images;
+    pool->test_labels = &data->test_labels;
+
+    // the validation samples are the tail of the training set, both views point into the same mapping
+    size_t image_size = (size_t)data->training_images.number_of_rows * (size_t)data->training_images.number_of_columns;
+    size_t validation_num = spec->validation_samples;
+    pool->training_images = data->training_images;
+    pool->training_labels = data->training_labels;
+    pool->training_images.number_of_images = (int32_t)(training_num - validation_num);
+    pool->training_labels.number_of_items = (int32_t)(training_num - validation_num);
+    if(validation_num == 0){
+        pool->validation_images = data->test_images;
+        pool->validation_labels = data->test_labels;
+    } else {
+        pool->validation_images = data->training_images;
+        pool->validation_labels = data->training_labels;
+        pool->validation_images.pixels += (training_num - validation_num) * image_size;
+        pool->validation_images.number_of_images = (int32_t)validation_num;
+        pool->validation_labels.labels += training_num - validation_num;
+        pool->validation_labels.number_of_items = (int32_t)validation_num;
+    }
+    atomic_init(&pool->next_run, 0);
+    atomic_init(&pool->runs_done, 0);
+    atomic_init(&pool->workers_pinned, 0);
+    pthread_mutex_init(&pool->progress_lock, NULL);
+
+    size_t workers_num = spec->workers;
+    if(workers_num == 0){
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers_num = online_cpus > 0 ? (size_t)online_cpus : 1;
+    }
+    if(workers_num > runs_num) workers_num = runs_num;
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * workers_num);
+    size_t started = 0;
+    for(; started<workers_num; ++started){
+        if(pthread_create(&workers[started], NULL, sweep_worker, pool) != 0){
+            fprintf(stderr, "Failed to create sweep worker %zu, continuing with %zu\n", started, started);
+            break;
+        }
+    }
+    // with no worker at all the calling thread trains every run
+    if(started == 0) sweep_worker(pool);
+    for(size_t worker=0; worker<started; ++worker) pthread_join(workers[worker], NULL);
+
+    free(workers);
+    pthread_mutex_destroy(&pool->progress_lock);
+    free(pool);
+    return 0;
+}
+
+
+/* Returns non-zero when result ranks before other: failed runs last, then by validation metric, equal accuracies by
+ * validation loss */
+static int ranks_before(const sweep_spec *spec, const sweep_result *result, const sweep_result *other){
+    if(result->failed || other->failed) return other->failed && !result->failed;
+    if(spec->metric == SWEEP_METRIC_ACCURACY && result->validation.accuracy != other->validation.accuracy)
+        return result->validation.accuracy > other->validation.accuracy;
+    return result->validation.loss < other->validation.loss;
+}
+
+
+void print_sweep_summary(FILE *file, const sweep_spec *spec, const sweep_result *results, size_t runs_num){
+    const sweep_result **ranked = malloc(sizeof(sweep_result*) * runs_num);
+    // insertion sort keeps runs of equal metrics in run order
+    for(size_t run=0; run<runs_num; ++run) ranked[run] = &results[run];
+    for(size_t run=1; run<runs_num; ++run){
+        const sweep_result *result = ranked[run];
+        size_t slot = run;
+        for(; slot>0 && ranks_before(spec, result, ranked[slot-1]); --slot) ranked[slot] = ranked[slot-1];
+        ranked[slot] = result;
+    }
+
+    fprintf(file, "%4s  %4s  %-16s %-8s %-9s %10s %6s %8s %10s %9s %10s %9s %8s\n", "rank", "run", "hidden layers",
+            "act", "optimizer", "lr", "batch", "epochs", "val acc", "val loss", "test acc", "test loss", "seconds");
+    for(size_t rank=0; rank<runs_num; ++rank){
+        const sweep_result *result = ranked[rank];
+        char architecture[128], epochs[32];
+        format_architecture(&result->params, architecture, sizeof(architecture));
+        if(result->failed){
+            fprintf(file, "%4zu  %4zu  %-16s %-8s %-9s %10.3g %6zu  failed\n", rank + 1, (size_t)(result - results),
+                    architecture, activation_names[result->params.activation], optimizer_names[result->params.optimizer],
+                    result->params.learning_rate, result->params.batch_size);
+            continue;
+        }
+        snprintf(epochs, sizeof(epochs), "%zu/%zu%s", result->best_epoch, result->epochs_run, result->stopped_early ? "*" : "");
+        fprintf(file, "%4zu  %4zu  %-16s %-8s %-9s %10.3g %6zu %8s %9.2f%% %9.4f %9.2f%% %9.4f %8.1f\n", rank + 1,
+                (size_t)(result - results), architecture, activation_names[result->params.activation],
+                optimizer_names[result->params.optimizer], result->params.learning_rate, result->params.batch_size,
+                epochs, 100.0 * result->validation.accuracy, result->validation.loss, 100.0 * result->test.accuracy,
+                result->test.loss, result->seconds);
+    }
+    fprintf(file, "Ranked by validation %s, epochs are best/run and * marks runs stopped early\n", metric_names[spec->metric]);
+    free(ranked);
+}
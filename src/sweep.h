@@ -0,0 +1,110 @@
+#ifndef DIGITS_NN_C_SWEEP_H
+#define DIGITS_NN_C_SWEEP_H
+
+#include "nn_core.h"
+#include "data.h"
+#include "evaluation.h"
+
+
+/* Values a spec may list per hyperparameter, and hidden layers per architecture */
+#define SWEEP_MAX_VALUES 16
+#define SWEEP_MAX_HIDDEN_LAYERS 8
+
+#define SWEEP_GRID 0            // every combination of the listed values
+#define SWEEP_RANDOM 1          // random_runs combinations drawn from them, learning rate ranges log-uniformly
+
+#define SWEEP_METRIC_ACCURACY 0 // validation metric early termination and the ranking go by
+#define SWEEP_METRIC_LOSS 1
+
+
+/* Hyperparameters of one run. The hidden layers share an activation, the output layer is always a softmax over the
+ * MNIST classes trained with cross-entropy */
+typedef struct {
+    size_t hidden_layers_num;
+    size_t hidden_layers[SWEEP_MAX_HIDDEN_LAYERS];
+    int activation;         // one of the *_ACTIVATION ids, softmax excluded
+    int optimizer;          // one of the *_OPTIMIZER ids, with default_optimizer_config's other hyperparameters
+    double learning_rate;
+    size_t batch_size;
+} sweep_params;
+
+
+/* Search space and the settings shared by every run, see parse_sweep_spec for its text form */
+typedef struct {
+    int search;                     // SWEEP_GRID or SWEEP_RANDOM
+    size_t random_runs;
+
+    size_t architectures_num;
+    size_t hidden_layers_num[SWEEP_MAX_VALUES];
+    size_t hidden_layers[SWEEP_MAX_VALUES][SWEEP_MAX_HIDDEN_LAYERS];
+    size_t activations_num;
+    int activations[SWEEP_MAX_VALUES];
+    size_t optimizers_num;
+    int optimizers[SWEEP_MAX_VALUES];
+    size_t learning_rates_num;      // 0 when the learning rate is the range below
+    double learning_rates[SWEEP_MAX_VALUES];
+    double learning_rate_min;
+    double learning_rate_max;
+    size_t batch_sizes_num;
+    size_t batch_sizes[SWEEP_MAX_VALUES];
+
+    size_t epochs;                  // at most, per run
+    size_t patience;                // epochs without improvement a run is stopped after, 0 never stops one early
+    double min_delta;               // smallest change of the metric that counts as an improvement
+    int metric;                     // SWEEP_METRIC_ACCURACY or SWEEP_METRIC_LOSS
+    size_t validation_samples;      // held out from the end of the training set, 0 validates on the test set
+    size_t workers;                 // runs trained at once, 0 uses one per online CPU
+} sweep_spec;
+
+
+typedef struct {
+    sweep_params params;
+    int failed;                     // the network could not be created, nothing below is set
+    int stopped_early;              // patience ran out, or the loss stopped being finite
+    size_t epochs_run;
+    size_t best_epoch;              // 1-based epoch of the best validation metric
+    evaluation_result validation;   // at the best epoch
+    evaluation_result test;         // of the parameters of the best epoch
+    double seconds;
+} sweep_result;
+
+
+/* Defaults of every setting: one 16,16 relu architecture trained by adam at learning rate 0.001 with batches of 256,
+ * grid search, 10 epochs, patience 3, accuracy metric and 10000 validation samples */
+sweep_spec default_sweep_spec(void);
+
+/* Reads a spec from a text file of one setting per line, '#' starting a comment:
+ *   search grid | random <runs>
+ *   hidden_layers <sizes>...    every architecture is a comma separated list of hidden layer sizes
+ *   activation <relu|sigmoid|tanh|linear>...
+ *   optimizer <sgd|momentum|nesterov|adam|adamw>...
+ *   learning_rate <value>... | <min>:<max>    the range is sampled log-uniformly by random search only
+ *   batch_size <size>...
+ *   epochs, patience, min_delta, validation, workers <value>
+ *   metric <accuracy|loss>
+ * Settings left out keep their default. Returns non-zero, after printing the offending line, on failure */
+int parse_sweep_spec(const char *filepath, sweep_spec *spec);
+
+/* Parses a non-negative integer the way the spec reads its patience, validation and workers settings, for the command
+ * line to override them. Returns non-zero when the text isn't one */
+int parse_sweep_count(const char *text, size_t *value);
+
+/* Number of runs the provided spec expands to */
+size_t sweep_runs_num(const sweep_spec *spec);
+
+/* Expands the spec into sweep_runs_num parameter sets, random search draws them from the random seed (see rng.h) */
+void expand_sweep_spec(const sweep_spec *spec, sweep_params *params);
+
+/* Trains one network per parameter set on a pool of spec->workers threads, each run single threaded on its own
+ * thread. Every run reads the same sets, which are never copied or written, and draws the same initialization for
+ * the same layer sizes and the same sample order every epoch, so runs only differ by their hyperparameters. After
+ * every epoch a run is evaluated on the validation samples and stopped once the metric hasn't improved for
+ * spec->patience epochs, the parameters of its best epoch are then evaluated on the test set. A line is printed to
+ * progress, when not NULL, as every run ends. Returns non-zero when the sets don't hold enough samples */
+int run_sweep(const sweep_spec *spec, const mnist_handwritten_digits_data *data, const sweep_params *params,
+              size_t runs_num, sweep_result *results, FILE *progress);
+
+/* Prints the hyperparameters, epochs and validation and test metrics of every run, best validation metric first */
+void print_sweep_summary(FILE *file, const sweep_spec *spec, const sweep_result *results, size_t runs_num);
+
+#endif //DIGITS_NN_C_SWEEP_H
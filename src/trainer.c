@@ -0,0 +1,128 @@
+#include "trainer.h"
+#include "simd.h"
+
+
+typedef struct {
+    nn_trainer *trainer;
+    size_t index;
+} trainer_worker;
+
+
+/* Adds the gradients of the workers in pairs, doubling the distance each level, so worker 0 holds the total after
+ * ceil(log2(threads_num)) levels and no level touches the same buffer twice */
+static void reduce_gradients(nn_trainer *trainer, size_t index){
+    for(size_t stride=1; stride<trainer->threads_num; stride*=2){
+        pthread_barrier_wait(&trainer->reduce_barrier);
+        if(index % (2 * stride) == 0 && index + stride < trainer->threads_num){
+            simd->axpy(trainer->nn->parameters_num, 1, trainer->workspaces[index + stride]->gradients,
+                       trainer->workspaces[index]->gradients);
+            trainer->losses[index] += trainer->losses[index + stride];
+        }
+    }
+}
+
+
+static void *trainer_worker_loop(void *argument){
+    trainer_worker *worker = argument;
+    nn_trainer *trainer = worker->trainer;
+    const NeuralNetwork *nn = trainer->nn;
+    size_t output_size = nn->dense_layers[nn->dense_layers_num-1].size;
+
+    // allocated by the worker once pinned, so its buffers land on the worker's node. create_trainer waits on the
+    // first round barrier for every workspace before checking them
+    pin_thread(worker->index);
+    trainer->workspaces[worker->index] = create_workspace(nn, nn->workspace->max_batch_size);
+    pthread_barrier_wait(&trainer->round_barrier);
+
+    while(1){
+        pthread_barrier_wait(&trainer->round_barrier);
+        if(trainer->stop) break;
+
+        size_t shard_size = (trainer->batch_size + trainer->threads_num - 1) / trainer->threads_num;
+        size_t first = worker->index * shard_size;
+        if(first > trainer->batch_size) first = trainer->batch_size;
+        size_t samples = trainer->batch_size - first < shard_size ? trainer->batch_size - first : shard_size;
+
+        trainer->losses[worker->index] = compute_gradients(nn,
+                                                           trainer->inputs + first * nn->input_layer_size,
+                                                           trainer->expected_outputs + first * output_size,
+                                                           samples, trainer->workspaces[worker->index]);
+        reduce_gradients(trainer, worker->index);
+
+        pthread_barrier_wait(&trainer->round_barrier);
+    }
+
+    free(worker);
+    return NULL;
+}
+
+
+nn_trainer *create_trainer(NeuralNetwork *nn, size_t threads_num){
+    if(threads_num == 0){
+        long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_num = online_cpus > 0 ? (size_t)online_cpus : 1;
+    }
+
+    nn_trainer *trainer = malloc(sizeof(nn_trainer));
+    trainer->nn = nn;
+    trainer->threads_num = threads_num;
+    trainer->stop = 0;
+    trainer->threads = malloc(sizeof(pthread_t) * threads_num);
+    trainer->workspaces = malloc(sizeof(nn_workspace*) * threads_num);
+    trainer->losses = calloc(threads_num, sizeof(double));
+    pthread_barrier_init(&trainer->round_barrier, NULL, threads_num + 1);
+    pthread_barrier_init(&trainer->reduce_barrier, NULL, threads_num);
+
+    for(size_t thread=0; thread<threads_num; ++thread){
+        trainer_worker *worker = malloc(sizeof(trainer_worker));
+        worker->trainer = trainer;
+        worker->index = thread;
+        if(pthread_create(&trainer->threads[thread], NULL, trainer_worker_loop, worker) != 0){
+            fprintf(stderr, "Failed to create trainer worker thread %zu\n", thread);
+            exit(1);
+        }
+    }
+
+    pthread_barrier_wait(&trainer->round_barrier); // every worker allocated its workspace, or failed to
+    for(size_t thread=0; thread<threads_num; ++thread){
+        if(trainer->workspaces[thread] == NULL){
+            fprintf(stderr, "Failed to allocate the workspace of trainer worker %zu\n", thread);
+            destroy_trainer(trainer);
+            return NULL;
+        }
+    }
+    return trainer;
+}
+
+
+void destroy_trainer(nn_trainer *trainer){
+    if(trainer == NULL) return;
+
+    trainer->stop = 1;
+    pthread_barrier_wait(&trainer->round_barrier);
+    for(size_t thread=0; thread<trainer->threads_num; ++thread){
+        pthread_join(trainer->threads[thread], NULL);
+        destroy_workspace(trainer->workspaces[thread]);
+    }
+
+    pthread_barrier_destroy(&trainer->round_barrier);
+    pthread_barrier_destroy(&trainer->reduce_barrier);
+    free(trainer->threads);
+    free(trainer->workspaces);
+    free(trainer->losses);
+    free(trainer);
+}
+
+
+double trainer_backprop_batch(nn_trainer *trainer, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size){
+    trainer->inputs = inputs;
+    trainer->expected_outputs = expected_outputs;
+    trainer->batch_size = batch_size;
+
+    pthread_barrier_wait(&trainer->round_barrier); // start the workers
+    pthread_barrier_wait(&trainer->round_barrier); // wait for the reduced gradients
+
+    apply_gradients(trainer->nn, trainer->workspaces[0]->gradients, batch_size);
+
+    return trainer->losses[0] / (double)batch_size;
+}
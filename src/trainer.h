@@ -0,0 +1,38 @@
+#ifndef DIGITS_NN_C_TRAINER_H
+#define DIGITS_NN_C_TRAINER_H
+
+#include "nn_core.h"
+#include <pthread.h>
+
+
+/* Data-parallel trainer: every mini-batch is split into one contiguous shard per worker thread, each worker computes the
+ * gradients of its shard into its own workspace, the gradients are summed by a pairwise tree reduction and applied once */
+typedef struct {
+    NeuralNetwork *nn;
+    size_t threads_num;
+    pthread_t *threads;
+    nn_workspace **workspaces;   // one per worker, workspaces[0] ends up holding the reduced gradients
+    double *losses;               // summed loss of each worker's shard
+    pthread_barrier_t round_barrier;   // workers and the caller, marks the start and the end of a batch
+    pthread_barrier_t reduce_barrier;  // workers only, separates the levels of the gradient reduction
+
+    // batch being processed, written by the caller before the start of a round
+    const nn_real *inputs;
+    const nn_real *expected_outputs;
+    size_t batch_size;
+    int stop;
+} nn_trainer;
+
+
+/* Creates a trainer for the provided network backed by threads_num worker threads, 0 uses one per online CPU.
+ * Returns NULL when a worker's workspace can't be allocated */
+nn_trainer *create_trainer(NeuralNetwork *nn, size_t threads_num);
+
+/* Stops the worker threads and deallocates the provided trainer, the network is left untouched */
+void destroy_trainer(nn_trainer *trainer);
+
+/* Parallel counterpart of backprop_batch: trains the network on batch_size contiguous inputs and expected outputs with
+ * a single averaged update and returns the mean loss of the batch */
+double trainer_backprop_batch(nn_trainer *trainer, const nn_real *inputs, const nn_real *expected_outputs, size_t batch_size);
+
+#endif //DIGITS_NN_C_TRAINER_H
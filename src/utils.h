@@ -8,91 +8,52 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
-#include <math.h>
+#include <tgmath.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
 
-static inline void free_double_array(double **array, int count) {
-    if (array != NULL) {
-        for (int i = 0; i < count; ++i) {
-            free(array[i]);
-        }
-        free(array);
-    }
-}
+/* Floating point type of weights, activations, gradients and datasets, float when built with NN_SINGLE_PRECISION
+ * Math calls go through tgmath.h so they resolve to the matching precision */
+#if NN_SINGLE_PRECISION
+typedef float nn_real;
+#else
+typedef double nn_real;
+#endif
 
 
-static inline void free_uint8_array(uint8_t **array, int count) {
-    if (array != NULL) {
-        for (int i = 0; i < count; ++i) {
-            free(array[i]);
-        }
-        free(array);
-    }
+/* Rounds value up to the next multiple of alignment (alignment must be a power of two) */
+static inline size_t align_up(size_t value, size_t alignment){
+    return (value + alignment - 1) & ~(alignment - 1);
 }
 
 
-static inline double **convert_uint8_to_double(uint8_t **data, int data_size, int subdata_size){
-    double **double_data = malloc(data_size * sizeof(double*));
-    for (int i = 0; i < data_size; ++i) {
-        double_data[i] = malloc(subdata_size * sizeof(double));
-    }
-
-    for(int i=0; i<data_size; ++i){
-        for(int j = 0; j<subdata_size; ++j){
-            double_data[i][j] = (double) data[i][j];
-            //fprintf(stdout, "uint8: %d - double: %f\n", data[i][j], double_data[i][j]);
-        }
-    }
-
-    return double_data;
+/* Allocates a zeroed block whose address is a multiple of alignment, release it with free() */
+static inline void *aligned_calloc(size_t alignment, size_t size){
+    void *block = NULL;
+    if(posix_memalign(&block, alignment, align_up(size, alignment)) != 0) return NULL;
+    memset(block, 0, align_up(size, alignment));
+    return block;
 }
 
 
-static inline void normalize_double_data(double **data, int data_size, int subdata_size){
-    if (data == NULL || data_size == 0 || subdata_size == 0) {
-        return;
-    }
-
-    double max_value = 0;
-    for (int i = 0; i < data_size; ++i) {
-        for (int j = 0; j < subdata_size; ++j) {
-            if (data[i][j] > max_value) {
-                max_value = data[i][j];
-            }
-        }
-    }
-
-    if (max_value == 0) {
-        return;
-    }
-
-    for (int i = 0; i < data_size; ++i) {
-        for (int j = 0; j < subdata_size; ++j) {
-            //fprintf(stdout, "double: %f - norm double: %.8f\n", data[i][j], (double) (data[i][j] / max_value));
-            data[i][j] = (double) (data[i][j] / max_value);
-        }
-    }
+/* Index of the largest of n values, the first one on ties. argmax resolves to the variant of the values' precision,
+ * like the tgmath.h calls, so float wire outputs and nn_real outputs share it */
+static inline size_t argmax_float(size_t n, const float *values){
+    size_t best = 0;
+    for(size_t i=1; i<n; ++i)
+        if(values[i] > values[best]) best = i;
+    return best;
 }
 
-
-static void swap_double_pointers(double** a, double** b) {
-    double* temp = *a;
-    *a = *b;
-    *b = temp;
+static inline size_t argmax_double(size_t n, const double *values){
+    size_t best = 0;
+    for(size_t i=1; i<n; ++i)
+        if(values[i] > values[best]) best = i;
+    return best;
 }
 
-
-static inline void shuffle_training_data(double **images, double** labels, int data_size) {
-    srand(time(NULL));
-
-    for (int i = 0; i < data_size - 1; i++) {
-        int j = i + rand() / (RAND_MAX / (data_size - i) + 1);
-        swap_double_pointers(&images[i], &images[j]);
-        swap_double_pointers(&labels[i], &labels[j]);
-    }
-}
+#define argmax(n, values) _Generic(*(values), float: argmax_float, double: argmax_double)(n, values)
 
 
 #endif //DIGITS_NN_C_UTILS_H
@@ -0,0 +1,197 @@
+#include "dataset_reader.h"
+#include <stdatomic.h>
+#include <errno.h>
+
+
+/* Drains whole epochs of dataset readers over synthetic sources whose samples encode their own index, checking that
+ * every epoch hands out every sample exactly once with its label, and that the reader never holds more than its two
+ * staging chunks and its shuffle buffer ahead of what it has handed out, whatever the dataset size */
+
+#define SAMPLE_SIZE 2           // little endian index of the sample
+#define CLASSES 10
+#define EPOCHS 3
+
+
+typedef struct {
+    size_t samples_num;
+    size_t position;
+    size_t max_request;         // largest max_samples the reader asked for
+    atomic_size_t read_total;   // samples read over every epoch, the producer thread writes it
+} memory_source;
+
+
+static size_t failures;
+
+
+static void fail(const char *name, const char *message, size_t value){
+    if(++failures <= 20) fprintf(stderr, "%s: %s %zu\n", name, message, value);
+}
+
+
+static size_t memory_source_read(void *context, size_t max_samples, uint8_t *samples, uint8_t *labels){
+    memory_source *memory = context;
+    if(max_samples > memory->max_request) memory->max_request = max_samples;
+    size_t count = 0;
+    for(; count<max_samples && memory->position<memory->samples_num; ++count, ++memory->position){
+        samples[count * SAMPLE_SIZE] = (uint8_t)(memory->position & 0xff);
+        samples[count * SAMPLE_SIZE + 1] = (uint8_t)(memory->position >> 8);
+        labels[count] = (uint8_t)(memory->position % CLASSES);
+    }
+    atomic_fetch_add(&memory->read_total, count);
+    return count;
+}
+
+
+static int memory_source_rewind(void *context){
+    ((memory_source*)context)->position = 0;
+    return 0;
+}
+
+
+static void memory_source_close(void *context){
+    (void)context;
+}
+
+
+/* Drains EPOCHS epochs of reader in batches of batch_size. source is the memory source behind the reader, NULL when
+ * it reads files, which skips the memory bound */
+static void check_epochs(const char *name, dataset_reader *reader, memory_source *source, size_t samples_num, size_t batch_size){
+    nn_real *inputs = malloc(sizeof(nn_real) * batch_size * SAMPLE_SIZE);
+    nn_real *expected = malloc(sizeof(nn_real) * batch_size * CLASSES);
+    unsigned *visits = malloc(sizeof(unsigned) * samples_num);
+    size_t bound = 2 * reader->chunk_samples + reader->shuffle_capacity;
+    size_t handed_out = 0;
+
+    for(size_t epoch=0; epoch<EPOCHS; ++epoch){
+        memset(visits, 0, sizeof(unsigned) * samples_num);
+        size_t count;
+        size_t epoch_samples = 0;
+        while((count = dataset_reader_next_batch(reader, batch_size, inputs, expected)) > 0){
+            if(count > batch_size) fail(name, "batch larger than requested:", count);
+            if(count < batch_size && epoch_samples + count != samples_num) fail(name, "short batch before the end of the epoch at", epoch_samples);
+            for(size_t sample=0; sample<count; ++sample){
+                size_t index = (size_t)lround(inputs[sample * SAMPLE_SIZE] * 255) | (size_t)lround(inputs[sample * SAMPLE_SIZE + 1] * 255) << 8;
+                if(index >= samples_num){
+                    fail(name, "sample out of range", index);
+                    continue;
+                }
+                ++visits[index];
+                for(size_t class=0; class<CLASSES; ++class)
+                    if(expected[sample * CLASSES + class] != (class == index % CLASSES)) fail(name, "wrong label of sample", index);
+            }
+            epoch_samples += count;
+            handed_out += count;
+            if(source != NULL && atomic_load(&source->read_total) > handed_out + bound)
+                fail(name, "samples read ahead of the consumer:", atomic_load(&source->read_total) - handed_out);
+        }
+        if(epoch_samples != samples_num) fail(name, "samples in the epoch:", epoch_samples);
+        for(size_t index=0; index<samples_num; ++index)
+            if(visits[index] != 1) fail(name, "visits of sample", index);
+    }
+    if(source != NULL && source->max_request > reader->chunk_samples) fail(name, "samples read at once:", source->max_request);
+
+    free(visits);
+    free(expected);
+    free(inputs);
+}
+
+
+static void test_memory_source(size_t samples_num, size_t chunk_samples, size_t shuffle_samples, size_t batch_size){
+    char name[96];
+    snprintf(name, sizeof(name), "samples=%zu chunk=%zu shuffle=%zu batch=%zu", samples_num, chunk_samples, shuffle_samples, batch_size);
+    size_t failures_before = failures;
+
+    memory_source memory = {.samples_num = samples_num};
+    atomic_init(&memory.read_total, 0);
+    dataset_source source = {
+        .sample_size = SAMPLE_SIZE,
+        .classes = CLASSES,
+        .samples_num = samples_num,
+        .context = &memory,
+        .read = memory_source_read,
+        .rewind = memory_source_rewind,
+        .close = memory_source_close
+    };
+    dataset_reader *reader = create_dataset_reader(source, chunk_samples, shuffle_samples);
+    if(reader == NULL) fail(name, "no reader, chunk of", chunk_samples);
+    else{
+        if(reader->chunk_samples != chunk_samples || reader->shuffle_capacity != shuffle_samples)
+            fail(name, "staging sized for a chunk of", reader->chunk_samples);
+        check_epochs(name, reader, &memory, samples_num, batch_size);
+        destroy_dataset_reader(reader);
+    }
+    fprintf(stdout, "%-48s %s\n", name, failures == failures_before ? "ok" : "FAILED");
+}
+
+
+static int write_idx_file(const char *filepath, uint8_t dimensions_num, const int32_t *dimensions, const uint8_t *data, size_t size){
+    FILE *file = fopen(filepath, "wb");
+    if(file == NULL) return 1;
+    uint8_t magic[4] = {0, 0, 0x08, dimensions_num};
+    fwrite(magic, 1, 4, file);
+    for(uint8_t dimension=0; dimension<dimensions_num; ++dimension){
+        uint8_t big_endian[4] = {(uint8_t)(dimensions[dimension] >> 24), (uint8_t)(dimensions[dimension] >> 16),
+                                 (uint8_t)(dimensions[dimension] >> 8), (uint8_t)dimensions[dimension]};
+        fwrite(big_endian, 1, 4, file);
+    }
+    size_t written = fwrite(data, 1, size, file);
+    return fclose(file) != 0 || written != size;
+}
+
+
+/* The IDX source main streams MNIST through, over a 300 sample file pair of 1x2 images */
+static void test_idx_source(void){
+    const char *name = "idx samples=300 chunk=32 shuffle=50 batch=16";
+    const size_t samples_num = 300;
+    size_t failures_before = failures;
+
+    char directory[] = "/tmp/ceural-dataset-reader-XXXXXX";
+    if(mkdtemp(directory) == NULL){
+        fail(name, "no temporary directory, errno", (size_t)errno);
+        return;
+    }
+    char images_filepath[64], labels_filepath[64];
+    snprintf(images_filepath, sizeof(images_filepath), "%s/images", directory);
+    snprintf(labels_filepath, sizeof(labels_filepath), "%s/labels", directory);
+
+    uint8_t images[300 * SAMPLE_SIZE], labels[300];
+    for(size_t index=0; index<samples_num; ++index){
+        images[index * SAMPLE_SIZE] = (uint8_t)(index & 0xff);
+        images[index * SAMPLE_SIZE + 1] = (uint8_t)(index >> 8);
+        labels[index] = (uint8_t)(index % CLASSES);
+    }
+    const int32_t images_dimensions[] = {(int32_t)samples_num, 1, SAMPLE_SIZE};
+    const int32_t labels_dimensions[] = {(int32_t)samples_num};
+    dataset_source source;
+    if(write_idx_file(images_filepath, 3, images_dimensions, images, sizeof(images)) ||
+       write_idx_file(labels_filepath, 1, labels_dimensions, labels, sizeof(labels)))
+        fail(name, "failed writing the IDX files, errno", (size_t)errno);
+    else if(open_idx_source(images_filepath, labels_filepath, CLASSES, &source))
+        fail(name, "failed opening the IDX files of samples", samples_num);
+    else{
+        dataset_reader *reader = create_dataset_reader(source, 32, 50);
+        check_epochs(name, reader, NULL, samples_num, 16);
+        destroy_dataset_reader(reader);
+    }
+
+    remove(images_filepath);
+    remove(labels_filepath);
+    rmdir(directory);
+    fprintf(stdout, "%-48s %s\n", name, failures == failures_before ? "ok" : "FAILED");
+}
+
+
+int main(void){
+    // shuffle buffer smaller than, equal to and larger than a chunk and than the dataset, epochs ending on a chunk
+    // boundary, on a batch boundary and in the middle of both
+    test_memory_source(1037, 64, 100, 32);
+    test_memory_source(1024, 64, 64, 32);
+    test_memory_source(1000, 128, 1, 7);
+    test_memory_source(10, 64, 1000, 3);
+    test_memory_source(4096, 1, 1, 256);
+    test_memory_source(60000, 4096, 16384, 256);
+    test_idx_source();
+
+    if(failures > 0) fprintf(stderr, "%zu failures\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,249 @@
+#include "simd.h"
+#include "rng.h"
+
+
+/* Compares every kernel of every SIMD level this CPU supports against the scalar reference. Integer kernels must
+ * match exactly, floating point ones within a tolerance relative to the magnitude of what they sum, since the vector
+ * kernels add in a different order, and the approximations within the ulp bounds documented in simd.c */
+
+#if NN_SINGLE_PRECISION
+#define SUM_TOLERANCE 1e-5
+#define APPROX_TOLERANCE 1e-6       // 8 ulp
+#else
+#define SUM_TOLERANCE 1e-13
+#define APPROX_TOLERANCE 2e-15
+#endif
+
+#define MAX_N 1031
+#define SPARSE_ROWS 64
+#define TEST_SEED 20241017
+
+
+/* Lengths hitting every tail of every vector width */
+static const size_t lengths[] = {0, 1, 3, 4, 7, 8, 15, 16, 17, 31, 33, 64, 100, 257, MAX_N};
+#define LENGTHS_NUM (sizeof(lengths) / sizeof(lengths[0]))
+
+
+static size_t failures;
+
+
+static void check(const char *level, const char *kernel, size_t n, double value, double expected, double scale, double tolerance){
+    if(fabs(value - expected) <= tolerance * (scale > 1 ? scale : 1)) return;
+    if(++failures <= 20)
+        fprintf(stderr, "%s %s n=%zu: %.17g instead of %.17g\n", level, kernel, n, value, expected);
+}
+
+
+static void random_values(uint64_t stream, size_t n, nn_real min, nn_real max, nn_real *values){
+    rng_fill_uniform(TEST_SEED, rng_stream_id(RNG_SAMPLING, stream), 0, n, min, max, values);
+}
+
+
+static void test_dense(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static nn_real x[MAX_N], y[MAX_N], expected[MAX_N], actual[MAX_N];
+    for(size_t length=0; length<LENGTHS_NUM; ++length){
+        size_t n = lengths[length];
+        random_values(1, n, -1, 1, x);
+        random_values(2, n, -1, 1, y);
+        double magnitude = 0;
+        for(size_t i=0; i<n; ++i) magnitude += fabs((double)x[i] * y[i]);
+        check(level, "dot", n, kernels->dot(n, x, y), reference->dot(n, x, y), magnitude, SUM_TOLERANCE);
+
+        memcpy(expected, y, sizeof(nn_real) * n);
+        memcpy(actual, y, sizeof(nn_real) * n);
+        reference->axpy(n, (nn_real)0.75, x, expected);
+        kernels->axpy(n, (nn_real)0.75, x, actual);
+        for(size_t i=0; i<n; ++i) check(level, "axpy", n, actual[i], expected[i], 1, SUM_TOLERANCE);
+
+        reference->relu(n, x, expected);
+        kernels->relu(n, x, actual);
+        for(size_t i=0; i<n; ++i) check(level, "relu", n, actual[i], expected[i], 0, 0);
+
+        memcpy(expected, y, sizeof(nn_real) * n);
+        memcpy(actual, y, sizeof(nn_real) * n);
+        reference->relu_derivative_mul(n, x, expected);
+        kernels->relu_derivative_mul(n, x, actual);
+        for(size_t i=0; i<n; ++i) check(level, "relu_derivative_mul", n, actual[i], expected[i], 0, 0);
+    }
+}
+
+
+static void test_gemm_tile(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static const size_t depths[] = {1, 2, 5, 64, GEMM_KC};
+    nn_real *packed_a = aligned_calloc(64, sizeof(nn_real) * GEMM_KC * GEMM_MR);
+    nn_real *packed_b = aligned_calloc(64, sizeof(nn_real) * GEMM_KC * GEMM_NR);
+    _Alignas(64) nn_real expected[GEMM_MR][GEMM_NR];
+    _Alignas(64) nn_real actual[GEMM_MR][GEMM_NR];
+
+    for(size_t depth=0; depth<sizeof(depths)/sizeof(depths[0]); ++depth){
+        size_t kc = depths[depth];
+        random_values(3, kc * GEMM_MR, -1, 1, packed_a);
+        random_values(4, kc * GEMM_NR, -1, 1, packed_b);
+        reference->gemm_tile(kc, packed_a, packed_b, expected);
+        kernels->gemm_tile(kc, packed_a, packed_b, actual);
+        for(size_t i=0; i<GEMM_MR; ++i)
+            for(size_t j=0; j<GEMM_NR; ++j) check(level, "gemm_tile", kc, actual[i][j], expected[i][j], (double)kc, SUM_TOLERANCE);
+    }
+    free(packed_b);
+    free(packed_a);
+}
+
+
+static void test_dot_u8s8(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static uint8_t a[MAX_N];
+    static int8_t w[MAX_N];
+    rng_stream rng;
+    rng_open(&rng, TEST_SEED, rng_stream_id(RNG_SAMPLING, 5));
+    for(size_t i=0; i<MAX_N; ++i){
+        a[i] = (uint8_t)rng_below(&rng, QUANTIZED_ACTIVATION_MAX + 1);
+        w[i] = (int8_t)((int)rng_below(&rng, 256) - 128);
+    }
+    for(size_t length=0; length<LENGTHS_NUM; ++length){
+        size_t n = lengths[length];
+        check(level, "dot_u8s8", n, kernels->dot_u8s8(n, a, w), reference->dot_u8s8(n, a, w), 0, 0);
+    }
+}
+
+
+static void test_optimizer_updates(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static nn_real gradients[MAX_N], parameters[2][MAX_N], m[2][MAX_N], v[2][MAX_N];
+    optimizer_coefficients c = {(nn_real)0.25, (nn_real)0.01, (nn_real)0.999, (nn_real)0.01, (nn_real)0.9,
+                                (nn_real)0.999, (nn_real)1e-8, (nn_real)0.1, (nn_real)0.9};
+
+    for(size_t length=0; length<LENGTHS_NUM; ++length){
+        size_t n = lengths[length];
+        random_values(6, n, -1, 1, gradients);
+        for(int side=0; side<2; ++side){
+            random_values(7, n, -1, 1, parameters[side]);
+            random_values(8, n, -1, 1, m[side]);
+            random_values(9, n, 0, 1, v[side]);
+        }
+        reference->sgd_update(n, &c, gradients, parameters[0]);
+        kernels->sgd_update(n, &c, gradients, parameters[1]);
+        for(size_t i=0; i<n; ++i) check(level, "sgd_update", n, parameters[1][i], parameters[0][i], 1, SUM_TOLERANCE);
+
+        reference->momentum_update(n, &c, gradients, m[0], parameters[0]);
+        kernels->momentum_update(n, &c, gradients, m[1], parameters[1]);
+        for(size_t i=0; i<n; ++i){
+            check(level, "momentum_update", n, parameters[1][i], parameters[0][i], 1, SUM_TOLERANCE);
+            check(level, "momentum_update velocity", n, m[1][i], m[0][i], 1, SUM_TOLERANCE);
+        }
+
+        reference->adam_update(n, &c, gradients, m[0], v[0], parameters[0]);
+        kernels->adam_update(n, &c, gradients, m[1], v[1], parameters[1]);
+        for(size_t i=0; i<n; ++i){
+            check(level, "adam_update", n, parameters[1][i], parameters[0][i], 1, SUM_TOLERANCE);
+            check(level, "adam_update m", n, m[1][i], m[0][i], 1, SUM_TOLERANCE);
+            check(level, "adam_update v", n, v[1][i], v[0][i], 1, SUM_TOLERANCE);
+        }
+    }
+}
+
+
+static void test_approximations(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static nn_real x[MAX_N], expected[MAX_N], actual[MAX_N];
+    struct {
+        const char *name;
+        void (*kernel)(size_t, const nn_real*, nn_real*);
+        void (*reference)(size_t, const nn_real*, nn_real*);
+    } approximations[] = {{"exp_approx", kernels->exp_approx, reference->exp_approx},
+                          {"sigmoid_approx", kernels->sigmoid_approx, reference->sigmoid_approx},
+                          {"tanh_approx", kernels->tanh_approx, reference->tanh_approx}};
+
+    for(size_t approximation=0; approximation<3; ++approximation){
+        for(size_t length=0; length<LENGTHS_NUM; ++length){
+            size_t n = lengths[length];
+            random_values(10, n, -20, 20, x);
+            approximations[approximation].reference(n, x, expected);
+            approximations[approximation].kernel(n, x, actual);
+            for(size_t i=0; i<n; ++i)
+                check(level, approximations[approximation].name, n, actual[i] / expected[i], 1, 0, APPROX_TOLERANCE);
+        }
+    }
+}
+
+
+static void test_sparse(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static nn_real x[MAX_N], values[2][MAX_N + SPARSE_COMPACTION_SLACK], y[2][MAX_N];
+    static uint32_t indices[2][MAX_N + SPARSE_COMPACTION_SLACK];
+    static nn_real rows[2][SPARSE_ROWS * 64];
+
+    for(size_t length=0; length<LENGTHS_NUM; ++length){
+        size_t n = lengths[length];
+        random_values(11, n, -1, 1, x);
+        for(size_t i=0; i<n; ++i) if(x[i] < (nn_real)0.5) x[i] = 0;   // about 3 in 4 zeros
+        size_t expected_count = reference->compact_nonzeros(n, x, values[0], indices[0]);
+        size_t count = kernels->compact_nonzeros(n, x, values[1], indices[1]);
+        check(level, "compact_nonzeros count", n, (double)count, (double)expected_count, 0, 0);
+        for(size_t k=0; k<count && k<expected_count; ++k){
+            check(level, "compact_nonzeros values", n, values[1][k], values[0][k], 0, 0);
+            check(level, "compact_nonzeros indices", n, indices[1][k], indices[0][k], 0, 0);
+        }
+    }
+
+    // nonzeros picked out of SPARSE_ROWS rows of up to 64 columns
+    for(size_t length=0; length<LENGTHS_NUM && lengths[length]<=64; ++length){
+        size_t n = lengths[length];
+        size_t nonzeros = 0;
+        for(uint32_t row=0; row<SPARSE_ROWS; row+=3) indices[0][nonzeros++] = row;
+        random_values(12, nonzeros, -1, 1, values[0]);
+        random_values(13, SPARSE_ROWS * n, -1, 1, rows[0]);
+        random_values(14, n, -1, 1, x);
+
+        reference->sparse_rows_sum(nonzeros, values[0], indices[0], rows[0], n, y[0]);
+        kernels->sparse_rows_sum(nonzeros, values[0], indices[0], rows[0], n, y[1]);
+        for(size_t j=0; j<n; ++j) check(level, "sparse_rows_sum", n, y[1][j], y[0][j], (double)nonzeros, SUM_TOLERANCE);
+
+        memcpy(rows[1], rows[0], sizeof(nn_real) * SPARSE_ROWS * n);
+        reference->sparse_rows_axpy(nonzeros, values[0], indices[0], x, n, rows[0]);
+        kernels->sparse_rows_axpy(nonzeros, values[0], indices[0], x, n, rows[1]);
+        for(size_t i=0; i<SPARSE_ROWS * n; ++i) check(level, "sparse_rows_axpy", n, rows[1][i], rows[0][i], 1, SUM_TOLERANCE);
+    }
+}
+
+
+static void test_philox(const char *level, const simd_kernels *kernels, const simd_kernels *reference){
+    static uint32_t expected[4 * 100], actual[4 * 100];
+    for(size_t length=0; length<LENGTHS_NUM && lengths[length]<=100; ++length){
+        size_t blocks = lengths[length];
+        // the block counter crosses 2^32 within the run, carrying into its high word
+        reference->philox_blocks(blocks, 0x0123456789ABCDEFull, 42, 0xFFFFFFF8ull, expected);
+        kernels->philox_blocks(blocks, 0x0123456789ABCDEFull, 42, 0xFFFFFFF8ull, actual);
+        for(size_t i=0; i<4 * blocks; ++i) check(level, "philox_blocks", blocks, actual[i], expected[i], 0, 0);
+    }
+}
+
+
+static const struct {
+    const char *name;
+    void (*run)(const char *level, const simd_kernels *kernels, const simd_kernels *reference);
+} tests[] = {
+    {"dense", test_dense},
+    {"gemm_tile", test_gemm_tile},
+    {"dot_u8s8", test_dot_u8s8},
+    {"optimizer updates", test_optimizer_updates},
+    {"approximations", test_approximations},
+    {"sparse", test_sparse},
+    {"philox", test_philox},
+};
+
+
+int main(void){
+    static const char *levels[] = {"scalar", "sse2", "avx2", "avx512", "avx512vnni"};
+    const simd_kernels *reference = simd_kernels_for("scalar");
+
+    for(size_t level=0; level<sizeof(levels)/sizeof(levels[0]); ++level){
+        const simd_kernels *kernels = simd_kernels_for(levels[level]);
+        if(kernels == NULL){
+            fprintf(stdout, "%-10s not supported by this CPU, skipped\n", levels[level]);
+            continue;
+        }
+        for(size_t test=0; test<sizeof(tests)/sizeof(tests[0]); ++test){
+            size_t failures_before = failures;
+            tests[test].run(levels[level], kernels, reference);
+            fprintf(stdout, "%-10s %-18s %s\n", levels[level], tests[test].name, failures == failures_before ? "ok" : "FAILED");
+        }
+    }
+    if(failures > 0) fprintf(stderr, "%zu mismatches\n", failures);
+    return failures > 0;
+}
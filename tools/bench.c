@@ -0,0 +1,542 @@
+#include "nn_core.h"
+#include "activations.h"
+#include "loss.h"
+#include "data.h"
+#include "trainer.h"
+#include "simd.h"
+#include "rng.h"
+
+
+#define DEFAULT_DATA_DIRECTORY "../data/mnist/handwritten-digits"
+#define DEFAULT_WARMUP 3
+#define DEFAULT_REPETITIONS 20
+#define DEFAULT_BATCH_SIZE 256
+#define MAX_SIZES 16
+#define MIN_REPETITION_NS 1e6       // inner iterations are doubled until one repetition lasts at least this long
+
+/* Values are drawn from a fixed seed rather than NN_SEED, so every run benchmarks the same values. Every benchmark
+ * draws from its own RNG_SAMPLING streams, one per size it runs, see bench_stream */
+#define BENCH_SEED 0x5eed
+#define BENCH_DOT 1
+#define BENCH_DENSE 2
+#define BENCH_SOFTMAX 3
+#define BENCH_DENSE_WEIGHTS 4
+#define BENCH_MACRO 5               // size 0 draws the inputs, 1 the labels and 2 + topology the weights
+#define MACRO_BATCHES 16            // distinct batches the macro benchmarks cycle through
+
+
+/* Timing of one benchmark, every time is the duration of a single inner iteration */
+typedef struct {
+    char name[32];
+    char parameters[128];       // a macro benchmark's parameters and the threads of train_parallel
+    size_t iterations;          // inner iterations per repetition
+    double median_ns;
+    double p99_ns;
+    double min_ns;
+    double mean_ns;
+    double items_per_second;    // at the median time, items are elements, samples or rows depending on the benchmark
+} bench_result;
+
+
+typedef struct {
+    size_t warmup;
+    size_t repetitions;
+    const char *filter;         // only benchmarks whose name contains it run, NULL runs every one
+    double *timings;
+    bench_result *results;
+    size_t results_num;
+} bench_suite;
+
+
+/* Body of a benchmark, runs its operation iterations times back to back */
+typedef void (*bench_body)(void *argument, size_t iterations);
+
+
+static volatile nn_real bench_sink; // keeps the compiler from dropping results nobody reads
+
+
+static double now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+
+static double time_iterations(bench_body body, void *argument, size_t iterations){
+    double start = now_ns();
+    body(argument, iterations);
+    return now_ns() - start;
+}
+
+
+static int compare_doubles(const void *a, const void *b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+/* Calibrates the inner iterations so timer resolution stays negligible, runs the warmup repetitions and then records
+ * the measured ones, reporting median, nearest rank p99, min and mean */
+static void run_benchmark(bench_suite *suite, const char *name, const char *parameters, double items,
+                          bench_body body, void *argument
+                          ){
+    if(suite->filter != NULL && strstr(name, suite->filter) == NULL) return;
+
+    size_t iterations = 1;
+    while(time_iterations(body, argument, iterations) < MIN_REPETITION_NS && iterations < ((size_t)1 << 30)) iterations *= 2;
+    for(size_t repetition=0; repetition<suite->warmup; ++repetition) body(argument, iterations);
+
+    double total = 0;
+    for(size_t repetition=0; repetition<suite->repetitions; ++repetition){
+        suite->timings[repetition] = time_iterations(body, argument, iterations) / (double)iterations;
+        total += suite->timings[repetition];
+    }
+    qsort(suite->timings, suite->repetitions, sizeof(double), compare_doubles);
+
+    size_t n = suite->repetitions;
+    size_t p99_rank = (size_t)ceil(0.99 * (double)n);
+    bench_result result = {0};
+    snprintf(result.name, sizeof(result.name), "%s", name);
+    snprintf(result.parameters, sizeof(result.parameters), "%s", parameters);
+    result.iterations = iterations;
+    result.median_ns = n % 2 ? suite->timings[n/2] : (suite->timings[n/2 - 1] + suite->timings[n/2]) / 2;
+    result.p99_ns = suite->timings[p99_rank > 0 ? p99_rank - 1 : 0];
+    result.min_ns = suite->timings[0];
+    result.mean_ns = total / (double)n;
+    result.items_per_second = items * 1e9 / result.median_ns;
+
+    suite->results = realloc(suite->results, sizeof(bench_result) * (suite->results_num + 1));
+    suite->results[suite->results_num++] = result;
+    fprintf(stdout, "%-16s %-40s median %12.3f us   p99 %12.3f us   %14.1f items/s\n",
+            result.name, result.parameters, result.median_ns * 1e-3, result.p99_ns * 1e-3, result.items_per_second);
+    fflush(stdout);
+}
+
+
+static uint64_t bench_stream(uint64_t benchmark, uint64_t size){
+    return rng_stream_id(RNG_SAMPLING, benchmark << 32 | size);
+}
+
+
+/* values[i] = element first + i of the uniform [-scale, scale) sequence of the provided stream */
+static void fill_uniform(uint64_t stream, size_t first, size_t n, nn_real scale, nn_real *values){
+    rng_fill_uniform(BENCH_SEED, stream, first, n, -scale, scale, values);
+}
+
+
+/* He scaled uniform weights and small biases, independent of the initialization create_neural_network performs */
+static void initialize_network(NeuralNetwork *nn, uint64_t stream){
+    size_t first = 0;
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer){
+        DenseLayer *dense_layer = &nn->dense_layers[layer];
+        nn_real scale = sqrt((nn_real)6 / (nn_real)dense_layer->previous_layer_size);
+        for(size_t neuron=0; neuron<dense_layer->size; ++neuron){
+            fill_uniform(stream, first, dense_layer->previous_layer_size, scale, dense_layer_neuron_weights(dense_layer, neuron));
+            first += dense_layer->previous_layer_size;
+        }
+        fill_uniform(stream, first, dense_layer->size, (nn_real)0.01, dense_layer->biases);
+        first += dense_layer->size;
+    }
+    parameters_changed(nn);
+}
+
+
+/* One hot expected outputs with uniformly random classes */
+static void fill_one_hot(size_t samples, size_t classes, nn_real *expected_outputs, rng_stream *rng){
+    memset(expected_outputs, 0, sizeof(nn_real) * samples * classes);
+    for(size_t sample=0; sample<samples; ++sample)
+        expected_outputs[sample * classes + rng_below(rng, classes)] = 1;
+}
+
+
+typedef struct {
+    size_t n;
+    const nn_real *x;
+    const nn_real *y;
+} dot_arguments;
+
+static void dot_body(void *argument, size_t iterations){
+    dot_arguments *dot = argument;
+    nn_real sum = 0;
+    for(size_t iteration=0; iteration<iterations; ++iteration) sum += simd->dot(dot->n, dot->x, dot->y);
+    bench_sink = sum;
+}
+
+
+typedef struct {
+    NeuralNetwork *nn;
+    nn_workspace *workspace;
+    const nn_real *inputs;
+    const nn_real *expected_outputs;
+    nn_real *outputs;
+    size_t batch_size;
+} dense_arguments;
+
+static void dense_forward_body(void *argument, size_t iterations){
+    dense_arguments *dense = argument;
+    for(size_t iteration=0; iteration<iterations; ++iteration)
+        nn_predict_batch(dense->nn, dense->inputs, dense->batch_size, dense->outputs, dense->workspace);
+}
+
+/* Backward pass only, the workspace keeps the activations of the forward pass run before timing */
+static void dense_backward_body(void *argument, size_t iterations){
+    dense_arguments *dense = argument;
+    for(size_t iteration=0; iteration<iterations; ++iteration){
+        memset(dense->workspace->gradients, 0, sizeof(nn_real) * dense->nn->parameters_num);
+        backpropagate_gradients(dense->nn, dense->inputs, dense->expected_outputs, dense->batch_size, dense->workspace);
+    }
+}
+
+
+typedef struct {
+    size_t classes;
+    size_t rows;
+    const nn_real *logits;
+    nn_real *outputs;
+    nn_real *log_sum_exps;
+} softmax_arguments;
+
+static void softmax_body(void *argument, size_t iterations){
+    softmax_arguments *softmax_batch = argument;
+    for(size_t iteration=0; iteration<iterations; ++iteration)
+        for(size_t row=0; row<softmax_batch->rows; ++row)
+            log_softmax_into(softmax_batch->classes, softmax_batch->logits + row * softmax_batch->classes,
+                             softmax_batch->outputs + row * softmax_batch->classes, &softmax_batch->log_sum_exps[row]);
+}
+
+
+typedef struct {
+    const char *paths[4];
+    size_t batch_size;
+    size_t *indices;
+    nn_real *inputs;
+    nn_real *expected_outputs;
+} dataset_arguments;
+
+/* Maps and validates the four MNIST files, then converts the whole training set batch by batch */
+static void dataset_load_body(void *argument, size_t iterations){
+    dataset_arguments *dataset = argument;
+    for(size_t iteration=0; iteration<iterations; ++iteration){
+        mnist_handwritten_digits_data mnist_data = load_mnist_data(dataset->paths[0], dataset->paths[1], dataset->paths[2], dataset->paths[3]);
+        if(mnist_data.training_images.magic_number == -1) return;
+
+        size_t samples_num = (size_t)mnist_data.training_images.number_of_images;
+        for(size_t first=0; first<samples_num; first+=dataset->batch_size){
+            size_t count = samples_num - first < dataset->batch_size ? samples_num - first : dataset->batch_size;
+            for(size_t sample=0; sample<count; ++sample) dataset->indices[sample] = first + sample;
+            gather_mnist_batch(&mnist_data.training_images, &mnist_data.training_labels, dataset->indices, count,
+                               dataset->inputs, dataset->expected_outputs);
+        }
+        bench_sink = dataset->inputs[0];
+        destroy_mnist_data(mnist_data);
+    }
+}
+
+
+typedef struct {
+    NeuralNetwork *nn;
+    nn_trainer *trainer;
+    nn_workspace *workspace;
+    const nn_real *inputs;           // MACRO_BATCHES consecutive batches
+    const nn_real *expected_outputs;
+    nn_real *outputs;
+    size_t batch_size;
+    size_t next_batch;
+} macro_arguments;
+
+static void macro_batch(macro_arguments *macro, const nn_real **inputs, const nn_real **expected_outputs){
+    size_t input_size = macro->nn->input_layer_size;
+    size_t output_size = macro->nn->dense_layers[macro->nn->dense_layers_num-1].size;
+    *inputs = macro->inputs + macro->next_batch * macro->batch_size * input_size;
+    *expected_outputs = macro->expected_outputs + macro->next_batch * macro->batch_size * output_size;
+    macro->next_batch = (macro->next_batch + 1) % MACRO_BATCHES;
+}
+
+static void train_body(void *argument, size_t iterations){
+    macro_arguments *macro = argument;
+    double loss = 0;
+    for(size_t iteration=0; iteration<iterations; ++iteration){
+        const nn_real *inputs, *expected_outputs;
+        macro_batch(macro, &inputs, &expected_outputs);
+        loss += backprop_batch(macro->nn, inputs, expected_outputs, macro->batch_size);
+    }
+    bench_sink = (nn_real)loss;
+}
+
+static void train_parallel_body(void *argument, size_t iterations){
+    macro_arguments *macro = argument;
+    double loss = 0;
+    for(size_t iteration=0; iteration<iterations; ++iteration){
+        const nn_real *inputs, *expected_outputs;
+        macro_batch(macro, &inputs, &expected_outputs);
+        loss += trainer_backprop_batch(macro->trainer, inputs, expected_outputs, macro->batch_size);
+    }
+    bench_sink = (nn_real)loss;
+}
+
+static void inference_body(void *argument, size_t iterations){
+    macro_arguments *macro = argument;
+    for(size_t iteration=0; iteration<iterations; ++iteration){
+        const nn_real *inputs, *expected_outputs;
+        macro_batch(macro, &inputs, &expected_outputs);
+        nn_predict_batch(macro->nn, inputs, macro->batch_size, macro->outputs, macro->workspace);
+    }
+}
+
+
+static void bench_dot(bench_suite *suite, const size_t *sizes, size_t sizes_num){
+    for(size_t size=0; size<sizes_num; ++size){
+        size_t n = sizes[size];
+        nn_real *x = aligned_calloc(NN_WEIGHTS_ALIGNMENT, sizeof(nn_real) * n);
+        nn_real *y = aligned_calloc(NN_WEIGHTS_ALIGNMENT, sizeof(nn_real) * n);
+        fill_uniform(bench_stream(BENCH_DOT, n), 0, n, 1, x);
+        fill_uniform(bench_stream(BENCH_DOT, n), n, n, 1, y);
+
+        char parameters[96];
+        snprintf(parameters, sizeof(parameters), "n=%zu", n);
+        dot_arguments dot = {n, x, y};
+        run_benchmark(suite, "dot", parameters, (double)n, dot_body, &dot);
+        free(x);
+        free(y);
+    }
+}
+
+
+/* Single square relu layer of every size, trained against mean squared error so the backward pass has no fusion */
+static void bench_dense(bench_suite *suite, const size_t *sizes, size_t sizes_num, size_t batch_size){
+    for(size_t size=0; size<sizes_num; ++size){
+        size_t n = sizes[size];
+        int activation = RELU_ACTIVATION;
+        NeuralNetwork *nn = create_neural_network(n, 1, &n, &activation, MEAN_SQUARED_ERROR_LOSS, 0.01, batch_size);
+        if(nn == NULL) continue;
+        initialize_network(nn, bench_stream(BENCH_DENSE_WEIGHTS, n));
+
+        nn_workspace *workspace = create_workspace(nn, batch_size);
+        nn_real *inputs = malloc(sizeof(nn_real) * n * batch_size);
+        nn_real *expected_outputs = malloc(sizeof(nn_real) * n * batch_size);
+        nn_real *outputs = malloc(sizeof(nn_real) * n * batch_size);
+        fill_uniform(bench_stream(BENCH_DENSE, n), 0, n * batch_size, 1, inputs);
+        fill_uniform(bench_stream(BENCH_DENSE, n), n * batch_size, n * batch_size, 1, expected_outputs);
+
+        char parameters[96];
+        snprintf(parameters, sizeof(parameters), "in=%zu out=%zu batch=%zu", n, n, batch_size);
+        dense_arguments dense = {nn, workspace, inputs, expected_outputs, outputs, batch_size};
+        run_benchmark(suite, "dense_forward", parameters, (double)batch_size, dense_forward_body, &dense);
+        compute_gradients(nn, inputs, expected_outputs, batch_size, workspace);
+        run_benchmark(suite, "dense_backward", parameters, (double)batch_size, dense_backward_body, &dense);
+
+        free(inputs);
+        free(expected_outputs);
+        free(outputs);
+        destroy_workspace(workspace);
+        destroy_neural_network(nn);
+    }
+}
+
+
+static void bench_softmax(bench_suite *suite, size_t batch_size){
+    const size_t classes_sizes[] = {MNIST_CLASSES, 1000};
+    for(size_t size=0; size<sizeof(classes_sizes)/sizeof(classes_sizes[0]); ++size){
+        size_t classes = classes_sizes[size];
+        nn_real *logits = malloc(sizeof(nn_real) * classes * batch_size);
+        nn_real *outputs = malloc(sizeof(nn_real) * classes * batch_size);
+        nn_real *log_sum_exps = malloc(sizeof(nn_real) * batch_size);
+        fill_uniform(bench_stream(BENCH_SOFTMAX, classes), 0, classes * batch_size, 10, logits);
+
+        char parameters[96];
+        snprintf(parameters, sizeof(parameters), "classes=%zu rows=%zu", classes, batch_size);
+        softmax_arguments softmax_batch = {classes, batch_size, logits, outputs, log_sum_exps};
+        run_benchmark(suite, "softmax", parameters, (double)batch_size, softmax_body, &softmax_batch);
+        free(logits);
+        free(outputs);
+        free(log_sum_exps);
+    }
+}
+
+
+static void bench_dataset_load(bench_suite *suite, char paths[4][4096], const mnist_images_set *images, size_t batch_size){
+    size_t samples_num = (size_t)images->number_of_images;
+    dataset_arguments dataset = {{paths[0], paths[1], paths[2], paths[3]}, batch_size, NULL, NULL, NULL};
+    dataset.indices = malloc(sizeof(size_t) * batch_size);
+    dataset.inputs = malloc(sizeof(nn_real) * (size_t)images->number_of_rows * (size_t)images->number_of_columns * batch_size);
+    dataset.expected_outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * batch_size);
+
+    char parameters[96];
+    snprintf(parameters, sizeof(parameters), "samples=%zu batch=%zu", samples_num, batch_size);
+    run_benchmark(suite, "dataset_load", parameters, (double)samples_num, dataset_load_body, &dataset);
+    free(dataset.indices);
+    free(dataset.inputs);
+    free(dataset.expected_outputs);
+}
+
+
+/* Training and inference throughput of MNIST shaped networks, the first topology is the one main.c trains */
+static void bench_macro(bench_suite *suite, const mnist_handwritten_digits_data *mnist_data, size_t batch_size, size_t threads_num){
+    static const size_t topologies[][3] = {{16, 16, 10}, {128, 64, 10}, {512, 256, 10}};
+    const int activations[] = {RELU_ACTIVATION, RELU_ACTIVATION, SOFTMAX_ACTIVATION};
+    const size_t input_size = 28 * 28;
+    const size_t samples = MACRO_BATCHES * batch_size;
+
+    // real MNIST batches when the dataset is available, uniform pixels otherwise
+    nn_real *inputs = malloc(sizeof(nn_real) * input_size * samples);
+    nn_real *expected_outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * samples);
+    if(mnist_data != NULL && (size_t)mnist_data->training_images.number_of_images >= samples &&
+       (size_t)mnist_data->training_images.number_of_rows * (size_t)mnist_data->training_images.number_of_columns == input_size){
+        size_t *indices = malloc(sizeof(size_t) * samples);
+        for(size_t sample=0; sample<samples; ++sample) indices[sample] = sample;
+        gather_mnist_batch(&mnist_data->training_images, &mnist_data->training_labels, indices, samples, inputs, expected_outputs);
+        free(indices);
+    }else{
+        rng_fill_uniform(BENCH_SEED, bench_stream(BENCH_MACRO, 0), 0, input_size * samples, 0, 1, inputs);
+        rng_stream labels;
+        rng_open(&labels, BENCH_SEED, bench_stream(BENCH_MACRO, 1));
+        fill_one_hot(samples, MNIST_CLASSES, expected_outputs, &labels);
+    }
+    nn_real *outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * batch_size);
+
+    for(size_t topology=0; topology<sizeof(topologies)/sizeof(topologies[0]); ++topology){
+        NeuralNetwork *nn = create_neural_network(input_size, 3, topologies[topology], activations, MULTI_CROSS_ENTROPY_LOSS, 0.001, batch_size);
+        if(nn == NULL) continue;
+        set_network_optimizer(nn, default_optimizer_config(ADAM_OPTIMIZER, 0.001));
+        nn_trainer *trainer = create_trainer(nn, threads_num);
+        nn_workspace *workspace = create_workspace(nn, batch_size);
+
+        char parameters[96];
+        snprintf(parameters, sizeof(parameters), "layers=%zu,%zu,%zu batch=%zu",
+                 topologies[topology][0], topologies[topology][1], topologies[topology][2], batch_size);
+        macro_arguments macro = {nn, trainer, workspace, inputs, expected_outputs, outputs, batch_size, 0};
+
+        initialize_network(nn, bench_stream(BENCH_MACRO, 2 + topology));
+        run_benchmark(suite, "inference", parameters, (double)batch_size, inference_body, &macro);
+        run_benchmark(suite, "train", parameters, (double)batch_size, train_body, &macro);
+        if(trainer != NULL){
+            char parallel_parameters[sizeof(parameters) + 32];
+            snprintf(parallel_parameters, sizeof(parallel_parameters), "%s threads=%zu", parameters, trainer->threads_num);
+            initialize_network(nn, bench_stream(BENCH_MACRO, 2 + topology));
+            run_benchmark(suite, "train_parallel", parallel_parameters, (double)batch_size, train_parallel_body, &macro);
+        }
+
+        destroy_workspace(workspace);
+        destroy_trainer(trainer);
+        destroy_neural_network(nn);
+    }
+
+    free(inputs);
+    free(expected_outputs);
+    free(outputs);
+}
+
+
+static int write_json(const bench_suite *suite, const char *filepath, size_t batch_size){
+    FILE *file = fopen(filepath, "w");
+    if(file == NULL){
+        fprintf(stderr, "Failed to open %s for the benchmark results\n", filepath);
+        return 1;
+    }
+
+    fprintf(file, "{\n  \"timestamp\": %lld,\n  \"kernels\": \"%s\",\n  \"precision\": \"%s\",\n", (long long)time(NULL),
+            simd->name, sizeof(nn_real) == sizeof(float) ? "float32" : "float64");
+    fprintf(file, "  \"batch_size\": %zu,\n  \"warmup\": %zu,\n  \"repetitions\": %zu,\n  \"results\": [\n",
+            batch_size, suite->warmup, suite->repetitions);
+    for(size_t i=0; i<suite->results_num; ++i){
+        const bench_result *result = &suite->results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"parameters\": \"%s\", \"iterations\": %zu, \"median_ns\": %.3f, \"p99_ns\": %.3f, "
+                      "\"min_ns\": %.3f, \"mean_ns\": %.3f, \"items_per_second\": %.3f}%s\n",
+                result->name, result->parameters, result->iterations, result->median_ns, result->p99_ns,
+                result->min_ns, result->mean_ns, result->items_per_second, i + 1 < suite->results_num ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    int failed = ferror(file);
+    if(fclose(file) != 0 || failed){
+        fprintf(stderr, "Failed to write the benchmark results to %s\n", filepath);
+        return 1;
+    }
+    return 0;
+}
+
+
+static size_t parse_sizes(const char *list, size_t *sizes){
+    size_t sizes_num = 0;
+    char *end;
+    while(*list != '\0' && sizes_num < MAX_SIZES){
+        size_t size = strtoul(list, &end, 10);
+        if(end == list || size == 0) return 0;
+        sizes[sizes_num++] = size;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return sizes_num;
+}
+
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: ceural-bench [--filter name] [--warmup n] [--repetitions n] [--batch n] [--threads n]\n"
+                    "                    [--sizes n,n,...] [--data mnist directory] [--json output file]\n");
+}
+
+
+/* Micro benchmarks of the kernels and macro benchmarks of whole training and inference steps, every benchmark is
+ * warmed up and repeated, the table goes to stdout and --json additionally writes every result for regression tracking */
+int main(int argc, char *argv[]){
+    bench_suite suite = {DEFAULT_WARMUP, DEFAULT_REPETITIONS, NULL, NULL, NULL, 0};
+    size_t batch_size = DEFAULT_BATCH_SIZE;
+    size_t threads_num = 0; // one worker per online CPU
+    size_t sizes[MAX_SIZES] = {64, 256, 1024};
+    size_t sizes_num = 3;
+    const char *data_directory = DEFAULT_DATA_DIRECTORY;
+    const char *json_filepath = NULL;
+
+    for(int arg=1; arg<argc; ++arg){
+        const char *value = arg + 1 < argc ? argv[arg+1] : NULL;
+        if(value == NULL){
+            print_usage();
+            return 1;
+        }
+        if(strcmp(argv[arg], "--filter") == 0) suite.filter = value;
+        else if(strcmp(argv[arg], "--warmup") == 0) suite.warmup = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--repetitions") == 0) suite.repetitions = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--batch") == 0) batch_size = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--threads") == 0) threads_num = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--sizes") == 0) sizes_num = parse_sizes(value, sizes);
+        else if(strcmp(argv[arg], "--data") == 0) data_directory = value;
+        else if(strcmp(argv[arg], "--json") == 0) json_filepath = value;
+        else{
+            print_usage();
+            return 1;
+        }
+        ++arg;
+    }
+    if(suite.repetitions == 0 || batch_size == 0 || sizes_num == 0){
+        fprintf(stderr, "Repetitions, batch size and sizes must be positive\n");
+        print_usage();
+        return 1;
+    }
+    suite.timings = malloc(sizeof(double) * suite.repetitions);
+
+    char paths[4][4096];
+    snprintf(paths[0], sizeof(paths[0]), "%s/train/train-images.idx3-ubyte", data_directory);
+    snprintf(paths[1], sizeof(paths[1]), "%s/train/train-labels.idx1-ubyte", data_directory);
+    snprintf(paths[2], sizeof(paths[2]), "%s/test/t10k-images.idx3-ubyte", data_directory);
+    snprintf(paths[3], sizeof(paths[3]), "%s/test/t10k-labels.idx1-ubyte", data_directory);
+    mnist_handwritten_digits_data mnist_data = load_mnist_data(paths[0], paths[1], paths[2], paths[3]);
+    int mnist_loaded = mnist_data.training_images.magic_number != -1;
+    if(!mnist_loaded)
+        fprintf(stderr, "MNIST not found in %s, skipping dataset_load and using synthetic samples\n", data_directory);
+
+    fprintf(stdout, "kernels: %s, precision: %s, warmup: %zu, repetitions: %zu\n", simd->name,
+            sizeof(nn_real) == sizeof(float) ? "float32" : "float64", suite.warmup, suite.repetitions);
+    print_placement_config(stdout);
+
+    bench_dot(&suite, sizes, sizes_num);
+    bench_dense(&suite, sizes, sizes_num, batch_size);
+    bench_softmax(&suite, batch_size);
+    if(mnist_loaded) bench_dataset_load(&suite, paths, &mnist_data.training_images, batch_size);
+    bench_macro(&suite, mnist_loaded ? &mnist_data : NULL, batch_size, threads_num);
+
+    int failed = json_filepath != NULL && write_json(&suite, json_filepath, batch_size);
+
+    if(mnist_loaded) destroy_mnist_data(mnist_data);
+    free(suite.timings);
+    free(suite.results);
+    return failed;
+}
@@ -0,0 +1,142 @@
+#include "nn_core.h"
+#include "data.h"
+#include "checkpoint.h"
+#include "quantization.h"
+#include "simd.h"
+#include "evaluation.h"
+
+
+#define DEFAULT_CHECKPOINT "digits-recognizer.ckpt"
+#define DEFAULT_DATA_DIRECTORY "../data/mnist/handwritten-digits"
+#define DEFAULT_CALIBRATION_SAMPLES 1000
+
+
+/* Quantizes a trained checkpoint to int8, calibrating on the first training images, and reports how the int8 model
+ * compares against the float one on the test set
+ * Usage: ceural-quantize [checkpoint] [mnist directory] [calibration samples] */
+int main(int argc, char *argv[]){
+    const char *checkpoint_path = argc > 1 ? argv[1] : DEFAULT_CHECKPOINT;
+    const char *data_directory = argc > 2 ? argv[2] : DEFAULT_DATA_DIRECTORY;
+    size_t calibration_samples = argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_CALIBRATION_SAMPLES;
+
+    char paths[4][4096];
+    snprintf(paths[0], sizeof(paths[0]), "%s/train/train-images.idx3-ubyte", data_directory);
+    snprintf(paths[1], sizeof(paths[1]), "%s/train/train-labels.idx1-ubyte", data_directory);
+    snprintf(paths[2], sizeof(paths[2]), "%s/test/t10k-images.idx3-ubyte", data_directory);
+    snprintf(paths[3], sizeof(paths[3]), "%s/test/t10k-labels.idx1-ubyte", data_directory);
+    mnist_handwritten_digits_data mnist_data = load_mnist_data(paths[0], paths[1], paths[2], paths[3]);
+    if(mnist_data.training_images.magic_number == -1){
+        fprintf(stderr, "Error loading mnist data!\n");
+        return 1;
+    }
+
+    NeuralNetwork *nn = load_neural_network(checkpoint_path, EVALUATION_BATCH_SIZE, 1);
+    if(nn == NULL){
+        destroy_mnist_data(mnist_data);
+        return 1;
+    }
+
+    const size_t input_size = nn->input_layer_size;
+    const size_t output_size = nn->dense_layers[nn->dense_layers_num-1].size;
+    const mnist_images_set *test_images = &mnist_data.test_images;
+    const mnist_labels_set *test_labels = &mnist_data.test_labels;
+    if(input_size != (size_t)test_images->number_of_rows * (size_t)test_images->number_of_columns || output_size != MNIST_CLASSES){
+        fprintf(stderr, "Checkpoint %s expects %zu inputs and %zu outputs, the dataset has %d x %d images and %d classes\n",
+                checkpoint_path, input_size, output_size, test_images->number_of_rows, test_images->number_of_columns, MNIST_CLASSES);
+        destroy_neural_network(nn);
+        destroy_mnist_data(mnist_data);
+        return 1;
+    }
+    // the float side of the comparison is the evaluation digits-recognizer prints, only int8 is scored below. It
+    // cannot fail, the checkpoint was just matched against the sets
+    evaluation_result float_evaluation;
+    evaluate(nn, test_images, test_labels, 0, &float_evaluation);
+
+    if(calibration_samples == 0) calibration_samples = 1;
+    if(calibration_samples > (size_t)mnist_data.training_images.number_of_images)
+        calibration_samples = (size_t)mnist_data.training_images.number_of_images;
+    size_t buffer_samples = calibration_samples > EVALUATION_BATCH_SIZE ? calibration_samples : EVALUATION_BATCH_SIZE;
+    size_t *indices = malloc(sizeof(size_t) * buffer_samples);
+    nn_real *inputs = malloc(sizeof(nn_real) * input_size * buffer_samples);
+    nn_real *expected_outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * buffer_samples);
+    for(size_t sample=0; sample<calibration_samples; ++sample) indices[sample] = sample;
+    gather_mnist_batch(&mnist_data.training_images, &mnist_data.training_labels, indices, calibration_samples, inputs, expected_outputs);
+
+    quantized_network *qnn = quantize_neural_network(nn, inputs, calibration_samples);
+    if(qnn == NULL){
+        free(indices);
+        free(inputs);
+        free(expected_outputs);
+        destroy_neural_network(nn);
+        destroy_mnist_data(mnist_data);
+        return 1;
+    }
+
+    nn_workspace *workspace = create_workspace(nn, EVALUATION_BATCH_SIZE);
+    quantized_workspace *qworkspace = create_quantized_workspace(qnn);
+    nn_real *float_outputs = malloc(sizeof(nn_real) * output_size * EVALUATION_BATCH_SIZE);
+    nn_real *quantized_outputs = malloc(sizeof(nn_real) * output_size);
+
+    size_t samples_num = (size_t)test_images->number_of_images;
+    size_t quantized_correct = 0, agreements = 0;
+    nn_real max_difference = 0;
+    double float_seconds = 0, quantized_seconds = 0;
+    for(size_t first=0; first<samples_num; first+=EVALUATION_BATCH_SIZE){
+        size_t count = samples_num - first < EVALUATION_BATCH_SIZE ? samples_num - first : EVALUATION_BATCH_SIZE;
+        for(size_t sample=0; sample<count; ++sample) indices[sample] = first + sample;
+        gather_mnist_batch(test_images, test_labels, indices, count, inputs, expected_outputs);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        nn_predict_batch(nn, inputs, count, float_outputs, workspace);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        float_seconds += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+        for(size_t sample=0; sample<count; ++sample){
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            quantized_predict(qnn, inputs + sample * input_size, quantized_outputs, qworkspace);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            quantized_seconds += (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+            const nn_real *sample_float_outputs = float_outputs + sample * output_size;
+            size_t label = test_labels->labels[first + sample];
+            size_t float_class = argmax(output_size, sample_float_outputs);
+            size_t quantized_class = argmax(output_size, quantized_outputs);
+            quantized_correct += quantized_class == label;
+            agreements += float_class == quantized_class;
+            for(size_t output=0; output<output_size; ++output){
+                nn_real difference = fabs(sample_float_outputs[output] - quantized_outputs[output]);
+                if(difference > max_difference) max_difference = difference;
+            }
+        }
+    }
+
+    double float_accuracy = 100.0 * float_evaluation.accuracy;
+    double quantized_accuracy = 100.0 * (double)quantized_correct / (double)samples_num;
+    size_t float_size = 0;
+    for(size_t layer=0; layer<nn->dense_layers_num; ++layer)
+        float_size += sizeof(nn_real) * nn->dense_layers[layer].size * (nn->dense_layers[layer].previous_layer_size + 1);
+
+    fprintf(stdout, "kernels:              %s\n", simd->name);
+    fprintf(stdout, "calibration samples:  %zu\n", calibration_samples);
+    fprintf(stdout, "test samples:         %zu\n", samples_num);
+    fprintf(stdout, "float accuracy:       %.2f%%\n", float_accuracy);
+    fprintf(stdout, "int8 accuracy:        %.2f%%\n", quantized_accuracy);
+    fprintf(stdout, "accuracy delta:       %+.2f%%\n", quantized_accuracy - float_accuracy);
+    fprintf(stdout, "prediction agreement: %.2f%%\n", 100.0 * (double)agreements / (double)samples_num);
+    fprintf(stdout, "max output delta:     %g\n", (double)max_difference);
+    fprintf(stdout, "model size:           %zu bytes float, %zu bytes int8\n", float_size, quantized_network_size(qnn));
+    fprintf(stdout, "inference time:       %.3fs float (batched), %.3fs int8 (per sample)\n", float_seconds, quantized_seconds);
+
+    free(quantized_outputs);
+    free(float_outputs);
+    destroy_quantized_workspace(qworkspace);
+    destroy_workspace(workspace);
+    destroy_quantized_network(qnn);
+    free(indices);
+    free(inputs);
+    free(expected_outputs);
+    destroy_neural_network(nn);
+    destroy_mnist_data(mnist_data);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "nn_core.h"
+#include "checkpoint.h"
+#include "serving.h"
+#include "simd.h"
+
+
+#define DEFAULT_CHECKPOINT "digits-recognizer.ckpt"
+#define DEFAULT_SOCKET "ceural.sock"
+#define DEFAULT_MAX_BATCH_SIZE 64
+#define DEFAULT_MAX_DELAY_US 500
+#define DEFAULT_MAX_CONNECTIONS 1024
+#define DEFAULT_REPORT_SECONDS 10
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal_number){
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: ceural-serve [--socket path] [--max-batch n] [--max-delay-us n] [--workers n]\n"
+                    "                    [--max-connections n] [--report-seconds n] [checkpoint]\n");
+}
+
+
+/* Serves a checkpoint over a Unix domain socket (see serving.h for the protocol), coalescing concurrent requests into
+ * batches of up to --max-batch samples that wait at most --max-delay-us for each other. The counters and latency
+ * percentiles are printed every --report-seconds (0 disables) and on SIGINT/SIGTERM, which stop the server */
+int main(int argc, char *argv[]){
+    const char *checkpoint_path = DEFAULT_CHECKPOINT;
+    const char *socket_path = DEFAULT_SOCKET;
+    serve_config config = {DEFAULT_MAX_BATCH_SIZE, DEFAULT_MAX_DELAY_US * 1000u, 0, DEFAULT_MAX_CONNECTIONS};
+    double report_seconds = DEFAULT_REPORT_SECONDS;
+
+    for(int arg=1; arg<argc; ++arg){
+        if(strncmp(argv[arg], "--", 2) != 0){
+            checkpoint_path = argv[arg];
+            continue;
+        }
+        const char *value = arg + 1 < argc ? argv[arg+1] : NULL;
+        if(value == NULL){
+            print_usage();
+            return 1;
+        }
+        if(strcmp(argv[arg], "--socket") == 0) socket_path = value;
+        else if(strcmp(argv[arg], "--max-batch") == 0) config.max_batch_size = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--max-delay-us") == 0) config.max_delay_ns = strtoull(value, NULL, 10) * 1000u;
+        else if(strcmp(argv[arg], "--workers") == 0) config.workers_num = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--max-connections") == 0) config.max_connections = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--report-seconds") == 0) report_seconds = strtod(value, NULL);
+        else{
+            print_usage();
+            return 1;
+        }
+        ++arg;
+    }
+    if(config.max_batch_size == 0 || config.max_connections == 0){
+        fprintf(stderr, "Max batch size and max connections must be positive\n");
+        print_usage();
+        return 1;
+    }
+
+    NeuralNetwork *nn = load_neural_network(checkpoint_path, config.max_batch_size, 1);
+    if(nn == NULL) return 1;
+
+    inference_server *server = create_inference_server(nn, socket_path, config);
+    if(server == NULL){
+        destroy_neural_network(nn);
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    fprintf(stdout, "Serving %s (%zu inputs, %zu outputs) on %s with %zu workers, batches of up to %zu samples waiting "
+                    "at most %lluus, kernels: %s\n", checkpoint_path, nn->input_layer_size,
+            nn->dense_layers[nn->dense_layers_num-1].size, socket_path, server->workers_started,
+            server->config.max_batch_size, (unsigned long long)(server->config.max_delay_ns / 1000u), simd->name);
+    print_placement_config(stdout);
+    fflush(stdout);
+
+    int failed = run_inference_server(server, &stop_requested, stdout, report_seconds);
+
+    char report[1024];
+    serve_report(server, report, sizeof(report));
+    fputs(report, stdout);
+
+    destroy_inference_server(server);
+    destroy_neural_network(nn);
+    return failed;
+}
@@ -0,0 +1,225 @@
+#include "data.h"
+#include "serving.h"
+
+
+#define DEFAULT_SOCKET "ceural.sock"
+#define DEFAULT_DATA_DIRECTORY "../data/mnist/handwritten-digits"
+#define DEFAULT_CONNECTIONS 8
+#define DEFAULT_REQUESTS 2000
+#define SYNTHETIC_SAMPLES 1024
+
+
+typedef struct {
+    const char *socket_path;
+    const float *samples;           // samples_num x input_size
+    const uint8_t *labels;          // expected class of every sample, NULL when synthetic
+    size_t samples_num;
+    size_t input_size;
+    size_t output_size;
+    size_t requests;                // sent by every connection
+    latency_histogram *latency;     // shared by every connection
+} load_config;
+
+
+typedef struct {
+    const load_config *config;
+    size_t connection;
+    size_t answered;
+    size_t errors;
+    size_t correct;
+} load_connection;
+
+
+static uint64_t now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+/* Closed loop: every connection sends its next request as soon as the previous one is answered */
+static void *load_connection_loop(void *argument){
+    load_connection *connection = argument;
+    const load_config *config = connection->config;
+
+    int fd = serve_connect(config->socket_path);
+    if(fd < 0){
+        connection->errors = config->requests;
+        return NULL;
+    }
+    size_t capacity = sizeof(float) * config->output_size + 1024; // room for error messages too
+    float *outputs = malloc(capacity);
+
+    for(size_t request=0; request<config->requests; ++request){
+        size_t sample = (connection->connection * config->requests + request) % config->samples_num;
+        serve_frame_header header;
+        uint64_t sent_ns = now_ns();
+        if(serve_write_frame(fd, SERVE_PREDICT, config->samples + sample * config->input_size,
+                             (uint32_t)(sizeof(float) * config->input_size)) ||
+           serve_read_frame(fd, &header, outputs, capacity)){
+            fprintf(stderr, "Connection %zu lost after %zu requests\n", connection->connection, request);
+            connection->errors += config->requests - request;
+            break;
+        }
+        latency_histogram_record(config->latency, now_ns() - sent_ns);
+
+        if(header.type != SERVE_PREDICT){
+            ++connection->errors;
+            continue;
+        }
+        ++connection->answered;
+        if(config->labels) connection->correct += argmax(config->output_size, outputs) == config->labels[sample];
+    }
+
+    free(outputs);
+    close(fd);
+    return NULL;
+}
+
+
+/* Loads the MNIST test images as float32 samples when they fit the served network, returns how many */
+static size_t load_mnist_samples(const char *data_directory, size_t input_size, float **samples, uint8_t **labels){
+    char paths[4][4096];
+    snprintf(paths[0], sizeof(paths[0]), "%s/train/train-images.idx3-ubyte", data_directory);
+    snprintf(paths[1], sizeof(paths[1]), "%s/train/train-labels.idx1-ubyte", data_directory);
+    snprintf(paths[2], sizeof(paths[2]), "%s/test/t10k-images.idx3-ubyte", data_directory);
+    snprintf(paths[3], sizeof(paths[3]), "%s/test/t10k-labels.idx1-ubyte", data_directory);
+    mnist_handwritten_digits_data mnist_data = load_mnist_data(paths[0], paths[1], paths[2], paths[3]);
+    if(mnist_data.training_images.magic_number == -1) return 0;
+
+    const mnist_images_set *images = &mnist_data.test_images;
+    size_t samples_num = (size_t)images->number_of_images;
+    if((size_t)images->number_of_rows * (size_t)images->number_of_columns != input_size || samples_num == 0){
+        destroy_mnist_data(mnist_data);
+        return 0;
+    }
+
+    size_t *indices = malloc(sizeof(size_t) * samples_num);
+    nn_real *inputs = malloc(sizeof(nn_real) * input_size * samples_num);
+    nn_real *expected_outputs = malloc(sizeof(nn_real) * MNIST_CLASSES * samples_num);
+    for(size_t sample=0; sample<samples_num; ++sample) indices[sample] = sample;
+    gather_mnist_batch(images, &mnist_data.test_labels, indices, samples_num, inputs, expected_outputs);
+
+    *samples = malloc(sizeof(float) * input_size * samples_num);
+    *labels = malloc(samples_num);
+    for(size_t i=0; i<input_size * samples_num; ++i) (*samples)[i] = (float)inputs[i];
+    for(size_t sample=0; sample<samples_num; ++sample) (*labels)[sample] = mnist_data.test_labels.labels[sample];
+
+    free(expected_outputs);
+    free(inputs);
+    free(indices);
+    destroy_mnist_data(mnist_data);
+    return samples_num;
+}
+
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: ceural-serve-load [--socket path] [--connections n] [--requests n per connection]\n"
+                    "                         [--data mnist directory]\n");
+}
+
+
+/* Load generator for ceural-serve: every connection sends single-sample requests back to back, the client side
+ * throughput and latency percentiles are printed along with the server's own report. The MNIST test images are sent
+ * when they fit the served network, so the accuracy doubles as a correctness check, random inputs otherwise */
+int main(int argc, char *argv[]){
+    const char *socket_path = DEFAULT_SOCKET;
+    const char *data_directory = DEFAULT_DATA_DIRECTORY;
+    size_t connections_num = DEFAULT_CONNECTIONS;
+    size_t requests = DEFAULT_REQUESTS;
+
+    for(int arg=1; arg<argc; ++arg){
+        const char *value = arg + 1 < argc ? argv[arg+1] : NULL;
+        if(value == NULL){
+            print_usage();
+            return 1;
+        }
+        if(strcmp(argv[arg], "--socket") == 0) socket_path = value;
+        else if(strcmp(argv[arg], "--connections") == 0) connections_num = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--requests") == 0) requests = strtoul(value, NULL, 10);
+        else if(strcmp(argv[arg], "--data") == 0) data_directory = value;
+        else{
+            print_usage();
+            return 1;
+        }
+        ++arg;
+    }
+    if(connections_num == 0 || requests == 0){
+        fprintf(stderr, "Connections and requests must be positive\n");
+        print_usage();
+        return 1;
+    }
+
+    int fd = serve_connect(socket_path);
+    if(fd < 0) return 1;
+    serve_frame_header header;
+    uint32_t info[3];
+    if(serve_write_frame(fd, SERVE_INFO, NULL, 0) || serve_read_frame(fd, &header, info, sizeof(info)) ||
+       header.type != SERVE_INFO || header.length != sizeof(info)){
+        fprintf(stderr, "Server on %s did not describe its network\n", socket_path);
+        close(fd);
+        return 1;
+    }
+
+    load_config config = {socket_path, NULL, NULL, 0, info[0], info[1], requests, calloc(1, sizeof(latency_histogram))};
+    float *samples = NULL;
+    uint8_t *labels = NULL;
+    config.samples_num = load_mnist_samples(data_directory, config.input_size, &samples, &labels);
+    if(config.samples_num == 0){
+        fprintf(stderr, "No MNIST test images of %zu pixels in %s, sending random inputs\n", config.input_size, data_directory);
+        config.samples_num = SYNTHETIC_SAMPLES;
+        samples = malloc(sizeof(float) * config.input_size * config.samples_num);
+        unsigned int seed = 1;
+        for(size_t i=0; i<config.input_size * config.samples_num; ++i) samples[i] = (float)rand_r(&seed) / (float)RAND_MAX;
+    }
+    config.samples = samples;
+    config.labels = labels;
+
+    fprintf(stdout, "Sending %zu requests over each of %zu connections to %s (%zu inputs, %zu outputs, server batches "
+                    "up to %u)\n", requests, connections_num, socket_path, config.input_size, config.output_size, info[2]);
+    fflush(stdout);
+
+    load_connection *connections = calloc(connections_num, sizeof(load_connection));
+    pthread_t *threads = malloc(sizeof(pthread_t) * connections_num);
+    uint64_t start_ns = now_ns();
+    size_t started = 0;
+    for(; started<connections_num; ++started){
+        connections[started].config = &config;
+        connections[started].connection = started;
+        if(pthread_create(&threads[started], NULL, load_connection_loop, &connections[started]) != 0){
+            fprintf(stderr, "Failed to create connection thread %zu, continuing with %zu\n", started, started);
+            break;
+        }
+    }
+    for(size_t connection=0; connection<started; ++connection) pthread_join(threads[connection], NULL);
+    double seconds = (double)(now_ns() - start_ns) * 1e-9;
+
+    size_t answered = 0, errors = 0, correct = 0;
+    for(size_t connection=0; connection<started; ++connection){
+        answered += connections[connection].answered;
+        errors += connections[connection].errors;
+        correct += connections[connection].correct;
+    }
+    fprintf(stdout, "Answered %zu requests in %.3fs, %.1f requests/s, %zu errors, latency p50 %.1fus p99 %.1fus "
+                    "p999 %.1fus max %.1fus\n", answered, seconds, seconds > 0 ? (double)answered / seconds : 0.0, errors,
+            (double)latency_histogram_percentile(config.latency, 0.5) * 1e-3,
+            (double)latency_histogram_percentile(config.latency, 0.99) * 1e-3,
+            (double)latency_histogram_percentile(config.latency, 0.999) * 1e-3,
+            (double)atomic_load(&config.latency->max) * 1e-3);
+    if(labels && answered > 0) fprintf(stdout, "Accuracy %.2f%%\n", 100.0 * (double)correct / (double)answered);
+
+    char report[1024];
+    if(serve_write_frame(fd, SERVE_STATS, NULL, 0) == 0 && serve_read_frame(fd, &header, report, sizeof(report) - 1) == 0 &&
+       header.type == SERVE_STATS){
+        report[header.length] = '\0';
+        fprintf(stdout, "Server: %s", report);
+    }
+
+    close(fd);
+    free(threads);
+    free(connections);
+    free(labels);
+    free(samples);
+    free(config.latency);
+    return errors > 0;
+}
@@ -0,0 +1,94 @@
+#include "sweep.h"
+#include "rng.h"
+#include "simd.h"
+
+
+#define DEFAULT_DATA_DIRECTORY "../data/mnist/handwritten-digits"
+
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: ceural-sweep [--data mnist directory] [--workers n] spec\n"
+                    "See src/sweep.h for the spec format\n");
+}
+
+
+/* Hyperparameter sweep: expands a grid or random-search spec into runs and trains them concurrently, one per worker
+ * thread, all of them reading the one copy of MNIST loaded here. Prints a line as every run ends and a table of every
+ * run ranked by its validation metric at the end */
+int main(int argc, char *argv[]){
+    const char *data_directory = DEFAULT_DATA_DIRECTORY;
+    const char *spec_path = NULL;
+    const char *workers = NULL;
+
+    for(int arg=1; arg<argc; ++arg){
+        if(strncmp(argv[arg], "--", 2) != 0){
+            spec_path = argv[arg];
+            continue;
+        }
+        const char *value = arg + 1 < argc ? argv[arg+1] : NULL;
+        if(value == NULL){
+            print_usage();
+            return 1;
+        }
+        if(strcmp(argv[arg], "--data") == 0) data_directory = value;
+        else if(strcmp(argv[arg], "--workers") == 0) workers = value;
+        else{
+            print_usage();
+            return 1;
+        }
+        ++arg;
+    }
+    if(spec_path == NULL){
+        print_usage();
+        return 1;
+    }
+
+    sweep_spec spec;
+    if(parse_sweep_spec(spec_path, &spec)) return 1;
+    if(workers != NULL && parse_sweep_count(workers, &spec.workers)){
+        print_usage();
+        return 1;
+    }
+    size_t runs_num = sweep_runs_num(&spec);
+    if(runs_num == 0){
+        fprintf(stderr, "Sweep spec %s describes no run\n", spec_path);
+        return 1;
+    }
+
+    char paths[4][4096];
+    snprintf(paths[0], sizeof(paths[0]), "%s/train/train-images.idx3-ubyte", data_directory);
+    snprintf(paths[1], sizeof(paths[1]), "%s/train/train-labels.idx1-ubyte", data_directory);
+    snprintf(paths[2], sizeof(paths[2]), "%s/test/t10k-images.idx3-ubyte", data_directory);
+    snprintf(paths[3], sizeof(paths[3]), "%s/test/t10k-labels.idx1-ubyte", data_directory);
+    mnist_handwritten_digits_data mnist_data = load_mnist_data(paths[0], paths[1], paths[2], paths[3]);
+    if(mnist_data.training_images.magic_number == -1){
+        fprintf(stderr, "Error loading mnist data from %s\n", data_directory);
+        return 1;
+    }
+
+    sweep_params *params = malloc(sizeof(sweep_params) * runs_num);
+    sweep_result *results = malloc(sizeof(sweep_result) * runs_num);
+    expand_sweep_spec(&spec, params);
+
+    fprintf(stdout, "Sweeping %zu runs (%s search) of up to %zu epochs with patience %zu, random seed %llu, kernels: %s\n",
+            runs_num, spec.search == SWEEP_RANDOM ? "random" : "grid", spec.epochs, spec.patience,
+            (unsigned long long)get_random_seed(), simd->name);
+    print_placement_config(stdout);
+    fflush(stdout);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = run_sweep(&spec, &mnist_data, params, runs_num, results, stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(!failed){
+        fprintf(stdout, "Swept %zu runs in %.1fs\n", runs_num,
+                (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) * 1e-9);
+        print_sweep_summary(stdout, &spec, results, runs_num);
+    }
+
+    free(results);
+    free(params);
+    destroy_mnist_data(mnist_data);
+    return failed;
+}